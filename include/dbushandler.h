@@ -139,7 +139,8 @@ DBusConnection *dbushandler_get_session_bus(DBusHandler *self);
  *
  * @param self DBusHandler instance
  *
- * @return Pointer to GList structure containing the needed dbus connections.
+ * @return Newly allocated GList of the dbus connections, free with
+ *         g_list_free.
  */
 GList * dbushandler_get_control_connections(DBusHandler *self); 
 
@@ -148,7 +149,8 @@ GList * dbushandler_get_control_connections(DBusHandler *self);
  *
  * @param self DBusHandler instance
  *
- * @return Pointer to GList structure containing the needed dbus connections.
+ * @return Newly allocated GList of the dbus connections, free with
+ *         g_list_free.
  */
 GList * dbushandler_get_kp_connections(DBusHandler *self); 
 
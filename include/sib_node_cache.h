@@ -0,0 +1,129 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_node_cache.h
+ *
+ * Bounded cache of the mappings between node strings and the integer
+ * nodes of the RDF store, in both directions. The cache is split into
+ * shards with a lock each, so that the scheduler and the reader threads
+ * rarely wait for each other. Each shard evicts with the CLOCK
+ * (second chance) algorithm once full.
+ */
+
+#ifndef SIB_NODE_CACHE_H
+#define SIB_NODE_CACHE_H
+
+#include <glib.h>
+
+struct _SibNodeCache;
+typedef struct _SibNodeCache SibNodeCache;
+
+/**
+ * Creates a new, empty cache
+ *
+ * @param size Maximum number of mappings kept in each direction
+ * @return pointer to the cache
+ */
+SibNodeCache* sib_node_cache_new(guint size);
+
+/**
+ * Frees the cache and all mappings in it
+ *
+ * @param self Pointer to the cache
+ */
+void sib_node_cache_destroy(SibNodeCache* self);
+
+/**
+ * Finds the node of a string
+ *
+ * @param self Pointer to the cache
+ * @param str The URI (as given by the client, not expanded) or literal
+ * @param literal Whether str is a literal
+ * @param node Set to the node if found
+ * @return TRUE if found
+ */
+gboolean sib_node_cache_get_node(SibNodeCache* self, const gchar* str,
+				 gboolean literal, gint* node);
+
+/**
+ * Stores the node of a string
+ *
+ * @param self Pointer to the cache
+ * @param str The URI (as given by the client, not expanded) or literal
+ * @param literal Whether str is a literal
+ * @param node The node
+ */
+void sib_node_cache_put_node(SibNodeCache* self, const gchar* str,
+			     gboolean literal, gint node);
+
+/**
+ * Finds the string of a node
+ *
+ * @param self Pointer to the cache
+ * @param node The node
+ * @return expanded URI or literal, NULL if not found. Free with g_free.
+ */
+gchar* sib_node_cache_get_string(SibNodeCache* self, gint node);
+
+/**
+ * Stores the string of a node
+ *
+ * @param self Pointer to the cache
+ * @param node The node
+ * @param str Expanded URI or literal
+ */
+void sib_node_cache_put_string(SibNodeCache* self, gint node, const gchar* str);
+
+/**
+ * Removes all mappings of nodes that no longer exist in the store
+ *
+ * @param self Pointer to the cache
+ * @param nodes The removed nodes
+ * @param n_nodes Number of nodes
+ */
+void sib_node_cache_invalidate(SibNodeCache* self, const gint* nodes, guint n_nodes);
+
+/**
+ * Lookup counters of the cache, both directions together
+ *
+ * @param self Pointer to the cache
+ * @param hits Set to the number of lookups found in the cache
+ * @param misses Set to the number of lookups not found
+ */
+void sib_node_cache_stats(SibNodeCache* self, guint64* hits, guint64* misses);
+
+#endif /* SIB_NODE_CACHE_H */
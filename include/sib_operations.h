@@ -50,6 +50,13 @@
 #endif /* WITH_WQL */
 #include <sibdefs.h>
 
+#include "sib_rdfs_index.h"
+#include "sib_result_cache.h"
+#include "sib_same_as.h"
+#include "sib_ssap_server.h"
+#include "sib_store.h"
+#include "sib_sub_index.h"
+
 typedef ssStatus_t ss_status;
 
 /* Definitions for enumerated SSAP protocol values */
@@ -60,6 +67,10 @@ typedef enum {M3_JOIN, M3_LEAVE, M3_INSERT, M3_REMOVE, M3_UPDATE,
 typedef enum {M3_REQUEST, M3_CONFIRMATION, M3_RESPONSE,
 	      M3_INDICATION} message_type;
 
+/* Status of requests refused because the SIB is too busy. libsib has
+   no busy status, so KPs see a failed operation and may retry. */
+#define M3_STATUS_BUSY ss_OperationFailed
+
 typedef QueryType query_type;
 
 typedef EncodingType triple_encoding;
@@ -77,6 +88,14 @@ typedef struct {
   gchar* lang;
 } m3_triple_int;
 
+/* Change of one triple, delivered to matching template subscriptions */
+typedef struct {
+  gint s;
+  gint p;
+  gint o;
+  gboolean added;
+} m3_triple_delta;
+
 /* Struct to hold a node using piglet's int representation*/
 typedef struct {
   gint node;
@@ -150,35 +169,136 @@ typedef struct {
 
 /* SIB common data structures */
 
+/* Evaluation of a subscription query, shared by all subscriptions
+   whose query has the same canonical form (see m3_sub_key) */
 typedef struct {
   sub_status status;
+  /* Id of the first subscription, names the evaluation in the logs */
   gchar* sub_id;
-  gchar* kp_id;
+  /* Canonical form of the query, key in sub_groups */
+  gchar* key;
+  query_type type;
 
-  /* Lock and cond needed to sync with subscribe and unsubscribe */
-  GMutex* unsub_lock;
-  GCond* unsub_cond;
-  gboolean unsub;
+  /* Template subscriptions only: patterns (m3_triple_int) compiled at
+     subscribe and filed in sub_index once indexed is set, and
+     m3_triple_delta changes matching them, newest first.
+     resync asks the scheduler for a full re-query instead of deltas,
+     requeried tells that the last result came from one. */
+  GSList* patterns;
+  gboolean indexed;
+  GSList* deltas;
+  gboolean resync;
+  gboolean requeried;
+
+  /* Scheduler item evaluating the query, made from the first
+     subscribe request. evaluated is set once the first result is in
+     current_result. */
+  struct SCHEDULER_ITEM* op;
+  gboolean evaluated;
+
+  /* Result last reported to the members */
+  GHashTable* current_result;
+  gint current_bool;
+
+  /* The subscription_member objects getting the results, protected
+     by subscriptions_lock */
+  GSList* members;
+
+  /* Coalescing of the indications, protected by subscriptions_lock.
+     A pending state is not evaluated before next_round (usec, wall
+     clock), min_interval ms after the last indication, unless
+     max_batch changes are waiting (n_deltas) or members_changed asks
+     to answer or let go of members. Changes cancelling out each other
+     meanwhile are never sent. 0 disables either limit. */
+  gint min_interval;
+  gint max_batch;
+  gint64 next_round;
+  guint n_deltas;
+  gboolean members_changed;
+  /* Some member has indications held back, the state is run again
+     at next_round to send them */
+  gboolean blocked;
 } subscription_state;
 
+/* Subscription of a KP, fed by a shared subscription_state */
+typedef struct {
+  gchar* sub_id;
+  gchar* space_id;
+  gchar* kp_id;
+  gint tr_id;
+  gint ind_seqnum;
+
+  /* The subscribe request, answered with the result of the first
+     round of state the member takes part in. answered is set then. */
+  struct SIB_OP_PARAMETER* param;
+  gboolean answered;
+  subscription_state* state;
+
+  /* Set by unsubscribe, the member leaves state in its next round.
+     The unsubscribe request, kept in unsub_param and unsub_header, is
+     answered then, so that no indication follows the answer. NULL if
+     the member was stopped otherwise. */
+  gboolean stopped;
+  struct SIB_OP_PARAMETER* unsub_param;
+  ssap_message_header* unsub_header;
+
+  /* Flow control, only used in the rounds of state. Indications are
+     held back while the transport of the member is behind: at most
+     SIB_SUB_MAX_PENDING of them in pending, oldest first. Past that
+     they are dropped and lagging is set, and the member is sent one
+     net delta from lag_base (lag_base_bool), the result it last got,
+     once the transport has caught up. */
+  gboolean behind;
+  GQueue* pending;
+  gboolean lagging;
+  GHashTable* lag_base;
+  gint lag_base_bool;
+  /* Length of pending and lagging at the end of the last round, for
+     m3_sub_status. Protected by subscriptions_lock. */
+  guint n_pending_seen;
+  gboolean lagging_seen;
+} subscription_member;
+
 typedef struct {
   /* SS name and the node (int) in piglet*/
   gchar* ss_name;
   gint ss_node;
 
-  /* Caches of int node - str node and str node - int node mappings */
-  GHashTable* piglet_str_to_int_cache;
-  GHashTable* piglet_int_to_str_cache;
-
   /* List of joined KPs */
   GHashTable* joined;
 
-  /* Piglet database */
-  DB RDF_store;
+  /* RDF store */
+  SibStore* RDF_store;
 
-  /* Hash table for ongoing subscriptions */
+  /* Hash table for ongoing subscriptions: sub_id -> subscription_member */
   GHashTable* subs;
 
+  /* Evaluations of the ongoing subscriptions: canonical query ->
+     subscription_state, protected by subscriptions_lock */
+  GHashTable* sub_groups;
+
+  /* Coalescing of subscriptions not asking for any, from
+     SIB_SUB_MIN_INTERVAL (ms) and SIB_SUB_MAX_BATCH */
+  gint sub_min_interval;
+  gint sub_max_batch;
+
+  /* Template patterns of ongoing subscriptions,
+     protected by subscriptions_lock */
+  SibSubIndex* sub_index;
+
+  /* Compiled patterns of recent template queries by query string,
+     protected by store_lock */
+  GHashTable* prepared;
+
+  /* Result strings of recent template queries by canonical query */
+  SibResultCache* results;
+
+  /* Added triples waiting for the RDFS post-processing of the store,
+     which runs once per scheduler round after the writes of the
+     round are committed. Set of m3_triple_int, protected by
+     store_lock. */
+  GHashTable* inferences;
+
   /* Variables needed to wake up scheduler when new operations arrive */
   GCond* new_reqs_cond;
   GMutex* new_reqs_lock;
@@ -205,9 +325,37 @@ typedef struct {
   GAsyncQueue* query_queue;
   /* GAsyncQueue* subscribe_queue; */
 
+  /* Threads running completion callbacks of processed operations */
+  GThreadPool* completion_pool;
+
+  /* Threads running template queries outside store_lock, each with
+     an own read-only store handle kept in reader_store. Queries only
+     run in parallel with writes on an engine with reader handles,
+     currently the memory engine. NULL on piglet, which has none: there
+     the queries run in the scheduler under store_lock. */
+  GThreadPool* reader_pool;
+  GPrivate* reader_store;
+
 #ifdef WITH_WQL
   /* Pointers to wilbur Python functions, parameters and return values */
   p_wilbur_functions* p_w;
+
+  /* WQL queries run in the native engine (sib_wql.h) instead of the
+     Python layer, selected with SIB_WQL=native or by a store other
+     than piglet */
+  gboolean wql_native;
+
+  /* Compiled native WQL paths by path expression, dropped when
+     subproperties change. Protected by store_lock. */
+  GHashTable* wql_paths;
+
+  /* RDFS closure for the native type checks, kept up to date with
+     the changes of the store. Protected by store_lock. */
+  SibRdfsIndex* rdfs;
+
+  /* Classes of owl:sameAs followed by the native WQL queries, kept up
+     to date with the changes of the store. Protected by store_lock. */
+  SibSameAs* same_as;
 #endif /* WITH_WQL */
 } sib_data_structure;
 
@@ -223,14 +371,31 @@ typedef struct SCHEDULER_ITEM{
   ssap_kp_message* req;
   ssap_sib_message* rsp;
 
-  GMutex* op_lock;
-  GCond* op_cond;
-  gboolean op_complete;
+  /* Called from the completion pool when the operation has been
+     processed, replies to the KP. Nobody waits for the operation. */
+  void (*complete)(struct SCHEDULER_ITEM* op, sib_data_structure* sib);
+  gpointer complete_data;
+
+  /* Template query as m3_triple_int node ids, resolved by the
+     scheduler for queries run in the reader pool */
+  GSList* patterns;
+
+  /* Template queries only: canonical form of the query, and the
+     versions its result depends on, taken when patterns are resolved.
+     The result is put in the result cache of the SIB under cache_key. */
+  gchar* cache_key;
+  SibResultCacheStamp* cache_stamp;
 } scheduler_item;
 
-typedef struct {
+typedef struct SIB_OP_PARAMETER{
   DBusConnection* conn;
   DBusMessage* msg;
+  /* Native SSAP connection of the request, NULL for DBus (conn) */
+  SibSsapConnection* ssap;
+  /* Transaction of the request in the window of ssap, ended by the
+     reply or when param is freed */
+  gint tr_id;
+  gboolean in_window;
   sib_data_structure* sib;
   transaction_type operation;
 } sib_op_parameter;
@@ -264,4 +429,22 @@ gpointer m3_subscribe(gpointer data);
 
 gpointer m3_unsubscribe(gpointer data);
 
+/* Flow control state of the subscriptions, one line per subscription:
+   sub_id, kp_id, number of indications held back and 1 if they were
+   dropped for a net delta, else 0. Free with g_free. */
+gchar* m3_sub_status(sib_data_structure* sib);
+
+/* Sends the reply to the request of param, or an indication to its
+   KP, over the transport the request came from. Arguments as for
+   dbus_message_append_args. */
+void m3_send_return(sib_op_parameter* param, int first_type, ...);
+void m3_send_indication(sib_op_parameter* param, int first_type, ...);
+
+/* Unreferences the message and connection of param and frees it */
+void m3_param_free(sib_op_parameter* param);
+
+/* Replies with status to a request that is not run, e.g.
+   M3_STATUS_BUSY. Unreferences the message and frees param. */
+void m3_refuse(sib_op_parameter* param, ssStatus_t status);
+
 #endif
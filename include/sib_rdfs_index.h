@@ -0,0 +1,139 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_rdfs_index.h
+ *
+ * Materialised RDFS closure of the store for the WQL type checks:
+ * the superclasses of classes, the subproperties of the RDFS
+ * vocabulary and the types of nodes, as the native WQL engine finds
+ * them by walking the rdf:type and rdfs:subClassOf paths with
+ * reasoning. Types come from rdf:type, from the rdfs:domain of the
+ * properties a node is subject of and the rdfs:range of the ones it
+ * is object of, closed under rdfs:subClassOf, and include
+ * rdfs:Resource.
+ *
+ * Entries are computed from the store when first looked up and kept
+ * up to date from the triples written to and removed from the store.
+ * Added rdf:type, rdfs:subClassOf and instance triples extend the
+ * entries in place, removed triples drop the entries of their nodes
+ * and other schema changes drop the whole index.
+ */
+
+#ifndef SIB_RDFS_INDEX_H
+#define SIB_RDFS_INDEX_H
+
+#include <glib.h>
+
+#include "sib_same_as.h"
+#include "sib_store.h"
+
+struct _SibRdfsIndex;
+typedef struct _SibRdfsIndex SibRdfsIndex;
+
+/**
+ * Creates a new, empty index
+ *
+ * @param size Number of classes and nodes kept before the index is
+ *        emptied
+ * @return pointer to the index
+ */
+SibRdfsIndex* sib_rdfs_index_new(guint size);
+
+/**
+ * Frees the index
+ *
+ * @param self Pointer to the index
+ */
+void sib_rdfs_index_destroy(SibRdfsIndex* self);
+
+/**
+ * Whether a node is of a type, the WQL isType
+ *
+ * @param self Pointer to the index
+ * @param store The store, written if the RDFS vocabulary is not in it
+ * @param node The node
+ * @param type The type
+ */
+gboolean sib_rdfs_index_is_type(SibRdfsIndex* self, SibStore* store, gint node, gint type);
+
+/**
+ * Whether a class is a subclass of another, the WQL isSubtype
+ *
+ * @param self Pointer to the index
+ * @param store The store
+ * @param sub The subclass
+ * @param super The superclass
+ */
+gboolean sib_rdfs_index_is_subclass(SibRdfsIndex* self, SibStore* store, gint sub, gint super);
+
+/**
+ * Values of a node along rdf:type or rdfs:subClassOf with reasoning,
+ * the ones of the node and of all nodes owl:sameAs it
+ *
+ * @param self Pointer to the index
+ * @param store The store
+ * @param same_as The owl:sameAs classes
+ * @param prop The property of the path
+ * @param node The start node
+ * @param values Set to a list of m3_node_int, each node once. Free
+ *        the nodes with g_free and the list with g_slist_free.
+ * @return FALSE if the index has no values of prop
+ */
+gboolean sib_rdfs_index_values(SibRdfsIndex* self, SibStore* store, SibSameAs* same_as,
+			       gint prop, gint node, GSList** values);
+
+/**
+ * Updates the index after triples were added or removed
+ *
+ * @param self Pointer to the index
+ * @param store The store, the triples already committed to it
+ * @param triples List of the changed m3_triple_int triples
+ * @param added Whether the triples were added or removed
+ * @param complete Whether the triples are all that was added, FALSE if
+ *        the store infers more triples from them
+ */
+void sib_rdfs_index_changed(SibRdfsIndex* self, SibStore* store, GSList* triples,
+			    gboolean added, gboolean complete);
+
+/**
+ * Empties the index, after changes not known triple by triple
+ *
+ * @param self Pointer to the index
+ */
+void sib_rdfs_index_clear(SibRdfsIndex* self);
+
+#endif /* SIB_RDFS_INDEX_H */
@@ -0,0 +1,132 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_result_cache.h
+ *
+ * Cache of the result strings of template queries. Every entry
+ * depends on one version counter per query pattern: the counter of
+ * the subject if the pattern binds it, else of the predicate, else
+ * the counter shared by all fully open patterns. Changing a triple
+ * bumps the counters of its subject, its predicate and the shared
+ * one, so a cached result is valid as long as none of the counters
+ * it depends on have moved, without looking at the store.
+ */
+
+#ifndef SIB_RESULT_CACHE_H
+#define SIB_RESULT_CACHE_H
+
+#include <glib.h>
+
+struct _SibResultCache;
+typedef struct _SibResultCache SibResultCache;
+
+/* Versions a result depends on, taken before reading the store */
+struct _SibResultCacheStamp;
+typedef struct _SibResultCacheStamp SibResultCacheStamp;
+
+/**
+ * Creates a new, empty cache
+ *
+ * @param size Maximum number of results kept
+ * @return pointer to the cache
+ */
+SibResultCache* sib_result_cache_new(guint size);
+
+/**
+ * Frees the cache and all results in it
+ *
+ * @param self Pointer to the cache
+ */
+void sib_result_cache_destroy(SibResultCache* self);
+
+/**
+ * Finds the result of a query, if none of the triples it depends on
+ * have changed since it was stored
+ *
+ * @param self Pointer to the cache
+ * @param key Canonical form of the query
+ * @return the result or NULL. Free with g_free.
+ */
+gchar* sib_result_cache_get(SibResultCache* self, const gchar* key);
+
+/**
+ * Takes the versions the result of a query depends on. Must be taken
+ * before the store is read for the result, so that changes made
+ * meanwhile invalidate it.
+ *
+ * @param self Pointer to the cache
+ * @param patterns List of m3_triple_int patterns of the query
+ * @return the stamp, give it to sib_result_cache_put or free it with
+ *         sib_result_cache_stamp_free
+ */
+SibResultCacheStamp* sib_result_cache_stamp(SibResultCache* self, GSList* patterns);
+
+/**
+ * Frees a stamp not given to sib_result_cache_put
+ *
+ * @param stamp The stamp
+ */
+void sib_result_cache_stamp_free(SibResultCacheStamp* stamp);
+
+/**
+ * Stores the result of a query. Dropped if changes have already
+ * invalidated it.
+ *
+ * @param self Pointer to the cache
+ * @param key Canonical form of the query
+ * @param stamp Versions taken before reading the result, freed
+ * @param result The result string
+ */
+void sib_result_cache_put(SibResultCache* self, const gchar* key,
+			  SibResultCacheStamp* stamp, const gchar* result);
+
+/**
+ * Invalidates the results depending on changed triples
+ *
+ * @param self Pointer to the cache
+ * @param triples List of the changed m3_triple_int triples
+ */
+void sib_result_cache_changed(SibResultCache* self, GSList* triples);
+
+/**
+ * Invalidates all results, also the ones being read
+ *
+ * @param self Pointer to the cache
+ */
+void sib_result_cache_clear(SibResultCache* self);
+
+#endif /* SIB_RESULT_CACHE_H */
@@ -0,0 +1,115 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_same_as.h
+ *
+ * Equivalence classes of owl:sameAs, kept in a union-find forest for
+ * the native WQL engine. The classes are read from the store on first
+ * use. Added sameAs triples join classes, removed ones rebuild the
+ * class they were in from the sameAs triples of its members only.
+ * Nodes without sameAs triples are not kept.
+ */
+
+#ifndef SIB_SAME_AS_H
+#define SIB_SAME_AS_H
+
+#include <glib.h>
+
+#include "sib_store.h"
+
+struct _SibSameAs;
+typedef struct _SibSameAs SibSameAs;
+
+/**
+ * Creates a new, empty set of classes
+ *
+ * @return pointer to the classes
+ */
+SibSameAs* sib_same_as_new(void);
+
+/**
+ * Frees the classes
+ *
+ * @param self Pointer to the classes
+ */
+void sib_same_as_destroy(SibSameAs* self);
+
+/**
+ * Nodes owl:sameAs a node, in either direction and transitively
+ *
+ * @param self Pointer to the classes
+ * @param store The store, written if owl:sameAs is not in it
+ * @param node The node
+ * @return Array of gint, node first. Free with g_array_free.
+ */
+GArray* sib_same_as_members(SibSameAs* self, SibStore* store, gint node);
+
+/**
+ * Values of a node along owl:sameAs with reasoning: its whole class,
+ * the node included, or none if it has no class. The same as the
+ * Python WQL layer, where the sameAs path is not walked.
+ *
+ * @param self Pointer to the classes
+ * @param store The store
+ * @param prop The property of the path
+ * @param node The start node
+ * @param values Set to a list of m3_node_int, each node once. Free
+ *        the nodes with g_free and the list with g_slist_free.
+ * @return FALSE if prop is not owl:sameAs
+ */
+gboolean sib_same_as_values(SibSameAs* self, SibStore* store, gint prop, gint node,
+			    GSList** values);
+
+/**
+ * Updates the classes after triples were added or removed
+ *
+ * @param self Pointer to the classes
+ * @param store The store, the triples already committed to it
+ * @param triples List of the changed m3_triple_int triples
+ * @param added Whether the triples were added or removed
+ */
+void sib_same_as_changed(SibSameAs* self, SibStore* store, GSList* triples, gboolean added);
+
+/**
+ * Forgets the classes, they are read from the store again on next
+ * use. For changes not known triple by triple.
+ *
+ * @param self Pointer to the classes
+ */
+void sib_same_as_clear(SibSameAs* self);
+
+#endif /* SIB_SAME_AS_H */
@@ -0,0 +1,192 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_ssap_server.h
+ *
+ * Native SSAP transport: KPs connect over TCP or a unix socket instead
+ * of DBus. One epoll thread accepts connections, reads requests and
+ * writes replies and indications.
+ *
+ * The wire format is the binary framing of this SIB, described below,
+ * and not the SSAP XML protocol: it carries the arguments of the DBus
+ * KP interface as they are, and KPs speaking SSAP XML over TCP can not
+ * connect to it.
+ *
+ * Each message is a frame: a 32 bit big endian payload length and the
+ * payload. The payload is a list of fields, each a type byte followed
+ * by the value: 's' with a 32 bit big endian length and the UTF-8
+ * bytes, or 'i' with a 32 bit big endian integer. The first field is
+ * a string naming the message, the rest are the arguments of the DBus
+ * interface in the same order:
+ *
+ * - requests are named by the KP method (SIB_DBUS_KP_METHOD_*)
+ * - replies carry the method name of the request
+ * - indications are named SIB_DBUS_KP_SIGNAL_SUBSCRIPTION_IND
+ *
+ * Requests may be pipelined. Replies are sent as the operations
+ * complete, not necessarily in request order; KPs match them by the
+ * transaction id. Each connection may have a window of outstanding
+ * transactions; when it is full the server stops reading from the
+ * socket until a transaction completes.
+ */
+
+#ifndef SIB_SSAP_SERVER_H
+#define SIB_SSAP_SERVER_H
+
+#include <stdarg.h>
+#include <glib.h>
+
+#define DBUS_API_SUBJECT_TO_CHANGE
+#include <dbus/dbus.h>
+
+struct _SibSsapServer;
+typedef struct _SibSsapServer SibSsapServer;
+
+struct _SibSsapConnection;
+typedef struct _SibSsapConnection SibSsapConnection;
+
+/**
+ * Called in the server thread for each request. The request is given
+ * as a DBus method call on the KP interface so that it is handled like
+ * a DBus request; it is unreferenced after the call returns. The
+ * transaction is outstanding until sib_ssap_connection_done is called.
+ *
+ * @param conn The connection, referenced for the call only
+ * @param tr_id Transaction id of the request
+ * @param msg The request
+ * @param data User data given to sib_ssap_server_new
+ */
+typedef void (*SibSsapRequestFunc)(SibSsapConnection* conn, gint tr_id,
+				   DBusMessage* msg, gpointer data);
+
+/**
+ * Creates a server without listening sockets
+ *
+ * @param func Called for each request
+ * @param data Passed to func
+ * @return pointer to the server
+ */
+SibSsapServer* sib_ssap_server_new(SibSsapRequestFunc func, gpointer data);
+
+/**
+ * Listens on a TCP port of all interfaces
+ *
+ * @param self Pointer to the server
+ * @param port The port
+ * @return TRUE on success
+ */
+gboolean sib_ssap_server_listen_tcp(SibSsapServer* self, guint16 port);
+
+/**
+ * Listens on a unix socket, replacing an existing file
+ *
+ * @param self Pointer to the server
+ * @param path Path of the socket
+ * @return TRUE on success
+ */
+gboolean sib_ssap_server_listen_unix(SibSsapServer* self, const gchar* path);
+
+/**
+ * Sets the number of transactions a connection may have outstanding
+ *
+ * @param self Pointer to the server
+ * @param window The window, at least 1
+ */
+void sib_ssap_server_set_window(SibSsapServer* self, guint window);
+
+/**
+ * Starts the server thread
+ *
+ * @param self Pointer to the server
+ * @return TRUE on success
+ */
+gboolean sib_ssap_server_start(SibSsapServer* self);
+
+/**
+ * Stops the server thread and closes all sockets. Connections still
+ * referenced by operations are freed when they are unreferenced.
+ *
+ * @param self Pointer to the server
+ */
+void sib_ssap_server_destroy(SibSsapServer* self);
+
+/**
+ * Reference counting of connections. Operations keep a reference
+ * while they may still reply or send indications.
+ *
+ * @param conn The connection
+ */
+SibSsapConnection* sib_ssap_connection_ref(SibSsapConnection* conn);
+void sib_ssap_connection_unref(SibSsapConnection* conn);
+
+/**
+ * Sends a reply or indication. Thread safe; the message is queued and
+ * written by the server thread together with the other messages
+ * queued meanwhile, it is dropped if the connection is closed.
+ *
+ * @param conn The connection
+ * @param name Name of the message, the first field
+ * @param first_type Type of the first argument, the arguments are
+ *        given as for dbus_message_append_args: DBUS_TYPE_STRING or
+ *        DBUS_TYPE_INT32 and a pointer to the value, ended by
+ *        DBUS_TYPE_INVALID
+ * @param args The arguments
+ * @return FALSE if the connection is closed or an argument type is
+ *         not supported
+ */
+gboolean sib_ssap_send_valist(SibSsapConnection* conn, const gchar* name,
+			      int first_type, va_list args);
+
+/**
+ * Ends a transaction of the connection, once it has been replied to
+ * or dropped. Thread safe.
+ *
+ * @param conn The connection
+ * @param tr_id Transaction id of the request
+ */
+void sib_ssap_connection_done(SibSsapConnection* conn, gint tr_id);
+
+/**
+ * Bytes queued to the connection but not yet written, for flow
+ * control of indications. Thread safe.
+ *
+ * @param conn The connection
+ * @return the number of bytes, 0 once the connection is closed
+ */
+gsize sib_ssap_connection_backlog(SibSsapConnection* conn);
+
+#endif /* SIB_SSAP_SERVER_H */
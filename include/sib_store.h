@@ -0,0 +1,291 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_store.h
+ *
+ * Storage engine interface of the SIB. All RDF store access of the
+ * operations goes through a SibStore handle, which is backed either by
+ * piglet (SQLite) or by the native in-memory engine.
+ *
+ * Nodes are integers: URIs are positive, literals negative and 0 is
+ * the wildcard (sib:any) in queries. Strings returned by the store are
+ * allocated with glib and freed with g_free.
+ */
+
+#ifndef SIB_STORE_H
+#define SIB_STORE_H
+
+#include <glib.h>
+#include <cpiglet.h>
+
+#include "sib_node_cache.h"
+
+struct _SibStore;
+typedef struct _SibStore SibStore;
+
+/**
+ * Called for each triple found by sib_store_query
+ *
+ * @return FALSE to stop the query
+ */
+typedef gboolean (*SibStoreTripleFunc)(gint s, gint p, gint o, gpointer data);
+
+/* Kind of the last error of a store, see sib_store_status */
+typedef enum {
+  SIB_STORE_OK = 0,
+  /* A node was not found and could not be created */
+  SIB_STORE_NODE_NEW,
+  /* No string is known for a node */
+  SIB_STORE_NODE_FIND,
+  /* Any other error */
+  SIB_STORE_FAILED
+} SibStoreStatus;
+
+/* Operations of a storage engine, see the sib_store_ functions.
+   open_reader is NULL if the engine has no reader handles. */
+typedef struct {
+  const gchar* name;
+  SibStore* (*open_reader)(SibStore* store);
+  void (*close)(SibStore* store);
+  gboolean (*transaction)(SibStore* store);
+  gboolean (*commit)(SibStore* store);
+  gboolean (*rollback)(SibStore* store);
+  gint (*node)(SibStore* store, const gchar* uri);
+  gint (*literal)(SibStore* store, const gchar* str);
+  gchar* (*info)(SibStore* store, gint node);
+  gchar* (*expand)(SibStore* store, const gchar* str);
+  gboolean (*add)(SibStore* store, gint s, gint p, gint o);
+  gboolean (*post_process)(SibStore* store, gint s, gint p, gint o);
+  gboolean (*del)(SibStore* store, gint s, gint p, gint o);
+  gboolean (*query)(SibStore* store, gint s, gint p, gint o,
+		    SibStoreTripleFunc func, gpointer data);
+  gboolean (*load_rdfxml)(SibStore* store, const gchar* rdfxml);
+  const gchar* (*error)(SibStore* store);
+  SibStoreStatus (*status)(SibStore* store);
+} SibStoreEngine;
+
+/* Common part of all store handles, engines extend this */
+struct _SibStore {
+  const SibStoreEngine* engine;
+  /* Cache of node mappings for sib_store_resolve and sib_store_string,
+     NULL if the engine is fast enough without */
+  SibNodeCache* cache;
+  /* Nodes put in the cache during the current transaction, they are
+     invalidated if the transaction is rolled back */
+  GArray* resolved;
+};
+
+/**
+ * Opens a piglet backed store
+ *
+ * @param name Name of the piglet database
+ * @return the store or NULL on error
+ */
+SibStore* sib_store_piglet_open(const gchar* name);
+
+/**
+ * Wraps an already open piglet database (from the Python layer)
+ *
+ * @param db The database, not closed with the store
+ * @return the store
+ */
+SibStore* sib_store_piglet_wrap(DB db);
+
+/**
+ * Opens a native in-memory store
+ *
+ * @param path Path prefix of the snapshot (path.snap) and log (path.log)
+ *        files, NULL keeps the store in memory only
+ * @return the store or NULL on error
+ */
+SibStore* sib_store_mem_open(const gchar* path);
+
+/**
+ * Opens the store selected by the SIB_STORE environment variable:
+ * unset or "piglet" for piglet, "memory" or "memory:<path>" for the
+ * native engine.
+ *
+ * @param name Smart space name, used as the piglet database name
+ * @return the store or NULL on error
+ */
+SibStore* sib_store_open(const gchar* name);
+
+/**
+ * Opens a handle for reading in another thread. Reads in a transaction
+ * of the handle see a consistent state of the store. The memory engine
+ * holds back commits of the main store during the transaction.
+ *
+ * @param store The main store
+ * @return the handle or NULL if not supported. Close with sib_store_close.
+ */
+SibStore* sib_store_open_reader(SibStore* store);
+
+/**
+ * Whether the engine has handles for reading in other threads
+ *
+ * @param store The main store
+ */
+gboolean sib_store_has_readers(SibStore* store);
+
+/**
+ * Closes a store or reader handle
+ *
+ * @param store The store
+ */
+void sib_store_close(SibStore* store);
+
+/**
+ * Transaction control, transactions do not nest
+ *
+ * @param store The store
+ * @return TRUE on success
+ */
+gboolean sib_store_transaction(SibStore* store);
+gboolean sib_store_commit(SibStore* store);
+gboolean sib_store_rollback(SibStore* store);
+
+/**
+ * Finds the node of an URI, creating it if needed
+ *
+ * @param store The store
+ * @param uri Expanded URI
+ * @return the node or 0 on error
+ */
+gint sib_store_node(SibStore* store, const gchar* uri);
+
+/**
+ * Finds the node of a literal, creating it if needed
+ *
+ * @param store The store
+ * @param str The literal
+ * @return the node or 0 on error
+ */
+gint sib_store_literal(SibStore* store, const gchar* str);
+
+/**
+ * Finds the node of an URI as given by a client, expanding it first,
+ * or of a literal. Creates the node if needed. Uses the node cache.
+ *
+ * @param store The store
+ * @param str URI or literal
+ * @param literal Whether str is a literal
+ * @return the node or 0 on error
+ */
+gint sib_store_resolve(SibStore* store, const gchar* str, gboolean literal);
+
+/**
+ * String of a node for a client: expanded URI or literal. Uses the
+ * node cache.
+ *
+ * @param store The store
+ * @param node The node
+ * @return the string, NULL if unknown
+ */
+gchar* sib_store_string(SibStore* store, gint node);
+
+/**
+ * String of a node
+ *
+ * @param store The store
+ * @param node The node
+ * @return URI or literal, NULL if unknown
+ */
+gchar* sib_store_info(SibStore* store, gint node);
+
+/**
+ * Expands a qname with a namespace prefix known to the store
+ *
+ * @param store The store
+ * @param str The qname or URI
+ * @return the expanded string
+ */
+gchar* sib_store_expand(SibStore* store, const gchar* str);
+
+/**
+ * Adds, post-processes (RDFS) and deletes triples
+ *
+ * @param store The store
+ * @return TRUE on success
+ */
+gboolean sib_store_add(SibStore* store, gint s, gint p, gint o);
+gboolean sib_store_post_process(SibStore* store, gint s, gint p, gint o);
+gboolean sib_store_del(SibStore* store, gint s, gint p, gint o);
+
+/**
+ * Finds triples matching a pattern, 0 is a wildcard
+ *
+ * @param store The store
+ * @param func Called for each triple
+ * @param data Passed to func
+ * @return TRUE on success
+ */
+gboolean sib_store_query(SibStore* store, gint s, gint p, gint o,
+			 SibStoreTripleFunc func, gpointer data);
+
+/**
+ * Loads RDF/XML content
+ *
+ * @param store The store
+ * @param rdfxml The content
+ * @return TRUE on success
+ */
+gboolean sib_store_load_rdfxml(SibStore* store, const gchar* rdfxml);
+
+/**
+ * Message of the last error of the store
+ *
+ * @param store The store
+ */
+const gchar* sib_store_error(SibStore* store);
+
+/**
+ * Kind of the last error of the store, for callers that treat some
+ * errors as results, e.g. a node not known to a query
+ *
+ * @param store The store
+ */
+SibStoreStatus sib_store_status(SibStore* store);
+
+/**
+ * Whether the store is piglet backed, needed by the WQL queries that
+ * run in the Python layer
+ *
+ * @param store The store
+ */
+gboolean sib_store_is_piglet(SibStore* store);
+
+#endif /* SIB_STORE_H */
@@ -0,0 +1,106 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_sub_index.h
+ *
+ * Index from triple patterns of template subscriptions to the
+ * subscriptions themselves. Every pattern is filed under one of the
+ * eight s/p/o wildcard shapes, so that a changed triple can be matched
+ * against all live subscriptions with eight hash lookups.
+ */
+
+#ifndef SIB_SUB_INDEX_H
+#define SIB_SUB_INDEX_H
+
+#include <glib.h>
+
+struct _SibSubIndex;
+typedef struct _SibSubIndex SibSubIndex;
+
+/**
+ * Creates a new, empty subscription index
+ *
+ * @return pointer to the index
+ */
+SibSubIndex* sib_sub_index_new(void);
+
+/**
+ * Frees the index. Subscriptions stored in it are not touched.
+ *
+ * @param self Pointer to the index
+ */
+void sib_sub_index_destroy(SibSubIndex* self);
+
+/**
+ * Files a subscription under each of its template patterns.
+ * Node value 0 (sib:any) in a pattern is a wildcard.
+ *
+ * @param self Pointer to the index
+ * @param patterns List of m3_triple_int patterns of the subscription
+ * @param sub The subscription to be returned from matches
+ */
+void sib_sub_index_add(SibSubIndex* self, GSList* patterns, gpointer sub);
+
+/**
+ * Removes a subscription previously added with the same patterns
+ *
+ * @param self Pointer to the index
+ * @param patterns List of m3_triple_int patterns of the subscription
+ * @param sub The subscription to remove
+ */
+void sib_sub_index_remove(SibSubIndex* self, GSList* patterns, gpointer sub);
+
+/**
+ * Finds all subscriptions having at least one pattern matching a triple.
+ *
+ * @param self Pointer to the index
+ * @param s Subject node
+ * @param p Predicate node
+ * @param o Object node
+ *
+ * @return List of subscriptions, each at most once. Free with g_slist_free.
+ */
+GSList* sib_sub_index_match(SibSubIndex* self, gint s, gint p, gint o);
+
+/**
+ * Number of distinct patterns stored in the index
+ *
+ * @param self Pointer to the index
+ */
+guint sib_sub_index_size(SibSubIndex* self);
+
+#endif /* SIB_SUB_INDEX_H */
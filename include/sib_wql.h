@@ -0,0 +1,118 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_wql.h
+ *
+ * Native evaluation of WQL path queries over the integer nodes of a
+ * SibStore, in place of the Walker and PathFSA of the Python layer.
+ * A path expression is given in the syntax the Python layer reads: a
+ * string naming a property, or a nested list such as
+ * ['seq', 'ex:p', ['rep*', ['inv', 'ex:q']]] with the operators seq,
+ * seq+, or, rep*, rep+, inv, value, norewrite and filter and the
+ * special steps any, members, self, p-of-s and p-of-o. It is compiled
+ * into a deterministic automaton over the steps of the path, which is
+ * walked from a start node.
+ *
+ * With reasoning, paths are rewritten for rdf:type, rdfs:subClassOf
+ * and subproperties, and values follow owl:sameAs from the start
+ * node (sib_same_as.h), as rdfplus_m3 does. The subproperties are
+ * looked up when the path is compiled, so a compiled path is valid
+ * until rdfs:subPropertyOf triples change.
+ */
+
+#ifndef SIB_WQL_H
+#define SIB_WQL_H
+
+#include <glib.h>
+
+#include "sib_same_as.h"
+#include "sib_store.h"
+
+struct _SibWqlPath;
+typedef struct _SibWqlPath SibWqlPath;
+
+/**
+ * Compiles a path expression. Resolving the nodes named in it may
+ * create them in the store, so the caller must be able to write it.
+ *
+ * @param store The store
+ * @param expr The path expression
+ * @param reasoner Whether to rewrite the path for RDFS and follow
+ *        owl:sameAs
+ * @return the path or NULL if the expression is not valid
+ */
+SibWqlPath* sib_wql_path_new(SibStore* store, const gchar* expr, gboolean reasoner);
+
+/**
+ * Frees a compiled path
+ *
+ * @param path The path
+ */
+void sib_wql_path_free(SibWqlPath* path);
+
+/**
+ * The property a path expression consists of, such as 'rdf:type'
+ *
+ * @param path The path
+ * @return the property, 0 if the path is not a single property
+ */
+gint sib_wql_path_property(SibWqlPath* path);
+
+/**
+ * Finds the nodes reached from a node along a path
+ *
+ * @param store The store
+ * @param same_as The owl:sameAs classes, the path is walked from all
+ *        members of the class of node if it was compiled with reasoning
+ * @param path The path
+ * @param node The start node
+ * @return List of m3_node_int, each node once. Free the nodes with
+ *         g_free and the list with g_slist_free.
+ */
+GSList* sib_wql_values(SibStore* store, SibSameAs* same_as, SibWqlPath* path, gint node);
+
+/**
+ * Whether a node is reached from another along a path
+ *
+ * @param store The store
+ * @param path The path
+ * @param source The start node
+ * @param sink The node to reach
+ */
+gboolean sib_wql_related(SibStore* store, SibWqlPath* path, gint source, gint sink);
+
+#endif /* SIB_WQL_H */
@@ -58,6 +58,7 @@ class DB(wilbur_m3.DB):
         self.saClusters = {}
         self.saQuery = self.qe.fsa(['rep*', ['or', self.sa, ['inv', self.sa]]])
         self.subprops = [self.subprop]
+        self.m3Paths = {}
 
     def clearReasonerCache(self):
         self.qe.fsaCache = {}
@@ -95,7 +96,7 @@ class DB(wilbur_m3.DB):
         elif p == self.subclass:
             self.add(o, self.subclass, self.resource, self.reasoner, True)
         elif p == self.sa:
-            self.updateSameas(s)
+            self.mergeSameas(s, o)
         elif p in self.subprops:
             self.clearReasonerCache()
             if o in self.subprops:
@@ -145,9 +146,18 @@ class DB(wilbur_m3.DB):
                 path_expr.append(i)
         return path_expr
 
+    def _path_m3(self, path):
+        # Nodes never change, so the parsed path stays valid
+        path_expr = self.m3Paths.get(path)
+        if path_expr == None:
+            path_expr = self._str_to_node_wql(eval(path))
+            if len(self.m3Paths) >= 256:
+                self.m3Paths = {}
+            self.m3Paths[path] = path_expr
+        return path_expr
+
     def values_m3(self, node, path, reasoner=True):
-        str_path = eval(path)
-        path_expr = self._str_to_node_wql(str_path)
+        path_expr = self._path_m3(path)
         #print "WQL VALUES QUERY M3:            node:", node
         #print "WQL VALUES QUERY M3:            path:", path
         #print "WQL VALUES QUERY M3: path expression:", path_expr
@@ -184,8 +194,7 @@ class DB(wilbur_m3.DB):
             return super(DB, self).values(node, path, False)
 
     def related_m3(self, source, path, sink, reasoner=True):
-        str_path = eval(path)
-        path_expr = self._str_to_node_wql(str_path)
+        path_expr = self._path_m3(path)
         return self.related(source, path_expr, sink, reasoner)
         
 
@@ -206,7 +215,23 @@ class DB(wilbur_m3.DB):
             for i in sameas:
                 self.saClusters[i] = sameas
         else:
-            del self.saClusters[node]
+            self.saClusters.pop(node, None)
+
+    def mergeSameas(self, s, o):
+        # Join the clusters, relabeling the smaller one, instead of
+        # walking the joined cluster again
+        if s == o:
+            return
+        big = self.saClusters.get(s) or [s]
+        small = self.saClusters.get(o) or [o]
+        if big is small:
+            return
+        if len(big) < len(small):
+            (big, small) = (small, big)
+        big.extend(small)
+        self.saClusters[big[0]] = big
+        for i in small:
+            self.saClusters[i] = big
 
     def newMemberProp(self, i):
         prop = super(DB, self).newMemberProp(i)
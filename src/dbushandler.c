@@ -63,13 +63,30 @@
 
 #include "dbushandler.h"
 #include "sib_operations.h"
+#include "sib_ssap_server.h"
+
+/* Method of the SIB interface answering m3_sub_status */
+#define SIB_DBUS_METHOD_SUBSCRIPTION_STATUS "SubscriptionStatus"
+
+/* Worker pools per operation class, so that a burst of one kind of
+   request cannot starve the others or spawn unbounded threads */
+typedef enum {DBUSHANDLER_POOL_CONTROL, DBUSHANDLER_POOL_WRITE,
+	      DBUSHANDLER_POOL_READ, DBUSHANDLER_POOL_SUBSCRIPTION,
+	      DBUSHANDLER_N_POOLS} DBusHandlerPoolClass;
+
+typedef DBusHandlerResult (*DBusHandlerRoute)(DBusHandler* self,
+					      DBusConnection* conn,
+					      DBusMessage* msg);
 
 struct _DBusHandler
 {
-  GList *kp_connections;
-  GList *control_connections;
+  /* Sets of registered KP and control connections */
+  GHashTable *kp_connections;
+  GHashTable *control_connections;
   /* UUID -> dbus connection */
   GHashTable *connection_map;
+  /* dbus connection -> set of its UUIDs, for cleanup on disconnect */
+  GHashTable *connection_uuids;
 
   GMainLoop *loop;
   DBusConnection *session_bus;
@@ -77,16 +94,41 @@ struct _DBusHandler
   gchar *my_uri;
   sib_data_structure* sib_data;
 
+  /* Interface -> DBusHandlerRoute and KP method -> operation, built
+     once and only read afterwards, so lookups need no locking */
+  GHashTable *routes;
+  GHashTable *kp_operations;
+
+  /* Protects connection_map, connection_uuids and the connection sets */
   GMutex *lock;
 
-  GThreadPool *threadpool;
+  GThreadPool *pools[DBUSHANDLER_N_POOLS];
+
+  /* Native SSAP listener, NULL if not enabled */
+  SibSsapServer *ssap;
 };
 
-typedef struct _rmData
+typedef struct _DBusHandlerRouteEntry
+{
+  const gchar *interface;
+  DBusHandlerRoute route;
+} DBusHandlerRouteEntry;
+
+typedef struct _DBusHandlerKPMethod
+{
+  const gchar *member;
+  transaction_type operation;
+  DBusHandlerPoolClass pool;
+} DBusHandlerKPMethod;
+
+typedef struct _DBusHandlerPoolLimits
 {
-  gpointer value;
-  gpointer key;
-} rmData;
+  const gchar *name;
+  /* Worker threads */
+  gint max_threads;
+  /* Requests waiting for a worker, more are refused as busy */
+  guint max_queued;
+} DBusHandlerPoolLimits;
   
 
 /* Keep this preprocessor instruction always AFTER struct definitions
@@ -96,6 +138,9 @@ typedef struct _rmData
 /* Private function prototypes */
 
 static int dbushandler_initialize(DBusHandler* self);
+static void dbushandler_start_ssap(DBusHandler* self);
+static void dbushandler_ssap_request(SibSsapConnection* ssap, gint tr_id,
+				     DBusMessage* msg, gpointer data);
 
 static void dbushandler_handle_connection(DBusServer* server,
 					  DBusConnection* conn,
@@ -121,11 +166,70 @@ static int dbushandler_unregister_kp(DBusHandler *self, DBusConnection *conn,
 				     DBusMessage *msg);
 
 static void dbushandler_handle_disconnect( DBusHandler *self, DBusConnection *conn);
-static gboolean dbushandler_compare_hashtable_value(gpointer _key, gpointer _value, gpointer _data);
 
 static gint dbushandler_send_register_sib(DBusHandler* self, DBusConnection* conn);
 static void kp_handler(gpointer data, gpointer userdata);
 
+static DBusHandlerResult dbushandler_sib_register_message(DBusHandler* self,
+							  DBusConnection* conn,
+							  DBusMessage* msg);
+static DBusHandlerResult dbushandler_sib_general_message(DBusHandler* self,
+							 DBusConnection* conn,
+							 DBusMessage* msg);
+static DBusHandlerResult dbushandler_log_message(DBusHandler* self,
+						 DBusConnection* conn,
+						 DBusMessage* msg);
+static DBusHandlerResult dbushandler_org_freedesktop_dbus_message(DBusHandler* self,
+								  DBusConnection* conn,
+								  DBusMessage* msg);
+static DBusHandlerResult dbushandler_org_freedesktop_dbus_local(DBusHandler* self,
+								DBusConnection* conn,
+								DBusMessage* msg);
+static DBusHandlerResult dbushandler_org_freedesktop_dbus_introspectable(DBusHandler* self,
+									 DBusConnection* conn,
+									 DBusMessage* msg);
+
+static void dbushandler_add_connection(DBusHandler* self, gchar* uuid,
+				       DBusConnection* conn);
+static gboolean dbushandler_remove_connection(DBusHandler* self, gchar* uuid);
+
+/* Routing tables */
+
+static const DBusHandlerRouteEntry dbushandler_routes[] =
+  {
+    { SIB_DBUS_KP_INTERFACE, dbushandler_kp_message },
+    { SIB_DBUS_REGISTER_INTERFACE, dbushandler_sib_register_message },
+    { SIB_DBUS_INTERFACE, dbushandler_sib_general_message },
+    { SIB_DBUS_LOG_INTERFACE, dbushandler_log_message },
+    { DBUS_INTERFACE_DBUS, dbushandler_org_freedesktop_dbus_message },
+    { DBUS_INTERFACE_LOCAL, dbushandler_org_freedesktop_dbus_local },
+    { DBUS_INTERFACE_INTROSPECTABLE, dbushandler_org_freedesktop_dbus_introspectable },
+    { NULL, NULL }
+  };
+
+static const DBusHandlerKPMethod dbushandler_kp_methods[] =
+  {
+    { SIB_DBUS_KP_METHOD_JOIN, M3_JOIN, DBUSHANDLER_POOL_CONTROL },
+    { SIB_DBUS_KP_METHOD_LEAVE, M3_LEAVE, DBUSHANDLER_POOL_CONTROL },
+    { SIB_DBUS_KP_METHOD_INSERT, M3_INSERT, DBUSHANDLER_POOL_WRITE },
+    { SIB_DBUS_KP_METHOD_REMOVE, M3_REMOVE, DBUSHANDLER_POOL_WRITE },
+    { SIB_DBUS_KP_METHOD_UPDATE, M3_UPDATE, DBUSHANDLER_POOL_WRITE },
+    { SIB_DBUS_KP_METHOD_QUERY, M3_QUERY, DBUSHANDLER_POOL_READ },
+    { SIB_DBUS_KP_METHOD_SUBSCRIBE, M3_SUBSCRIBE, DBUSHANDLER_POOL_SUBSCRIPTION },
+    { SIB_DBUS_KP_METHOD_UNSUBSCRIBE, M3_UNSUBSCRIBE, DBUSHANDLER_POOL_SUBSCRIPTION },
+    { NULL, 0, 0 }
+  };
+
+/* Writes are serialized by the scheduler and subscriptions by the
+   store lock, more threads would only queue up there */
+static const DBusHandlerPoolLimits dbushandler_pool_limits[DBUSHANDLER_N_POOLS] =
+  {
+    { "control", 2, 64 },
+    { "write", 4, 256 },
+    { "read", 8, 256 },
+    { "subscription", 4, 128 }
+  };
+
 /* Public functions */
 
 /**
@@ -138,6 +242,9 @@ DBusHandler* dbushandler_new(gchar* local_address, gchar *uri, GMainLoop* loop,
   static gboolean instantiated = FALSE;
   DBusHandler *self = NULL;
   GError *gerror=NULL;
+  const DBusHandlerRouteEntry *route;
+  const DBusHandlerKPMethod *method;
+  gint i;
   whiteboard_log_debug_fb();
   
   g_return_val_if_fail(NULL != local_address, NULL);
@@ -160,25 +267,46 @@ DBusHandler* dbushandler_new(gchar* local_address, gchar *uri, GMainLoop* loop,
   
   self->local_address = g_strdup(local_address);
   self->my_uri = g_strdup(uri);
- self->kp_connections = NULL;
+  self->kp_connections = g_hash_table_new(g_direct_hash, g_direct_equal);
+  self->control_connections = g_hash_table_new(g_direct_hash, g_direct_equal);
   
   self->connection_map = g_hash_table_new_full(g_str_hash, g_str_equal,
 					       g_free, NULL);
+  self->connection_uuids = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						 NULL, (GDestroyNotify)g_hash_table_destroy);
   self->lock = g_mutex_new();
   self->sib_data = sib_data;
 
-  self->threadpool = g_thread_pool_new( kp_handler, self, -1, FALSE, &gerror );
-  if(gerror)
+  self->routes = g_hash_table_new(g_str_hash, g_str_equal);
+  for (route = dbushandler_routes; route->interface != NULL; route++)
+    g_hash_table_insert(self->routes, (gpointer)route->interface,
+			(gpointer)route);
+
+  self->kp_operations = g_hash_table_new(g_str_hash, g_str_equal);
+  for (method = dbushandler_kp_methods; method->member != NULL; method++)
+    g_hash_table_insert(self->kp_operations, (gpointer)method->member,
+			(gpointer)method);
+
+  for (i = 0; i < DBUSHANDLER_N_POOLS; i++)
     {
-      whiteboard_log_error("Could not create threadpool for kp_handler: %s\n", gerror->message);
-      g_error_free(gerror);
-      return NULL;
+      self->pools[i] = g_thread_pool_new( kp_handler, self,
+					  dbushandler_pool_limits[i].max_threads,
+					  FALSE, &gerror );
+      if(gerror)
+	{
+	  whiteboard_log_error("Could not create %s threadpool for kp_handler: %s\n",
+			       dbushandler_pool_limits[i].name, gerror->message);
+	  g_error_free(gerror);
+	  return NULL;
+	}
     }
 
   if (-1 == dbushandler_initialize(self))
     {
       whiteboard_log_error("DBusHandler initialization failed.\n");
     }
+
+  dbushandler_start_ssap(self);
 	
   if (NULL != self)
     instantiated = TRUE;
@@ -193,12 +321,18 @@ void dbushandler_destroy(DBusHandler *self)
   whiteboard_log_debug_fb();
 
   g_return_if_fail(NULL != self);
+  if (NULL != self->ssap)
+    sib_ssap_server_destroy(self->ssap);
   g_mutex_lock(self->lock);
   g_free(self->local_address);
   g_free(self->my_uri);
   g_hash_table_destroy(self->connection_map);
+  g_hash_table_destroy(self->routes);
+  g_hash_table_destroy(self->kp_operations);
+  g_hash_table_destroy(self->connection_uuids);
 
-  g_list_free(self->kp_connections);
+  g_hash_table_destroy(self->kp_connections);
+  g_hash_table_destroy(self->control_connections);
   g_mutex_unlock(self->lock);
   g_mutex_free(self->lock);
   g_main_loop_unref(self->loop);	
@@ -209,16 +343,28 @@ void dbushandler_destroy(DBusHandler *self)
 
 GList *dbushandler_get_control_connections(DBusHandler *self)
 {
+  GList *list;
+
   g_return_val_if_fail(NULL != self, NULL);
 
-  return self->control_connections;
+  g_mutex_lock(self->lock);
+  list = g_hash_table_get_keys(self->control_connections);
+  g_mutex_unlock(self->lock);
+
+  return list;
 }
 
 GList *dbushandler_get_kp_connections(DBusHandler *self)
 {
+  GList *list;
+
   g_return_val_if_fail(NULL != self, NULL);
 
-  return self->kp_connections;
+  g_mutex_lock(self->lock);
+  list = g_hash_table_get_keys(self->kp_connections);
+  g_mutex_unlock(self->lock);
+
+  return list;
 }
 
 DBusConnection *dbushandler_get_session_bus(DBusHandler *self)
@@ -247,11 +393,13 @@ static int dbushandler_register_kp(DBusHandler *self, DBusConnection *conn,
   //  dbus_bus_set_unique_name(conn, unique_name); 
   //dbushandler_add_connection_by_uuid(self, g_strdup(unique_name), conn);
   
-  dbushandler_add_connection_by_uuid(self, g_strdup(registered_uuid), conn);
+  g_mutex_lock(self->lock);
+  dbushandler_add_connection(self, registered_uuid, conn);
 
   //  g_free(unique_name);
 
-  self->kp_connections = g_list_prepend(self->kp_connections, conn);
+  g_hash_table_insert(self->kp_connections, conn, conn);
+  g_mutex_unlock(self->lock);
 
   status = 0;
   whiteboard_util_send_method_return(conn, msg,
@@ -302,13 +450,14 @@ static int dbushandler_register_control(DBusHandler *self, DBusConnection *conn,
 
   whiteboard_log_debug("Registered uuid: %s\n", registered_uuid);
 
-  dbushandler_add_connection_by_uuid(self, registered_uuid, conn);
+  g_mutex_lock(self->lock);
+  dbushandler_add_connection(self, registered_uuid, conn);
 
   //dbus_bus_set_unique_name(conn, unique_name); 
   //g_free(unique_name);
 
-  self->control_connections = g_list_prepend(self->control_connections,
-					     conn);
+  g_hash_table_insert(self->control_connections, conn, conn);
+  g_mutex_unlock(self->lock);
 
 
   status = 0;
@@ -414,6 +563,45 @@ static gint dbushandler_initialize(DBusHandler *self)
   return retval;
 }
 
+/* Starts the native SSAP listener, in the binary framing of
+   sib_ssap_server.h and not SSAP XML, if SIB_SSAP_PORT (TCP) or
+   SIB_SSAP_PATH (unix socket) is set. SIB_SSAP_WINDOW sets the
+   transactions a connection may have outstanding. */
+static void dbushandler_start_ssap(DBusHandler *self)
+{
+  const gchar *port = getenv("SIB_SSAP_PORT");
+  const gchar *path = getenv("SIB_SSAP_PATH");
+  const gchar *window = getenv("SIB_SSAP_WINDOW");
+  gboolean listening = FALSE;
+
+  if (NULL == port && NULL == path)
+    return;
+
+  self->ssap = sib_ssap_server_new(dbushandler_ssap_request, self);
+  if (NULL == self->ssap)
+    return;
+  if (NULL != window && atoi(window) > 0)
+    sib_ssap_server_set_window(self->ssap, atoi(window));
+
+  if (NULL != port && sib_ssap_server_listen_tcp(self->ssap, atoi(port)))
+    {
+      whiteboard_log_debug("SSAP listening on TCP port %s\n", port);
+      listening = TRUE;
+    }
+  if (NULL != path && sib_ssap_server_listen_unix(self->ssap, path))
+    {
+      whiteboard_log_debug("SSAP listening on %s\n", path);
+      listening = TRUE;
+    }
+
+  if (!listening || !sib_ssap_server_start(self->ssap))
+    {
+      whiteboard_log_error("Could not start the SSAP listener\n");
+      sib_ssap_server_destroy(self->ssap);
+      self->ssap = NULL;
+    }
+}
+
 static void dbushandler_handle_connection(DBusServer *server,
 					  DBusConnection *conn,
 					  gpointer data)
@@ -526,6 +714,7 @@ static DBusHandlerResult dbushandler_sib_general_message(
   gint type = 0;
   GString *address;
   gchar *uri = NULL;;
+  gchar *status;
   whiteboard_log_debug_fb();
 
   interface = dbus_message_get_interface(msg);
@@ -550,6 +739,14 @@ static DBusHandlerResult dbushandler_sib_general_message(
 					     WHITEBOARD_UTIL_LIST_END);
 	  g_string_free(address,FALSE);
 	}
+      else if (!strcmp(member, SIB_DBUS_METHOD_SUBSCRIPTION_STATUS))
+	{
+	  status = m3_sub_status(self->sib_data);
+	  whiteboard_util_send_method_return(conn, msg,
+					     DBUS_TYPE_STRING, &status,
+					     WHITEBOARD_UTIL_LIST_END);
+	  g_free(status);
+	}
       else
 	{
 	  whiteboard_log_warning("Method %s not defined " \
@@ -587,9 +784,9 @@ static DBusHandlerResult dbushandler_sib_general_message(
   whiteboard_log_debug_fe();
 }
 
-static void dbushandler_org_freedesktop_dbus_message(DBusHandler* self,
-						     DBusConnection* conn,
-						     DBusMessage* msg)
+static DBusHandlerResult dbushandler_org_freedesktop_dbus_message(DBusHandler* self,
+								  DBusConnection* conn,
+								  DBusMessage* msg)
 {
   const gchar *interface = NULL;
   const gchar *member = NULL;
@@ -623,11 +820,13 @@ static void dbushandler_org_freedesktop_dbus_message(DBusHandler* self,
     }
   
   whiteboard_log_debug_fe();
+
+  return DBUS_HANDLER_RESULT_HANDLED;
 }
 
-static void dbushandler_org_freedesktop_dbus_local( DBusHandler* self,
-						    DBusConnection* conn,
-						    DBusMessage* msg)
+static DBusHandlerResult dbushandler_org_freedesktop_dbus_local( DBusHandler* self,
+								 DBusConnection* conn,
+								 DBusMessage* msg)
 {
    const gchar* interface = NULL;
   const gchar* member = NULL;
@@ -635,8 +834,8 @@ static void dbushandler_org_freedesktop_dbus_local( DBusHandler* self,
   
   whiteboard_log_debug_fb();
   
-  g_return_if_fail( NULL != self );
-  g_return_if_fail( NULL != msg );
+  g_return_val_if_fail( NULL != self, DBUS_HANDLER_RESULT_NOT_YET_HANDLED );
+  g_return_val_if_fail( NULL != msg, DBUS_HANDLER_RESULT_NOT_YET_HANDLED );
   
   interface = dbus_message_get_interface(msg);
   member = dbus_message_get_member(msg);
@@ -652,6 +851,8 @@ static void dbushandler_org_freedesktop_dbus_local( DBusHandler* self,
       whiteboard_log_debug("Unknown message on org.freedesktop.DBus.Local interface, member %s\n", member);
     }
   whiteboard_log_debug_fe();
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
 static DBusHandlerResult dbushandler_org_freedesktop_dbus_introspectable( DBusHandler* self,
@@ -690,222 +891,125 @@ static DBusHandlerResult dbushandler_org_freedesktop_dbus_introspectable( DBusHa
   return retval;
 }
 
-static DBusHandlerResult dbushandler_kp_message(DBusHandler* self,
-						DBusConnection* conn,
-						DBusMessage* msg)
+static DBusHandlerResult dbushandler_log_message(DBusHandler* self,
+						 DBusConnection* conn,
+						 DBusMessage* msg)
+{
+  const gchar* connection_name = NULL;
+  GList* kp_connections;
+
+  whiteboard_log_debug("Got log message packet\n"); 
+
+  connection_name = dbus_bus_get_unique_name(conn);
+  if ( NULL != connection_name ) 
+    dbus_message_set_sender(msg, connection_name); 
+
+  kp_connections = dbushandler_get_kp_connections(self);
+  whiteboard_util_send_message_to_list(kp_connections, msg);
+  g_list_free(kp_connections);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Runs a KP request in the pool of its operation. The request came
+   over DBus (conn) or over a native SSAP connection (ssap). */
+static DBusHandlerResult dbushandler_dispatch_kp(DBusHandler* self,
+						 DBusConnection* conn,
+						 SibSsapConnection* ssap,
+						 gint tr_id,
+						 DBusMessage* msg)
 {
   DBusHandlerResult retval = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
   const gchar* interface = NULL;
   const gchar* member = NULL;
-  gint type = 0;
+  const DBusHandlerKPMethod* method = NULL;
+  GThreadPool* pool;
   sib_op_parameter* p;
   GError* gerror = NULL;
 
   whiteboard_log_debug_fb();
   
-  p = g_new0(sib_op_parameter, 1);
-      
   g_return_val_if_fail( NULL != self, retval );
   g_return_val_if_fail( NULL != msg, retval );
   
   interface = dbus_message_get_interface(msg);
   member = dbus_message_get_member(msg);
-  type = dbus_message_get_type(msg);
-
-  // printf("Got DBUS KP message: %s, type %d\n", member, type);
-  /*
-   * Dispatch SIB operation handlers in separate threads
-   */
 
-  if(!strcmp(member, SIB_DBUS_KP_METHOD_JOIN ))
+  if (NULL != member)
+    method = (const DBusHandlerKPMethod*)g_hash_table_lookup(self->kp_operations,
+							      member);
+  if (NULL == method)
     {
-      whiteboard_log_debug("Got JOIN\n");
-      /* DBus message unreferenced in m3_join */
-      dbus_message_ref(msg);
-      // printf("Ref'd dbus message\n");
-
-
-      p->msg = msg;
-      p->conn = conn;
-      p->sib = self->sib_data;
-      p->operation = M3_JOIN;
-      g_thread_pool_push(self->threadpool, p, &gerror);
-      //g_thread_create(m3_join, p, FALSE, &gerror);
-      if (gerror)
-	{
-	  printf("Error creating thread: %s\n", gerror->message);
-	  g_error_free(gerror);
-	}
-
-      retval = DBUS_HANDLER_RESULT_HANDLED;
+      whiteboard_log_debug("Unknown message on interface: %s, member: %s\n", interface, member);
+      whiteboard_log_debug_fe();
+      return retval;
     }
 
-  else if(!strcmp(member, SIB_DBUS_KP_METHOD_LEAVE ))
-    {
-      whiteboard_log_debug("Got LEAVE\n");
+  whiteboard_log_debug("Got %s\n", member);
 
-      /* DBus message unreferenced in m3_leave */
-      dbus_message_ref(msg);
+  /*
+   * Dispatch SIB operation handlers in separate threads
+   */
 
-      p->msg = msg;
-      p->conn = conn;
-      p->sib = self->sib_data;
-      p->operation = M3_LEAVE;
-      g_thread_pool_push(self->threadpool, p, &gerror);
+  /* Message and connection unreferenced in the m3_ operation */
+  dbus_message_ref(msg);
 
-      //      g_thread_create(m3_leave, p, FALSE, &gerror);
-      if (gerror)
-	{
-	  printf("Error creating thread: %s\n", gerror->message);
-	  g_error_free(gerror);
-	}
-      retval = DBUS_HANDLER_RESULT_HANDLED;
-    }
-  
-  else if(!strcmp(member, SIB_DBUS_KP_METHOD_INSERT ))
+  p = g_new0(sib_op_parameter, 1);
+  p->msg = msg;
+  p->conn = conn;
+  if (NULL != ssap)
     {
-      whiteboard_log_debug("Got INSERT\n");
-
-      /* DBus message unreferenced in m3_insert */
-      dbus_message_ref(msg);
-
-      p->msg = msg;
-      p->conn = conn;
-      p->sib = self->sib_data;
-      p->operation = M3_INSERT;
-      g_thread_pool_push(self->threadpool, p, &gerror);
-
-      //g_thread_create(m3_insert, p, FALSE, &gerror);
-      if (gerror)
-	{
-	  printf("Error creating thread: %s\n", gerror->message);
-	  g_error_free(gerror);
-	}
-
-      retval = DBUS_HANDLER_RESULT_HANDLED;
+      p->ssap = sib_ssap_connection_ref(ssap);
+      p->tr_id = tr_id;
+      p->in_window = TRUE;
     }
-  
-  else if(!strcmp(member, SIB_DBUS_KP_METHOD_REMOVE ))
-    {
-      whiteboard_log_debug("Got REMOVE\n");
-      
-      /* DBus message unreferenced in m3_remove */
-      dbus_message_ref(msg);
-      
-      p->msg = msg;
-      p->conn = conn;
-      p->sib = self->sib_data;
-      p->operation = M3_REMOVE;
-      g_thread_pool_push(self->threadpool, p, &gerror);
-      
-      //g_thread_create(m3_remove, p, FALSE, &gerror);
-      if (gerror)
-	{
-	  printf("Error creating thread: %s\n", gerror->message);
-	  g_error_free(gerror);
-	}
+  p->sib = self->sib_data;
+  p->operation = method->operation;
 
-      retval = DBUS_HANDLER_RESULT_HANDLED;
-    }
-  
-  else if(!strcmp(member, SIB_DBUS_KP_METHOD_UPDATE ))
+  /* Refuse rather than queue without bound when the pool is behind */
+  pool = self->pools[method->pool];
+  if (g_thread_pool_unprocessed(pool) >= dbushandler_pool_limits[method->pool].max_queued)
     {
-      whiteboard_log_debug("Got UPDATE\n");
-
-      /* DBus message unreferenced in m3_update */
-      dbus_message_ref(msg);
-
-      p->msg = msg;
-      p->conn = conn;
-      p->sib = self->sib_data;
-      p->operation = M3_UPDATE;
-      g_thread_pool_push(self->threadpool, p, &gerror);
-
-      //g_thread_create(m3_update, p, FALSE, &gerror);
-      if (gerror)
-	{
-	  printf("Error creating thread: %s\n", gerror->message);
-	  g_error_free(gerror);
-	}
-      retval = DBUS_HANDLER_RESULT_HANDLED;
+      whiteboard_log_debug("%s pool full, refusing %s\n",
+			   dbushandler_pool_limits[method->pool].name, member);
+      m3_refuse(p, M3_STATUS_BUSY);
+      whiteboard_log_debug_fe();
+      return DBUS_HANDLER_RESULT_HANDLED;
     }
 
-  else if(!strcmp(member, SIB_DBUS_KP_METHOD_QUERY ))
+  g_thread_pool_push(pool, p, &gerror);
+  if (gerror)
     {
-
-      whiteboard_log_debug("Got QUERY\n");
-
-      /* DBus message unreferenced in m3_query */
-      dbus_message_ref(msg);
-
-      p->msg = msg;
-      p->conn = conn;
-      p->sib = self->sib_data;
-      p->operation = M3_QUERY;
-      g_thread_pool_push(self->threadpool, p, &gerror);
-      
-      //g_thread_create(m3_query, p, FALSE, &gerror);
-      if (gerror)
-	{
-	  printf("Error creating thread: %s\n", gerror->message);
-	  g_error_free(gerror);
-	}
-
-      retval = DBUS_HANDLER_RESULT_HANDLED;
+      printf("Error creating thread: %s\n", gerror->message);
+      g_error_free(gerror);
     }
-  else if(!strcmp(member, SIB_DBUS_KP_METHOD_SUBSCRIBE ))
-    {
-      
-      whiteboard_log_debug("Got SUBSCRIBE\n");
+  retval = DBUS_HANDLER_RESULT_HANDLED;
 
-      /* DBus message unreferenced in m3_subscribe */
-      dbus_message_ref(msg);
+  whiteboard_log_debug_fe();
+  return retval;
+}
 
-      p->msg = msg;
-      p->conn = conn;
-      p->sib = self->sib_data;
-      p->operation = M3_SUBSCRIBE;
-      g_thread_pool_push(self->threadpool, p, &gerror);
-      
-      //g_thread_create(m3_subscribe, p, FALSE, &gerror);
-      if (gerror)
-	{
-	  printf("Error creating thread: %s\n", gerror->message);
-	  g_error_free(gerror);
-	}
+static DBusHandlerResult dbushandler_kp_message(DBusHandler* self,
+						DBusConnection* conn,
+						DBusMessage* msg)
+{
+  return dbushandler_dispatch_kp(self, conn, NULL, 0, msg);
+}
 
-      retval = DBUS_HANDLER_RESULT_HANDLED;
-    }
-  else if(!strcmp(member, SIB_DBUS_KP_METHOD_UNSUBSCRIBE ))
-    {
-      
-      whiteboard_log_debug("Got UNSUBSCRIBE\n");
-      /* DBus message unreferenced in m3_subscribe */
-      dbus_message_ref(msg);
-      
-      p->msg = msg;
-      p->conn = conn;
-      p->sib = self->sib_data;
-      p->operation = M3_UNSUBSCRIBE;
-      g_thread_pool_push(self->threadpool, p, &gerror);
-
-      //g_thread_create(m3_unsubscribe, p, FALSE, &gerror);
-      if (gerror)
-	{
-	  printf("Error creating thread: %s\n", gerror->message);
-	  g_error_free(gerror);
-	}
-      retval = DBUS_HANDLER_RESULT_HANDLED;
-    }
-  else
+static void dbushandler_ssap_request(SibSsapConnection* ssap, gint tr_id,
+				     DBusMessage* msg, gpointer data)
+{
+  DBusHandler* self = (DBusHandler*)data;
+
+  if (DBUS_HANDLER_RESULT_HANDLED !=
+      dbushandler_dispatch_kp(self, NULL, ssap, tr_id, msg))
     {
-      whiteboard_log_debug("Unknown message on interface: %s, member: %s\n", interface, member);
+      whiteboard_log_warning("Unknown SSAP request %s\n",
+			     dbus_message_get_member(msg));
+      sib_ssap_connection_done(ssap, tr_id);
     }
-  whiteboard_log_debug_fe();
-  return retval;
 }
 
-
 static void kp_handler(gpointer data, gpointer userdata)
 {
   /* DBusHandler *self = (DBusHandler *)userdata; */
@@ -948,36 +1052,30 @@ static void kp_handler(gpointer data, gpointer userdata)
 static void dbushandler_handle_disconnect( DBusHandler* self,
 					   DBusConnection* conn)
 {
+  GHashTable *uuids;
+  GHashTableIter iter;
+  gpointer uuid;
+
   whiteboard_log_debug_fb();
   // Assume that it was a node connection that left
   // TODO: apply also for SIB access
-  rmData *rm = NULL;
-  gchar *nodeid = NULL;
-  rm = g_new0(rmData,1);
-  rm->value = conn;
   
-  while( g_hash_table_find(self->connection_map, dbushandler_compare_hashtable_value, rm ) )
+  g_mutex_lock(self->lock);
+  /* Only the UUIDs of this connection are visited */
+  uuids = (GHashTable*) g_hash_table_lookup(self->connection_uuids, conn);
+  if (NULL != uuids)
     {
-      nodeid = g_strdup((gchar *)rm->key);
-      
-      dbushandler_remove_connection_by_uuid(self, nodeid);
-      
-      g_free(nodeid);
+      g_hash_table_steal(self->connection_uuids, conn);
+      g_hash_table_iter_init(&iter, uuids);
+      while (g_hash_table_iter_next(&iter, &uuid, NULL))
+	g_hash_table_remove(self->connection_map, uuid);
+      g_hash_table_destroy(uuids);
     }
-  g_free(rm);
-  whiteboard_log_debug_fe(); 
-}
+  g_hash_table_remove(self->kp_connections, conn);
+  g_hash_table_remove(self->control_connections, conn);
+  g_mutex_unlock(self->lock);
 
-static gboolean dbushandler_compare_hashtable_value(gpointer _key, gpointer _value, gpointer _data)
-{
-  rmData *rm = (rmData *)_data;
-  g_return_val_if_fail(rm != NULL, FALSE);
-  if( _value == rm->value)
-    {
-      rm->key = _key;
-      return TRUE;
-    }
-  return FALSE;
+  whiteboard_log_debug_fe(); 
 }
 
 static DBusHandlerResult dbushandler_handle_message(DBusConnection *conn,
@@ -987,8 +1085,7 @@ static DBusHandlerResult dbushandler_handle_message(DBusConnection *conn,
   DBusHandler* self = NULL;
   const gchar* interface = NULL;
   const gchar* member = NULL;
-  const gchar* connection_name = NULL;
-  gint type = 0;
+  const DBusHandlerRouteEntry* route = NULL;
   DBusHandlerResult result = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
   whiteboard_log_debug_fb();
   
@@ -998,66 +1095,15 @@ static DBusHandlerResult dbushandler_handle_message(DBusConnection *conn,
 
   interface = dbus_message_get_interface(msg);
   member = dbus_message_get_member(msg);
-  type = dbus_message_get_type(msg);
-  connection_name = dbus_bus_get_unique_name(conn);
-  /* printf("dbushandler_handle_message %s %s %d\n", interface,member, type); */
+  /* printf("dbushandler_handle_message %s %s\n", interface,member); */
   g_return_val_if_fail(NULL != interface,
 		       DBUS_HANDLER_RESULT_NOT_YET_HANDLED);
-  g_mutex_lock(self->lock);
-  /* TODO: Could be optimized, sender is not needed in many
-   * of the routed packets.
-   */
-  if (!strcmp(interface, SIB_DBUS_KP_INTERFACE))
-    {
-      whiteboard_log_debug("Got KP packet\n");
-      result = dbushandler_kp_message(self,conn,msg);
-    }
-  else if (!strcmp(interface, SIB_DBUS_REGISTER_INTERFACE))
+  /* The routing tables are not modified after dbushandler_new */
+  route = (const DBusHandlerRouteEntry*)g_hash_table_lookup(self->routes,
+							    interface);
+  if (NULL != route)
     {
-      whiteboard_log_debug("Got register packet\n");
-
-      //if ( NULL != connection_name )
-      //	dbus_message_set_sender(msg, connection_name);
-
-      result = dbushandler_sib_register_message(self, conn, msg);
-    }
-  else if (!strcmp(interface, SIB_DBUS_INTERFACE))
-    {
-      whiteboard_log_debug("Got general packet\n");
-
-      /* Don't set the sender because session bus goes wacko */
-
-      dbushandler_sib_general_message(self, conn, msg);
-      result = DBUS_HANDLER_RESULT_HANDLED;      
-    }
-  else if (!strcmp(interface, SIB_DBUS_LOG_INTERFACE))
-    {
-      GList* kp_connections = dbushandler_get_kp_connections(self); 
-	  
-      whiteboard_log_debug("Got log message packet\n"); 
-	  
-      if ( NULL != connection_name ) 
-	dbus_message_set_sender(msg, connection_name); 
-	  
-      whiteboard_util_send_message_to_list(kp_connections, msg);
-      result = DBUS_HANDLER_RESULT_HANDLED;      
-      
-    }
-  else if (!strcmp(interface, DBUS_INTERFACE_DBUS))
-    {
-      printf("Got generic DBus packet\n");
-      dbushandler_org_freedesktop_dbus_message(self, conn, msg);
-      result = DBUS_HANDLER_RESULT_HANDLED;      
-    }
-  else if (!strcmp(interface, DBUS_INTERFACE_LOCAL))
-    {
-      whiteboard_log_debug("Got Local DBus packet\n");
-      dbushandler_org_freedesktop_dbus_local( self, conn,msg);
-    }
-  else if( !strcmp(interface, DBUS_INTERFACE_INTROSPECTABLE ) )
-    {
-      whiteboard_log_debug("Got Introspectable DBus packet\n");
-      result = dbushandler_org_freedesktop_dbus_introspectable( self, conn,msg);
+      result = route->route(self, conn, msg);
     }
   else
     {
@@ -1066,7 +1112,6 @@ static DBusHandlerResult dbushandler_handle_message(DBusConnection *conn,
     }
 	
   whiteboard_log_debug_fe();
-  g_mutex_unlock(self->lock);
   /* TODO: Check what should be returned here */
   return result;
 }
@@ -1113,6 +1158,69 @@ gint dbushandler_send_register_sib(DBusHandler* self, DBusConnection* conn)
  * Connection map manipulation
  *****************************************************************************/
 
+/* Connection map and list changes, called with self->lock held */
+
+static gboolean dbushandler_remove_connection(DBusHandler* self, gchar* uuid);
+
+static void dbushandler_add_connection(DBusHandler* self, gchar* uuid,
+				       DBusConnection* conn)
+{
+  GHashTable *uuids;
+
+  /* A UUID moving to another connection leaves the old one */
+  if (NULL != g_hash_table_lookup(self->connection_map, uuid))
+    dbushandler_remove_connection(self, uuid);
+
+  g_hash_table_insert(self->connection_map, g_strdup(uuid), conn);
+
+  uuids = (GHashTable*) g_hash_table_lookup(self->connection_uuids, conn);
+  if (NULL == uuids)
+    {
+      uuids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+      g_hash_table_insert(self->connection_uuids, conn, uuids);
+    }
+  g_hash_table_replace(uuids, g_strdup(uuid), NULL);
+
+  whiteboard_log_debugc(WHITEBOARD_DEBUG_DBUS,
+			"Insert UUID: %s, conn: %p. Map size: %d\n",
+			uuid, conn, g_hash_table_size(self->connection_map));
+}
+
+static gboolean dbushandler_remove_connection(DBusHandler* self, gchar* uuid)
+{
+  DBusConnection* conn = NULL;
+  GHashTable *uuids;
+  gboolean retval = FALSE;
+
+  conn = (DBusConnection*) g_hash_table_lookup(self->connection_map, uuid);
+  if (conn != NULL)
+    {
+      /* Remove the connection from the hash map */
+      retval = g_hash_table_remove(self->connection_map, uuid);
+
+      whiteboard_log_debugc(WHITEBOARD_DEBUG_DBUS,
+			    "Removed:%s, conn:%p, ok:%s. Map size:%d\n",
+			    uuid, conn, (retval) ? "TRUE" : "FALSE",
+			    g_hash_table_size(self->connection_map));
+
+      /* The connection stays registered while it has UUIDs left */
+      uuids = (GHashTable*) g_hash_table_lookup(self->connection_uuids, conn);
+      if (NULL != uuids)
+	{
+	  g_hash_table_remove(uuids, uuid);
+	  if (g_hash_table_size(uuids) > 0)
+	    return retval;
+	  g_hash_table_remove(self->connection_uuids, conn);
+	}
+      g_hash_table_remove(self->kp_connections, conn);
+      g_hash_table_remove(self->control_connections, conn);
+      
+      // dbus_connection_unref(conn);
+    }
+
+  return retval;
+}
+
 void dbushandler_add_connection_by_uuid(DBusHandler* self, gchar* uuid,
 					DBusConnection* conn)
 {
@@ -1122,11 +1230,9 @@ void dbushandler_add_connection_by_uuid(DBusHandler* self, gchar* uuid,
   g_return_if_fail(NULL != uuid);
   g_return_if_fail(NULL != conn);
 
-  g_hash_table_insert(self->connection_map, g_strdup(uuid), conn);
-
-  whiteboard_log_debugc(WHITEBOARD_DEBUG_DBUS,
-			"Insert UUID: %s, conn: %p. Map size: %d\n",
-			uuid, conn, g_hash_table_size(self->connection_map));
+  g_mutex_lock(self->lock);
+  dbushandler_add_connection(self, uuid, conn);
+  g_mutex_unlock(self->lock);
 
   whiteboard_log_debug_fe();
 }
@@ -1141,11 +1247,13 @@ DBusConnection *dbushandler_get_connection_by_uuid(DBusHandler *self,
   g_return_val_if_fail(NULL != self, NULL);
   g_return_val_if_fail(NULL != uuid, NULL);
 
+  g_mutex_lock(self->lock);
   whiteboard_log_debugc(WHITEBOARD_DEBUG_DBUS,
 			"Trying to get UUID: %s, Map size: %d\n",
 			uuid, g_hash_table_size(self->connection_map));
 	
   conn = (DBusConnection*) g_hash_table_lookup(self->connection_map, uuid);
+  g_mutex_unlock(self->lock);
 
   whiteboard_log_debug_fe();
 
@@ -1154,7 +1262,6 @@ DBusConnection *dbushandler_get_connection_by_uuid(DBusHandler *self,
 
 gboolean dbushandler_remove_connection_by_uuid(DBusHandler* self, gchar* uuid)
 {
-  DBusConnection* conn = NULL;
   gboolean retval = FALSE;
 
   whiteboard_log_debug_fb();
@@ -1162,22 +1269,9 @@ gboolean dbushandler_remove_connection_by_uuid(DBusHandler* self, gchar* uuid)
   g_return_val_if_fail(NULL != self, FALSE);
   g_return_val_if_fail(NULL != uuid, FALSE);
 
-  conn = dbushandler_get_connection_by_uuid(self, uuid);
-  if (conn != NULL)
-    {
-      /* Remove the connection from the hash map */
-      retval = g_hash_table_remove(self->connection_map, uuid);
-
-      whiteboard_log_debugc(WHITEBOARD_DEBUG_DBUS,
-			    "Removed:%s, conn:%p, ok:%s. Map size:%d\n",
-			    uuid, conn, (retval) ? "TRUE" : "FALSE",
-			    g_hash_table_size(self->connection_map));
-
-      self->kp_connections = 
-	g_list_remove(self->kp_connections, conn);
-      
-      // dbus_connection_unref(conn);
-    }
+  g_mutex_lock(self->lock);
+  retval = dbushandler_remove_connection(self, uuid);
+  g_mutex_unlock(self->lock);
 
   whiteboard_log_debug_fe();
 
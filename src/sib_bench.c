@@ -0,0 +1,848 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_bench.c
+ *
+ * Load generator for the SIB. Starts the SIB (sib_initialize and
+ * dbushandler_new) in process on a private unix socket and drives it
+ * with simulated KPs over DBus. Reports throughput and latency
+ * percentiles per operation type and the delivery lag of subscription
+ * indications.
+ *
+ * Load KPs run a weighted mix of operations on their own triples.
+ * Watcher KPs subscribe to the time stamp triple that each insert
+ * carries and measure how long the indication took to arrive. Each
+ * load KP has one stamp in the store: with watchers, inserts are
+ * sent as updates that replace the previous stamp of the KP, and are
+ * reported as updates. Run with --watchers=0 to measure inserts.
+ *
+ * SIB_DBUS_PATH gives the socket to start the SIB on. It must not
+ * exist, so that the socket of a running sibd is never taken over.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#define DBUS_API_SUBJECT_TO_CHANGE
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib.h>
+
+#include <sib_dbus_ifaces.h>
+#include <whiteboard_util.h>
+#include <whiteboard_log.h>
+#include <sibdefs.h>
+
+#include "dbushandler.h"
+#include "sib_operations.h"
+
+#define BENCH_URI "http://www.nokia.com/NRC/M3/bench#"
+#define BENCH_ANY "http://www.nokia.com/NRC/M3/sib#any"
+
+typedef enum {BENCH_JOIN, BENCH_LEAVE, BENCH_INSERT, BENCH_REMOVE,
+	      BENCH_UPDATE, BENCH_QUERY, BENCH_SUBSCRIBE, BENCH_UNSUBSCRIBE,
+	      BENCH_N_OPS} bench_op;
+
+static const gchar* bench_op_names[BENCH_N_OPS] =
+  {"join", "leave", "insert", "remove", "update", "query", "subscribe",
+   "unsubscribe"};
+
+/* Operations that can be weighted in the mix; LEAVE and UNSUBSCRIBE
+   are run together with JOIN and SUBSCRIBE */
+static const bench_op bench_mix_ops[] =
+  {BENCH_JOIN, BENCH_INSERT, BENCH_REMOVE, BENCH_UPDATE, BENCH_QUERY,
+   BENCH_SUBSCRIBE};
+#define BENCH_N_MIX_OPS (sizeof(bench_mix_ops) / sizeof(bench_mix_ops[0]))
+
+typedef struct {
+  gint id;
+  gchar* kp_id;
+  gchar* kp_uri;
+  DBusConnection* conn;
+  gint tr_id;
+  GRand* rand;
+  /* Time stamp of the KP in the store, NULL if none */
+  gchar* stamp;
+  /* Latencies in microseconds per operation type */
+  GArray* latency[BENCH_N_OPS];
+  guint failed[BENCH_N_OPS];
+} BenchKP;
+
+/* Options */
+static gint n_kps = 8;
+static gint n_watchers = 1;
+static gint n_ops = 1000;
+static gint n_triples = 4;
+static gint n_objects = 64;
+static gchar* mix_str = NULL;
+static gchar* space = NULL;
+
+static GOptionEntry entries[] =
+  {
+    { "kps", 'k', 0, G_OPTION_ARG_INT, &n_kps,
+      "Number of load KPs (8)", "N" },
+    { "watchers", 'w', 0, G_OPTION_ARG_INT, &n_watchers,
+      "Number of KPs measuring indication lag (1)", "N" },
+    { "ops", 'n', 0, G_OPTION_ARG_INT, &n_ops,
+      "Operations per load KP (1000)", "N" },
+    { "triples", 't', 0, G_OPTION_ARG_INT, &n_triples,
+      "Triples per insert, remove and update (4)", "N" },
+    { "objects", 'o', 0, G_OPTION_ARG_INT, &n_objects,
+      "Distinct objects per KP, bounds the store size (64)", "N" },
+    { "mix", 'm', 0, G_OPTION_ARG_STRING, &mix_str,
+      "Operation weights (insert=40,remove=20,update=10,query=20,subscribe=5,join=5)",
+      "OP=W,..." },
+    { "space", 's', 0, G_OPTION_ARG_STRING, &space,
+      "Smart space name (bench)", "NAME" },
+    { NULL }
+  };
+
+static guint mix[BENCH_N_MIX_OPS] = {5, 40, 20, 10, 20, 5};
+static guint mix_total = 0;
+
+static gchar* bench_address = NULL;
+static volatile gint watching = 1;
+
+/* Indication lags in microseconds from all watchers */
+static GArray* lag = NULL;
+static GMutex* lag_lock = NULL;
+
+/* Private functions */
+
+static gint64 bench_now()
+{
+  GTimeVal tv;
+  g_get_current_time(&tv);
+  return (gint64)tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+static gboolean bench_parse_mix(const gchar* str)
+{
+  gchar** items;
+  gchar** kv;
+  guint i, j;
+  gboolean found;
+
+  memset(mix, 0, sizeof(mix));
+  items = g_strsplit(str, ",", -1);
+  for (i = 0; items[i] != NULL; i++)
+    {
+      kv = g_strsplit(items[i], "=", 2);
+      found = FALSE;
+      if (kv[0] != NULL && kv[1] != NULL)
+	{
+	  for (j = 0; j < BENCH_N_MIX_OPS; j++)
+	    if (!strcmp(g_strstrip(kv[0]), bench_op_names[bench_mix_ops[j]]))
+	      {
+		mix[j] = atoi(kv[1]);
+		found = TRUE;
+	      }
+	}
+      if (!found)
+	{
+	  fprintf(stderr, "Invalid mix item: %s\n", items[i]);
+	  g_strfreev(kv);
+	  g_strfreev(items);
+	  return FALSE;
+	}
+      g_strfreev(kv);
+    }
+  g_strfreev(items);
+  return TRUE;
+}
+
+static bench_op bench_pick(BenchKP* kp)
+{
+  gint r;
+  guint i;
+
+  r = g_rand_int_range(kp->rand, 0, mix_total);
+  for (i = 0; i < BENCH_N_MIX_OPS; i++)
+    {
+      if (r < (gint)mix[i])
+	return bench_mix_ops[i];
+      r -= mix[i];
+    }
+  return BENCH_QUERY;
+}
+
+static void bench_append_triple(GString* s, const gchar* subject,
+				const gchar* predicate, const gchar* object,
+				gboolean literal)
+{
+  g_string_append_printf(s, "<triple><subject type=\"uri\">%s</subject>"
+			 "<predicate>%s</predicate>"
+			 "<object type=\"%s\">%s</object></triple>",
+			 subject, predicate, literal ? "literal" : "uri",
+			 object);
+}
+
+/* n triples of the KP with random objects */
+static GString* bench_triples(BenchKP* kp, gint n)
+{
+  GString* s = g_string_new("<triple_list>");
+  gchar* object;
+  gint i;
+
+  for (i = 0; i < n; i++)
+    {
+      object = g_strdup_printf(BENCH_URI "o%d",
+			       g_rand_int_range(kp->rand, 0, n_objects));
+      bench_append_triple(s, kp->kp_uri, BENCH_URI "p", object, FALSE);
+      g_free(object);
+    }
+  return s;
+}
+
+static gchar* bench_triples_end(GString* s)
+{
+  g_string_append(s, "</triple_list>");
+  return g_string_free(s, FALSE);
+}
+
+/*
+ * Insert and remove graphs of an update carrying a new time stamp
+ * for the watchers. The remove graph takes the previous stamp of the
+ * KP out, so that the stamps do not pile up in the store.
+ *
+ * @return the new stamp, the stamp of the KP once the update is done
+ */
+static gchar* bench_stamped(BenchKP* kp, gint n_ins, gint n_rem, gchar** ins, gchar** rem)
+{
+  GString* insert = bench_triples(kp, n_ins);
+  GString* remove = bench_triples(kp, n_rem);
+  gchar* stamp = g_strdup_printf("t%" G_GINT64_FORMAT, bench_now());
+
+  if (NULL != kp->stamp)
+    bench_append_triple(remove, kp->kp_uri, BENCH_URI "stamp", kp->stamp, TRUE);
+  bench_append_triple(insert, kp->kp_uri, BENCH_URI "stamp", stamp, TRUE);
+  *ins = bench_triples_end(insert);
+  *rem = bench_triples_end(remove);
+  return stamp;
+}
+
+static gchar* bench_template(const gchar* subject, const gchar* predicate)
+{
+  GString* s = g_string_new("<triple_list>");
+
+  bench_append_triple(s, subject, predicate, BENCH_ANY, FALSE);
+  g_string_append(s, "</triple_list>");
+  return g_string_free(s, FALSE);
+}
+
+/* Drops signals queued while waiting for replies */
+static void bench_drain(DBusConnection* conn)
+{
+  DBusMessage* msg;
+
+  while (NULL != (msg = dbus_connection_pop_message(conn)))
+    dbus_message_unref(msg);
+}
+
+static DBusConnection* bench_connect(const gchar* kp_id)
+{
+  DBusConnection* conn;
+  DBusMessage* reply = NULL;
+  DBusError err;
+  gint status = -1;
+
+  dbus_error_init(&err);
+  conn = dbus_connection_open_private(bench_address, &err);
+  if (NULL == conn)
+    {
+      fprintf(stderr, "Could not connect to %s: %s\n", bench_address,
+	      err.message);
+      dbus_error_free(&err);
+      return NULL;
+    }
+
+  whiteboard_util_send_method_with_reply(SIB_DBUS_SERVICE,
+					 SIB_DBUS_OBJECT,
+					 SIB_DBUS_REGISTER_INTERFACE,
+					 SIB_DBUS_REGISTER_METHOD_KP,
+					 conn,
+					 &reply,
+					 DBUS_TYPE_STRING, &kp_id,
+					 WHITEBOARD_UTIL_LIST_END);
+  if (reply)
+    {
+      whiteboard_util_parse_message(reply,
+				    DBUS_TYPE_INT32, &status,
+				    DBUS_TYPE_INVALID);
+      dbus_message_unref(reply);
+    }
+  if (status != 0)
+    {
+      fprintf(stderr, "Could not register KP %s\n", kp_id);
+      dbus_connection_close(conn);
+      dbus_connection_unref(conn);
+      return NULL;
+    }
+  return conn;
+}
+
+static void bench_disconnect(DBusConnection* conn)
+{
+  dbus_connection_close(conn);
+  dbus_connection_unref(conn);
+}
+
+/* Sends a request with the SSAP header of the KP followed by the
+   arguments. Records the latency and returns the reply or NULL if the
+   request failed. */
+static DBusMessage* bench_request(BenchKP* kp, bench_op op,
+				  const gchar* method, int first_type, ...)
+{
+  DBusMessage* msg;
+  DBusMessage* reply;
+  DBusError err;
+  va_list args;
+  gint64 start;
+  gint64 elapsed;
+  const gchar* space_id;
+  const gchar* kp_id;
+  gint tr_id;
+  gint status = -1;
+
+  kp->tr_id++;
+  msg = dbus_message_new_method_call(SIB_DBUS_SERVICE, SIB_DBUS_OBJECT,
+				     SIB_DBUS_KP_INTERFACE, method);
+  dbus_message_append_args(msg,
+			   DBUS_TYPE_STRING, &space,
+			   DBUS_TYPE_STRING, &kp->kp_id,
+			   DBUS_TYPE_INT32, &kp->tr_id,
+			   DBUS_TYPE_INVALID);
+  if (first_type != DBUS_TYPE_INVALID)
+    {
+      va_start(args, first_type);
+      dbus_message_append_args_valist(msg, first_type, args);
+      va_end(args);
+    }
+
+  dbus_error_init(&err);
+  start = bench_now();
+  reply = dbus_connection_send_with_reply_and_block(kp->conn, msg, -1, &err);
+  elapsed = bench_now() - start;
+  dbus_message_unref(msg);
+
+  if (NULL == reply)
+    {
+      dbus_error_free(&err);
+      kp->failed[op]++;
+      return NULL;
+    }
+
+  /* space_id, kp_id and tr_id precede the status in all replies */
+  if (!whiteboard_util_parse_message(reply,
+				     DBUS_TYPE_STRING, &space_id,
+				     DBUS_TYPE_STRING, &kp_id,
+				     DBUS_TYPE_INT32, &tr_id,
+				     DBUS_TYPE_INT32, &status,
+				     DBUS_TYPE_INVALID) ||
+      status != ss_StatusOK)
+    {
+      dbus_message_unref(reply);
+      kp->failed[op]++;
+      return NULL;
+    }
+
+  g_array_append_val(kp->latency[op], elapsed);
+  return reply;
+}
+
+static void bench_run_op(BenchKP* kp, bench_op op)
+{
+  DBusMessage* reply = NULL;
+  DBusMessage* unsub;
+  gint encoding = EncodingM3XML;
+  gint type = QueryTypeTemplate;
+  gchar* ins = NULL;
+  gchar* rem = NULL;
+  gchar* query = NULL;
+  gchar* stamp = NULL;
+  gchar* sub_id = NULL;
+  const gchar* space_id;
+  const gchar* kp_id;
+  gint tr_id;
+  gint status;
+  const gchar* credentials = "m3:any";
+
+  switch (op)
+    {
+    case BENCH_JOIN:
+      reply = bench_request(kp, BENCH_LEAVE, SIB_DBUS_KP_METHOD_LEAVE,
+			    DBUS_TYPE_INVALID);
+      if (reply)
+	dbus_message_unref(reply);
+      reply = bench_request(kp, BENCH_JOIN, SIB_DBUS_KP_METHOD_JOIN,
+			    DBUS_TYPE_STRING, &credentials,
+			    DBUS_TYPE_INVALID);
+      break;
+    case BENCH_INSERT:
+      if (n_watchers > 0)
+	{
+	  /* Replaces the previous stamp, so timed as an update */
+	  stamp = bench_stamped(kp, n_triples, 0, &ins, &rem);
+	  reply = bench_request(kp, BENCH_UPDATE, SIB_DBUS_KP_METHOD_UPDATE,
+				DBUS_TYPE_INT32, &encoding,
+				DBUS_TYPE_STRING, &ins,
+				DBUS_TYPE_STRING, &rem,
+				DBUS_TYPE_INVALID);
+	  break;
+	}
+      ins = bench_triples_end(bench_triples(kp, n_triples));
+      reply = bench_request(kp, op, SIB_DBUS_KP_METHOD_INSERT,
+			    DBUS_TYPE_INT32, &encoding,
+			    DBUS_TYPE_STRING, &ins,
+			    DBUS_TYPE_INVALID);
+      break;
+    case BENCH_REMOVE:
+      rem = bench_triples_end(bench_triples(kp, n_triples));
+      reply = bench_request(kp, op, SIB_DBUS_KP_METHOD_REMOVE,
+			    DBUS_TYPE_INT32, &encoding,
+			    DBUS_TYPE_STRING, &rem,
+			    DBUS_TYPE_INVALID);
+      break;
+    case BENCH_UPDATE:
+      if (n_watchers > 0)
+	stamp = bench_stamped(kp, n_triples, n_triples, &ins, &rem);
+      else
+	{
+	  ins = bench_triples_end(bench_triples(kp, n_triples));
+	  rem = bench_triples_end(bench_triples(kp, n_triples));
+	}
+      reply = bench_request(kp, op, SIB_DBUS_KP_METHOD_UPDATE,
+			    DBUS_TYPE_INT32, &encoding,
+			    DBUS_TYPE_STRING, &ins,
+			    DBUS_TYPE_STRING, &rem,
+			    DBUS_TYPE_INVALID);
+      break;
+    case BENCH_QUERY:
+      query = bench_template(kp->kp_uri, BENCH_URI "p");
+      reply = bench_request(kp, op, SIB_DBUS_KP_METHOD_QUERY,
+			    DBUS_TYPE_INT32, &type,
+			    DBUS_TYPE_STRING, &query,
+			    DBUS_TYPE_INVALID);
+      break;
+    case BENCH_SUBSCRIBE:
+      query = bench_template(kp->kp_uri, BENCH_URI "p");
+      reply = bench_request(kp, op, SIB_DBUS_KP_METHOD_SUBSCRIBE,
+			    DBUS_TYPE_INT32, &type,
+			    DBUS_TYPE_STRING, &query,
+			    DBUS_TYPE_INVALID);
+      if (reply &&
+	  whiteboard_util_parse_message(reply,
+					DBUS_TYPE_STRING, &space_id,
+					DBUS_TYPE_STRING, &kp_id,
+					DBUS_TYPE_INT32, &tr_id,
+					DBUS_TYPE_INT32, &status,
+					DBUS_TYPE_STRING, &sub_id,
+					DBUS_TYPE_INVALID))
+	{
+	  /* sub_id points into the reply */
+	  unsub = bench_request(kp, BENCH_UNSUBSCRIBE,
+				SIB_DBUS_KP_METHOD_UNSUBSCRIBE,
+				DBUS_TYPE_STRING, &sub_id,
+				DBUS_TYPE_INVALID);
+	  if (unsub)
+	    dbus_message_unref(unsub);
+	}
+      break;
+    default:
+      break;
+    }
+
+  if (reply && NULL != stamp)
+    {
+      /* The update went through, the new stamp replaced the old */
+      g_free(kp->stamp);
+      kp->stamp = stamp;
+      stamp = NULL;
+    }
+  if (reply)
+    dbus_message_unref(reply);
+  g_free(ins);
+  g_free(rem);
+  g_free(query);
+  g_free(stamp);
+  bench_drain(kp->conn);
+}
+
+static BenchKP* bench_kp_new(gint id, const gchar* role)
+{
+  BenchKP* kp = g_new0(BenchKP, 1);
+  const gchar* credentials = "m3:any";
+  DBusMessage* reply;
+  gint i;
+
+  kp->id = id;
+  kp->kp_id = g_strdup_printf("bench-%s-%d-%d", role, getpid(), id);
+  kp->kp_uri = g_strdup_printf(BENCH_URI "%s", kp->kp_id);
+  kp->rand = g_rand_new_with_seed(id);
+  for (i = 0; i < BENCH_N_OPS; i++)
+    kp->latency[i] = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+  kp->conn = bench_connect(kp->kp_id);
+  if (NULL == kp->conn)
+    return kp;
+
+  reply = bench_request(kp, BENCH_JOIN, SIB_DBUS_KP_METHOD_JOIN,
+			DBUS_TYPE_STRING, &credentials,
+			DBUS_TYPE_INVALID);
+  if (reply)
+    dbus_message_unref(reply);
+  return kp;
+}
+
+static void bench_kp_free(BenchKP* kp)
+{
+  DBusMessage* reply;
+  gint i;
+
+  if (kp->conn)
+    {
+      reply = bench_request(kp, BENCH_LEAVE, SIB_DBUS_KP_METHOD_LEAVE,
+			    DBUS_TYPE_INVALID);
+      if (reply)
+	dbus_message_unref(reply);
+      bench_disconnect(kp->conn);
+    }
+  for (i = 0; i < BENCH_N_OPS; i++)
+    g_array_free(kp->latency[i], TRUE);
+  g_rand_free(kp->rand);
+  g_free(kp->stamp);
+  g_free(kp->kp_uri);
+  g_free(kp->kp_id);
+  g_free(kp);
+}
+
+static gpointer bench_kp_thread(gpointer data)
+{
+  BenchKP* kp = (BenchKP*)data;
+  gint i;
+
+  for (i = 0; i < n_ops; i++)
+    bench_run_op(kp, bench_pick(kp));
+  return NULL;
+}
+
+/* Records the lag of each time stamp in the new results */
+static void bench_indication(DBusMessage* msg)
+{
+  const gchar* space_id;
+  const gchar* kp_id;
+  const gchar* sub_id;
+  const gchar* new_results;
+  gint tr_id;
+  gint seqnum;
+  const gchar* c;
+  gchar* end;
+  gint64 now, stamp, diff;
+
+  if (!whiteboard_util_parse_message(msg,
+				     DBUS_TYPE_STRING, &space_id,
+				     DBUS_TYPE_STRING, &kp_id,
+				     DBUS_TYPE_INT32, &tr_id,
+				     DBUS_TYPE_INT32, &seqnum,
+				     DBUS_TYPE_STRING, &sub_id,
+				     DBUS_TYPE_STRING, &new_results,
+				     DBUS_TYPE_INVALID))
+    return;
+
+  now = bench_now();
+  g_mutex_lock(lag_lock);
+  for (c = strstr(new_results, ">t"); c != NULL; c = strstr(c, ">t"))
+    {
+      c += 2;
+      stamp = g_ascii_strtoll(c, &end, 10);
+      if (end == c || *end != '<')
+	continue;
+      diff = now - stamp;
+      g_array_append_val(lag, diff);
+    }
+  g_mutex_unlock(lag_lock);
+}
+
+static gpointer bench_watcher_thread(gpointer data)
+{
+  BenchKP* kp = (BenchKP*)data;
+  DBusMessage* msg;
+
+  while (g_atomic_int_get(&watching))
+    {
+      dbus_connection_read_write(kp->conn, 100);
+      while (NULL != (msg = dbus_connection_pop_message(kp->conn)))
+	{
+	  if (dbus_message_is_signal(msg, SIB_DBUS_KP_INTERFACE,
+				     SIB_DBUS_KP_SIGNAL_SUBSCRIPTION_IND))
+	    bench_indication(msg);
+	  dbus_message_unref(msg);
+	}
+    }
+  return NULL;
+}
+
+static gpointer bench_loop_thread(gpointer data)
+{
+  g_main_loop_run((GMainLoop*)data);
+  return NULL;
+}
+
+static gint bench_compare(gconstpointer a, gconstpointer b)
+{
+  gint64 x = *(const gint64*)a;
+  gint64 y = *(const gint64*)b;
+  return (x > y) - (x < y);
+}
+
+static gdouble bench_percentile(GArray* sorted, gdouble q)
+{
+  if (sorted->len == 0)
+    return 0;
+  return g_array_index(sorted, gint64, (guint)(q * (sorted->len - 1))) / 1000.0;
+}
+
+static void bench_print_row(const gchar* name, GArray* values, guint failed,
+			    gdouble seconds)
+{
+  g_array_sort(values, bench_compare);
+  printf("%-12s %8u %6u %10.1f %9.3f %9.3f %9.3f\n", name, values->len,
+	 failed, seconds > 0 ? values->len / seconds : 0,
+	 bench_percentile(values, 0.5), bench_percentile(values, 0.99),
+	 bench_percentile(values, 0.999));
+}
+
+static void bench_report(BenchKP** kps, gdouble seconds)
+{
+  GArray* all;
+  guint failed;
+  guint total = 0;
+  gint i, j;
+
+  printf("\n%d KPs, %d operations each, %d triples per write, %.2f s\n\n",
+	 n_kps, n_ops, n_triples, seconds);
+  printf("%-12s %8s %6s %10s %9s %9s %9s\n", "operation", "count", "failed",
+	 "ops/s", "p50 ms", "p99 ms", "p999 ms");
+
+  for (j = 0; j < BENCH_N_OPS; j++)
+    {
+      all = g_array_new(FALSE, FALSE, sizeof(gint64));
+      failed = 0;
+      for (i = 0; i < n_kps; i++)
+	{
+	  g_array_append_vals(all, kps[i]->latency[j]->data,
+			      kps[i]->latency[j]->len);
+	  failed += kps[i]->failed[j];
+	}
+      total += all->len;
+      if (all->len > 0 || failed > 0)
+	bench_print_row(bench_op_names[j], all, failed, seconds);
+      g_array_free(all, TRUE);
+    }
+  printf("\nthroughput %.1f ops/s\n", seconds > 0 ? total / seconds : 0);
+
+  if (n_watchers > 0)
+    {
+      printf("\n%-12s %8s %6s %10s %9s %9s %9s\n", "", "count", "", "",
+	     "p50 ms", "p99 ms", "p999 ms");
+      bench_print_row("indication", lag, 0, 0);
+    }
+}
+
+/* Public functions */
+
+int main(int argc, char **argv)
+{
+  GOptionContext* context;
+  GError* gerror = NULL;
+  GMainLoop* loop;
+  GThread* loop_thread;
+  GThread** threads;
+  GThread** watcher_threads;
+  BenchKP** kps;
+  BenchKP** watchers;
+  DBusMessage* reply;
+  DBusHandler* dbushandler;
+  sib_data_structure* sib_data;
+  gchar* dbus_path;
+  gchar* private_path;
+  gchar* query;
+  gint type = QueryTypeTemplate;
+  gint64 start;
+  gdouble seconds;
+  guint i;
+
+  context = g_option_context_new("- SIB load generator");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &gerror))
+    {
+      fprintf(stderr, "%s\n", gerror->message);
+      g_error_free(gerror);
+      return 1;
+    }
+  g_option_context_free(context);
+
+  if (mix_str && !bench_parse_mix(mix_str))
+    return 1;
+  for (i = 0; i < BENCH_N_MIX_OPS; i++)
+    mix_total += mix[i];
+  if (mix_total == 0 || n_kps <= 0 || n_triples <= 0 || n_objects <= 0)
+    {
+      fprintf(stderr, "Nothing to do\n");
+      return 1;
+    }
+  if (NULL == space)
+    space = g_strdup("bench");
+
+  if (!g_thread_supported ()) g_thread_init (NULL);
+  g_type_init();
+  dbus_g_thread_init();
+
+  /* The SIB, as started by sibd. Only the private socket path is
+     ever removed. */
+  dbus_path = getenv("SIB_DBUS_PATH");
+  if (NULL != dbus_path)
+    {
+      if (g_file_test(dbus_path, G_FILE_TEST_EXISTS))
+	{
+	  fprintf(stderr, "%s exists, not starting the SIB on it\n", dbus_path);
+	  return 1;
+	}
+      private_path = NULL;
+    }
+  else
+    {
+      private_path = g_strdup_printf("/tmp/sibd-bench-%d", getpid());
+      unlink(private_path);
+      dbus_path = private_path;
+    }
+  bench_address = g_strdup_printf("unix:path=%s", dbus_path);
+
+  loop = g_main_loop_new(NULL, FALSE);
+  sib_data = sib_initialize(space);
+  dbushandler = dbushandler_new(dbus_path, space, loop, sib_data);
+  if (NULL == sib_data || NULL == dbushandler)
+    {
+      fprintf(stderr, "Could not start the SIB\n");
+      return 1;
+    }
+  loop_thread = g_thread_create(bench_loop_thread, loop, TRUE, NULL);
+
+  /* Watchers subscribe before the load starts */
+  lag = g_array_new(FALSE, FALSE, sizeof(gint64));
+  lag_lock = g_mutex_new();
+  watchers = g_new0(BenchKP*, n_watchers + 1);
+  watcher_threads = g_new0(GThread*, n_watchers + 1);
+  query = bench_template(BENCH_ANY, BENCH_URI "stamp");
+  for (i = 0; i < (guint)n_watchers; i++)
+    {
+      watchers[i] = bench_kp_new(i, "watcher");
+      if (NULL == watchers[i]->conn)
+	return 1;
+      reply = bench_request(watchers[i], BENCH_SUBSCRIBE,
+			    SIB_DBUS_KP_METHOD_SUBSCRIBE,
+			    DBUS_TYPE_INT32, &type,
+			    DBUS_TYPE_STRING, &query,
+			    DBUS_TYPE_INVALID);
+      if (NULL == reply)
+	{
+	  fprintf(stderr, "Watcher could not subscribe\n");
+	  return 1;
+	}
+      dbus_message_unref(reply);
+      watcher_threads[i] = g_thread_create(bench_watcher_thread, watchers[i],
+					   TRUE, NULL);
+    }
+  g_free(query);
+
+  kps = g_new0(BenchKP*, n_kps);
+  for (i = 0; i < (guint)n_kps; i++)
+    {
+      kps[i] = bench_kp_new(n_watchers + i, "kp");
+      if (NULL == kps[i]->conn)
+	return 1;
+      /* Only the joins of the mix are reported */
+      g_array_set_size(kps[i]->latency[BENCH_JOIN], 0);
+    }
+
+  /* Load */
+  threads = g_new0(GThread*, n_kps);
+  start = bench_now();
+  for (i = 0; i < (guint)n_kps; i++)
+    threads[i] = g_thread_create(bench_kp_thread, kps[i], TRUE, NULL);
+  for (i = 0; i < (guint)n_kps; i++)
+    g_thread_join(threads[i]);
+  seconds = (bench_now() - start) / (gdouble)G_USEC_PER_SEC;
+
+  /* Give the last indications time to arrive */
+  g_usleep(G_USEC_PER_SEC);
+  g_atomic_int_set(&watching, 0);
+  for (i = 0; i < (guint)n_watchers; i++)
+    g_thread_join(watcher_threads[i]);
+
+  bench_report(kps, seconds);
+
+  for (i = 0; i < (guint)n_kps; i++)
+    bench_kp_free(kps[i]);
+  for (i = 0; i < (guint)n_watchers; i++)
+    bench_kp_free(watchers[i]);
+  g_free(kps);
+  g_free(watchers);
+  g_free(threads);
+  g_free(watcher_threads);
+
+  g_main_loop_quit(loop);
+  g_thread_join(loop_thread);
+  dbushandler_destroy(dbushandler);
+  if (NULL != private_path)
+    {
+      unlink(private_path);
+      g_free(private_path);
+    }
+
+  g_array_free(lag, TRUE);
+  g_mutex_free(lag_lock);
+  g_free(bench_address);
+  return 0;
+}
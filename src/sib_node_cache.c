@@ -0,0 +1,373 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_node_cache.c
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string.h>
+#include <glib.h>
+
+#include "sib_node_cache.h"
+
+/* Number of shards in each direction, a power of two */
+#define SHARD_BITS 4
+#define N_SHARDS (1 << SHARD_BITS)
+
+typedef struct
+{
+  gchar* str;
+  gint node;
+  /* Only meaningful in the string to node direction */
+  gboolean literal;
+  /* Set on use, cleared when the clock hand passes */
+  gboolean referenced;
+  /* Position in the slots of the shard */
+  guint slot;
+} SibNodeCacheEntry;
+
+typedef struct
+{
+  GMutex* lock;
+  /* Key -> SibNodeCacheEntry, key is the entry itself in the
+     string to node direction and the node in the other */
+  GHashTable* table;
+  gboolean by_node;
+  SibNodeCacheEntry** slots;
+  guint size;
+  guint used;
+  guint hand;
+  guint64 hits;
+  guint64 misses;
+} SibNodeCacheShard;
+
+struct _SibNodeCache
+{
+  SibNodeCacheShard by_string[N_SHARDS];
+  SibNodeCacheShard by_node[N_SHARDS];
+};
+
+/* Private functions */
+
+static guint sib_node_cache_entry_hash(gconstpointer key)
+{
+  const SibNodeCacheEntry* e = (const SibNodeCacheEntry*)key;
+  return g_str_hash(e->str) ^ (guint)e->literal;
+}
+
+static gboolean sib_node_cache_entry_equal(gconstpointer a, gconstpointer b)
+{
+  const SibNodeCacheEntry* ea = (const SibNodeCacheEntry*)a;
+  const SibNodeCacheEntry* eb = (const SibNodeCacheEntry*)b;
+  return ea->literal == eb->literal && 0 == strcmp(ea->str, eb->str);
+}
+
+static void sib_node_cache_entry_free(SibNodeCacheEntry* e)
+{
+  g_free(e->str);
+  g_free(e);
+}
+
+static SibNodeCacheShard* sib_node_cache_node_shard(SibNodeCache* self, gint node)
+{
+  /* Fibonacci hashing, consecutive nodes go to different shards */
+  return &self->by_node[((guint32)node * 2654435761u) >> (32 - SHARD_BITS)];
+}
+
+static SibNodeCacheShard* sib_node_cache_string_shard(SibNodeCache* self, const SibNodeCacheEntry* key)
+{
+  return &self->by_string[(sib_node_cache_entry_hash(key) >> 7) & (N_SHARDS - 1)];
+}
+
+static gconstpointer sib_node_cache_shard_key(SibNodeCacheShard* shard, SibNodeCacheEntry* e)
+{
+  return shard->by_node ? GINT_TO_POINTER(e->node) : (gconstpointer)e;
+}
+
+static void sib_node_cache_shard_init(SibNodeCacheShard* shard, guint size, gboolean by_node)
+{
+  shard->lock = g_mutex_new();
+  shard->by_node = by_node;
+  if (by_node)
+    shard->table = g_hash_table_new(g_direct_hash, g_direct_equal);
+  else
+    shard->table = g_hash_table_new(sib_node_cache_entry_hash,
+				    sib_node_cache_entry_equal);
+  shard->size = size;
+  shard->slots = g_new0(SibNodeCacheEntry*, size);
+}
+
+static void sib_node_cache_shard_free(SibNodeCacheShard* shard)
+{
+  guint i;
+
+  for (i = 0; i < shard->used; i++)
+    sib_node_cache_entry_free(shard->slots[i]);
+  g_free(shard->slots);
+  g_hash_table_destroy(shard->table);
+  g_mutex_free(shard->lock);
+}
+
+/* Shard lock must be held */
+static SibNodeCacheEntry* sib_node_cache_shard_lookup(SibNodeCacheShard* shard, gconstpointer key)
+{
+  SibNodeCacheEntry* e = (SibNodeCacheEntry*)g_hash_table_lookup(shard->table, key);
+
+  if (NULL != e)
+    {
+      e->referenced = TRUE;
+      shard->hits++;
+    }
+  else
+    shard->misses++;
+  return e;
+}
+
+/* Shard lock must be held */
+static void sib_node_cache_shard_remove(SibNodeCacheShard* shard, SibNodeCacheEntry* e)
+{
+  SibNodeCacheEntry* last;
+
+  g_hash_table_remove(shard->table, sib_node_cache_shard_key(shard, e));
+
+  /* Fill the hole with the last slot */
+  last = shard->slots[--shard->used];
+  shard->slots[e->slot] = last;
+  last->slot = e->slot;
+  if (shard->hand >= shard->used)
+    shard->hand = 0;
+
+  sib_node_cache_entry_free(e);
+}
+
+/* Shard lock must be held */
+static void sib_node_cache_shard_insert(SibNodeCacheShard* shard, SibNodeCacheEntry* e)
+{
+  SibNodeCacheEntry* old;
+
+  old = (SibNodeCacheEntry*)g_hash_table_lookup(shard->table,
+						sib_node_cache_shard_key(shard, e));
+  if (NULL != old)
+    sib_node_cache_shard_remove(shard, old);
+
+  /* Give each entry a second chance before evicting it */
+  while (shard->used == shard->size)
+    {
+      old = shard->slots[shard->hand];
+      if (old->referenced)
+	{
+	  old->referenced = FALSE;
+	  shard->hand = (shard->hand + 1) % shard->used;
+	}
+      else
+	sib_node_cache_shard_remove(shard, old);
+    }
+
+  e->slot = shard->used;
+  shard->slots[shard->used++] = e;
+  g_hash_table_insert(shard->table, (gpointer)sib_node_cache_shard_key(shard, e), e);
+}
+
+/* Public functions */
+
+SibNodeCache* sib_node_cache_new(guint size)
+{
+  SibNodeCache* self;
+  guint shard_size;
+  gint i;
+
+  shard_size = MAX(size / N_SHARDS, 1);
+  self = g_new0(SibNodeCache, 1);
+  for (i = 0; i < N_SHARDS; i++)
+    {
+      sib_node_cache_shard_init(&self->by_string[i], shard_size, FALSE);
+      sib_node_cache_shard_init(&self->by_node[i], shard_size, TRUE);
+    }
+  return self;
+}
+
+void sib_node_cache_destroy(SibNodeCache* self)
+{
+  gint i;
+
+  g_return_if_fail(NULL != self);
+
+  for (i = 0; i < N_SHARDS; i++)
+    {
+      sib_node_cache_shard_free(&self->by_string[i]);
+      sib_node_cache_shard_free(&self->by_node[i]);
+    }
+  g_free(self);
+}
+
+gboolean sib_node_cache_get_node(SibNodeCache* self, const gchar* str,
+				 gboolean literal, gint* node)
+{
+  SibNodeCacheShard* shard;
+  SibNodeCacheEntry key;
+  SibNodeCacheEntry* e;
+
+  g_return_val_if_fail(NULL != self && NULL != str, FALSE);
+
+  key.str = (gchar*)str;
+  key.literal = literal;
+  shard = sib_node_cache_string_shard(self, &key);
+
+  g_mutex_lock(shard->lock);
+  e = sib_node_cache_shard_lookup(shard, &key);
+  if (NULL != e)
+    *node = e->node;
+  g_mutex_unlock(shard->lock);
+  return NULL != e;
+}
+
+void sib_node_cache_put_node(SibNodeCache* self, const gchar* str,
+			     gboolean literal, gint node)
+{
+  SibNodeCacheShard* shard;
+  SibNodeCacheEntry* e;
+
+  g_return_if_fail(NULL != self && NULL != str);
+
+  e = g_new0(SibNodeCacheEntry, 1);
+  e->str = g_strdup(str);
+  e->node = node;
+  e->literal = literal;
+  shard = sib_node_cache_string_shard(self, e);
+
+  g_mutex_lock(shard->lock);
+  sib_node_cache_shard_insert(shard, e);
+  g_mutex_unlock(shard->lock);
+}
+
+gchar* sib_node_cache_get_string(SibNodeCache* self, gint node)
+{
+  SibNodeCacheShard* shard;
+  SibNodeCacheEntry* e;
+  gchar* str = NULL;
+
+  g_return_val_if_fail(NULL != self, NULL);
+
+  shard = sib_node_cache_node_shard(self, node);
+  g_mutex_lock(shard->lock);
+  e = sib_node_cache_shard_lookup(shard, GINT_TO_POINTER(node));
+  if (NULL != e)
+    str = g_strdup(e->str);
+  g_mutex_unlock(shard->lock);
+  return str;
+}
+
+void sib_node_cache_put_string(SibNodeCache* self, gint node, const gchar* str)
+{
+  SibNodeCacheShard* shard;
+  SibNodeCacheEntry* e;
+
+  g_return_if_fail(NULL != self && NULL != str);
+
+  e = g_new0(SibNodeCacheEntry, 1);
+  e->str = g_strdup(str);
+  e->node = node;
+  shard = sib_node_cache_node_shard(self, node);
+
+  g_mutex_lock(shard->lock);
+  sib_node_cache_shard_insert(shard, e);
+  g_mutex_unlock(shard->lock);
+}
+
+void sib_node_cache_invalidate(SibNodeCache* self, const gint* nodes, guint n_nodes)
+{
+  SibNodeCacheShard* shard;
+  SibNodeCacheEntry* e;
+  GHashTable* removed;
+  guint i;
+  gint n;
+
+  g_return_if_fail(NULL != self);
+
+  if (0 == n_nodes)
+    return;
+
+  removed = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (i = 0; i < n_nodes; i++)
+    {
+      g_hash_table_insert(removed, GINT_TO_POINTER(nodes[i]), GINT_TO_POINTER(1));
+
+      shard = sib_node_cache_node_shard(self, nodes[i]);
+      g_mutex_lock(shard->lock);
+      e = (SibNodeCacheEntry*)g_hash_table_lookup(shard->table, GINT_TO_POINTER(nodes[i]));
+      if (NULL != e)
+	sib_node_cache_shard_remove(shard, e);
+      g_mutex_unlock(shard->lock);
+    }
+
+  /* The string direction is not indexed by node, sweep it once */
+  for (n = 0; n < N_SHARDS; n++)
+    {
+      shard = &self->by_string[n];
+      g_mutex_lock(shard->lock);
+      /* Backwards, so that the slot moved into a hole is already checked */
+      for (i = shard->used; i > 0; i--)
+	{
+	  e = shard->slots[i - 1];
+	  if (NULL != g_hash_table_lookup(removed, GINT_TO_POINTER(e->node)))
+	    sib_node_cache_shard_remove(shard, e);
+	}
+      g_mutex_unlock(shard->lock);
+    }
+  g_hash_table_destroy(removed);
+}
+
+void sib_node_cache_stats(SibNodeCache* self, guint64* hits, guint64* misses)
+{
+  SibNodeCacheShard* shard;
+  gint i;
+
+  g_return_if_fail(NULL != self);
+
+  *hits = 0;
+  *misses = 0;
+  for (i = 0; i < 2 * N_SHARDS; i++)
+    {
+      shard = (i < N_SHARDS) ? &self->by_string[i] : &self->by_node[i - N_SHARDS];
+      g_mutex_lock(shard->lock);
+      *hits += shard->hits;
+      *misses += shard->misses;
+      g_mutex_unlock(shard->lock);
+    }
+}
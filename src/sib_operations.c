@@ -32,7 +32,9 @@
 
  */
 #include <glib.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <cpiglet.h>
 
 #include <sib_dbus_ifaces.h>
@@ -45,11 +47,51 @@
 #include <sibmsg.h>
 
 #include "sib_operations.h"
+#include "sib_wql.h"
 
 #if WITH_WQL==1
 #define PYTHON_WILBUR_MODULE "rdfplus_m3"
 #endif /* WITH_WQL */
 
+/* Number of threads running completion callbacks: replies to the
+   KPs and subscription updates */
+#define SIB_COMPLETION_THREADS 4
+
+/* Number of threads running template queries against read-only store
+   handles, 0 runs all queries in the scheduler under store_lock. Only
+   engines with reader handles, currently the memory engine, run them;
+   on piglet the queries stay in the scheduler. */
+#define SIB_READER_THREADS 4
+
+/* Number of template queries kept compiled for reuse */
+#define SIB_PREPARED_QUERIES 256
+
+/* Number of template query results kept in the result cache */
+#define SIB_CACHED_RESULTS 256
+
+/* Number of compiled WQL paths kept */
+#define SIB_COMPILED_PATHS 256
+
+/* Number of classes and nodes kept in the RDFS closure index */
+#define SIB_RDFS_INDEXED_NODES 4096
+
+/* Changes of subproperties invalidate the compiled WQL paths */
+#define M3_SUBPROPERTY_URI "http://www.w3.org/2000/01/rdf-schema#subPropertyOf"
+
+/* Vocabulary the RDFS post-processing of piglet infers with */
+#define M3_TYPE_URI "http://www.w3.org/1999/02/22-rdf-syntax-ns#type"
+#define M3_SUBCLASS_URI "http://www.w3.org/2000/01/rdf-schema#subClassOf"
+#define M3_DOMAIN_URI "http://www.w3.org/2000/01/rdf-schema#domain"
+#define M3_RANGE_URI "http://www.w3.org/2000/01/rdf-schema#range"
+
+/* Flow control of subscription indications: bytes waiting in the
+   transport of a KP before its indications are held back, how many
+   are held before they are merged into one net delta, and the
+   interval in ms to try sending them again */
+#define SIB_SUB_MAX_BACKLOG (256 * 1024)
+#define SIB_SUB_MAX_PENDING 16
+#define SIB_SUB_RETRY_INTERVAL 100
+
 char* PIGLET_ERR_DB_OPEN = "Unable to open database";
 char* PIGLET_ERR_NODE_ID = "Unable to create a new node ID";
 char* PIGLET_ERR_NODE_DETAILS = "Unable to query for node details";
@@ -76,6 +118,8 @@ extern void ssFreeTripleList (GSList **tripleList);
 extern void ssFreePathNode (ssPathNode_t *pathNode);
 extern void ssFreePathNodeList (GSList **pathNodeList);
 
+ssStatus_t m3_template_compile(sib_data_structure* p, GSList* template_query, GSList** patterns);
+
 typedef struct {
   GAsyncQueue *insert_queue;
   GAsyncQueue *query_queue;
@@ -302,6 +346,84 @@ gint p_call_issubtype(p_wilbur_functions* w, gint subtype, gint type)
 
 #endif /* WITH_WQL */
 
+/*
+ * Transport of the requests: replies and indications go back over
+ * DBus or over the native SSAP connection the request came from.
+ * Arguments are given as for dbus_message_append_args.
+ *
+ * DBus messages are sent by the operation threads, libdbus writes
+ * each one as it is sent. Only SSAP batches: frames are queued on the
+ * connection and its server thread writes them together.
+ */
+
+static void m3_transaction_done(sib_op_parameter* param)
+{
+  if (param->in_window)
+    {
+      param->in_window = FALSE;
+      sib_ssap_connection_done(param->ssap, param->tr_id);
+    }
+}
+
+void m3_send_return(sib_op_parameter* param, int first_type, ...)
+{
+  DBusMessage* reply;
+  va_list args;
+
+  va_start(args, first_type);
+  if (NULL != param->ssap)
+    {
+      sib_ssap_send_valist(param->ssap, dbus_message_get_member(param->msg),
+			   first_type, args);
+      m3_transaction_done(param);
+    }
+  else
+    {
+      reply = dbus_message_new_method_return(param->msg);
+      if (reply != NULL &&
+	  dbus_message_append_args_valist(reply, first_type, args))
+	dbus_connection_send(param->conn, reply, NULL);
+      if (reply != NULL)
+	dbus_message_unref(reply);
+    }
+  va_end(args);
+}
+
+void m3_send_indication(sib_op_parameter* param, int first_type, ...)
+{
+  DBusMessage* ind;
+  va_list args;
+
+  va_start(args, first_type);
+  if (NULL != param->ssap)
+    {
+      sib_ssap_send_valist(param->ssap, SIB_DBUS_KP_SIGNAL_SUBSCRIPTION_IND,
+			   first_type, args);
+    }
+  else
+    {
+      ind = dbus_message_new_signal(SIB_DBUS_OBJECT,
+				    SIB_DBUS_KP_INTERFACE,
+				    SIB_DBUS_KP_SIGNAL_SUBSCRIPTION_IND);
+      if (ind != NULL &&
+	  dbus_message_append_args_valist(ind, first_type, args))
+	dbus_connection_send(param->conn, ind, NULL);
+      if (ind != NULL)
+	dbus_message_unref(ind);
+    }
+  va_end(args);
+}
+
+void m3_param_free(sib_op_parameter* param)
+{
+  m3_transaction_done(param);
+  if (NULL != param->msg)
+    dbus_message_unref(param->msg);
+  if (NULL != param->ssap)
+    sib_ssap_connection_unref(param->ssap);
+  g_free(param);
+}
+
 gpointer m3_join(gpointer data)
 {
   ssap_message_header *header;
@@ -365,14 +487,13 @@ gpointer m3_join(gpointer data)
       credentials_rsp = g_strdup("m3:Success");
       rsp_msg->status = ss_StatusOK;
     send_response:
-      whiteboard_util_send_method_return(param->conn,
-				  param->msg,
-				  DBUS_TYPE_STRING, &(header->space_id),
-				  DBUS_TYPE_STRING, &(header->kp_id),
-				  DBUS_TYPE_INT32, &(header->tr_id),
-				  DBUS_TYPE_INT32, &(rsp_msg->status),
-				  DBUS_TYPE_STRING, &credentials_rsp,
-				  WHITEBOARD_UTIL_LIST_END);
+      m3_send_return(param,
+		     DBUS_TYPE_STRING, &(header->space_id),
+		     DBUS_TYPE_STRING, &(header->kp_id),
+		     DBUS_TYPE_INT32, &(header->tr_id),
+		     DBUS_TYPE_INT32, &(rsp_msg->status),
+		     DBUS_TYPE_STRING, &credentials_rsp,
+		     DBUS_TYPE_INVALID);
       whiteboard_log_debug("Sent response with status %d\n", rsp_msg->status);
       g_free(credentials_rsp);
       g_free(header);
@@ -384,8 +505,7 @@ gpointer m3_join(gpointer data)
     {
       whiteboard_log_warning("Could not parse JOIN method call message\n");
     }
-  dbus_message_unref(param->msg);
-  g_free(param);
+  m3_param_free(param);
 
   return NULL;
 }
@@ -465,13 +585,12 @@ gpointer m3_leave(gpointer data)
       whiteboard_log_debug("KP %s left the smart space\n", header->kp_id);
 
     send_response:
-      whiteboard_util_send_method_return(param->conn,
-				  param->msg,
-				  DBUS_TYPE_STRING, &(header->space_id),
-				  DBUS_TYPE_STRING, &(header->kp_id),
-				  DBUS_TYPE_INT32, &(header->tr_id),
-				  DBUS_TYPE_INT32, &(rsp_msg->status),
-				  WHITEBOARD_UTIL_LIST_END);
+      m3_send_return(param,
+		     DBUS_TYPE_STRING, &(header->space_id),
+		     DBUS_TYPE_STRING, &(header->kp_id),
+		     DBUS_TYPE_INT32, &(header->tr_id),
+		     DBUS_TYPE_INT32, &(rsp_msg->status),
+		     DBUS_TYPE_INVALID);
       g_free(req_msg);
       g_free(rsp_msg);
       g_free(header);
@@ -481,19 +600,83 @@ gpointer m3_leave(gpointer data)
     {
       whiteboard_log_warning("Could not parse LEAVE method call message\n");
     }
-  dbus_message_unref(param->msg);
-  g_free(param);
+  m3_param_free(param);
   return NULL;
 
 }
 
+/*
+ * Queue an operation for the scheduler. The operation is finished by
+ * its complete callback in the completion pool, nobody waits for it.
+ */
+void m3_schedule(sib_data_structure* sib, GAsyncQueue* queue, scheduler_item* s)
+{
+  g_async_queue_push(queue, s);
+
+  /* Signal scheduler that new operation has been added to queue */
+  g_mutex_lock(sib->new_reqs_lock);
+  sib->new_reqs = TRUE;
+  g_cond_signal(sib->new_reqs_cond);
+  g_mutex_unlock(sib->new_reqs_lock);
+}
+
+/*
+ * Completion of an insert or update: reply to the KP and free the
+ * request. Also called directly for requests that failed to parse.
+ */
+void m3_insert_reply(scheduler_item* s, sib_data_structure* sib)
+{
+  sib_op_parameter* param = (sib_op_parameter*) s->complete_data;
+
+  /* REMOVED rsp_msg->status = status; DAN - ARCES */
+  m3_send_return(param,
+		 DBUS_TYPE_STRING, &(s->header->space_id),
+		 DBUS_TYPE_STRING, &(s->header->kp_id),
+		 DBUS_TYPE_INT32, &(s->header->tr_id),
+		 DBUS_TYPE_INT32, &(s->rsp->status),
+		 DBUS_TYPE_STRING, &(s->rsp->bnodes_str),
+		 DBUS_TYPE_INVALID);
+
+  ssFreeTripleList(&(s->req->remove_graph));
+  ssFreeTripleList(&(s->req->insert_graph));
+  g_free(s->rsp->bnodes_str);
+  g_free(s->req);
+  g_free(s->rsp);
+  g_free(s->header);
+  g_free(s);
+
+  m3_param_free(param);
+}
+
+/*
+ * Completion of a remove: reply to the KP and free the request
+ */
+void m3_remove_reply(scheduler_item* s, sib_data_structure* sib)
+{
+  sib_op_parameter* param = (sib_op_parameter*) s->complete_data;
+
+  /* REMOVED rsp_msg->status = status; DAN - ARCES */
+  m3_send_return(param,
+		 DBUS_TYPE_STRING, &(s->header->space_id),
+		 DBUS_TYPE_STRING, &(s->header->kp_id),
+		 DBUS_TYPE_INT32, &(s->header->tr_id),
+		 DBUS_TYPE_INT32, &(s->rsp->status),
+		 DBUS_TYPE_INVALID);
+
+  ssFreeTripleList(&(s->req->remove_graph));
+  g_free(s->req);
+  g_free(s->rsp);
+  g_free(s->header);
+  g_free(s);
+
+  m3_param_free(param);
+}
+
 gpointer m3_insert(gpointer data)
 {
   ssap_message_header *header;
   ssap_kp_message *req_msg;
   ssap_sib_message *rsp_msg;
-  GMutex* op_lock;
-  GCond* op_cond;
   scheduler_item* s;
   ssStatus_t status = ss_StatusOK;
   sib_op_parameter* param = (sib_op_parameter*) data;
@@ -503,10 +686,14 @@ gpointer m3_insert(gpointer data)
   req_msg = g_new0(ssap_kp_message, 1);
   rsp_msg = g_new0(ssap_sib_message, 1);
   s = g_new0(scheduler_item, 1);
-  op_lock = g_mutex_new();
-  op_cond = g_cond_new();
   rsp_msg->status = ss_StatusOK;    /* JUKKA - ARCES */
 
+  s->header = header;
+  s->req = req_msg;
+  s->rsp = rsp_msg;
+  s->complete = m3_insert_reply;
+  s->complete_data = param;
+
   if(whiteboard_util_parse_message(param->msg,
 				   DBUS_TYPE_STRING, &(header->space_id),
 				   DBUS_TYPE_STRING, &(header->kp_id),
@@ -536,68 +723,25 @@ gpointer m3_insert(gpointer data)
 	      printf("INSERT: Parse failed, status code %d\n", status);
 	      rsp_msg->bnodes_str = g_strdup("");
 	      rsp_msg->status = status;
-	      goto send_response;
+	      m3_insert_reply(s, param->sib);
+	      return NULL;
 	    }
 	}
 
-
-      s->header = header;
-      s->req = req_msg;
-      s->rsp = rsp_msg;
-      s->op_lock = op_lock;
-      s->op_cond = op_cond;
-      s->op_complete = FALSE;
-
-      g_async_queue_push(param->sib->insert_queue, s);
-
-      /* Signal scheduler that new operation has been added to queue */
-      g_mutex_lock(param->sib->new_reqs_lock);
-      param->sib->new_reqs = TRUE;
-      g_cond_signal(param->sib->new_reqs_cond);
-      g_mutex_unlock(param->sib->new_reqs_lock);
-
-      /* Block while operation is being processed */
-      g_mutex_lock(s->op_lock);
-      while (!(s->op_complete))
-	{
-	  g_cond_wait(s->op_cond, s->op_lock);
-	}
-      s->op_complete = FALSE;
-      g_mutex_unlock(op_lock);
-
-
-    /* DAN - ARCES : XXX */
-    send_response:
-      /* REMOVED rsp_msg->status = status; DAN - ARCES */
-      whiteboard_util_send_method_return(param->conn,
-					 param->msg,
-					 DBUS_TYPE_STRING, &(header->space_id),
-					 DBUS_TYPE_STRING, &(header->kp_id),
-					 DBUS_TYPE_INT32, &(header->tr_id),
-					 DBUS_TYPE_INT32, &(rsp_msg->status),
-					 DBUS_TYPE_STRING, &(rsp_msg->bnodes_str),
-					 WHITEBOARD_UTIL_LIST_END);
-
-      if (EncodingM3XML == req_msg->encoding)
-	{
-	  ssFreeTripleList(&(req_msg->insert_graph));
-	}
-      g_mutex_free(op_lock);
-      g_cond_free(op_cond);
-      g_free(s);
-      g_free(rsp_msg->bnodes_str);
-      g_free(req_msg);
-      g_free(rsp_msg);
-      g_free(header);
-
+      /* The reply is sent by m3_insert_reply once processed */
+      m3_schedule(param->sib, param->sib->insert_queue, s);
+      return NULL;
     }
   else
     {
       printf("COULD NOT PARSE INSERT DBUS MESSAGE\n");
       whiteboard_log_warning("Could not parse INSERT method call message\n");
     }
-  dbus_message_unref(param->msg);
-  g_free(param);
+  g_free(s);
+  g_free(req_msg);
+  g_free(rsp_msg);
+  g_free(header);
+  m3_param_free(param);
   return NULL;
 
 }
@@ -607,8 +751,6 @@ gpointer m3_remove(gpointer data)
   ssap_message_header *header;
   ssap_kp_message *req_msg;
   ssap_sib_message *rsp_msg;
-  GMutex* op_lock;
-  GCond* op_cond;
   scheduler_item* s;
   ssStatus_t status = ss_StatusOK;
   sib_op_parameter* param = (sib_op_parameter*) data;
@@ -618,10 +760,14 @@ gpointer m3_remove(gpointer data)
   req_msg = g_new0(ssap_kp_message, 1);
   rsp_msg = g_new0(ssap_sib_message, 1);
   s = g_new0(scheduler_item, 1);
-  op_lock = g_mutex_new();
-  op_cond = g_cond_new();
   rsp_msg->status = ss_StatusOK;    /* DAN - ARCES */
 
+  s->header = header;
+  s->req = req_msg;
+  s->rsp = rsp_msg;
+  s->complete = m3_remove_reply;
+  s->complete_data = param;
+
   if(whiteboard_util_parse_message(param->msg,
 				   DBUS_TYPE_STRING, &(header->space_id),
 				   DBUS_TYPE_STRING, &(header->kp_id),
@@ -643,51 +789,14 @@ gpointer m3_remove(gpointer data)
 	    {
 	      printf("REMOVE: Parse failed, status code %d\n", status);
 	      rsp_msg->status = status; /* DAN - ARCES */
-	      goto send_response;
+	      m3_remove_reply(s, param->sib);
+	      return NULL;
 	    }
 	}
-      s->header = header;
-      s->req = req_msg;
-      s->rsp = rsp_msg;
-      s->op_lock = op_lock;
-      s->op_cond = op_cond;
-      s->op_complete = FALSE;
-
-      g_async_queue_push(param->sib->insert_queue, s);
-
-      /* Signal scheduler that new operation has been added to queue */
-      g_mutex_lock(param->sib->new_reqs_lock);
-      param->sib->new_reqs = TRUE;
-      g_cond_signal(param->sib->new_reqs_cond);
-      g_mutex_unlock(param->sib->new_reqs_lock);
-
-      /* Block while operation is being processed */
-      g_mutex_lock(s->op_lock);
-      while (!(s->op_complete))
-	{
-	  g_cond_wait(s->op_cond, s->op_lock);
-	}
-      s->op_complete = FALSE;
-      g_mutex_unlock(op_lock);
 
-    send_response:
-      /* REMOVED rsp_msg->status = status; DAN - ARCES */
-      whiteboard_util_send_method_return(param->conn,
-					 param->msg,
-					 DBUS_TYPE_STRING, &(header->space_id),
-					 DBUS_TYPE_STRING, &(header->kp_id),
-					 DBUS_TYPE_INT32, &(header->tr_id),
-					 DBUS_TYPE_INT32, &(rsp_msg->status),
-					 WHITEBOARD_UTIL_LIST_END);
-
-      ssFreeTripleList(&(req_msg->remove_graph));
-
-      g_mutex_free(op_lock);
-      g_cond_free(op_cond);
-      g_free(s);
-      g_free(req_msg);
-      g_free(rsp_msg);
-      g_free(header);
+      /* The reply is sent by m3_remove_reply once processed */
+      m3_schedule(param->sib, param->sib->insert_queue, s);
+      return NULL;
     }
   else
     {
@@ -695,8 +804,11 @@ gpointer m3_remove(gpointer data)
       whiteboard_log_warning("Could not parse REMOVE method call message\n");
     }
 
-  dbus_message_unref(param->msg);
-  g_free(param);
+  g_free(s);
+  g_free(req_msg);
+  g_free(rsp_msg);
+  g_free(header);
+  m3_param_free(param);
   return NULL;
 }
 
@@ -705,8 +817,6 @@ gpointer m3_update(gpointer data)
   ssap_message_header *header;
   ssap_kp_message *req_msg;
   ssap_sib_message *rsp_msg;
-  GMutex* op_lock;
-  GCond* op_cond;
   scheduler_item* s;
   ssStatus_t status = ss_StatusOK;
   sib_op_parameter* param = (sib_op_parameter*) data;
@@ -716,10 +826,14 @@ gpointer m3_update(gpointer data)
   req_msg = g_new0(ssap_kp_message, 1);
   rsp_msg = g_new0(ssap_sib_message, 1);
   s = g_new0(scheduler_item, 1);
-  op_lock = g_mutex_new();
-  op_cond = g_cond_new();
   rsp_msg->status = ss_StatusOK;    /* DAN - ARCES */
 
+  s->header = header;
+  s->req = req_msg;
+  s->rsp = rsp_msg;
+  s->complete = m3_insert_reply;
+  s->complete_data = param;
+
   if(whiteboard_util_parse_message(param->msg,
 				   DBUS_TYPE_STRING, &(header->space_id),
 				   DBUS_TYPE_STRING, &(header->kp_id),
@@ -743,7 +857,8 @@ gpointer m3_update(gpointer data)
 	      whiteboard_log_debug("UPDATE: Remove parse failed, status code %d\n", status);
 	      rsp_msg->bnodes_str = g_strdup("");
 	      rsp_msg->status = status; /* DAN - ARCES */
-	      goto send_response;
+	      m3_insert_reply(s, param->sib);
+	      return NULL;
 	    }
 	}
       if (EncodingM3XML == req_msg->encoding)
@@ -757,60 +872,25 @@ gpointer m3_update(gpointer data)
 	      whiteboard_log_debug("UPDATE: Insert parse failed, status code %d\n", status);
 	      rsp_msg->bnodes_str = g_strdup("");
 	      rsp_msg->status = status; /* DAN - ARCES */
-	      goto send_response;
+	      m3_insert_reply(s, param->sib);
+	      return NULL;
 	    }
 	}
 
-      s->header = header;
-      s->req = req_msg;
-      s->rsp = rsp_msg;
-      s->op_lock = op_lock;
-      s->op_cond = op_cond;
-      s->op_complete = FALSE;
-
-      g_async_queue_push(param->sib->insert_queue, s);
-
-      /* Signal scheduler that new operation has been added to queue */
-      g_mutex_lock(param->sib->new_reqs_lock);
-      param->sib->new_reqs = TRUE;
-      g_cond_signal(param->sib->new_reqs_cond);
-      g_mutex_unlock(param->sib->new_reqs_lock);
-
-      /* Block while operation is being processed */
-      g_mutex_lock(s->op_lock);
-      while (!(s->op_complete))
-	{
-	  g_cond_wait(s->op_cond, s->op_lock);
-	}
-      s->op_complete = FALSE;
-      g_mutex_unlock(op_lock);
-
-    send_response:
-    /* REMOVED rsp_msg->status = status; DAN - ARCES */
-      whiteboard_util_send_method_return(param->conn,
-				  param->msg,
-				  DBUS_TYPE_STRING, &(header->space_id),
-				  DBUS_TYPE_STRING, &(header->kp_id),
-				  DBUS_TYPE_INT32, &(header->tr_id),
-				  DBUS_TYPE_INT32, &(rsp_msg->status),
-				  DBUS_TYPE_STRING, &(rsp_msg->bnodes_str),
-				  WHITEBOARD_UTIL_LIST_END);
-
-      ssFreeTripleList(&(req_msg->remove_graph));
-      ssFreeTripleList(&(req_msg->insert_graph));
-      g_free(s);
-      g_free(rsp_msg->bnodes_str);
-      g_free(req_msg);
-      g_free(rsp_msg);
-      g_free(header);
+      /* The reply is sent by m3_insert_reply once processed */
+      m3_schedule(param->sib, param->sib->insert_queue, s);
+      return NULL;
     }
   else
     {
       whiteboard_log_warning("Could not parse UPDATE method call message\n");
     }
 
-  dbus_message_unref(param->msg);
-  g_free(param);
+  g_free(s);
+  g_free(req_msg);
+  g_free(rsp_msg);
+  g_free(header);
+  m3_param_free(param);
   return NULL;
 
 }
@@ -839,6 +919,36 @@ void m3_free_node_int_list(GSList** node_list, GHashTable* current)
 }
 #endif /* WITH_WQL */
 
+/*
+ * Hash and equality of m3_triple_int by the s, p and o nodes, for sets
+ * of triples keyed by the triples themselves (see m3_triple_set_new)
+ */
+guint m3_triple_int_hash(gconstpointer key)
+{
+  const m3_triple_int* t = (const m3_triple_int*)key;
+  guint h = (guint)t->s;
+  h = h * 0x9E3779B1u + (guint)t->p;
+  h = h * 0x9E3779B1u + (guint)t->o;
+  return h ^ (h >> 16);
+}
+
+gboolean m3_triple_int_equal(gconstpointer a, gconstpointer b)
+{
+  const m3_triple_int* ta = (const m3_triple_int*)a;
+  const m3_triple_int* tb = (const m3_triple_int*)b;
+  return ta->s == tb->s && ta->p == tb->p && ta->o == tb->o;
+}
+
+/*
+ * New set of m3_triple_int, each triple is both the key and the value.
+ * Look up with a triple on the stack, nothing is allocated per triple.
+ * The triples are not freed with the set.
+ */
+GHashTable* m3_triple_set_new(void)
+{
+  return g_hash_table_new(m3_triple_int_hash, m3_triple_int_equal);
+}
+
 void m3_free_triple_int_list(GSList** triple_list, GHashTable* current)
 {
   if (!triple_list || !*triple_list)
@@ -852,19 +962,16 @@ void m3_free_triple_int_list(GSList** triple_list, GHashTable* current)
       tl = g_slist_remove(tl, t);
       if (NULL != current)
 	{
-	  gchar* key = g_strdup_printf("%d_%d_%d", t->s, t->p, t->o);
-	  if (NULL == g_hash_table_lookup(current, key))
+	  /* Triples in the current result set are owned by it */
+	  if (t != g_hash_table_lookup(current, t))
 	    {
 	      //printf("m3_free_triple_int_list: HT: triple freed %d %d %d\n", t->s, t->p, t->o);
 	      if (t->lang) g_free(t->lang);
 	      g_free(t);
 	    }
-	  //printf("m3_free_triple_int_list: HT: triple not freed %d %d %d\n", t->s, t->p, t->o);
-	  g_free(key);
 	}
       else
 	{
-	  printf("m3_free_triple_int_list: !HT: triple freed %d %d %d\n", t->s, t->p, t->o);
 	  if (t->lang) g_free(t->lang);
 	  g_free(t);
 	}
@@ -925,79 +1032,50 @@ gchar* m3_gen_node_string(GSList* nodes, sib_op_parameter* param)
 }
 #endif /* WITH_WQL */
 
-GSList* m3_triple_list_int_to_str(GSList* int_triples, DB store, ssStatus_t* status)
+GSList* m3_triple_list_int_to_str(GSList* int_triples, SibStore* store, ssStatus_t* status)
 {
   GSList* str_triples = NULL;
   m3_triple_int* it;
   ssTriple_t* st;
-  char *str_tmp;
-  char *str_exp_tmp;
+  gchar *str_tmp;
 
-  piglet_transaction(store);
+  sib_store_transaction(store);
   while (NULL != int_triples)
     {
       st = g_new0(ssTriple_t, 1);
       it = (m3_triple_int*)int_triples->data;
-      str_tmp = piglet_info(store, it->s, &(it->dt), it->lang);
+      str_tmp = sib_store_string(store, it->s);
 
       if (!str_tmp)
 	goto error;
 
-      str_exp_tmp = piglet_expand_m3(store, str_tmp);
-      st->subject = (ssElement_t)g_strdup(str_exp_tmp);
-      /* These are allocated in Piglet using malloc */
-      free(str_tmp);
-      free(str_exp_tmp);
+      st->subject = (ssElement_t)str_tmp;
 
-      str_tmp = piglet_info(store, it->p, &(it->dt), it->lang);
+      str_tmp = sib_store_string(store, it->p);
 
       if (!str_tmp)
 	goto error;
 
-      str_exp_tmp = piglet_expand_m3(store, str_tmp);
-      st->predicate = (ssElement_t)g_strdup(str_exp_tmp);
-      /* These are allocated in Piglet using malloc */
-      free(str_tmp);
-      free(str_exp_tmp);
-
-      if (it->o >= 0)
-	{
-	  st->objType = ssElement_TYPE_URI;
-
-	  str_tmp = piglet_info(store, it->o, &(it->dt), it->lang);
-
-	  if (!str_tmp)
-	    goto error;
+      st->predicate = (ssElement_t)str_tmp;
 
-	  str_exp_tmp = piglet_expand_m3(store, str_tmp);
-	  st->object = (ssElement_t)g_strdup(str_exp_tmp);
-	  /* These are allocated in Piglet using malloc */
-	  free(str_tmp);
-	  free(str_exp_tmp);
-	}
-      else
-	{
-	  /* Literals should not be expanded */
-	  st->objType = ssElement_TYPE_LIT;
-	  str_tmp = piglet_info(store, it->o, &(it->dt), it->lang);
+      /* Literals are not expanded by sib_store_string */
+      st->objType = (it->o >= 0) ? ssElement_TYPE_URI : ssElement_TYPE_LIT;
+      str_tmp = sib_store_string(store, it->o);
 
-	  if (!str_tmp)
-	    goto error;
+      if (!str_tmp)
+	goto error;
 
-	  st->object = (ssElement_t)g_strdup(str_tmp);
-	  /* This is allocated in Piglet using malloc */
-	  free(str_tmp);
-	}
+      st->object = (ssElement_t)str_tmp;
         /* dt and lang handling here*/
       str_triples = g_slist_prepend(str_triples, st);
       int_triples = int_triples->next;
     }
-  piglet_commit(store);
+  sib_store_commit(store);
   return str_triples;
  error:
   /* Cleanup here */
-  printf("m3_triple_list_int_to_string: got error:\n%s\n", piglet_error_message);
-  piglet_rollback(store);
+  printf("m3_triple_list_int_to_string: got error:\n%s\n", sib_store_error(store));
+  sib_store_rollback(store);
   ssFreeTripleList(&str_triples);
   ssFreeTriple(st);
   *status = ss_OperationFailed;
@@ -1006,15 +1084,14 @@ GSList* m3_triple_list_int_to_str(GSList* int_triples, DB store, ssStatus_t* sta
 }
 
 #if WITH_WQL==1
-GSList* m3_node_list_int_to_str(GSList* int_nodes, DB store, ssStatus_t* status)
+GSList* m3_node_list_int_to_str(GSList* int_nodes, SibStore* store, ssStatus_t* status)
 {
   GSList* str_nodes = NULL;
   m3_node_int* in;
   ssPathNode_t* sn;
-  char* str_tmp_node;
-  char* str_exp_tmp_node;
+  gchar* str_tmp_node;
 
-  piglet_transaction(store);
+  sib_store_transaction(store);
   while (NULL != int_nodes)
     {
       sn = g_new0(ssPathNode_t, 1);
@@ -1029,16 +1106,12 @@ GSList* m3_node_list_int_to_str(GSList* int_nodes, DB store, ssStatus_t* status)
       if (in->node > 0)
 	{
 	  sn->nodeType = ssElement_TYPE_URI;
-	  str_tmp_node = piglet_info(store, in->node, &(in->dt), in->lang);
+	  str_tmp_node = sib_store_string(store, in->node);
 
 	  if (!str_tmp_node)
 	    goto error;
 
-	  str_exp_tmp_node = piglet_expand_m3(store, str_tmp_node);
-	  sn->string = (ssElement_t)g_strdup((gchar*)str_exp_tmp_node);
-	  /* These are allocated in Piglet using malloc */
-	  free(str_tmp_node);
-	  free(str_exp_tmp_node);
+	  sn->string = (ssElement_t)str_tmp_node;
 
 	  // whiteboard_log_debug("Int node %d is %s\n", in->node, sn->string);
 	}
@@ -1046,14 +1119,12 @@ GSList* m3_node_list_int_to_str(GSList* int_nodes, DB store, ssStatus_t* status)
 	{
 	  /* Literals should not be expanded */
 	  sn->nodeType = ssElement_TYPE_LIT;
-	  str_tmp_node = piglet_info(store, in->node, &(in->dt), in->lang);
+	  str_tmp_node = sib_store_string(store, in->node);
 
 	  if (!str_tmp_node)
 	    goto error;
 
-	  sn->string = (ssElement_t)g_strdup(str_tmp_node);
-	  /* This is allocated in Piglet using malloc */
-	  free(str_tmp_node);
+	  sn->string = (ssElement_t)str_tmp_node;
 
 	  // whiteboard_log_debug("Int node %d is %s\n", in->node, sn->string);
 	  /* dt and lang handling here*/
@@ -1061,11 +1132,11 @@ GSList* m3_node_list_int_to_str(GSList* int_nodes, DB store, ssStatus_t* status)
       str_nodes = g_slist_prepend(str_nodes, sn);
       int_nodes = int_nodes->next;
     }
-  piglet_commit(store);
+  sib_store_commit(store);
   return str_nodes;
  error:
   /* Cleanup here */
-  piglet_rollback(store);
+  sib_store_rollback(store);
   ssFreePathNodeList(&str_nodes);
   ssFreePathNode(sn);
   *status = ss_OperationFailed;
@@ -1073,174 +1144,316 @@ GSList* m3_node_list_int_to_str(GSList* int_nodes, DB store, ssStatus_t* status)
 }
 #endif /* WITH_WQL */
 
-gpointer m3_query(gpointer data)
+/*
+ * Read-only store handle of the calling thread, opened on first use.
+ * Reads in a transaction of the handle see a consistent state of the
+ * store without taking store_lock.
+ * Returns NULL if there are no reader handles.
+ */
+SibStore* sib_reader_store(sib_data_structure* p)
 {
-  ssap_message_header *header;
-  ssap_kp_message *req_msg;
-  ssap_sib_message *rsp_msg;
-  GMutex* op_lock;
-  GCond* op_cond;
-  scheduler_item* s;
-  ssStatus_t status;
-  sib_op_parameter* param = (sib_op_parameter*) data;
-
-  GSList* res_list_str = NULL;
-
+  SibStore* store;
 
+  if (NULL == p->reader_store)
+    return NULL;
 
-  /* Allocate memory for message structs */
-  header =  g_new0(ssap_message_header, 1);
-  req_msg = g_new0(ssap_kp_message, 1);
-  rsp_msg = g_new0(ssap_sib_message, 1);
-  s = g_new0(scheduler_item, 1);
-  op_lock = g_mutex_new();
-  op_cond = g_cond_new();
-
-  if(whiteboard_util_parse_message(param->msg,
-			    DBUS_TYPE_STRING, &(header->space_id),
-			    DBUS_TYPE_STRING, &(header->kp_id),
-			    DBUS_TYPE_INT32, &(header->tr_id),
-			    DBUS_TYPE_INT32, &(req_msg->type),
-			    DBUS_TYPE_STRING, &(req_msg->query_str),
-			    DBUS_TYPE_INVALID) )
+  store = (SibStore*)g_private_get(p->reader_store);
+  if (NULL == store)
     {
-      /* Initialize message structs */
-      header->tr_type = M3_QUERY;
-      header->msg_type = M3_REQUEST;
-      rsp_msg->status = ss_StatusOK;
-      switch(req_msg->type)
+      store = sib_store_open_reader(p->RDF_store);
+      if (NULL == store)
 	{
-	case QueryTypeTemplate:
-	  status = parseM3_triples(&(req_msg->template_query),
-				   req_msg->query_str,
-				   NULL);
-	  break;
-#if WITH_WQL==1
-	case QueryTypeWQLValues:
-	case QueryTypeWQLRelated:
-	case QueryTypeWQLIsType:
-	case QueryTypeWQLIsSubType:
-	  req_msg->wql_query = ssWqlDesc_new_jh(req_msg->type);
-	  whiteboard_log_debug("WQL query for tr %d is:\n%s\n", header->tr_id, req_msg->query_str);
-	  status = parseM3_query_req_wql(req_msg->wql_query,
-					 (const gchar*)req_msg->query_str);
-	  whiteboard_log_debug("Parsed WQL query for tr %d\n", header->tr_id);
-
-	  break;
-	case QueryTypeWQLNodeTypes:
-	  /* FALLTHROUGH */
-	  /* Not working in current release, will be fixed */
-#endif /* WITH_WQL */
-	case QueryTypeSPARQLSelect:
-	  /* FALLTHROUGH */
-	default: /* Error */
-	  rsp_msg->status = ss_SIBFailNotImpl;
-	  rsp_msg->results_str = g_strdup("");
-	  goto send_response;
-	  break;
+	  whiteboard_log_warning("Could not open reader store handle: %s\n", sib_store_error(p->RDF_store));
+	  return NULL;
 	}
+      g_private_set(p->reader_store, store);
+    }
+  return store;
+}
 
-      if (status != ss_StatusOK)
-	{
-	  if (status == ss_ParsingError)
-	    rsp_msg->status = ss_KPErrorMsgSyntax;
-	  else
-	    rsp_msg->status = status;
+/*
+ * Convert result triples to string form from the node cache only.
+ * Returns FALSE if a node is not in the cache.
+ */
+gboolean m3_triple_list_cached_str(GSList* int_triples, SibNodeCache* cache,
+				   GSList** str_triples)
+{
+  m3_triple_int* it;
+  ssTriple_t* st;
 
-	  rsp_msg->results_str = g_strdup("");
-	  goto send_response;
+  *str_triples = NULL;
+  if (NULL == cache)
+    return FALSE;
+
+  for ( ; int_triples != NULL; int_triples = int_triples->next)
+    {
+      it = (m3_triple_int*)int_triples->data;
+      st = g_new0(ssTriple_t, 1);
+      st->subject = (ssElement_t)sib_node_cache_get_string(cache, it->s);
+      st->predicate = (ssElement_t)sib_node_cache_get_string(cache, it->p);
+      st->objType = (it->o >= 0) ? ssElement_TYPE_URI : ssElement_TYPE_LIT;
+      st->object = (ssElement_t)sib_node_cache_get_string(cache, it->o);
+      if (!st->subject || !st->predicate || !st->object)
+	{
+	  ssFreeTriple(st);
+	  ssFreeTripleList(str_triples);
+	  return FALSE;
 	}
-      s->header = header;
-      s->req = req_msg;
-      s->rsp = rsp_msg;
-      s->op_lock = op_lock;
-      s->op_cond = op_cond;
-      s->op_complete = FALSE;
+      *str_triples = g_slist_prepend(*str_triples, st);
+    }
+  return TRUE;
+}
 
-      g_async_queue_push(param->sib->query_queue, s);
+/*
+ * Convert result triples to string form. Called outside the
+ * scheduler, so no store handles are opened here: the strings come
+ * from the node cache, or through the main store if some are missing.
+ */
+GSList* m3_result_triples_to_str(sib_data_structure* p, GSList* int_triples, ssStatus_t* status)
+{
+  GSList* str_triples;
 
-      /* Signal scheduler that new operation has been added to queue */
-      g_mutex_lock(param->sib->new_reqs_lock);
-      param->sib->new_reqs = TRUE;
-      g_cond_signal(param->sib->new_reqs_cond);
-      g_mutex_unlock(param->sib->new_reqs_lock);
+  if (m3_triple_list_cached_str(int_triples, p->RDF_store->cache, &str_triples))
+    return str_triples;
 
-      /* Block while operation is being processed */
-      g_mutex_lock(s->op_lock);
-      while (!(s->op_complete))
-	{
-	  g_cond_wait(s->op_cond, s->op_lock);
-	}
-      s->op_complete = FALSE;
-      g_mutex_unlock(op_lock);
+  g_mutex_lock(p->store_lock);
+  str_triples = m3_triple_list_int_to_str(int_triples, p->RDF_store, status);
+  g_mutex_unlock(p->store_lock);
+  return str_triples;
+}
 
-      /* Generate results strings here */
-      switch (req_msg->type)
-	{
-	case QueryTypeTemplate:
-	  g_mutex_lock(param->sib->store_lock);
-	  res_list_str = m3_triple_list_int_to_str(rsp_msg->results, param->sib->RDF_store, &status);
-	  g_mutex_unlock(param->sib->store_lock);
-	  rsp_msg->results_str = m3_gen_triple_string(res_list_str, param);
-	  break;
+/*
+ * Send the reply of a query and free the request
+ */
+void m3_query_send(scheduler_item* s, GSList* res_list_str)
+{
+  sib_op_parameter* param = (sib_op_parameter*) s->complete_data;
+  ssap_kp_message* req_msg = s->req;
+  ssap_sib_message* rsp_msg = s->rsp;
+
+  m3_send_return(param,
+		 DBUS_TYPE_STRING, &(s->header->space_id),
+		 DBUS_TYPE_STRING, &(s->header->kp_id),
+		 DBUS_TYPE_INT32, &(s->header->tr_id),
+		 DBUS_TYPE_INT32, &(rsp_msg->status),
+		 DBUS_TYPE_STRING, &(rsp_msg->results_str),
+		 DBUS_TYPE_INVALID);
+  /* Free memory*/
+  switch (req_msg->type)
+    {
+    case QueryTypeTemplate:
+      ssFreeTripleList(&res_list_str);
+      ssFreeTripleList(&(req_msg->template_query));
+      m3_free_triple_int_list(&(rsp_msg->results), NULL);
+      break;
 #if WITH_WQL==1
-	case QueryTypeWQLNodeTypes:
-	  /* FALLTHROUGH */
-	case QueryTypeWQLValues:
-	  g_mutex_lock(param->sib->store_lock);
-	  res_list_str = m3_node_list_int_to_str(rsp_msg->results, param->sib->RDF_store, &status);
-	  g_mutex_unlock(param->sib->store_lock);
-	  rsp_msg->results_str = m3_gen_node_string(res_list_str, param);
-	  whiteboard_log_debug("Generated results string %s\n", rsp_msg->results_str);
-	  break;
-	case QueryTypeWQLRelated:
-	  /* FALLTHROUGH */
-	case QueryTypeWQLIsType:
-	  /* FALLTHROUGH */
-	case QueryTypeWQLIsSubType:
-	  if (rsp_msg->bool_results)
-	    rsp_msg->results_str = g_strdup("TRUE");
-	  else
-	    rsp_msg->results_str = g_strdup("FALSE");
-	  break;
+    case QueryTypeWQLValues:
+      /* FALLTHROUGH */
+      ssFreePathNodeList(&res_list_str);
+      ssWqlDesc_free(&(req_msg->wql_query));
+      m3_free_node_int_list(&(rsp_msg->results), NULL);
+      break;
+    case QueryTypeWQLRelated:
+      /* FALLTHROUGH */
+    case QueryTypeWQLIsType:
+      /* FALLTHROUGH */
+    case QueryTypeWQLIsSubType:
+      ssWqlDesc_free(&req_msg->wql_query);
+      break;
+    case QueryTypeWQLNodeTypes:
+      /* FALLTHROUGH */
+      /* Not working in current release, will be fixed */
 #endif /* WITH_WQL */
-	case QueryTypeSPARQLSelect:
-	  break;
-	default: /* Error */
-	  /* Should never be reached */
-	  /* assert(0); */
-	  break;
+    case QueryTypeSPARQLSelect:
+      /* FALLTHROUGH */
+    default: /* Error */
+      /* Should not ever be reached */
+      /* assert(0); */
+      break;
+    }
+  g_free(rsp_msg->results_str);
+  g_free(req_msg);
+  g_free(rsp_msg);
+  g_free(s->header);
+  g_free(s->cache_key);
+  sib_result_cache_stamp_free(s->cache_stamp);
+  g_free(s);
+
+  m3_param_free(param);
+}
+
+/*
+ * Completion of a query: generate the result string in the completion
+ * pool and reply to the KP
+ */
+void m3_query_reply(scheduler_item* s, sib_data_structure* sib)
+{
+  sib_op_parameter* param = (sib_op_parameter*) s->complete_data;
+  ssap_kp_message* req_msg = s->req;
+  ssap_sib_message* rsp_msg = s->rsp;
+  GSList* res_list_str = NULL;
+  ssStatus_t status = ss_StatusOK;
+
+  /* Generate results strings here */
+  switch (req_msg->type)
+    {
+    case QueryTypeTemplate:
+      res_list_str = m3_result_triples_to_str(sib, rsp_msg->results, &status);
+      if (status != ss_StatusOK)
+	rsp_msg->status = status;
+      rsp_msg->results_str = m3_gen_triple_string(res_list_str, param);
+      /* A failed conversion is not cached, the next query retries */
+      if (rsp_msg->status == ss_StatusOK && NULL != s->cache_stamp)
+	{
+	  sib_result_cache_put(sib->results, s->cache_key, s->cache_stamp,
+			       rsp_msg->results_str);
+	  s->cache_stamp = NULL;
 	}
-    send_response:
-      whiteboard_util_send_method_return(param->conn,
-				  param->msg,
-				  DBUS_TYPE_STRING, &(header->space_id),
-				  DBUS_TYPE_STRING, &(header->kp_id),
-				  DBUS_TYPE_INT32, &(header->tr_id),
-				  DBUS_TYPE_INT32, &(rsp_msg->status),
-				  DBUS_TYPE_STRING, &(rsp_msg->results_str),
-				  WHITEBOARD_UTIL_LIST_END);
-      /* Free memory*/
-      switch (req_msg->type)
+      break;
+#if WITH_WQL==1
+    case QueryTypeWQLNodeTypes:
+      /* FALLTHROUGH */
+    case QueryTypeWQLValues:
+      g_mutex_lock(sib->store_lock);
+      res_list_str = m3_node_list_int_to_str(rsp_msg->results, sib->RDF_store, &status);
+      g_mutex_unlock(sib->store_lock);
+      if (status != ss_StatusOK)
+	rsp_msg->status = status;
+      rsp_msg->results_str = m3_gen_node_string(res_list_str, param);
+      whiteboard_log_debug("Generated results string %s\n", rsp_msg->results_str);
+      break;
+    case QueryTypeWQLRelated:
+      /* FALLTHROUGH */
+    case QueryTypeWQLIsType:
+      /* FALLTHROUGH */
+    case QueryTypeWQLIsSubType:
+      if (rsp_msg->bool_results)
+	rsp_msg->results_str = g_strdup("TRUE");
+      else
+	rsp_msg->results_str = g_strdup("FALSE");
+      break;
+#endif /* WITH_WQL */
+    case QueryTypeSPARQLSelect:
+      break;
+    default: /* Error */
+      /* Should never be reached */
+      /* assert(0); */
+      break;
+    }
+  m3_query_send(s, res_list_str);
+}
+
+/*
+ * Canonical form of a template query, the key of its result in the
+ * result cache. Triples are sorted and duplicates dropped, so the
+ * same query in another order shares the result.
+ *
+ * @return the key or NULL if the query has missing parts
+ */
+gchar* m3_query_key(GSList* template_query)
+{
+  GString* key;
+  GSList *l, *triples = NULL;
+  ssTriple_t* t;
+  gchar *str, *prev = NULL;
+
+  for (l = template_query; l != NULL; l = l->next)
+    {
+      t = (ssTriple_t*)l->data;
+      if (!t->subject || !t->predicate || !t->object)
+	{
+	  g_slist_foreach(triples, (GFunc)g_free, NULL);
+	  g_slist_free(triples);
+	  return NULL;
+	}
+      /* Lengths keep the parts apart whatever the literals contain */
+      triples = g_slist_prepend(triples,
+				g_strdup_printf("%d %d:%s %d:%s %d %d:%s;",
+						t->subjType,
+						(gint)strlen((gchar*)t->subject), t->subject,
+						(gint)strlen((gchar*)t->predicate), t->predicate,
+						t->objType,
+						(gint)strlen((gchar*)t->object), t->object));
+    }
+
+  key = g_string_new(NULL);
+  triples = g_slist_sort(triples, (GCompareFunc)strcmp);
+  for (l = triples; l != NULL; l = l->next)
+    {
+      str = (gchar*)l->data;
+      if (NULL == prev || 0 != strcmp(prev, str))
+	g_string_append(key, str);
+      prev = str;
+    }
+  g_slist_foreach(triples, (GFunc)g_free, NULL);
+  g_slist_free(triples);
+  return g_string_free(key, FALSE);
+}
+
+gpointer m3_query(gpointer data)
+{
+  ssap_message_header *header;
+  ssap_kp_message *req_msg;
+  ssap_sib_message *rsp_msg;
+  scheduler_item* s;
+  ssStatus_t status;
+  sib_op_parameter* param = (sib_op_parameter*) data;
+
+  /* Allocate memory for message structs */
+  header =  g_new0(ssap_message_header, 1);
+  req_msg = g_new0(ssap_kp_message, 1);
+  rsp_msg = g_new0(ssap_sib_message, 1);
+  s = g_new0(scheduler_item, 1);
+
+  s->header = header;
+  s->req = req_msg;
+  s->rsp = rsp_msg;
+  s->complete = m3_query_reply;
+  s->complete_data = param;
+
+  if(whiteboard_util_parse_message(param->msg,
+			    DBUS_TYPE_STRING, &(header->space_id),
+			    DBUS_TYPE_STRING, &(header->kp_id),
+			    DBUS_TYPE_INT32, &(header->tr_id),
+			    DBUS_TYPE_INT32, &(req_msg->type),
+			    DBUS_TYPE_STRING, &(req_msg->query_str),
+			    DBUS_TYPE_INVALID) )
+    {
+      /* Initialize message structs */
+      header->tr_type = M3_QUERY;
+      header->msg_type = M3_REQUEST;
+      rsp_msg->status = ss_StatusOK;
+      switch(req_msg->type)
 	{
 	case QueryTypeTemplate:
-	  ssFreeTripleList(&res_list_str);
-	  ssFreeTripleList(&(req_msg->template_query));
-	  m3_free_triple_int_list(&(rsp_msg->results), NULL);
+	  status = parseM3_triples(&(req_msg->template_query),
+				   req_msg->query_str,
+				   NULL);
+	  if (status != ss_StatusOK)
+	    break;
+	  s->cache_key = m3_query_key(req_msg->template_query);
+	  if (NULL == s->cache_key)
+	    break;
+	  rsp_msg->results_str = sib_result_cache_get(param->sib->results, s->cache_key);
+	  if (NULL != rsp_msg->results_str)
+	    {
+	      /* Nothing the result depends on has changed since */
+	      whiteboard_log_debug("Query of tr %d answered from the result cache\n", header->tr_id);
+	      m3_query_send(s, NULL);
+	      return NULL;
+	    }
 	  break;
 #if WITH_WQL==1
 	case QueryTypeWQLValues:
-	  /* FALLTHROUGH */
-	  ssFreePathNodeList(&res_list_str);
-	  ssWqlDesc_free(&(req_msg->wql_query));
-	  m3_free_node_int_list(&(rsp_msg->results), NULL);
-	  break;
 	case QueryTypeWQLRelated:
-	  /* FALLTHROUGH */
 	case QueryTypeWQLIsType:
-	  /* FALLTHROUGH */
 	case QueryTypeWQLIsSubType:
-	  ssWqlDesc_free(&req_msg->wql_query);
+	  req_msg->wql_query = ssWqlDesc_new_jh(req_msg->type);
+	  whiteboard_log_debug("WQL query for tr %d is:\n%s\n", header->tr_id, req_msg->query_str);
+	  status = parseM3_query_req_wql(req_msg->wql_query,
+					 (const gchar*)req_msg->query_str);
+	  whiteboard_log_debug("Parsed WQL query for tr %d\n", header->tr_id);
+
 	  break;
 	case QueryTypeWQLNodeTypes:
 	  /* FALLTHROUGH */
@@ -1249,25 +1462,38 @@ gpointer m3_query(gpointer data)
 	case QueryTypeSPARQLSelect:
 	  /* FALLTHROUGH */
 	default: /* Error */
-	  /* Should not ever be reached */
-	  /* assert(0); */
-	  break;
+	  rsp_msg->status = ss_SIBFailNotImpl;
+	  rsp_msg->results_str = g_strdup("");
+	  m3_query_send(s, NULL);
+	  return NULL;
 	}
-      g_mutex_free(op_lock);
-      g_cond_free(op_cond);
-      g_free(s);
-      g_free(rsp_msg->results_str);
-      g_free(req_msg);
-      g_free(rsp_msg);
-      g_free(header);
+
+      if (status != ss_StatusOK)
+	{
+	  if (status == ss_ParsingError)
+	    rsp_msg->status = ss_KPErrorMsgSyntax;
+	  else
+	    rsp_msg->status = status;
+
+	  rsp_msg->results_str = g_strdup("");
+	  m3_query_send(s, NULL);
+	  return NULL;
+	}
+
+      /* The reply is sent by m3_query_reply once processed */
+      m3_schedule(param->sib, param->sib->query_queue, s);
+      return NULL;
     }
   else
     {
       whiteboard_log_warning("Could not parse QUERY method call message\n");
     }
 
-  dbus_message_unref(param->msg);
-  g_free(param);
+  g_free(s);
+  g_free(req_msg);
+  g_free(rsp_msg);
+  g_free(header);
+  m3_param_free(param);
   return NULL;
 
 }
@@ -1288,18 +1514,14 @@ gboolean m3_sub_free_int_node(gpointer key, gpointer value, gpointer not_used)
 
 GHashTable* m3_sub_result_init_triples(GSList* baseline)
 {
-  GHashTable* hash_baseline = g_hash_table_new_full(g_str_hash, g_str_equal,
-						    g_free, NULL);
-
-  gchar* key;
+  GHashTable* hash_baseline = m3_triple_set_new();
   m3_triple_int* t;
 
   for ( ; baseline != NULL ; baseline = g_slist_next(baseline))
     {
       /* Store triple from new result to hash */
       t = (m3_triple_int*)baseline->data;
-      key = g_strdup_printf("%d_%d_%d", t->s, t->p, t->o);
-      g_hash_table_insert(hash_baseline, key, t);
+      g_hash_table_insert(hash_baseline, t, t);
     }
   return hash_baseline;
 }
@@ -1313,16 +1535,14 @@ GHashTable* m3_sub_diff_triples(GHashTable* previous, GSList* new_result,
    * The added and removed items are returned in added and removed
    * parameters
    *
-   * previous: a GHashTable of m3_triple_int with key of string "s_p_o"
+   * previous: a triple set (m3_triple_set_new) of m3_triple_int
    * new_result: a GSList of m3_triple_int
    *
    */
 
   GHashTableIter iter;
   /* Contains m3_triple_int */
-  GHashTable* new_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
-					       g_free, NULL);
-  gchar* key;
+  GHashTable* new_hash = m3_triple_set_new();
   m3_triple_int *t, *tmp;
 
   /* Contains m3_triple_int */
@@ -1333,12 +1553,11 @@ GHashTable* m3_sub_diff_triples(GHashTable* previous, GSList* new_result,
     {
       /* Store triple from new result to hash */
       t = (m3_triple_int*)new_result->data;
-      key = g_strdup_printf("%d_%d_%d", t->s, t->p, t->o);
-      g_hash_table_insert(new_hash, key, t);
-      tmp = g_hash_table_lookup(previous, key);
+      g_hash_table_insert(new_hash, t, t);
+      tmp = g_hash_table_lookup(previous, t);
       if (NULL != tmp)
 	{
-	  g_hash_table_remove(previous, key);
+	  g_hash_table_remove(previous, tmp);
 	  g_free(tmp);
 	}
       else
@@ -1348,7 +1567,7 @@ GHashTable* m3_sub_diff_triples(GHashTable* previous, GSList* new_result,
     }
   g_hash_table_iter_init(&iter, previous);
 
-  while(g_hash_table_iter_next(&iter, (gpointer*)&key, (gpointer*)&t))
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer*)&t))
     {
       removed_tmp = g_slist_prepend(removed_tmp, t);
     }
@@ -1358,6 +1577,99 @@ GHashTable* m3_sub_diff_triples(GHashTable* previous, GSList* new_result,
   return new_hash;
 }
 
+void m3_free_delta_list(GSList** delta_list)
+{
+  GSList* dl;
+
+  if (!delta_list || !*delta_list)
+    return;
+  for (dl = *delta_list; dl != NULL; dl = dl->next)
+    g_free(dl->data);
+  g_slist_free(*delta_list);
+  *delta_list = NULL;
+}
+
+void m3_sub_apply_deltas(GHashTable* current, GSList* deltas,
+			 GSList** added, GSList** removed)
+{
+  /*
+   * Function to apply triple changes found through the subscription
+   * index to the current result of a subscription.
+   * The current hash table is updated in place, triples that were
+   * actually added and removed are returned in added and removed
+   * parameters. Changes cancelling out each other are dropped.
+   *
+   * current: a triple set (m3_triple_set_new) of m3_triple_int
+   * deltas: a GSList of m3_triple_delta, oldest first
+   *
+   */
+
+  GHashTableIter iter;
+  GHashTable* added_hash = m3_triple_set_new();
+  GHashTable* removed_hash = m3_triple_set_new();
+  m3_triple_delta* d;
+  m3_triple_int *t, *tmp;
+  m3_triple_int key;
+
+  for ( ; deltas != NULL ; deltas = deltas->next)
+    {
+      d = (m3_triple_delta*)deltas->data;
+      key.s = d->s;
+      key.p = d->p;
+      key.o = d->o;
+      t = g_hash_table_lookup(current, &key);
+      if (d->added)
+	{
+	  if (NULL != t)
+	    continue;
+	  t = g_new0(m3_triple_int, 1);
+	  t->s = d->s;
+	  t->p = d->p;
+	  t->o = d->o;
+	  g_hash_table_insert(current, t, t);
+
+	  tmp = g_hash_table_lookup(removed_hash, &key);
+	  if (NULL != tmp)
+	    {
+	      /* Removed and added back in the same batch */
+	      g_hash_table_remove(removed_hash, tmp);
+	      g_free(tmp);
+	    }
+	  else
+	    g_hash_table_insert(added_hash, t, t);
+	}
+      else
+	{
+	  if (NULL == t)
+	    continue;
+	  g_hash_table_remove(current, t);
+
+	  if (NULL != g_hash_table_lookup(added_hash, t))
+	    {
+	      /* Added and removed again in the same batch */
+	      g_hash_table_remove(added_hash, t);
+	      g_free(t->lang);
+	      g_free(t);
+	    }
+	  else
+	    g_hash_table_insert(removed_hash, t, t);
+	}
+    }
+
+  g_hash_table_iter_init(&iter, added_hash);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer*)&t))
+    {
+      *added = g_slist_prepend(*added, t);
+    }
+  g_hash_table_iter_init(&iter, removed_hash);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer*)&t))
+    {
+      *removed = g_slist_prepend(*removed, t);
+    }
+  g_hash_table_destroy(added_hash);
+  g_hash_table_destroy(removed_hash);
+}
+
 #if WITH_WQL==1
 GHashTable* m3_sub_result_init_nodes(GSList* baseline)
 {
@@ -1427,725 +1739,868 @@ GHashTable* m3_sub_diff_nodes(GHashTable* previous, GSList* new_result,
 }
 #endif /* WITH_WQL */
 
-gint m3_subscribe_triples(ssap_message_header *header,
-			  ssap_kp_message *req_msg,
-			  ssap_sib_message *rsp_msg,
-			  sib_op_parameter* param)
-{
-  GMutex* op_lock;
-  GCond* op_cond;
-  scheduler_item* s;
-
-  gchar *space_id, *kp_id;
-  gchar* sub_id = rsp_msg->sub_id;
-  gint tr_id;
-
-  GHashTable* current_result;
-  GSList *added = NULL, *removed = NULL, *added_str = NULL, *removed_str = NULL;
-
-  subscription_state *sub_state;
+/*
+ * Subscriptions are kept as subscription_member objects in sib->subs.
+ * Subscriptions to the same canonical query share a subscription_state
+ * in sib->sub_groups, which is evaluated once per round for all of
+ * them. The scheduler item of a state is queued to the query queue,
+ * processed by the scheduler and handed to m3_sub_advance() through
+ * the completion pool, which sends the results to the members and
+ * then queues it again. No thread is held while a subscription waits
+ * for changes.
+ */
 
+gint m3_triple_int_compare(gconstpointer a, gconstpointer b)
+{
+  const m3_triple_int* ta = (const m3_triple_int*)a;
+  const m3_triple_int* tb = (const m3_triple_int*)b;
+
+  if (ta->s != tb->s)
+    return (ta->s < tb->s) ? -1 : 1;
+  if (ta->p != tb->p)
+    return (ta->p < tb->p) ? -1 : 1;
+  if (ta->o != tb->o)
+    return (ta->o < tb->o) ? -1 : 1;
+  return 0;
+}
 
-  space_id = header->space_id;
-  kp_id = header->kp_id;
-  tr_id = header->tr_id;
+/*
+ * Canonical form of a subscription query. The compiled patterns of a
+ * template query are sorted and their duplicates dropped in place, so
+ * that the same query written in another order or with other prefixes
+ * shares the evaluation. WQL queries are compared by query string.
+ * Only subscriptions asking for the same coalescing share.
+ */
+gchar* m3_sub_key(query_type type, GSList** patterns, const gchar* query_str,
+		  gint min_interval, gint max_batch)
+{
+  GString* key = g_string_new(NULL);
+  GSList *l, *next;
+  m3_triple_int *t, *prev = NULL;
 
-  s = g_new0(scheduler_item, 1);
-  op_lock = g_mutex_new();
-  op_cond = g_cond_new();
+  g_string_append_printf(key, "%d,%d,%d:", min_interval, max_batch, type);
+  if (type != QueryTypeTemplate)
+    {
+      g_string_append(key, query_str);
+      return g_string_free(key, FALSE);
+    }
 
-  s->header = header;
-  s->req = req_msg;
-  s->rsp = rsp_msg;
-  s->op_lock = op_lock;
-  s->op_cond = op_cond;
-  s->op_complete = FALSE;
+  *patterns = g_slist_sort(*patterns, m3_triple_int_compare);
+  for (l = *patterns; l != NULL; l = next)
+    {
+      next = l->next;
+      t = (m3_triple_int*)l->data;
+      if (NULL != prev && 0 == m3_triple_int_compare(prev, t))
+	{
+	  *patterns = g_slist_delete_link(*patterns, l);
+	  g_free(t->lang);
+	  g_free(t);
+	  continue;
+	}
+      g_string_append_printf(key, "%d %d %d;", t->s, t->p, t->o);
+      prev = t;
+    }
+  return g_string_free(key, FALSE);
+}
 
+/*
+ * Coalescing asked by a subscribe request with optional INT32
+ * arguments after the query string: the minimum interval between
+ * indications in milliseconds, and the number of changed triples
+ * sent without waiting for the interval. Missing arguments take the
+ * defaults of the SIB.
+ */
+void m3_sub_parse_coalescing(sib_op_parameter* param, gint* min_interval, gint* max_batch)
+{
+  DBusMessageIter iter;
+  gint i;
 
-  g_async_queue_push(param->sib->query_queue, s);
+  *min_interval = param->sib->sub_min_interval;
+  *max_batch = param->sib->sub_max_batch;
 
-  /* Signal scheduler that new operation has been added to queue */
-  g_mutex_lock(param->sib->new_reqs_lock);
-  param->sib->new_reqs = TRUE;
-  // printf("Now signaling SCHEDULER in SUBSCRIBE tr %d\n", header->tr_id);
-  g_cond_signal(param->sib->new_reqs_cond);
-  g_mutex_unlock(param->sib->new_reqs_lock);
+  /* After space_id, kp_id, tr_id, type and query */
+  if (!dbus_message_iter_init(param->msg, &iter))
+    return;
+  for (i = 0; i < 5; i++)
+    if (!dbus_message_iter_next(&iter))
+      return;
 
-  /* Block while operation is being processed */
-  g_mutex_lock(s->op_lock);
-  while (!(s->op_complete))
+  if (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_INT32)
     {
-      g_cond_wait(s->op_cond, s->op_lock);
+      dbus_message_iter_get_basic(&iter, min_interval);
+      if (dbus_message_iter_next(&iter) &&
+	  dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_INT32)
+	dbus_message_iter_get_basic(&iter, max_batch);
     }
-  s->op_complete = FALSE;
-  g_mutex_unlock(op_lock);
-  printf("Got baseline query result for subscription %s\n", rsp_msg->sub_id); /* SUB_DEBUG */
-
-  current_result = m3_sub_result_init_triples(rsp_msg->results);
+  *min_interval = MAX(*min_interval, 0);
+  *max_batch = MAX(*max_batch, 0);
+}
 
-  g_mutex_lock(param->sib->store_lock);
-  added_str = m3_triple_list_int_to_str(rsp_msg->results, param->sib->RDF_store, &(rsp_msg->status));
-  g_mutex_unlock(param->sib->store_lock);
+gint64 m3_now(void)
+{
+  GTimeVal tv;
 
-  rsp_msg->results_str = m3_gen_triple_string(added_str, param);
+  g_get_current_time(&tv);
+  return (gint64)tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
 
-  whiteboard_util_send_method_return(param->conn,
-				     param->msg,
-				     DBUS_TYPE_STRING, &(space_id),
-				     DBUS_TYPE_STRING, &(kp_id),
-				     DBUS_TYPE_INT32, &(tr_id),
-				     DBUS_TYPE_INT32, &(rsp_msg->status),
-				     DBUS_TYPE_STRING, &(rsp_msg->sub_id),
-				     DBUS_TYPE_STRING, &(rsp_msg->results_str),
-				     WHITEBOARD_UTIL_LIST_END);
+/*
+ * Whether the round of a pending subscription state waits for the
+ * minimum interval since its last indication. Called from the
+ * scheduler with subscriptions_lock held.
+ */
+gboolean m3_sub_delayed(subscription_state* sub, gint64 now)
+{
+  return (sub->status == M3_SUB_PENDING &&
+	  (sub->min_interval > 0 || sub->blocked) &&
+	  !sub->members_changed &&
+	  now < sub->next_round &&
+	  (sub->max_batch == 0 || sub->n_deltas < (guint)sub->max_batch));
+}
 
-  m3_free_triple_int_list(&(rsp_msg->results), current_result);
-  g_free(rsp_msg->results_str);
-  dbus_message_unref(param->msg);
-  ssFreeTripleList(&added_str);
+/*
+ * The m3_sub_advance_ functions bring the result of a subscription
+ * state up to date with the last round. The changes are returned as
+ * result strings for the indications, NULL if nothing changed, and
+ * the whole result in results_str if baseline is set.
+ */
+void m3_sub_advance_triples(subscription_state* sub, sib_data_structure* sib,
+			    gboolean baseline, gchar** results_str,
+			    gchar** new_results_str, gchar** obsolete_results_str)
+{
+  ssap_sib_message* rsp_msg = sub->op->rsp;
+  GSList *added = NULL, *removed = NULL, *added_str = NULL, *removed_str = NULL;
+  GSList *deltas = NULL, *all = NULL;
+  GHashTableIter iter;
+  m3_triple_int* t;
+  gboolean requeried;
 
-  do
+  if (!sub->evaluated)
     {
+      printf("Got baseline query result for subscription %s\n", sub->sub_id); /* SUB_DEBUG */
 
-      /* Check if unsubscribed */
-      g_mutex_lock(param->sib->subscriptions_lock);
-      sub_state = (subscription_state*)g_hash_table_lookup(param->sib->subs, sub_id);
-      g_mutex_unlock(param->sib->subscriptions_lock);
+      g_mutex_lock(sib->subscriptions_lock);
+      sub->requeried = FALSE;
+      g_mutex_unlock(sib->subscriptions_lock);
 
-      if (sub_state->status == M3_SUB_STOPPED)
-	{
-	  /* LOCK UNSUB LOCK */
-	  // g_mutex_lock(sub_state->unsub_lock);
-	  /* LOCK SUBSCRIPTION TABLE */
-	  g_mutex_lock(param->sib->subscriptions_lock);
-	  g_free(sub_state->sub_id);
-	  g_free(sub_state->kp_id);
-	  g_hash_table_remove(param->sib->subs, sub_id);
-	  sub_state->unsub = TRUE;
-	  g_cond_signal(sub_state->unsub_cond);
-	  /* UNLOCK SUBSCRIPTION TABLE */
-	  g_mutex_unlock(param->sib->subscriptions_lock);
-	  /* UNLOCK UNSUB LOCK */
-	  // g_mutex_unlock(sub_state->unsub_lock);
-	  g_hash_table_foreach_remove(current_result, m3_sub_free_int_triple, NULL);
-	  m3_free_triple_int_list(&(rsp_msg->results), NULL);
-	  break;
+      sub->current_result = m3_sub_result_init_triples(rsp_msg->results);
+      m3_free_triple_int_list(&(rsp_msg->results), sub->current_result);
+      sub->evaluated = TRUE;
+    }
+  else
+    {
+      printf("Got new query result for subscription %s\n", sub->sub_id); /* SUB_DEBUG */
+
+      /* Normally only the changes matched through the subscription
+	 index are applied, a full re-query result is diffed as before */
+      g_mutex_lock(sib->subscriptions_lock);
+      requeried = sub->requeried;
+      sub->requeried = FALSE;
+      if (!requeried)
+	{
+	  deltas = g_slist_reverse(sub->deltas);
+	  sub->deltas = NULL;
+	  sub->n_deltas = 0;
 	}
+      g_mutex_unlock(sib->subscriptions_lock);
 
-      g_async_queue_push(param->sib->query_queue, s);
-
-      g_mutex_lock(param->sib->subscriptions_lock);
-      sub_state = (subscription_state*)g_hash_table_lookup(param->sib->subs, sub_id);
-      g_mutex_unlock(param->sib->subscriptions_lock);
-
-      if (sub_state->status == M3_SUB_PENDING)
+      if (requeried)
 	{
-	  g_mutex_lock(param->sib->new_reqs_lock);
-	  param->sib->new_reqs = TRUE;
-	  g_cond_signal(param->sib->new_reqs_cond);
-	  g_mutex_unlock(param->sib->new_reqs_lock);
-	  printf("Subscription %s pending, setting new_reqs flag\n", rsp_msg->sub_id); /* SUB_DEBUG */
+	  sub->current_result = m3_sub_diff_triples(sub->current_result, rsp_msg->results, &added, &removed);
 	}
-
-      /* Block while operation is processed */
-      g_mutex_lock(s->op_lock);
-      while (!(s->op_complete))
+      else
 	{
-	  g_cond_wait(s->op_cond, s->op_lock);
+	  m3_sub_apply_deltas(sub->current_result, deltas, &added, &removed);
+	  m3_free_delta_list(&deltas);
 	}
-      s->op_complete = FALSE;
-      g_mutex_unlock(op_lock);
 
-      whiteboard_log_debug("Got new subscription result for transaction %d\n", tr_id);
-      printf("Got new query result for subscription %s\n", rsp_msg->sub_id); /* SUB_DEBUG */
-
-      current_result = m3_sub_diff_triples(current_result, rsp_msg->results, &added, &removed);
+      if (added != NULL || removed != NULL)
+	{
+	  added_str = m3_result_triples_to_str(sib, added, &(rsp_msg->status));
+	  *new_results_str = m3_gen_triple_string(added_str, NULL);
 
+	  removed_str = m3_result_triples_to_str(sib, removed, &(rsp_msg->status));
+	  *obsolete_results_str = m3_gen_triple_string(removed_str, NULL);
 
-      if (added == NULL && removed == NULL)
+	  ssFreeTripleList(&added_str);
+	  ssFreeTripleList(&removed_str);
+	}
+      else
 	{
-	  m3_free_triple_int_list(&(rsp_msg->results), current_result);
-	  printf("New result for subscription %s was not changed\n", rsp_msg->sub_id); /* SUB_DEBUG */
-	  whiteboard_log_debug("Subscription result was not changed for transaction %d\n", tr_id);
-	  continue;
+	  printf("New result for subscription %s was not changed\n", sub->sub_id); /* SUB_DEBUG */
 	}
 
-      g_mutex_lock(param->sib->store_lock);
-      added_str = m3_triple_list_int_to_str(added,
-					    param->sib->RDF_store,
-					    &(rsp_msg->status));
-      g_mutex_unlock(param->sib->store_lock);
-      rsp_msg->new_results_str = m3_gen_triple_string(added_str, param);
+      m3_free_triple_int_list(&added, sub->current_result);
+      m3_free_triple_int_list(&removed, sub->current_result);
+      m3_free_triple_int_list(&(rsp_msg->results), sub->current_result);
+    }
 
-      g_mutex_lock(param->sib->store_lock);
-      removed_str = m3_triple_list_int_to_str(removed,
-					      param->sib->RDF_store,
-					      &(rsp_msg->status));
-      g_mutex_unlock(param->sib->store_lock);
-      rsp_msg->obsolete_results_str = m3_gen_triple_string(removed_str, param);
-
-      if( ++(rsp_msg->ind_seqnum) == SSAP_IND_WRAP_NUM )
-	rsp_msg->ind_seqnum=1;
-
-      whiteboard_util_send_signal(SIB_DBUS_OBJECT,
-				  SIB_DBUS_KP_INTERFACE,
-				  SIB_DBUS_KP_SIGNAL_SUBSCRIPTION_IND,
-				  param->conn,
-				  DBUS_TYPE_STRING, &(header->space_id),
-				  DBUS_TYPE_STRING, &(header->kp_id),
-				  DBUS_TYPE_INT32, &(header->tr_id),
-				  DBUS_TYPE_INT32, &(rsp_msg->ind_seqnum),
-				  DBUS_TYPE_STRING, &(rsp_msg->sub_id),
-				  DBUS_TYPE_STRING, &(rsp_msg->new_results_str),
-				  DBUS_TYPE_STRING, &(rsp_msg->obsolete_results_str),
-				  WHITEBOARD_UTIL_LIST_END);
-
-      printf("Sent new result for sub %s, seqnum %d to transport\n",
-	     rsp_msg->sub_id, rsp_msg->ind_seqnum); /* SUB_DEBUG */
-      /* Free memory */
-      ssFreeTripleList(&added_str);
-      ssFreeTripleList(&removed_str);
+  if (baseline)
+    {
+      g_hash_table_iter_init(&iter, sub->current_result);
+      while(g_hash_table_iter_next(&iter, NULL, (gpointer*)&t))
+	{
+	  all = g_slist_prepend(all, t);
+	}
+      added_str = m3_result_triples_to_str(sib, all, &(rsp_msg->status));
+      *results_str = m3_gen_triple_string(added_str, NULL);
+      ssFreeTripleList(&added_str);
+      g_slist_free(all);
+    }
+}
+
+#if WITH_WQL==1
+void m3_sub_advance_nodes(subscription_state* sub, sib_data_structure* sib,
+			  gboolean baseline, gchar** results_str,
+			  gchar** new_results_str, gchar** obsolete_results_str)
+{
+  ssap_sib_message* rsp_msg = sub->op->rsp;
+  GSList *added = NULL;
+  GSList *removed = NULL;
+  GSList *added_str = NULL;
+  GSList *removed_str = NULL;
+  GSList *all = NULL;
+  GHashTableIter iter;
+  m3_node_int* n;
 
-      m3_free_triple_int_list(&added, current_result);
-      m3_free_triple_int_list(&removed, current_result);
-      m3_free_triple_int_list(&(rsp_msg->results), current_result);
+  if (!sub->evaluated)
+    {
+      sub->current_result = m3_sub_result_init_nodes(rsp_msg->results);
+      m3_free_node_int_list(&(rsp_msg->results), sub->current_result);
+      sub->evaluated = TRUE;
+    }
+  else
+    {
+      sub->current_result = m3_sub_diff_nodes(sub->current_result, rsp_msg->results, &added, &removed);
 
-      whiteboard_log_debug("Subscription result for transaction %d is\n%s\n%s\n", tr_id,
-			   rsp_msg->new_results_str,
-			   rsp_msg->obsolete_results_str);
+      if (added != NULL || removed != NULL)
+	{
+	  g_mutex_lock(sib->store_lock);
+	  added_str = m3_node_list_int_to_str(added,
+					      sib->RDF_store,
+					      &(rsp_msg->status));
+	  removed_str = m3_node_list_int_to_str(removed,
+						sib->RDF_store,
+						&(rsp_msg->status));
+	  g_mutex_unlock(sib->store_lock);
+	  *new_results_str = m3_gen_node_string(added_str, NULL);
+	  *obsolete_results_str = m3_gen_node_string(removed_str, NULL);
+
+	  ssFreePathNodeList(&added_str);
+	  ssFreePathNodeList(&removed_str);
+	}
 
-      g_free(rsp_msg->new_results_str);
-      g_free(rsp_msg->obsolete_results_str);
+      m3_free_node_int_list(&added, sub->current_result);
+      m3_free_node_int_list(&removed, sub->current_result);
+      m3_free_node_int_list(&(rsp_msg->results), sub->current_result);
     }
 
-  while(TRUE);
-  g_cond_free(op_cond);
-  g_mutex_free(op_lock);
-  g_free(s);
-  return ss_StatusOK;
+  if (baseline)
+    {
+      g_hash_table_iter_init(&iter, sub->current_result);
+      while(g_hash_table_iter_next(&iter, NULL, (gpointer*)&n))
+	{
+	  all = g_slist_prepend(all, n);
+	}
+      g_mutex_lock(sib->store_lock);
+      added_str = m3_node_list_int_to_str(all, sib->RDF_store, &(rsp_msg->status));
+      g_mutex_unlock(sib->store_lock);
+      *results_str = m3_gen_node_string(added_str, NULL);
+      ssFreePathNodeList(&added_str);
+      g_slist_free(all);
+    }
 }
 
-
-gint m3_subscribe_SPARQL(ssap_message_header *header,
-			 ssap_kp_message *req_msg,
-			 ssap_sib_message *rsp_msg,
-			 sib_op_parameter* param)
+void m3_sub_advance_bool(subscription_state* sub, sib_data_structure* sib,
+			 gboolean baseline, gchar** results_str,
+			 gchar** new_results_str, gchar** obsolete_results_str)
 {
-  GMutex* op_lock;
-  GCond* op_cond;
-  scheduler_item* s;
-
-  gchar *space_id, *kp_id;
-  gchar* sub_id = rsp_msg->sub_id;
-  gint tr_id;
-
-  GHashTable* current_result;
-  GSList *added = NULL, *removed = NULL, *added_str = NULL, *removed_str = NULL;
+  ssap_sib_message* rsp_msg = sub->op->rsp;
 
-  subscription_state *sub_state;
-
-  space_id = header->space_id;
-  kp_id = header->kp_id;
-  tr_id = header->tr_id;
+  if (sub->evaluated && sub->current_bool != rsp_msg->bool_results)
+    {
+      switch(rsp_msg->bool_results)
+	{
+	case true:
+	  *new_results_str = g_strdup("TRUE");
+	  *obsolete_results_str = g_strdup("FALSE");
+	  break;
+	case false:
+	  *new_results_str = g_strdup("FALSE");
+	  *obsolete_results_str = g_strdup("TRUE");
+	  break;
+	}
+    }
+  sub->current_bool = rsp_msg->bool_results;
+  sub->evaluated = TRUE;
 
-  s = g_new0(scheduler_item, 1);
-  op_lock = g_mutex_new();
-  op_cond = g_cond_new();
+  if (baseline)
+    {
+      if (sub->current_bool)
+	*results_str = g_strdup("TRUE");
+      else
+	*results_str = g_strdup("FALSE");
+    }
+}
+#endif /* WITH_WQL */
 
-  s->header = header;
-  s->req = req_msg;
-  s->rsp = rsp_msg;
-  s->op_lock = op_lock;
-  s->op_cond = op_cond;
-  s->op_complete = FALSE;
+/*
+ * Make the scheduler run a round for subscriptions set pending
+ */
+void m3_sub_wake_scheduler(sib_data_structure* sib)
+{
+  g_mutex_lock(sib->new_reqs_lock);
+  sib->new_reqs = TRUE;
+  g_cond_signal(sib->new_reqs_cond);
+  g_mutex_unlock(sib->new_reqs_lock);
+}
 
+/*
+ * Queue a subscription for the next scheduler round
+ */
+void m3_sub_requeue(subscription_state* sub, sib_data_structure* sib)
+{
+  gboolean wake;
 
-  g_async_queue_push(param->sib->query_queue, s);
+  g_async_queue_push(sib->query_queue, sub->op);
 
-  /* Signal scheduler that new operation has been added to queue */
-  g_mutex_lock(param->sib->new_reqs_lock);
-  param->sib->new_reqs = TRUE;
-  // printf("Now signaling SCHEDULER in SUBSCRIBE tr %d\n", header->tr_id);
-  g_cond_signal(param->sib->new_reqs_cond);
-  g_mutex_unlock(param->sib->new_reqs_lock);
+  g_mutex_lock(sib->subscriptions_lock);
+  wake = (sub->status != M3_SUB_ONGOING);
+  g_mutex_unlock(sib->subscriptions_lock);
 
-  /* Block while operation is being processed */
-  g_mutex_lock(s->op_lock);
-  while (!(s->op_complete))
+  if (wake)
     {
-      g_cond_wait(s->op_cond, s->op_lock);
+      m3_sub_wake_scheduler(sib);
+      printf("Subscription %s pending, setting new_reqs flag\n", sub->sub_id); /* SUB_DEBUG */
     }
-  s->op_complete = FALSE;
-  g_mutex_unlock(op_lock);
-
-  current_result = m3_sub_result_init_triples(rsp_msg->results);
-
-  g_mutex_lock(param->sib->store_lock);
-  added_str = m3_triple_list_int_to_str(rsp_msg->results, param->sib->RDF_store, &(rsp_msg->status));
-  g_mutex_unlock(param->sib->store_lock);
+}
 
-  rsp_msg->results_str = m3_gen_triple_string(added_str, param);
+/*
+ * Flow control of indications. A member whose transport is behind
+ * gets its indications held back and, when too many are held, one
+ * net delta between the result it last got and the current result
+ * once the transport has caught up. A stalled KP thus costs at most
+ * a copy of the result and SIB_SUB_MAX_PENDING indications.
+ */
 
-  whiteboard_util_send_method_return(param->conn,
-				     param->msg,
-				     DBUS_TYPE_STRING, &(space_id),
-				     DBUS_TYPE_STRING, &(kp_id),
-				     DBUS_TYPE_INT32, &(tr_id),
-				     DBUS_TYPE_INT32, &(rsp_msg->status),
-				     DBUS_TYPE_STRING, &(rsp_msg->sub_id),
-				     DBUS_TYPE_STRING, &(rsp_msg->results_str),
-				     WHITEBOARD_UTIL_LIST_END);
+/* An indication held back for a member */
+typedef struct {
+  gchar* new_results_str;
+  gchar* obsolete_results_str;
+} m3_sub_indication;
 
-  m3_free_triple_int_list(&(rsp_msg->results), current_result);
-  g_free(rsp_msg->results_str);
-  dbus_message_unref(param->msg);
-  ssFreeTripleList(&added_str);
+/* Bytes sent to the transport of param but not yet written */
+gsize m3_transport_backlog(sib_op_parameter* param)
+{
+  if (NULL != param->ssap)
+    return sib_ssap_connection_backlog(param->ssap);
+  return (gsize)dbus_connection_get_outgoing_size(param->conn);
+}
 
-  do
-    {
+void m3_triple_int_free(gpointer data)
+{
+  m3_triple_int* t = (m3_triple_int*)data;
+  g_free(t->lang);
+  g_free(t);
+}
 
-      /* Check if unsubscribed */
-      g_mutex_lock(param->sib->subscriptions_lock);
-      sub_state = (subscription_state*)g_hash_table_lookup(param->sib->subs, sub_id);
-      g_mutex_unlock(param->sib->subscriptions_lock);
+#if WITH_WQL==1
+void m3_node_int_free(gpointer data)
+{
+  m3_node_int* n = (m3_node_int*)data;
+  g_free(n->lang);
+  g_free(n);
+}
+#endif /* WITH_WQL */
 
-      if (sub_state->status == M3_SUB_STOPPED)
-	{
-	  /* LOCK SUBSCRIPTION TABLE */
-	  g_mutex_lock(param->sib->subscriptions_lock);
-	  g_free(sub_state->sub_id);
-	  g_free(sub_state->kp_id);
-	  g_hash_table_remove(param->sib->subs, sub_id);
-	  sub_state->unsub = TRUE;
-	  g_cond_signal(sub_state->unsub_cond);
-	  /* UNLOCK SUBSCRIPTION TABLE */
-	  g_mutex_unlock(param->sib->subscriptions_lock);
-	  g_hash_table_foreach_remove(current_result, m3_sub_free_int_triple, NULL);
-	  m3_free_triple_int_list(&(rsp_msg->results), NULL);
-	  break;
-	}
+void m3_sub_indication_free(gpointer data)
+{
+  m3_sub_indication* ind = (m3_sub_indication*)data;
+  g_free(ind->new_results_str);
+  g_free(ind->obsolete_results_str);
+  g_free(ind);
+}
 
-      g_async_queue_push(param->sib->query_queue, s);
+void m3_sub_send_indication(subscription_member* member,
+			    gchar* new_results_str, gchar* obsolete_results_str)
+{
+  if( ++(member->ind_seqnum) == SSAP_IND_WRAP_NUM )
+    member->ind_seqnum=1;
+
+  m3_send_indication(member->param,
+		     DBUS_TYPE_STRING, &(member->space_id),
+		     DBUS_TYPE_STRING, &(member->kp_id),
+		     DBUS_TYPE_INT32, &(member->tr_id),
+		     DBUS_TYPE_INT32, &(member->ind_seqnum),
+		     DBUS_TYPE_STRING, &(member->sub_id),
+		     DBUS_TYPE_STRING, &new_results_str,
+		     DBUS_TYPE_STRING, &obsolete_results_str,
+		     DBUS_TYPE_INVALID);
+}
 
-      g_mutex_lock(param->sib->subscriptions_lock);
-      sub_state = (subscription_state*)g_hash_table_lookup(param->sib->subs, sub_id);
-      g_mutex_unlock(param->sib->subscriptions_lock);
+/*
+ * Keep the result of sub, as the member last got it, as the base of
+ * a net delta
+ */
+void m3_sub_base_new(subscription_state* sub, subscription_member* member)
+{
+  GHashTableIter iter;
+  m3_triple_int *t, *c;
+#if WITH_WQL==1
+  m3_node_int *n, *nc;
+#endif /* WITH_WQL */
 
-      if (sub_state->status == M3_SUB_PENDING)
+  switch (sub->type)
+    {
+    case QueryTypeTemplate:
+      member->lag_base = g_hash_table_new_full(m3_triple_int_hash, m3_triple_int_equal,
+					       NULL, m3_triple_int_free);
+      g_hash_table_iter_init(&iter, sub->current_result);
+      while(g_hash_table_iter_next(&iter, NULL, (gpointer*)&t))
 	{
-	  g_mutex_lock(param->sib->new_reqs_lock);
-	  param->sib->new_reqs = TRUE;
-	  g_cond_signal(param->sib->new_reqs_cond);
-	  g_mutex_unlock(param->sib->new_reqs_lock);
+	  c = g_new0(m3_triple_int, 1);
+	  c->s = t->s;
+	  c->p = t->p;
+	  c->o = t->o;
+	  c->dt = t->dt;
+	  c->lang = g_strdup(t->lang);
+	  g_hash_table_insert(member->lag_base, c, c);
 	}
-
-      /* Block while operation is processed */
-      g_mutex_lock(s->op_lock);
-      while (!(s->op_complete))
+      break;
+#if WITH_WQL==1
+    case QueryTypeWQLValues:
+      member->lag_base = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+					       NULL, m3_node_int_free);
+      g_hash_table_iter_init(&iter, sub->current_result);
+      while(g_hash_table_iter_next(&iter, NULL, (gpointer*)&n))
 	{
-	  g_cond_wait(s->op_cond, s->op_lock);
+	  nc = g_new0(m3_node_int, 1);
+	  nc->node = n->node;
+	  nc->dt = n->dt;
+	  nc->lang = g_strdup(n->lang);
+	  g_hash_table_insert(member->lag_base, GINT_TO_POINTER(nc->node), nc);
 	}
-      s->op_complete = FALSE;
-      g_mutex_unlock(op_lock);
+      break;
+#endif /* WITH_WQL */
+    default:
+      member->lag_base_bool = sub->current_bool;
+      break;
+    }
+}
 
-      whiteboard_log_debug("Got new subscription result for transaction %d\n", tr_id);
+void m3_sub_base_free(subscription_member* member)
+{
+  if (NULL != member->lag_base)
+    g_hash_table_destroy(member->lag_base);
+  member->lag_base = NULL;
+}
 
-      current_result = m3_sub_diff_triples(current_result, rsp_msg->results, &added, &removed);
+/*
+ * Render the net delta between the base of a member and the current
+ * result of sub, NULL strings if there is none
+ */
+void m3_sub_render_net(subscription_state* sub, sib_data_structure* sib,
+		       subscription_member* member,
+		       gchar** new_results_str, gchar** obsolete_results_str)
+{
+  ssStatus_t status = ss_StatusOK;
+  GHashTableIter iter;
+  GSList *added = NULL, *removed = NULL, *added_str = NULL, *removed_str = NULL;
+  gpointer key, value;
 
+  switch (sub->type)
+    {
+    case QueryTypeTemplate:
+#if WITH_WQL==1
+    case QueryTypeWQLValues:
+#endif /* WITH_WQL */
+      g_hash_table_iter_init(&iter, sub->current_result);
+      while(g_hash_table_iter_next(&iter, &key, &value))
+	if (NULL == g_hash_table_lookup(member->lag_base, key))
+	  added = g_slist_prepend(added, value);
+      g_hash_table_iter_init(&iter, member->lag_base);
+      while(g_hash_table_iter_next(&iter, &key, &value))
+	if (NULL == g_hash_table_lookup(sub->current_result, key))
+	  removed = g_slist_prepend(removed, value);
+      if (NULL == added && NULL == removed)
+	break;
 
-      if (added == NULL && removed == NULL)
+#if WITH_WQL==1
+      if (sub->type == QueryTypeWQLValues)
 	{
-	  m3_free_triple_int_list(&(rsp_msg->results), current_result);
-	  whiteboard_log_debug("Subscription result was not changed for transaction %d\n", tr_id);
-	  continue;
+	  g_mutex_lock(sib->store_lock);
+	  added_str = m3_node_list_int_to_str(added, sib->RDF_store, &status);
+	  removed_str = m3_node_list_int_to_str(removed, sib->RDF_store, &status);
+	  g_mutex_unlock(sib->store_lock);
+	  *new_results_str = m3_gen_node_string(added_str, NULL);
+	  *obsolete_results_str = m3_gen_node_string(removed_str, NULL);
+	  ssFreePathNodeList(&added_str);
+	  ssFreePathNodeList(&removed_str);
+	  break;
 	}
-
-      g_mutex_lock(param->sib->store_lock);
-      added_str = m3_triple_list_int_to_str(added,
-					    param->sib->RDF_store,
-					    &(rsp_msg->status));
-      g_mutex_unlock(param->sib->store_lock);
-      rsp_msg->new_results_str = m3_gen_triple_string(added_str, param);
-
-      g_mutex_lock(param->sib->store_lock);
-      removed_str = m3_triple_list_int_to_str(removed,
-					      param->sib->RDF_store,
-					      &(rsp_msg->status));
-      g_mutex_unlock(param->sib->store_lock);
-      rsp_msg->obsolete_results_str = m3_gen_triple_string(removed_str, param);
-
-      whiteboard_util_send_signal(SIB_DBUS_OBJECT,
-				  SIB_DBUS_KP_INTERFACE,
-				  SIB_DBUS_KP_SIGNAL_SUBSCRIPTION_IND,
-				  param->conn,
-				  DBUS_TYPE_STRING, &(header->space_id),
-				  DBUS_TYPE_STRING, &(header->kp_id),
-				  DBUS_TYPE_INT32, &(header->tr_id),
-				  DBUS_TYPE_STRING, &(rsp_msg->sub_id),
-				  DBUS_TYPE_STRING, &(rsp_msg->new_results_str),
-				  DBUS_TYPE_STRING, &(rsp_msg->obsolete_results_str),
-				  WHITEBOARD_UTIL_LIST_END);
-
-      /* Free memory */
+#endif /* WITH_WQL */
+      added_str = m3_result_triples_to_str(sib, added, &status);
+      *new_results_str = m3_gen_triple_string(added_str, NULL);
+      removed_str = m3_result_triples_to_str(sib, removed, &status);
+      *obsolete_results_str = m3_gen_triple_string(removed_str, NULL);
       ssFreeTripleList(&added_str);
       ssFreeTripleList(&removed_str);
-
-      m3_free_triple_int_list(&added, current_result);
-      m3_free_triple_int_list(&removed, current_result);
-      m3_free_triple_int_list(&(rsp_msg->results), current_result);
-
-      whiteboard_log_debug("Subscription result for transaction %d is\n%s\n%s\n", tr_id,
-			   rsp_msg->new_results_str,
-			   rsp_msg->obsolete_results_str);
-
-      g_free(rsp_msg->new_results_str);
-      g_free(rsp_msg->obsolete_results_str);
+      break;
+    default:
+      if (member->lag_base_bool != sub->current_bool)
+	{
+	  *new_results_str = g_strdup(sub->current_bool ? "TRUE" : "FALSE");
+	  *obsolete_results_str = g_strdup(sub->current_bool ? "FALSE" : "TRUE");
+	}
+      break;
     }
-
-  while(TRUE);
-  g_cond_free(op_cond);
-  g_mutex_free(op_lock);
-  g_free(s);
-  return ss_StatusOK;
+  g_slist_free(added);
+  g_slist_free(removed);
 }
 
-#if WITH_WQL==1
-gint m3_subscribe_nodes(ssap_message_header *header,
-			ssap_kp_message *req_msg,
-			ssap_sib_message *rsp_msg,
-			sib_op_parameter* param)
+/*
+ * Hold back the indication of the round for a member that is behind
+ */
+void m3_sub_hold(subscription_member* member,
+		 gchar* new_results_str, gchar* obsolete_results_str)
 {
-  GMutex* op_lock;
-  GCond* op_cond;
-  scheduler_item* s;
+  m3_sub_indication* ind;
 
-  gchar *space_id;
-  gchar *kp_id;
-  gchar* sub_id = rsp_msg->sub_id;
-  gint tr_id;
+  if (member->lagging)
+    return;
 
-  GHashTable* current_result;
-  GSList *added = NULL;
-  GSList *removed = NULL;
-  GSList *added_str = NULL;
-  GSList *removed_str = NULL;
-  subscription_state* sub_state;
+  if (g_queue_get_length(member->pending) < SIB_SUB_MAX_PENDING)
+    {
+      ind = g_new0(m3_sub_indication, 1);
+      ind->new_results_str = g_strdup(new_results_str);
+      ind->obsolete_results_str = g_strdup(obsolete_results_str);
+      g_queue_push_tail(member->pending, ind);
+      whiteboard_log_debug("Subscription %s is behind, %d indications held\n",
+			   member->sub_id, g_queue_get_length(member->pending));
+      return;
+    }
 
-  space_id = header->space_id;
-  kp_id = header->kp_id;
-  tr_id = header->tr_id;
+  /* Sent as one net delta from the base instead */
+  whiteboard_log_warning("Subscription %s is behind, merging %d held indications\n",
+			 member->sub_id, g_queue_get_length(member->pending));
+  while (!g_queue_is_empty(member->pending))
+    m3_sub_indication_free(g_queue_pop_head(member->pending));
+  member->lagging = TRUE;
+}
 
-  s = g_new0(scheduler_item, 1);
-  op_lock = g_mutex_new();
-  op_cond = g_cond_new();
+/*
+ * Send a member what was held back for it, and the indication of the
+ * round unless a net delta already includes it
+ */
+void m3_sub_catch_up(subscription_state* sub, sib_data_structure* sib,
+		     subscription_member* member,
+		     gchar* new_results_str, gchar* obsolete_results_str)
+{
+  m3_sub_indication* ind;
+  gchar *net_new = NULL, *net_obsolete = NULL;
 
-  s->header = header;
-  s->req = req_msg;
-  s->rsp = rsp_msg;
-  s->op_lock = op_lock;
-  s->op_cond = op_cond;
-  s->op_complete = FALSE;
+  if (member->lagging)
+    {
+      m3_sub_render_net(sub, sib, member, &net_new, &net_obsolete);
+      if (NULL != net_new)
+	m3_sub_send_indication(member, net_new, net_obsolete);
+      g_free(net_new);
+      g_free(net_obsolete);
+      member->lagging = FALSE;
+      whiteboard_log_warning("Subscription %s has caught up\n", member->sub_id);
+      return;
+    }
 
-  g_async_queue_push(param->sib->query_queue, s);
+  while (NULL != (ind = (m3_sub_indication*)g_queue_pop_head(member->pending)))
+    {
+      m3_sub_send_indication(member, ind->new_results_str, ind->obsolete_results_str);
+      m3_sub_indication_free(ind);
+    }
+  if (NULL != new_results_str)
+    m3_sub_send_indication(member, new_results_str, obsolete_results_str);
+}
 
-  /* Signal scheduler that new operation has been added to queue */
-  g_mutex_lock(param->sib->new_reqs_lock);
-  param->sib->new_reqs = TRUE;
-  g_cond_signal(param->sib->new_reqs_cond);
-  g_mutex_unlock(param->sib->new_reqs_lock);
+/*
+ * Free a subscription state and everything it holds. The state must
+ * already be out of sib->sub_groups and the subscription index and
+ * have no members left.
+ */
+void m3_sub_free(subscription_state* sub)
+{
+  ssap_message_header* header = sub->op->header;
+  ssap_kp_message* req_msg = sub->op->req;
+  ssap_sib_message* rsp_msg = sub->op->rsp;
 
+  /* Results of the last round were not yet merged to current_result */
+  switch (sub->type)
+    {
+    case QueryTypeTemplate:
+      ssFreeTripleList(&(req_msg->template_query));
+      m3_free_triple_int_list(&(rsp_msg->results), sub->current_result);
+      break;
+#if WITH_WQL==1
+    case QueryTypeWQLValues:
+      m3_free_node_int_list(&(rsp_msg->results), sub->current_result);
+      /* FALLTHROUGH */
+    case QueryTypeWQLRelated:
+    case QueryTypeWQLIsType:
+    case QueryTypeWQLIsSubType:
+      if (NULL != req_msg->wql_query)
+	ssWqlDesc_free(&(req_msg->wql_query));
+      break;
+#endif /* WITH_WQL */
+    default:
+      break;
+    }
 
-  /* Block while operation is processed */
-  g_mutex_lock(s->op_lock);
-  while (!(s->op_complete))
+  if (NULL != sub->current_result)
     {
-      g_cond_wait(s->op_cond, s->op_lock);
+#if WITH_WQL==1
+      if (sub->type != QueryTypeTemplate)
+	g_hash_table_foreach_remove(sub->current_result, m3_sub_free_int_node, NULL);
+      else
+#endif /* WITH_WQL */
+	g_hash_table_foreach_remove(sub->current_result, m3_sub_free_int_triple, NULL);
+      g_hash_table_destroy(sub->current_result);
     }
-  s->op_complete = FALSE;
-  g_mutex_unlock(op_lock);
 
-  current_result = m3_sub_result_init_nodes(rsp_msg->results);
+  m3_free_triple_int_list(&(sub->patterns), NULL);
+  m3_free_delta_list(&(sub->deltas));
+
+  g_free(rsp_msg->sub_id);
+  g_free(rsp_msg);
+  g_free(req_msg);
+  g_free(header->space_id);
+  g_free(header->kp_id);
+  g_free(header);
+  g_free(sub->op);
+  g_free(sub->sub_id);
+  g_free(sub->key);
+  g_free(sub);
+}
 
-  g_mutex_lock(param->sib->store_lock);
-  added_str = m3_node_list_int_to_str(rsp_msg->results, param->sib->RDF_store, &(rsp_msg->status));
-  g_mutex_unlock(param->sib->store_lock);
+void m3_sub_member_free(subscription_member* member)
+{
+  while (!g_queue_is_empty(member->pending))
+    m3_sub_indication_free(g_queue_pop_head(member->pending));
+  g_queue_free(member->pending);
+  m3_sub_base_free(member);
+  m3_param_free(member->param);
+  g_free(member->sub_id);
+  g_free(member->space_id);
+  g_free(member->kp_id);
+  /* The header points into the unsubscribe request */
+  g_free(member->unsub_header);
+  if (NULL != member->unsub_param)
+    m3_param_free(member->unsub_param);
+  g_free(member);
+}
 
-  rsp_msg->results_str = m3_gen_node_string(added_str, param);
+/*
+ * Remove a stopped member, already out of its state, and answer the
+ * unsubscribe request that stopped it
+ */
+void m3_sub_member_finish(subscription_member* member, sib_data_structure* sib)
+{
+  ssStatus_t status = ss_StatusOK;
 
-  whiteboard_util_send_method_return(param->conn,
-				     param->msg,
-				     DBUS_TYPE_STRING, &(space_id),
-				     DBUS_TYPE_STRING, &(kp_id),
-				     DBUS_TYPE_INT32, &(tr_id),
-				     DBUS_TYPE_INT32, &(rsp_msg->status),
-				     DBUS_TYPE_STRING, &(rsp_msg->sub_id),
-				     DBUS_TYPE_STRING, &(rsp_msg->results_str),
-				     WHITEBOARD_UTIL_LIST_END);
+  printf("SUBSCRIBE: subscription %s finished \n", member->sub_id);
 
-  dbus_message_unref(param->msg);
-  g_free(rsp_msg->results_str);
-  ssFreePathNodeList(&added_str);
+  g_mutex_lock(sib->subscriptions_lock);
+  g_hash_table_remove(sib->subs, member->sub_id);
+  g_mutex_unlock(sib->subscriptions_lock);
 
-  do
+  if (NULL != member->unsub_param)
     {
-      /* Check if unsubscribed */
-      g_mutex_lock(param->sib->subscriptions_lock);
-      sub_state = (subscription_state*)g_hash_table_lookup(param->sib->subs, sub_id);
-      g_mutex_unlock(param->sib->subscriptions_lock);
+      m3_send_return(member->unsub_param,
+		     DBUS_TYPE_STRING, &(member->unsub_header->space_id),
+		     DBUS_TYPE_STRING, &(member->unsub_header->kp_id),
+		     DBUS_TYPE_INT32, &(member->unsub_header->tr_id),
+		     DBUS_TYPE_INT32, &status,
+		     DBUS_TYPE_STRING, &(member->sub_id),
+		     DBUS_TYPE_INVALID);
+      printf("UNSUBSCRIBE: Sent unsub cnf for sub id %s\n", member->sub_id);
+    }
+  m3_sub_member_free(member);
+}
 
-      if (sub_state->status == M3_SUB_STOPPED)
-	{
-	  // g_mutex_lock(sub_state->unsub_lock);
-	  g_mutex_lock(param->sib->subscriptions_lock);
-	  g_free(sub_state->sub_id);
-	  g_free(sub_state->kp_id);
-	  g_hash_table_remove(param->sib->subs, sub_id);
-	  sub_state->unsub = TRUE;
-	  g_cond_signal(sub_state->unsub_cond);
-	  g_mutex_unlock(param->sib->subscriptions_lock);
-	  // g_mutex_unlock(sub_state->unsub_lock);
-	  g_hash_table_foreach_remove(current_result, m3_sub_free_int_node, NULL);
-	  m3_free_node_int_list(&(rsp_msg->results), NULL);
-	  break;
-	}
+/*
+ * Remove a stopped subscription state whose last member has left
+ */
+void m3_sub_finish(subscription_state* sub, sib_data_structure* sib)
+{
+  g_mutex_lock(sib->subscriptions_lock);
+  sib_sub_index_remove(sib->sub_index, sub->patterns, sub);
+  if (sub == g_hash_table_lookup(sib->sub_groups, sub->key))
+    g_hash_table_remove(sib->sub_groups, sub->key);
+  g_mutex_unlock(sib->subscriptions_lock);
+
+  printf("SUBSCRIBE: evaluation of %s finished \n", sub->sub_id);
+  m3_sub_free(sub);
+}
 
-      g_async_queue_push(param->sib->query_queue, s);
+/*
+ * Completion callback of subscription scheduler items, run in the
+ * completion pool after the scheduler has processed the item
+ */
+void m3_sub_advance(scheduler_item* op, sib_data_structure* sib)
+{
+  subscription_state* sub = (subscription_state*)op->complete_data;
+  ssap_sib_message* rsp_msg = op->rsp;
+  subscription_member* member;
+  GSList *unanswered = NULL, *listeners = NULL, *finished = NULL;
+  GSList *l, *next;
+  gchar *results_str = NULL;
+  gchar *new_results_str = NULL;
+  gchar *obsolete_results_str = NULL;
+  gboolean stopped;
+  gboolean sent = FALSE;
+  gboolean blocked = FALSE;
+
+  /* Members joining from now on are answered in the next round */
+  g_mutex_lock(sib->subscriptions_lock);
+  sub->members_changed = FALSE;
+  for (l = sub->members; l != NULL; l = l->next)
+    {
+      member = (subscription_member*)l->data;
+      if (!member->answered)
+	unanswered = g_slist_prepend(unanswered, member);
+      else if (!member->stopped)
+	listeners = g_slist_prepend(listeners, member);
+    }
+  g_mutex_unlock(sib->subscriptions_lock);
 
-      g_mutex_lock(param->sib->subscriptions_lock);
-      sub_state = (subscription_state*)g_hash_table_lookup(param->sib->subs, sub_id);
-      g_mutex_unlock(param->sib->subscriptions_lock);
+  /* The base of a member that is behind is the result before the round */
+  for (l = listeners; l != NULL; l = l->next)
+    {
+      member = (subscription_member*)l->data;
+      member->behind = (m3_transport_backlog(member->param) > SIB_SUB_MAX_BACKLOG);
+      if (member->behind && !member->lagging && g_queue_is_empty(member->pending))
+	m3_sub_base_new(sub, member);
+    }
 
-      if (sub_state->status == M3_SUB_PENDING)
-	{
-	  g_mutex_lock(param->sib->new_reqs_lock);
-	  param->sib->new_reqs = TRUE;
-	  g_cond_signal(param->sib->new_reqs_cond);
-	  g_mutex_unlock(param->sib->new_reqs_lock);
-	}
+  /* One evaluation for all members */
+  switch (sub->type)
+    {
+    case QueryTypeTemplate:
+      m3_sub_advance_triples(sub, sib, (NULL != unanswered), &results_str,
+			     &new_results_str, &obsolete_results_str);
+      break;
+#if WITH_WQL==1
+    case QueryTypeWQLValues:
+      m3_sub_advance_nodes(sub, sib, (NULL != unanswered), &results_str,
+			   &new_results_str, &obsolete_results_str);
+      break;
+    case QueryTypeWQLRelated:
+    case QueryTypeWQLIsType:
+    case QueryTypeWQLIsSubType:
+      m3_sub_advance_bool(sub, sib, (NULL != unanswered), &results_str,
+			  &new_results_str, &obsolete_results_str);
+      break;
+#endif /* WITH_WQL */
+    default:
+      break;
+    }
 
-      /* Block while operation is processed */
-      g_mutex_lock(s->op_lock);
-      while (!(s->op_complete))
-	{
-	  g_cond_wait(s->op_cond, s->op_lock);
-	}
-      s->op_complete = FALSE;
-      g_mutex_unlock(op_lock);
+  /* The subscribe requests are always answered, indications are not
+     sent any more after unsubscribe */
+  for (l = unanswered; l != NULL; l = l->next)
+    {
+      member = (subscription_member*)l->data;
+      m3_send_return(member->param,
+		     DBUS_TYPE_STRING, &(member->space_id),
+		     DBUS_TYPE_STRING, &(member->kp_id),
+		     DBUS_TYPE_INT32, &(member->tr_id),
+		     DBUS_TYPE_INT32, &(rsp_msg->status),
+		     DBUS_TYPE_STRING, &(member->sub_id),
+		     DBUS_TYPE_STRING, &results_str,
+		     DBUS_TYPE_INVALID);
+      dbus_message_unref(member->param->msg);
+      member->param->msg = NULL;
+      member->answered = TRUE;
+    }
+
+  for (l = listeners; l != NULL; l = l->next)
+    {
+      member = (subscription_member*)l->data;
+      if (!member->behind)
+	m3_sub_catch_up(sub, sib, member, new_results_str, obsolete_results_str);
+      else if (NULL != new_results_str)
+	m3_sub_hold(member, new_results_str, obsolete_results_str);
+
+      if (member->lagging || !g_queue_is_empty(member->pending))
+	blocked = TRUE;
+      else
+	m3_sub_base_free(member);
+    }
+  if (NULL != new_results_str)
+    {
+      printf("Sent new result for sub %s to %d members\n",
+	     sub->sub_id, g_slist_length(listeners)); /* SUB_DEBUG */
+      sent = (NULL != listeners);
+    }
 
-      current_result = m3_sub_diff_nodes(current_result, rsp_msg->results, &added, &removed);
+  g_slist_free(unanswered);
+  g_slist_free(listeners);
+  g_free(results_str);
+  g_free(new_results_str);
+  g_free(obsolete_results_str);
 
-      if (added == NULL && removed == NULL)
+  /* Stopped members leave once answered, the state stops with the
+     last of them */
+  g_mutex_lock(sib->subscriptions_lock);
+  for (l = sub->members; l != NULL; l = next)
+    {
+      next = l->next;
+      member = (subscription_member*)l->data;
+      member->n_pending_seen = g_queue_get_length(member->pending);
+      member->lagging_seen = member->lagging;
+      if (member->stopped && member->answered)
 	{
-	  m3_free_node_int_list(&(rsp_msg->results), current_result);
-	  continue;
+	  sub->members = g_slist_delete_link(sub->members, l);
+	  finished = g_slist_prepend(finished, member);
 	}
-
-      g_mutex_lock(param->sib->store_lock);
-      added_str = m3_node_list_int_to_str(added,
-					  param->sib->RDF_store,
-					  &(rsp_msg->status));
-      g_mutex_unlock(param->sib->store_lock);
-      rsp_msg->new_results_str = m3_gen_node_string(added_str, param);
-
-      g_mutex_lock(param->sib->store_lock);
-      removed_str = m3_node_list_int_to_str(removed,
-					    param->sib->RDF_store,
-					    &(rsp_msg->status));
-      g_mutex_unlock(param->sib->store_lock);
-      rsp_msg->obsolete_results_str = m3_gen_node_string(removed_str, param);
-      if( ++(rsp_msg->ind_seqnum) == SSAP_IND_WRAP_NUM )
-	    rsp_msg->ind_seqnum=1;
-
-      whiteboard_util_send_signal(SIB_DBUS_OBJECT,
-				  SIB_DBUS_KP_INTERFACE,
-				  SIB_DBUS_KP_SIGNAL_SUBSCRIPTION_IND,
-				  param->conn,
-				  DBUS_TYPE_STRING, &(header->space_id),
-				  DBUS_TYPE_STRING, &(header->kp_id),
-				  DBUS_TYPE_INT32, &(header->tr_id),
-				  DBUS_TYPE_INT32, &(rsp_msg->ind_seqnum),
-				  DBUS_TYPE_STRING, &(rsp_msg->sub_id),
-				  DBUS_TYPE_STRING, &(rsp_msg->new_results_str),
-				  DBUS_TYPE_STRING, &(rsp_msg->obsolete_results_str),
-				  WHITEBOARD_UTIL_LIST_END);
-
-      ssFreePathNodeList(&added_str);
-      ssFreePathNodeList(&removed_str);
-
-      m3_free_node_int_list(&added, current_result);
-      m3_free_node_int_list(&removed, current_result);
-      m3_free_node_int_list(&(rsp_msg->results), current_result);
-
-      g_free(rsp_msg->new_results_str);
-      g_free(rsp_msg->obsolete_results_str);
-
     }
-  while(TRUE);
-
+  stopped = (sub->status == M3_SUB_STOPPED && NULL == sub->members);
+  /* The changes until the next round collect and cancel out */
+  if (sent && sub->min_interval > 0)
+    sub->next_round = m3_now() + (gint64)sub->min_interval * 1000;
+  /* Held indications are tried again after a while */
+  sub->blocked = (blocked && !stopped);
+  if (sub->blocked)
+    {
+      sub->next_round = MAX(sub->next_round,
+			    m3_now() + (gint64)SIB_SUB_RETRY_INTERVAL * 1000);
+      if (sub->status == M3_SUB_ONGOING)
+	sub->status = M3_SUB_PENDING;
+    }
+  g_mutex_unlock(sib->subscriptions_lock);
 
-  g_mutex_free(op_lock);
-  g_cond_free(op_cond);
+  for (l = finished; l != NULL; l = l->next)
+    m3_sub_member_finish((subscription_member*)l->data, sib);
+  g_slist_free(finished);
 
-  g_free(s);
-  return ss_StatusOK;
+  if (stopped)
+    m3_sub_finish(sub, sib);
+  else
+    m3_sub_requeue(sub, sib);
 }
 
-gint m3_subscribe_bool(ssap_message_header *header,
-		       ssap_kp_message *req_msg,
-		       ssap_sib_message *rsp_msg,
-		       sib_op_parameter* param)
+gchar* m3_sub_status(sib_data_structure* sib)
 {
-  GMutex* op_lock;
-  GCond* op_cond;
-  scheduler_item* s;
-
-  gchar *space_id, *kp_id;
-  gchar* sub_id = rsp_msg->sub_id;
-  gint tr_id;
-
-  gint current_result_bool;
-  /* gint new_result_bool, added_bool, removed_bool;*/
-
-  subscription_state* sub_state;
-
-  space_id = header->space_id;
-  kp_id = header->kp_id;
-  tr_id = header->tr_id;
-
-  s = g_new0(scheduler_item, 1);
-  op_lock = g_mutex_new();
-  op_cond = g_cond_new();
-
-  s->header = header;
-  s->req = req_msg;
-  s->rsp = rsp_msg;
-  s->op_lock = op_lock;
-  s->op_cond = op_cond;
-  s->op_complete = FALSE;
-
-  g_async_queue_push(param->sib->query_queue, s);
-
-  /* Signal scheduler that new operation has been added to queue */
-  g_mutex_lock(param->sib->new_reqs_lock);
-  param->sib->new_reqs = TRUE;
-  g_cond_signal(param->sib->new_reqs_cond);
-  g_mutex_unlock(param->sib->new_reqs_lock);
-
-  /* Block while operation is being processed */
-  g_mutex_lock(s->op_lock);
-  while (!(s->op_complete))
-    {
-      g_cond_wait(s->op_cond, s->op_lock);
-    }
-  s->op_complete = FALSE;
-  g_mutex_unlock(op_lock);
-
-  current_result_bool = rsp_msg->bool_results;
-
-  if (rsp_msg->bool_results)
-    rsp_msg->results_str = g_strdup("TRUE");
-  else
-    rsp_msg->results_str = g_strdup("FALSE");
-
-  whiteboard_util_send_method_return(param->conn,
-				     param->msg,
-				     DBUS_TYPE_STRING, &(space_id),
-				     DBUS_TYPE_STRING, &(kp_id),
-				     DBUS_TYPE_INT32, &(tr_id),
-				     DBUS_TYPE_INT32, &(rsp_msg->status),
-				     DBUS_TYPE_STRING, &(rsp_msg->sub_id),
-				     DBUS_TYPE_STRING, &(rsp_msg->results_str),
-				     WHITEBOARD_UTIL_LIST_END);
-  dbus_message_unref(param->msg);
-  g_free(rsp_msg->results_str);
-
-
-  do
-    {
-
-      /* Check if unsubscribed */
-      g_mutex_lock(param->sib->subscriptions_lock);
-      sub_state = (subscription_state*)g_hash_table_lookup(param->sib->subs, sub_id);
-      g_mutex_unlock(param->sib->subscriptions_lock);
-
-      if (sub_state->status == M3_SUB_STOPPED)
-	{
-	  g_mutex_lock(param->sib->subscriptions_lock);
-	  g_free(sub_state->sub_id);
-	  g_free(sub_state->kp_id);
-	  g_hash_table_remove(param->sib->subs, sub_id);
-	  sub_state->unsub = TRUE;
-	  g_cond_signal(sub_state->unsub_cond);
-	  g_mutex_unlock(param->sib->subscriptions_lock);
-	  break;
-	}
-
-      g_async_queue_push(param->sib->query_queue, s);
-
-      g_mutex_lock(param->sib->subscriptions_lock);
-      sub_state = (subscription_state*)g_hash_table_lookup(param->sib->subs, sub_id);
-      g_mutex_unlock(param->sib->subscriptions_lock);
-
-      if (sub_state->status == M3_SUB_PENDING)
-	{
-	  g_mutex_lock(param->sib->new_reqs_lock);
-	  param->sib->new_reqs = TRUE;
-	  g_cond_signal(param->sib->new_reqs_cond);
-	  g_mutex_unlock(param->sib->new_reqs_lock);
-	}
-
-      /* Block while operation is processed */
-      g_mutex_lock(s->op_lock);
-      while (!(s->op_complete))
-	{
-	  g_cond_wait(s->op_cond, s->op_lock);
-	}
-      s->op_complete = FALSE;
-      g_mutex_unlock(op_lock);
-
-      if (current_result_bool != rsp_msg->bool_results)
-	{
-	  switch(rsp_msg->bool_results)
-	    {
-	    case true:
-	      rsp_msg->new_results_str = g_strdup("TRUE");
-	      rsp_msg->obsolete_results_str = g_strdup("FALSE");
-	      break;
-	    case false:
-	      rsp_msg->new_results_str = g_strdup("FALSE");
-	      rsp_msg->obsolete_results_str = g_strdup("TRUE");
-	      break;
-	    }
-
-	  if( ++(rsp_msg->ind_seqnum) == SSAP_IND_WRAP_NUM )
-	    rsp_msg->ind_seqnum=1;
-
-	  whiteboard_util_send_signal(SIB_DBUS_OBJECT,
-				      SIB_DBUS_KP_INTERFACE,
-				      SIB_DBUS_KP_SIGNAL_SUBSCRIPTION_IND,
-				      param->conn,
-				      DBUS_TYPE_STRING, &(header->space_id),
-				      DBUS_TYPE_STRING, &(header->kp_id),
-				      DBUS_TYPE_INT32, &(header->tr_id),
-				      DBUS_TYPE_INT32, &(rsp_msg->ind_seqnum),
-				      DBUS_TYPE_STRING, &(rsp_msg->sub_id),
-				      DBUS_TYPE_STRING, &(rsp_msg->new_results_str),
-				      DBUS_TYPE_STRING, &(rsp_msg->obsolete_results_str),
-				      WHITEBOARD_UTIL_LIST_END);
-
-	  current_result_bool = rsp_msg->bool_results;
-	  g_free(rsp_msg->new_results_str);
-	  g_free(rsp_msg->obsolete_results_str);
-	}
-    }
-  while(TRUE);
-
-  g_mutex_free(op_lock);
-  g_cond_free(op_cond);
-  g_free(s);
-  return ss_StatusOK;
+  GString* status = g_string_new(NULL);
+  GHashTableIter iter;
+  subscription_member* member;
+
+  g_mutex_lock(sib->subscriptions_lock);
+  g_hash_table_iter_init(&iter, sib->subs);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&member))
+    g_string_append_printf(status, "%s %s %u %d\n", member->sub_id,
+			   member->kp_id, member->n_pending_seen,
+			   member->lagging_seen ? 1 : 0);
+  g_mutex_unlock(sib->subscriptions_lock);
+  return g_string_free(status, FALSE);
 }
-#endif /* WITH_WQL */
 
 gpointer m3_subscribe(gpointer data)
 {
@@ -2158,9 +2613,16 @@ gpointer m3_subscribe(gpointer data)
 
   gchar *space_id, *kp_id;
   gchar *temp_sub_id = NULL;
+  gchar *empty_str = "";
+  gchar *key;
   gint tr_id;
+  gint min_interval, max_batch;
+  gboolean shared = FALSE;
   member_data* kp_data;
   subscription_state* sub_state;
+  subscription_member* member;
+  scheduler_item* s;
+  GSList* patterns = NULL;
 
   /* Allocate memory for message structs */
   header =  g_new0(ssap_message_header, 1);
@@ -2171,8 +2633,6 @@ gpointer m3_subscribe(gpointer data)
   header->tr_type = M3_SUBSCRIBE;
   header->msg_type = M3_REQUEST;
 
-  sub_state = g_new0(subscription_state, 1);
-
   if(whiteboard_util_parse_message(param->msg,
 			    DBUS_TYPE_STRING, &space_id,
 			    DBUS_TYPE_STRING, &kp_id,
@@ -2185,33 +2645,7 @@ gpointer m3_subscribe(gpointer data)
       header->kp_id = g_strdup(kp_id);
       header->tr_id = tr_id;
 
-      /* ASSIGN SUB ID HERE */
-      temp_sub_id = g_strdup_printf("%s_%d", kp_id, tr_id);
-      g_mutex_lock(param->sib->subscriptions_lock);
-      while (g_hash_table_lookup(param->sib->subs, temp_sub_id)) {
-	/* Create better sub_id generator! */
-	g_free(temp_sub_id);
-	temp_sub_id = g_strdup_printf("%s_%d", kp_id, ++tr_id);
-      }
-      sub_state->status = M3_SUB_ONGOING;
-      sub_state->sub_id = g_strdup(temp_sub_id);
-      sub_state->kp_id = g_strdup(kp_id);
-
-      g_hash_table_insert(param->sib->subs, (gpointer)temp_sub_id, (gpointer)sub_state);
-      g_mutex_unlock(param->sib->subscriptions_lock);
-
-      g_mutex_lock(param->sib->members_lock);
-      kp_data = g_hash_table_lookup(param->sib->joined, kp_id);
-      if (kp_data != NULL)
-	{
-	  kp_data->subs = g_slist_prepend(kp_data->subs, g_strdup(temp_sub_id));
-	  kp_data->n_of_subs++;
-	}
-      g_mutex_unlock(param->sib->members_lock);
-
-      rsp_msg->sub_id = g_strdup(temp_sub_id);
-      /* Initialize the query structure and start
-	 suitable subscription processor */
+      /* Initialize the query structure */
       switch(req_msg->type)
 	{
 	case QueryTypeTemplate:
@@ -2220,38 +2654,20 @@ gpointer m3_subscribe(gpointer data)
 				   NULL);
 	  if (status == ss_StatusOK)
 	    {
-	      printf("Started triples subscription with id %s", rsp_msg->sub_id); /* SUB_DEBUG */
-	      status = m3_subscribe_triples(header, req_msg, rsp_msg, param);
+	      /* Compiled once, evaluations probe the store with node ids */
+	      g_mutex_lock(param->sib->store_lock);
+	      status = m3_template_compile(param->sib, req_msg->template_query, &patterns);
+	      g_mutex_unlock(param->sib->store_lock);
 	    }
-	  else
-	    break;
 	  break;
 #if WITH_WQL==1
 	case QueryTypeWQLValues:
-	  req_msg->wql_query = ssWqlDesc_new_jh(req_msg->type);
-	  status = parseM3_query_req_wql(req_msg->wql_query,
-					 (const gchar*)req_msg->query_str);
-	  if (status == ss_StatusOK)
-	    {
-	      printf("Started WQL nodes subscription with id %s", rsp_msg->sub_id); /* SUB_DEBUG */
-	      status = m3_subscribe_nodes(header, req_msg, rsp_msg, param);
-	    }
-	  else
-	    break;
-	  break;
 	case QueryTypeWQLRelated:
 	case QueryTypeWQLIsType:
 	case QueryTypeWQLIsSubType:
 	  req_msg->wql_query = ssWqlDesc_new_jh(req_msg->type);
 	  status = parseM3_query_req_wql(req_msg->wql_query,
 					 (const gchar*)req_msg->query_str);
-	  if (status == ss_StatusOK)
-	    {
-	      printf("Started WQL boolean subscription with id %s", rsp_msg->sub_id); /* SUB_DEBUG */
-	      status = m3_subscribe_bool(header, req_msg, rsp_msg, param);
-	    }
-	  else
-	    break;
 	  break;
 	case QueryTypeWQLNodeTypes:
 	  /* FALLTHROUGH */
@@ -2261,21 +2677,140 @@ gpointer m3_subscribe(gpointer data)
 	  status = ss_SIBFailNotImpl;
 	  break;
 	}
-      printf("SUBSCRIBE: subscription %s finished \n", rsp_msg->sub_id);
+
+      if (status != ss_StatusOK)
+	{
+	  if (status == ss_ParsingError)
+	    rsp_msg->status = ss_KPErrorMsgSyntax;
+	  else
+	    rsp_msg->status = status;
+
+	  m3_send_return(param,
+			 DBUS_TYPE_STRING, &(header->space_id),
+			 DBUS_TYPE_STRING, &(header->kp_id),
+			 DBUS_TYPE_INT32, &(header->tr_id),
+			 DBUS_TYPE_INT32, &(rsp_msg->status),
+			 DBUS_TYPE_STRING, &empty_str,
+			 DBUS_TYPE_STRING, &empty_str,
+			 DBUS_TYPE_INVALID);
+
+	  if (req_msg->type == QueryTypeTemplate)
+	    ssFreeTripleList(&(req_msg->template_query));
+#if WITH_WQL==1
+	  else if (NULL != req_msg->wql_query)
+	    ssWqlDesc_free(&(req_msg->wql_query));
+#endif /* WITH_WQL */
+	  g_free(header->space_id);
+	  g_free(header->kp_id);
+	  goto free_request;
+	}
+
+      rsp_msg->status = ss_StatusOK;
+
+      m3_sub_parse_coalescing(param, &min_interval, &max_batch);
+      key = m3_sub_key(req_msg->type, &patterns, req_msg->query_str,
+		       min_interval, max_batch);
+
+      member = g_new0(subscription_member, 1);
+      member->space_id = g_strdup(space_id);
+      member->kp_id = g_strdup(kp_id);
+      member->tr_id = tr_id;
+      member->param = param;
+      member->pending = g_queue_new();
+
+      /* ASSIGN SUB ID HERE */
+      temp_sub_id = g_strdup_printf("%s_%d", kp_id, tr_id);
+      g_mutex_lock(param->sib->subscriptions_lock);
+      while (g_hash_table_lookup(param->sib->subs, temp_sub_id)) {
+	/* Create better sub_id generator! */
+	g_free(temp_sub_id);
+	temp_sub_id = g_strdup_printf("%s_%d", kp_id, ++tr_id);
+      }
+      member->sub_id = temp_sub_id;
+      g_hash_table_insert(param->sib->subs, (gpointer)member->sub_id, (gpointer)member);
+
+      /* Subscriptions to the same query share its evaluation */
+      sub_state = (subscription_state*)g_hash_table_lookup(param->sib->sub_groups, key);
+      if (NULL == sub_state)
+	{
+	  s = g_new0(scheduler_item, 1);
+	  s->header = header;
+	  s->req = req_msg;
+	  s->rsp = rsp_msg;
+	  s->complete = m3_sub_advance;
+
+	  sub_state = g_new0(subscription_state, 1);
+	  sub_state->op = s;
+	  sub_state->patterns = patterns;
+	  sub_state->key = key;
+	  sub_state->min_interval = min_interval;
+	  sub_state->max_batch = max_batch;
+	  s->complete_data = sub_state;
+
+	  /* Pending until the scheduler has run the baseline query */
+	  sub_state->status = M3_SUB_PENDING;
+	  sub_state->sub_id = g_strdup(temp_sub_id);
+	  sub_state->type = req_msg->type;
+	  rsp_msg->sub_id = g_strdup(temp_sub_id);
+
+	  g_hash_table_insert(param->sib->sub_groups, (gpointer)sub_state->key, (gpointer)sub_state);
+	}
+      else
+	{
+	  /* The new member is answered in the next round of the state */
+	  shared = TRUE;
+	  sub_state->members_changed = TRUE;
+	  if (sub_state->status == M3_SUB_ONGOING)
+	    sub_state->status = M3_SUB_PENDING;
+	}
+      member->state = sub_state;
+      sub_state->members = g_slist_append(sub_state->members, member);
+      g_mutex_unlock(param->sib->subscriptions_lock);
+
+      g_mutex_lock(param->sib->members_lock);
+      kp_data = g_hash_table_lookup(param->sib->joined, kp_id);
+      if (kp_data != NULL)
+	{
+	  kp_data->subs = g_slist_prepend(kp_data->subs, g_strdup(temp_sub_id));
+	  kp_data->n_of_subs++;
+	}
+      g_mutex_unlock(param->sib->members_lock);
+
+      printf("Started subscription with id %s\n", temp_sub_id); /* SUB_DEBUG */
+
+      /* From here on the subscription is advanced by the scheduler */
+      if (!shared)
+	{
+	  m3_sub_requeue(sub_state, param->sib);
+	  return NULL;
+	}
+
+      /* Joined an existing state, the request is not needed any more */
+      m3_sub_wake_scheduler(param->sib);
+      g_free(key);
+      m3_free_triple_int_list(&patterns, NULL);
+      if (req_msg->type == QueryTypeTemplate)
+	ssFreeTripleList(&(req_msg->template_query));
+#if WITH_WQL==1
+      else if (NULL != req_msg->wql_query)
+	ssWqlDesc_free(&(req_msg->wql_query));
+#endif /* WITH_WQL */
+      g_free(header->space_id);
+      g_free(header->kp_id);
+      g_free(req_msg);
+      g_free(rsp_msg);
+      g_free(header);
+      return NULL;
     }
   else
     {
       whiteboard_log_warning("Could not parse SUBSCRIBE method call message\n");
     }
-  g_free(temp_sub_id);
+ free_request:
   g_free(req_msg);
-  g_free(rsp_msg->sub_id);
   g_free(rsp_msg);
-  g_free(header->space_id);
-  g_free(header->kp_id);
   g_free(header);
-  g_free(sub_state);
-  g_free(param);
+  m3_param_free(param);
   return NULL;
 
 }
@@ -2286,12 +2821,11 @@ gpointer m3_unsubscribe(gpointer data)
   ssap_kp_message *req_msg;
   ssap_sib_message *rsp_msg;
   sib_op_parameter* param = (sib_op_parameter*) data;
-  //GMutex* unsub_lock;
-  GCond* unsub_cond;
+  sib_data_structure* sib = param->sib;
+  subscription_member* member;
   subscription_state* sub;
+  GSList* l;
 
-  //unsub_lock = g_mutex_new();
-  unsub_cond = g_cond_new();
   /* Allocate memory for message structs */
   header =  g_new0(ssap_message_header, 1);
   req_msg = g_new0(ssap_kp_message, 1);
@@ -2304,308 +2838,761 @@ gpointer m3_unsubscribe(gpointer data)
 			    DBUS_TYPE_STRING, &(req_msg->sub_id),
 			    DBUS_TYPE_INVALID) )
     {
-      g_mutex_lock(param->sib->subscriptions_lock);
-      sub = (subscription_state*)g_hash_table_lookup(param->sib->subs, req_msg->sub_id);
-      g_mutex_unlock(param->sib->subscriptions_lock);
+      g_mutex_lock(sib->subscriptions_lock);
+      member = (subscription_member*)g_hash_table_lookup(sib->subs, req_msg->sub_id);
 
-      if (NULL != sub)
-	{
-	  // printf("UNSUBSCRIBE: Found sub for sub id %s\n", req_msg->sub_id);
-
-	  /* Set subscription status to stopped */
-	  g_mutex_lock(param->sib->subscriptions_lock);
-	  // sub->unsub_lock = unsub_lock;
-	  sub->unsub_cond = unsub_cond;
-	  sub->unsub = FALSE;
-	  sub->status = M3_SUB_STOPPED;
-	  g_mutex_unlock(param->sib->subscriptions_lock);
-
-	  /* Signal scheduler to execute a round to get
-	     all subscriptions to check their status
-	     TODO: better way to signal subscriptions
-	  */
-	  g_mutex_lock(param->sib->new_reqs_lock);
-	  param->sib->new_reqs = TRUE;
-	  g_cond_signal(param->sib->new_reqs_cond);
-	  g_mutex_unlock(param->sib->new_reqs_lock);
-
-	  /* Wait until subscription processing has finished */
-	  // g_mutex_lock(unsub_lock);
-	  g_mutex_lock(param->sib->subscriptions_lock);
-	  while(!sub->unsub)
+      /* A subscription already being stopped is not found again */
+      if (NULL != member && !member->stopped)
+	{
+	  /* Answered when the member leaves its state in the next
+	     round, see m3_sub_member_finish. No worker waits for it. */
+	  member->unsub_param = param;
+	  member->unsub_header = header;
+	  member->stopped = TRUE;
+
+	  /* The state is evaluated until its last member stops, new
+	     subscriptions do not join it from then on */
+	  sub = member->state;
+	  for (l = sub->members; l != NULL; l = l->next)
+	    if (!((subscription_member*)l->data)->stopped)
+	      break;
+	  if (NULL == l)
 	    {
-	      g_cond_wait(unsub_cond, param->sib->subscriptions_lock);
+	      sub->status = M3_SUB_STOPPED;
+	      g_hash_table_remove(sib->sub_groups, sub->key);
 	    }
-	  sub->unsub = FALSE;
-	  g_mutex_unlock(param->sib->subscriptions_lock);
-
-	  rsp_msg->status = ss_StatusOK;
+	  else
+	    {
+	      sub->members_changed = TRUE;
+	      if (sub->status == M3_SUB_ONGOING)
+		sub->status = M3_SUB_PENDING;
+	    }
+	  g_mutex_unlock(sib->subscriptions_lock);
+
+	  /* Signal scheduler to execute a round so that the
+	     subscription item queued there gets completed. The request
+	     may be answered and freed already. */
+	  m3_sub_wake_scheduler(sib);
+	  g_free(req_msg);
+	  g_free(rsp_msg);
+	  return NULL;
 	}
-      else
-	rsp_msg->status = ss_KPErrorRequest;
-
-      whiteboard_util_send_method_return(param->conn,
-					 param->msg,
-					 DBUS_TYPE_STRING, &(header->space_id),
-					 DBUS_TYPE_STRING, &(header->kp_id),
-					 DBUS_TYPE_INT32, &(header->tr_id),
-					 DBUS_TYPE_INT32, &(rsp_msg->status),
-					 DBUS_TYPE_STRING, &(req_msg->sub_id),
-					 WHITEBOARD_UTIL_LIST_END);
-
-      printf("UNSUBSCRIBE: Sent unsub cnf for sub id %s\n", req_msg->sub_id);
-      g_free(req_msg);
-      g_free(rsp_msg);
-      g_free(header);
+      g_mutex_unlock(sib->subscriptions_lock);
+      rsp_msg->status = ss_KPErrorRequest;
+
+      m3_send_return(param,
+		     DBUS_TYPE_STRING, &(header->space_id),
+		     DBUS_TYPE_STRING, &(header->kp_id),
+		     DBUS_TYPE_INT32, &(header->tr_id),
+		     DBUS_TYPE_INT32, &(rsp_msg->status),
+		     DBUS_TYPE_STRING, &(req_msg->sub_id),
+		     DBUS_TYPE_INVALID);
     }
   else
     {
       whiteboard_log_warning("Could not parse UNSUBSCRIBE method call message\n");
     }
-
-  // g_mutex_free(unsub_lock);
-  g_cond_free(unsub_cond);
-  dbus_message_unref(param->msg);
-  g_free(param);
-  return NULL;
-
+
+  g_free(req_msg);
+  g_free(rsp_msg);
+  g_free(header);
+  m3_param_free(param);
+  return NULL;
+
+}
+
+/*
+ * Replies to a request without running it, with the given status and
+ * empty results in the reply format of the operation. Used when the
+ * SIB is too busy to accept the request.
+ */
+void m3_refuse(sib_op_parameter* param, ssStatus_t status)
+{
+  gchar *space_id, *kp_id, *sub_id;
+  gchar *empty_str = "";
+  gint tr_id;
+
+  /* Unsubscribe confirmations echo the sub id of the request */
+  if (!whiteboard_util_parse_message(param->msg,
+				     DBUS_TYPE_STRING, &space_id,
+				     DBUS_TYPE_STRING, &kp_id,
+				     DBUS_TYPE_INT32, &tr_id,
+				     DBUS_TYPE_INVALID) ||
+      (param->operation == M3_UNSUBSCRIBE &&
+       !whiteboard_util_parse_message(param->msg,
+				      DBUS_TYPE_STRING, &space_id,
+				      DBUS_TYPE_STRING, &kp_id,
+				      DBUS_TYPE_INT32, &tr_id,
+				      DBUS_TYPE_STRING, &sub_id,
+				      DBUS_TYPE_INVALID)))
+    {
+      whiteboard_log_warning("Could not parse refused method call message\n");
+      goto out;
+    }
+
+  switch (param->operation)
+    {
+    case M3_LEAVE:
+    case M3_REMOVE:
+      m3_send_return(param,
+		     DBUS_TYPE_STRING, &space_id,
+		     DBUS_TYPE_STRING, &kp_id,
+		     DBUS_TYPE_INT32, &tr_id,
+		     DBUS_TYPE_INT32, &status,
+		     DBUS_TYPE_INVALID);
+      break;
+    case M3_SUBSCRIBE:
+      m3_send_return(param,
+		     DBUS_TYPE_STRING, &space_id,
+		     DBUS_TYPE_STRING, &kp_id,
+		     DBUS_TYPE_INT32, &tr_id,
+		     DBUS_TYPE_INT32, &status,
+		     DBUS_TYPE_STRING, &empty_str,
+		     DBUS_TYPE_STRING, &empty_str,
+		     DBUS_TYPE_INVALID);
+      break;
+    case M3_UNSUBSCRIBE:
+      m3_send_return(param,
+		     DBUS_TYPE_STRING, &space_id,
+		     DBUS_TYPE_STRING, &kp_id,
+		     DBUS_TYPE_INT32, &tr_id,
+		     DBUS_TYPE_INT32, &status,
+		     DBUS_TYPE_STRING, &sub_id,
+		     DBUS_TYPE_INVALID);
+      break;
+    default:
+      /* Join credentials, insert and update bnodes, query results */
+      m3_send_return(param,
+		     DBUS_TYPE_STRING, &space_id,
+		     DBUS_TYPE_STRING, &kp_id,
+		     DBUS_TYPE_INT32, &tr_id,
+		     DBUS_TYPE_INT32, &status,
+		     DBUS_TYPE_STRING, &empty_str,
+		     DBUS_TYPE_INVALID);
+      break;
+    }
+
+ out:
+  m3_param_free(param);
+}
+
+
+gboolean triple_callback(gint s, gint p, gint o, gpointer data)
+{
+  m3_triple_int *t;
+  m3_triple_int key;
+  GHashTable** triple_ht = (GHashTable**) data;
+
+  key.s = s;
+  key.p = p;
+  key.o = o;
+  //printf("triple_callback: got triple %d %d %d\n", s, p, o);
+  /* Triples matched by several patterns are kept once */
+  if (NULL != g_hash_table_lookup(*triple_ht, &key))
+    return TRUE;
+
+  /* The triples are used after hash table has been destroyed */
+  t = g_new0(m3_triple_int, 1);
+  t->s = s;
+  t->p = p;
+  t->o = o;
+  g_hash_table_insert(*triple_ht, t, t);
+  return TRUE;
+}
+
+gint ssElement_t_to_node(SibStore* store, ssElement_t str_node, ssElementType_t type, ssStatus_t *status)
+{
+  gint node = 0;
+  if (0 == g_strcmp0((const char*)str_node, "sib:any") ||
+      0 == g_strcmp0((const char*)str_node, "http://www.nokia.com/NRC/M3/sib#any"))
+    {
+      node = 0;
+      return node;
+    }
+
+  node = sib_store_resolve(store, (gchar*)str_node, ssElement_TYPE_URI != type);
+  /* printf("Str node %s was mapped to int %d\n", str_node, node); */
+
+  if (0 == node && SIB_STORE_NODE_NEW != sib_store_status(store))
+    {
+      *status = ss_OperationFailed;
+    }
+
+  return node;
+}
+
+ssElement_t node_to_ssElement_t(SibStore* store, gint node, ssStatus_t *status)
+{
+  gchar *uri = NULL;
+
+  if (0 == node)
+    {
+      uri = g_strdup("http://www.nokia.com/NRC/M3/sib#any");
+      return (ssElement_t)uri;
+    }
+  uri = sib_store_string(store, node);
+  if (NULL == uri && SIB_STORE_NODE_FIND != sib_store_status(store))
+    {
+      *status = ss_OperationFailed;
+    }
+  return (ssElement_t)uri;
+}
+
+ssTriple_t* m3_triple_int_to_ssTriple_t(SibStore* store, m3_triple_int *m3_t, ssStatus_t *status)
+{
+  ssTriple_t *wb_t;
+  wb_t = g_new0(ssTriple_t, 1);
+  wb_t->subject = node_to_ssElement_t(store, (gint)m3_t->s, status);
+  if (ss_StatusOK != *status)
+    {
+      goto error;
+    }
+
+  wb_t->predicate = node_to_ssElement_t(store, (gint)m3_t->p, status);
+  if (ss_StatusOK != *status)
+    {
+      goto error;
+    }
+
+  wb_t->object = node_to_ssElement_t(store, (gint)m3_t->o, status);
+  if (ss_StatusOK != *status)
+    {
+      goto error;
+    }
+  /* Set correct types for s, p and o */
+  wb_t->subjType = ssElement_TYPE_URI; /* Can't be bNode at this stage */
+  if (m3_t->o < 0)
+    {
+      wb_t->objType = ssElement_TYPE_LIT;
+    }
+  else
+    {
+      wb_t->objType = ssElement_TYPE_URI;
+    }
+  return wb_t;
+
+ error:
+  return NULL;
+}
+
+m3_triple_int* ssTriple_t_to_m3_triple_int(SibStore* store, ssTriple_t *wb_t, ssStatus_t *status)
+{
+  m3_triple_int *m3_t;
+  char *lang = NULL;
+  int dt = 0;
+
+  m3_t = g_new0(m3_triple_int, 1);
+  m3_t->s = ssElement_t_to_node(store, wb_t->subject, (ssElementType_t)wb_t->subjType, status);
+  if (ss_StatusOK != *status)
+    {
+      goto error;
+    }
+
+  m3_t->p = ssElement_t_to_node(store, wb_t->predicate, ssElement_TYPE_URI, status);
+  if (ss_StatusOK != *status)
+    {
+      goto error;
+    }
+  /* OLD CODE
+  if (wb_t->objType == ssElement_TYPE_LIT)
+    {
+      m3_t->o = piglet_literal(store, (char*)wb_t->object, dt, lang);
+      if (!m3_t->o && SIB_STORE_NODE_NEW != sib_store_status(store))
+	{
+	  *status = ss_OperationFailed;
+	  goto error;
+	}
+    }
+  else
+    {
+      m3_t->o = ssElement_t_to_node(store, (char*)wb_t->object, (ssElementType_t)wb_t->objType, status);
+      if (ss_StatusOK != *status)
+	{
+	  goto error;
+	}
+    }
+  */
+  m3_t->o = ssElement_t_to_node(store, wb_t->object, (ssElementType_t)wb_t->objType, status);
+  if (ss_StatusOK != *status)
+    {
+      goto error;
+    }
+  return m3_t;
+
+ error:
+  return NULL;
+
+}
+
+
+/*
+ * Deliver changed triples to the template subscriptions matching them.
+ * Called from the scheduler after the change is in the store.
+ */
+void m3_sub_notify_changes(sib_data_structure* p, GSList* triples, gboolean added)
+{
+  GSList *matches, *i;
+  m3_triple_int* t;
+  m3_triple_delta* d;
+  subscription_state* sub;
+  gboolean notified = FALSE;
+
+  if (NULL == triples)
+    return;
+
+  g_mutex_lock(p->subscriptions_lock);
+  if (0 == sib_sub_index_size(p->sub_index))
+    {
+      g_mutex_unlock(p->subscriptions_lock);
+      return;
+    }
+  for ( ; triples != NULL; triples = triples->next)
+    {
+      t = (m3_triple_int*)triples->data;
+      matches = sib_sub_index_match(p->sub_index, t->s, t->p, t->o);
+      for (i = matches; i != NULL; i = i->next)
+	{
+	  sub = (subscription_state*)i->data;
+	  d = g_new0(m3_triple_delta, 1);
+	  d->s = t->s;
+	  d->p = t->p;
+	  d->o = t->o;
+	  d->added = added;
+	  sub->deltas = g_slist_prepend(sub->deltas, d);
+	  sub->n_deltas++;
+	  if (sub->status != M3_SUB_STOPPED)
+	    sub->status = M3_SUB_PENDING;
+	  notified = TRUE;
+	}
+      g_slist_free(matches);
+    }
+  g_mutex_unlock(p->subscriptions_lock);
+
+  /* Run another round for subscriptions queued after this one started */
+  if (notified)
+    {
+      g_mutex_lock(p->new_reqs_lock);
+      p->new_reqs = TRUE;
+      g_mutex_unlock(p->new_reqs_lock);
+    }
+}
+
+void set_sub_to_resync(gpointer sub_id, gpointer sub_data, gpointer unused)
+{
+  subscription_state* s = (subscription_state*)sub_data;
+  if (s->type == QueryTypeTemplate && s->status != M3_SUB_STOPPED)
+    {
+      s->resync = TRUE;
+      s->status = M3_SUB_PENDING;
+    }
+}
+
+/*
+ * Changes that are not seen triple by triple (RDF/XML loads) make
+ * all template subscriptions run their full query on the next round.
+ */
+void m3_sub_request_resync(sib_data_structure* p)
+{
+  g_mutex_lock(p->subscriptions_lock);
+  g_hash_table_foreach(p->sub_groups, set_sub_to_resync, NULL);
+  g_mutex_unlock(p->subscriptions_lock);
+}
+
+/*
+ * Invalidate what is cached of the store that the changed triples may
+ * affect: query results, the RDFS closure index, the owl:sameAs
+ * classes and, when subproperties change, compiled WQL paths. The
+ * triples piglet infers from additions are invalidated after
+ * post-processing, see m3_post_process. Called with store_lock held.
+ */
+void m3_caches_changed(sib_data_structure* p, GSList* triples, gboolean added)
+{
+#if WITH_WQL==1
+  GSList* l;
+  gint subprop;
+#endif /* WITH_WQL */
+
+  if (NULL == triples)
+    return;
+  sib_result_cache_changed(p->results, triples);
+
+#if WITH_WQL==1
+  sib_rdfs_index_changed(p->rdfs, p->RDF_store, triples, added,
+			 !sib_store_is_piglet(p->RDF_store));
+  sib_same_as_changed(p->same_as, p->RDF_store, triples, added);
+  subprop = sib_store_resolve(p->RDF_store, M3_SUBPROPERTY_URI, FALSE);
+  for (l = triples; l != NULL; l = l->next)
+    if (((m3_triple_int*)l->data)->p == subprop)
+      {
+	g_hash_table_remove_all(p->wql_paths);
+	break;
+      }
+#endif /* WITH_WQL */
+}
+
+/*
+ * Invalidate all that is cached of the store, after changes not known
+ * triple by triple. Called with store_lock held.
+ */
+void m3_caches_clear(sib_data_structure* p)
+{
+  sib_result_cache_clear(p->results);
+#if WITH_WQL==1
+  g_hash_table_remove_all(p->wql_paths);
+  sib_rdfs_index_clear(p->rdfs);
+  sib_same_as_clear(p->same_as);
+#endif /* WITH_WQL */
+}
+
+/*
+ * Queue committed triples for post-processing, once each. Triples
+ * removed before their post-processing are not post-processed.
+ * Called with store_lock held.
+ */
+void m3_inference_changed(sib_data_structure* p, GSList* triples, gboolean added)
+{
+  m3_triple_int *t, *queued;
+  GSList* l;
+
+  /* Only piglet infers triples */
+  if (!sib_store_is_piglet(p->RDF_store))
+    return;
+
+  for (l = triples; l != NULL; l = l->next)
+    {
+      t = (m3_triple_int*)l->data;
+      queued = (m3_triple_int*)g_hash_table_lookup(p->inferences, t);
+      if (!added)
+	{
+	  if (NULL != queued)
+	    {
+	      g_hash_table_remove(p->inferences, queued);
+	      g_free(queued);
+	    }
+	  continue;
+	}
+      if (NULL != queued)
+	continue;
+      queued = g_new0(m3_triple_int, 1);
+      queued->s = t->s;
+      queued->p = t->p;
+      queued->o = t->o;
+      g_hash_table_insert(p->inferences, queued, queued);
+    }
 }
 
-
-bool triple_callback(DB store, void *data, Node s, Node p, Node o)
+/*
+ * Whether some of the triples are schema triples. They may change what
+ * is inferred about nodes not in them.
+ */
+gboolean m3_schema_triples(sib_data_structure* p, GSList* triples)
 {
-  m3_triple_int *t, *tmp;
-  gchar* key;
-  GHashTable** triple_ht = (GHashTable**) data;
+  m3_triple_int* t;
+  gint subclass, subprop, domain, range;
 
-  t = g_new0(m3_triple_int, 1);
-  t->s = (gint)s;
-  t->p = (gint)p;
-  t->o = (gint)o;
-  key = g_strdup_printf("%d_%d_%d", t->s, t->p, t->o);
-  tmp = g_hash_table_lookup(*triple_ht, key);
-  //printf("triple_callback: got triple %d %d %d\n", t->s, t->p, t->o);
-  if (NULL != tmp)
-    {
-      /* Free the previous instance of duplicate triple */
-      /* The triple values are used after hash table has been destroyed */
-      g_free(tmp);
-      g_hash_table_insert(*triple_ht, key, t);
-    }
-  else
+  subclass = sib_store_resolve(p->RDF_store, M3_SUBCLASS_URI, FALSE);
+  subprop = sib_store_resolve(p->RDF_store, M3_SUBPROPERTY_URI, FALSE);
+  domain = sib_store_resolve(p->RDF_store, M3_DOMAIN_URI, FALSE);
+  range = sib_store_resolve(p->RDF_store, M3_RANGE_URI, FALSE);
+
+  for ( ; triples != NULL; triples = triples->next)
     {
-      g_hash_table_insert(*triple_ht, key, t);
+      t = (m3_triple_int*)triples->data;
+      if (t->p == subclass || t->p == subprop ||
+	  t->p == domain || t->p == range)
+	return TRUE;
     }
-  return true;
+  return FALSE;
 }
 
-gint ssElement_t_to_node(DB store, ssElement_t str_node, ssElementType_t type, ssStatus_t *status)
+/*
+ * The stored triples that the RDFS post-processing of triples writes,
+ * in the shapes of addPostProcess in rdfplus_m3: the types of their
+ * predicates and objects, the superclasses of the classes they type,
+ * and for a literal object the objects of the same subject and
+ * predicate with their types, as a date literal is rewritten to a new
+ * one. Subproperties and owl:sameAs are reasoned about at query time
+ * and infer no triples. Read before and after post-processing, the
+ * difference is what it added and removed. Called with store_lock
+ * held.
+ *
+ * @return a triple set (m3_triple_set_new), free with m3_triple_set_free
+ */
+GHashTable* m3_inference_scope(sib_data_structure* p, GSList* triples)
 {
-  gint node = 0;
-  char* str_tmp = NULL;
-  if (0 == g_strcmp0((const char*)str_node, "sib:any") ||
-      0 == g_strcmp0((const char*)str_node, "http://www.nokia.com/NRC/M3/sib#any"))
-    {
-      node = 0;
-      return node;
-    }
+  GHashTable* found = m3_triple_set_new();
+  GHashTableIter iter;
+  GSList *literals = NULL, *l;
+  m3_triple_int *t, *f;
+  gint type, subclass;
 
-  if (ssElement_TYPE_URI == type)
-    {
-      str_tmp = piglet_expand_m3(store, (char*)str_node);
-      node = piglet_node(store, str_tmp);
-      /* printf("Str node %s was mapped to int %d\n", str_tmp, node); */
-      free(str_tmp);
-    }
-  else
-    {
-      node = piglet_literal(store, (char*)str_node, 0, NULL);
-    }
+  type = sib_store_resolve(p->RDF_store, M3_TYPE_URI, FALSE);
+  subclass = sib_store_resolve(p->RDF_store, M3_SUBCLASS_URI, FALSE);
 
-  if (0 == node && strcmp(piglet_error_message, PIGLET_ERR_NODE_NEW))
+  for ( ; triples != NULL; triples = triples->next)
     {
-      *status = ss_OperationFailed;
+      t = (m3_triple_int*)triples->data;
+      sib_store_query(p->RDF_store, t->p, type, 0, triple_callback, &found);
+      sib_store_query(p->RDF_store, t->o, type, 0, triple_callback, &found);
+      if (t->p == type || t->p == subclass)
+	sib_store_query(p->RDF_store, t->o, subclass, 0, triple_callback, &found);
+      if (t->o < 0)
+	sib_store_query(p->RDF_store, t->s, t->p, 0, triple_callback, &found);
     }
 
-  return node;
+  /* Types of the literals a date may have been rewritten to */
+  g_hash_table_iter_init(&iter, found);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&f))
+    if (f->o < 0 && f->p != type)
+      literals = g_slist_prepend(literals, GINT_TO_POINTER(f->o));
+  for (l = literals; l != NULL; l = l->next)
+    sib_store_query(p->RDF_store, GPOINTER_TO_INT(l->data), type, 0,
+		    triple_callback, &found);
+  g_slist_free(literals);
+  return found;
 }
 
-ssElement_t node_to_ssElement_t(DB store, gint node, ssStatus_t *status)
+/*
+ * Copies of the triples of set a that are not in set b
+ */
+GSList* m3_triple_set_minus(GHashTable* a, GHashTable* b)
 {
-  gchar *uri = NULL;
-  char *tmp_str = NULL;
-  char *exp_tmp_str = NULL;
-  gint dt = 0;
-  char *lang = NULL;
+  GHashTableIter iter;
+  GSList* diff = NULL;
+  m3_triple_int *t, *copy;
 
-  if (0 == node)
-    {
-      uri = g_strdup("http://www.nokia.com/NRC/M3/sib#any");
-      return (ssElement_t)uri;
-    }
-  tmp_str = piglet_info(store, node, &dt, lang);
-  if (NULL == tmp_str && strcmp(piglet_error_message, PIGLET_ERR_NODE_FIND))
-    {
-      *status = ss_OperationFailed;
-    }
-  else
+  g_hash_table_iter_init(&iter, a);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&t))
     {
-      if (node > 0)
-	{
-	  exp_tmp_str = piglet_expand_m3(store, tmp_str);
-	  uri = g_strdup((gchar*)exp_tmp_str);
-	  free(exp_tmp_str);
-	}
-      else
-	{
-	  uri = g_strdup((gchar*)tmp_str);
-	}
-      free(tmp_str);
+      if (NULL != g_hash_table_lookup(b, t))
+	continue;
+      copy = g_new0(m3_triple_int, 1);
+      copy->s = t->s;
+      copy->p = t->p;
+      copy->o = t->o;
+      diff = g_slist_prepend(diff, copy);
     }
-  return (ssElement_t)uri;
+  return diff;
 }
 
-ssTriple_t* m3_triple_int_to_ssTriple_t(DB store, m3_triple_int *m3_t, ssStatus_t *status)
+/*
+ * Frees a triple set and the triples in it
+ */
+void m3_triple_set_free(GHashTable* set)
 {
-  ssTriple_t *wb_t;
-  wb_t = g_new0(ssTriple_t, 1);
-  wb_t->subject = node_to_ssElement_t(store, (gint)m3_t->s, status);
-  if (ss_StatusOK != *status)
+  GHashTableIter iter;
+  m3_triple_int* t;
+
+  g_hash_table_iter_init(&iter, set);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&t))
     {
-      goto error;
+      g_free(t->lang);
+      g_free(t);
     }
+  g_hash_table_destroy(set);
+}
 
-  wb_t->predicate = node_to_ssElement_t(store, (gint)m3_t->p, status);
-  if (ss_StatusOK != *status)
+/*
+ * RDFS post-processing of the triples added since the last round, in
+ * one transaction of its own. Writers are replied before it, so their
+ * latency does not include inference. Queries see the inferred
+ * triples from the round after the write on.
+ *
+ * The triples piglet added and removed are found by reading the
+ * shapes it writes before and after, see m3_inference_scope, and go
+ * to the caches and subscriptions like any other change. Inferences
+ * outside those shapes, if the piglet post-processing ever makes any,
+ * would not be seen.
+ */
+void m3_post_process(sib_data_structure* p)
+{
+  GHashTableIter iter;
+  GHashTable *before, *after;
+  GSList *batch = NULL, *inferred, *retracted, *l;
+  m3_triple_int* t;
+  gboolean templates, schema;
+
+  g_mutex_lock(p->store_lock);
+  if (0 == g_hash_table_size(p->inferences))
     {
-      goto error;
+      g_mutex_unlock(p->store_lock);
+      return;
     }
 
-  wb_t->object = node_to_ssElement_t(store, (gint)m3_t->o, status);
-  if (ss_StatusOK != *status)
+  whiteboard_log_debug("Post-processing %d triples\n", g_hash_table_size(p->inferences));
+  g_hash_table_iter_init(&iter, p->inferences);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&t))
+    batch = g_slist_prepend(batch, t);
+  /* The triples are in batch now */
+  g_hash_table_remove_all(p->inferences);
+
+  sib_store_transaction(p->RDF_store);
+  before = m3_inference_scope(p, batch);
+  for (l = batch; l != NULL; l = l->next)
     {
-      goto error;
+      t = (m3_triple_int*)l->data;
+      sib_store_post_process(p->RDF_store, t->s, t->p, t->o);
     }
-  /* Set correct types for s, p and o */
-  wb_t->subjType = ssElement_TYPE_URI; /* Can't be bNode at this stage */
-  if (m3_t->o < 0)
+  after = m3_inference_scope(p, batch);
+
+  if (sib_store_commit(p->RDF_store))
     {
-      wb_t->objType = ssElement_TYPE_LIT;
+      inferred = m3_triple_set_minus(after, before);
+      retracted = m3_triple_set_minus(before, after);
+      m3_caches_changed(p, batch, TRUE);
+      m3_caches_changed(p, retracted, FALSE);
+      m3_caches_changed(p, inferred, TRUE);
+
+      g_mutex_lock(p->subscriptions_lock);
+      templates = (0 != sib_sub_index_size(p->sub_index));
+      g_mutex_unlock(p->subscriptions_lock);
+      schema = m3_schema_triples(p, batch);
+      if (schema)
+	sib_result_cache_clear(p->results);
+      if (templates && schema)
+	m3_sub_request_resync(p);
+      else if (templates)
+	{
+	  m3_sub_notify_changes(p, retracted, FALSE);
+	  m3_sub_notify_changes(p, inferred, TRUE);
+	}
+      m3_free_triple_int_list(&retracted, NULL);
+      m3_free_triple_int_list(&inferred, NULL);
     }
   else
     {
-      wb_t->objType = ssElement_TYPE_URI;
+      printf("Post-processing failed:\n%s\n", sib_store_error(p->RDF_store));
+      sib_store_rollback(p->RDF_store);
     }
-  return wb_t;
+  g_mutex_unlock(p->store_lock);
+  m3_triple_set_free(before);
+  m3_triple_set_free(after);
+  m3_free_triple_int_list(&batch, NULL);
+}
 
- error:
-  return NULL;
+#if WITH_WQL==1
+/*
+ * Compiled native path of a WQL path expression, from the cache if
+ * it has been compiled since subproperties last changed. Called with
+ * store_lock held, the path is valid until it is released.
+ *
+ * @return the path, NULL if the expression is not valid
+ */
+SibWqlPath* m3_wql_path(sib_data_structure* p, const gchar* expr)
+{
+  SibWqlPath* path;
+
+  path = (SibWqlPath*)g_hash_table_lookup(p->wql_paths, expr);
+  if (NULL != path)
+    return path;
+
+  path = sib_wql_path_new(p->RDF_store, expr, TRUE);
+  if (NULL == path)
+    return NULL;
+  /* Forget all at once when full, the paths in use come back soon */
+  if (g_hash_table_size(p->wql_paths) >= SIB_COMPILED_PATHS)
+    g_hash_table_remove_all(p->wql_paths);
+  g_hash_table_insert(p->wql_paths, g_strdup(expr), path);
+  return path;
 }
+#endif /* WITH_WQL */
 
-m3_triple_int* ssTriple_t_to_m3_triple_int(DB store, ssTriple_t *wb_t, ssStatus_t *status)
+/*
+ * Resolve the RDF/M3 insert graph of op to node ids. Nothing is added
+ * to the store yet, so an operation failing here leaves no triples
+ * behind. Only new nodes may have been created.
+ */
+ssStatus_t rdf_writer_resolve(scheduler_item* op, sib_data_structure* param, GSList** triples)
 {
-  m3_triple_int *m3_t;
-  char *lang = NULL;
-  int dt = 0;
+  GSList* i;
+  ssTriple_t* t;
+  m3_triple_int* t_int;
 
-  m3_t = g_new0(m3_triple_int, 1);
-  m3_t->s = ssElement_t_to_node(store, wb_t->subject, (ssElementType_t)wb_t->subjType, status);
-  if (ss_StatusOK != *status)
+  *triples = NULL;
+  for (i = op->req->insert_graph;
+       i != NULL;
+       i = i->next)
     {
-      goto error;
-    }
+      t = (ssTriple_t*)i->data;
 
-  m3_t->p = ssElement_t_to_node(store, wb_t->predicate, ssElement_TYPE_URI, status);
-  if (ss_StatusOK != *status)
-    {
-      goto error;
-    }
-  /* OLD CODE
-  if (wb_t->objType == ssElement_TYPE_LIT)
-    {
-      m3_t->o = piglet_literal(store, (char*)wb_t->object, dt, lang);
-      if (!m3_t->o && strcmp(piglet_error_message, PIGLET_ERR_NODE_NEW))
-	{
-	  *status = ss_OperationFailed;
-	  goto error;
-	}
-    }
-  else
-    {
-      m3_t->o = ssElement_t_to_node(store, (char*)wb_t->object, (ssElementType_t)wb_t->objType, status);
-      if (ss_StatusOK != *status)
+      /*
+      whiteboard_log_debug("Got s: %s, p: %s, o: %s",
+			   (unsigned char*)t->subject,
+			   (unsigned char*)t->predicate,
+			   (unsigned char*)t->object);
+      */
+      t_int = ssTriple_t_to_m3_triple_int(param->RDF_store, t, &(op->rsp->status));
+      if (op->rsp->status != ss_StatusOK)
 	{
-	  goto error;
+	  /* Free the created m3_triple_int*/
+	  g_free(t_int);
+	  m3_free_triple_int_list(triples, NULL);
+	  op->rsp->status = ss_OperationFailed;
+	  return op->rsp->status;
 	}
+      /* Kept for subscriptions, freed after notifying them */
+      *triples = g_slist_prepend(*triples, t_int);
     }
-  */
-  m3_t->o = ssElement_t_to_node(store, wb_t->object, (ssElementType_t)wb_t->objType, status);
-  if (ss_StatusOK != *status)
-    {
-      goto error;
-    }
-  return m3_t;
+  *triples = g_slist_reverse(*triples);
+  op->rsp->status = ss_StatusOK;
+  return op->rsp->status;
+}
 
- error:
-  return NULL;
+/*
+ * Add resolved triples to the store, within a transaction of the
+ * caller. They are post-processed later, see m3_post_process.
+ */
+void rdf_writer_apply(sib_data_structure* param, GSList* triples)
+{
+  m3_triple_int* t_int;
 
+  for ( ; triples != NULL; triples = triples->next)
+    {
+      t_int = (m3_triple_int*)triples->data;
+      sib_store_add(param->RDF_store, t_int->s, t_int->p, t_int->o);
+    }
 }
 
-
 ssStatus_t rdf_writer(scheduler_item* op, sib_data_structure* param)
 {
-  PigletStatus success;
+  gboolean success;
+  GSList* changed = NULL;
 
   switch (op->req->encoding)
     {
     case EncodingM3XML:
       whiteboard_log_debug("Writing RDF/M3 in transaction %d\n", op->header->tr_id);
-      GSList* i;
-      ssTriple_t* t;
-      m3_triple_int* t_int;
-      piglet_transaction(param->RDF_store);
-      for (i = op->req->insert_graph;
-	   i != NULL;
-	   i = i->next)
-	{
-	  t = (ssTriple_t*)i->data;
-
-	  /*
-	  whiteboard_log_debug("Got s: %s, p: %s, o: %s",
-			       (unsigned char*)t->subject,
-			       (unsigned char*)t->predicate,
-			       (unsigned char*)t->object);
-	  */
-	  t_int = ssTriple_t_to_m3_triple_int(param->RDF_store, t, &(op->rsp->status));
-	  if (op->rsp->status != ss_StatusOK)
-	    {
-	      /* Free the created m3_triple_int*/
-	      g_free(t_int);
-	      goto error;
-	    }
-
-	  piglet_add(param->RDF_store, t_int->s, t_int->p, t_int->o, 0, false);
-	  piglet_add_post_process(param->RDF_store, t_int->s, t_int->p, t_int->o);
-	  /* Free the created m3_triple_int*/
-	  g_free(t_int);
+      sib_store_transaction(param->RDF_store);
+      if (rdf_writer_resolve(op, param, &changed) != ss_StatusOK)
+	{
+	  sib_store_rollback(param->RDF_store);
+	  break;
+	}
+      rdf_writer_apply(param, changed);
+      if (!sib_store_commit(param->RDF_store))
+	{
+	  printf("rdf_writer: commit failed:\n%s\n", sib_store_error(param->RDF_store));
+	  sib_store_rollback(param->RDF_store);
+	  m3_free_triple_int_list(&changed, NULL);
+	  op->rsp->status = ss_OperationFailed;
+	  break;
 	}
-      piglet_commit(param->RDF_store);
-
-      op->rsp->status = ss_StatusOK;
-      break;
-
-    error:
-      piglet_rollback(param->RDF_store);
 
-      op->rsp->status = ss_OperationFailed;
+      m3_caches_changed(param, changed, TRUE);
+      m3_inference_changed(param, changed, TRUE);
+      m3_sub_notify_changes(param, changed, TRUE);
+      m3_free_triple_int_list(&changed, NULL);
       break;
 
     case EncodingRDFXML:
-      success = piglet_load_m3(param->RDF_store, 0,
-			       (unsigned char*)op->req->insert_str,
-			       false);
+      success = sib_store_load_rdfxml(param->RDF_store,
+				      (gchar*)op->req->insert_str);
       if (success)
-	op->rsp->status = ss_StatusOK;
+	{
+	  op->rsp->status = ss_StatusOK;
+	  m3_caches_clear(param);
+	  m3_sub_request_resync(param);
+	}
       else
 	op->rsp->status = ss_OperationFailed;
       /* No bnodes to uri mapping from RDF/XML content */
@@ -2619,153 +3606,313 @@ ssStatus_t rdf_writer(scheduler_item* op, sib_data_structure* param)
   return op->rsp->status;
 }
 
-ssStatus_t rdf_retractor(scheduler_item* op, sib_data_structure* param)
+/*
+ * Resolve the remove graph of op to the stored triples it matches.
+ * Nothing is deleted yet, so an operation failing here leaves the
+ * store as it was.
+ */
+ssStatus_t rdf_retractor_resolve(scheduler_item* op, sib_data_structure* param, GSList** rm_list)
 {
   whiteboard_log_debug("Removing in transaction %d\n", op->header->tr_id);
 
-  GSList *i, *rm_list;
-  ssTriple_t* t;
-  m3_triple_int *t_int, *t_int_iter, *tmp;
-  GHashTableIter iter;
-  gchar *key, *key_iter;
-  GHashTable* rm_triples_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
-						      g_free, NULL);
-  rm_list = NULL;
+  GSList *i;
+  ssTriple_t* t;
+  m3_triple_int *t_int, *t_int_iter;
+  GHashTableIter iter;
+  GHashTable* rm_triples_hash = m3_triple_set_new();
+  *rm_list = NULL;
+
+  for (i = op->req->remove_graph; i != NULL; i = i->next)
+    {
+      t = (ssTriple_t*)i->data;
+      if (!t->subject || !t->predicate || !t->object)
+	{
+	  goto error;
+	}
+
+      t_int = ssTriple_t_to_m3_triple_int(param->RDF_store, t, &(op->rsp->status));
+
+      if (op->rsp->status != ss_StatusOK)
+	{
+	  goto error;
+	}
+
+      if (t_int->s == 0 || t_int->p == 0 || t_int->o == 0)
+	{
+	  sib_store_query(param->RDF_store, t_int->s, t_int->p, t_int->o,
+			  triple_callback, &rm_triples_hash);
+	  g_free(t_int);
+ 	}
+      else
+	{
+	  if (NULL != g_hash_table_lookup(rm_triples_hash, t_int))
+	    {
+	      /* Duplicate triple, the first instance stays */
+	      g_free(t_int);
+	    }
+	  else
+	    {
+	      g_hash_table_insert(rm_triples_hash, t_int, t_int);
+	    }
+	  //printf("RDFRETRACTOR: adding to rm_list triple %d %d %d\n", t_int->s, t_int->p, t_int->o);
+	  //rm_list = g_slist_prepend(rm_list, t_int);
+	}
+
+    }
+
+  g_hash_table_iter_init(&iter, rm_triples_hash);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer*)&t_int_iter))
+    {
+      printf("RDFRETRACTOR: adding to rm_list triple %d %d %d from HT\n", t_int_iter->s, t_int_iter->p, t_int_iter->o);
+      *rm_list = g_slist_prepend(*rm_list, t_int_iter);
+    }
+  g_hash_table_destroy(rm_triples_hash);
+  op->rsp->status = ss_StatusOK;
+  return op->rsp->status;
+ error:
+  g_hash_table_iter_init(&iter, rm_triples_hash);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer*)&t_int_iter))
+    {
+      g_free(t_int_iter);
+    }
+  g_hash_table_destroy(rm_triples_hash);
+  op->rsp->status = ss_OperationFailed;
+  return op->rsp->status;
+}
+
+/*
+ * Delete resolved triples from the store
+ */
+void rdf_retractor_apply(sib_data_structure* param, GSList* rm_list)
+{
+  GSList* i;
+  m3_triple_int* t_int;
+
+  for (i = rm_list; i != NULL; i = i->next)
+    {
+      t_int = (m3_triple_int*)i->data;
+      sib_store_del(param->RDF_store, t_int->s, t_int->p, t_int->o);
+      printf("RDFRETRACTOR: Deleted triple %d %d %d\n", t_int->s, t_int->p, t_int->o);
+    }
+}
+
+ssStatus_t rdf_retractor(scheduler_item* op, sib_data_structure* param)
+{
+  GSList* rm_list = NULL;
+
+  if (rdf_retractor_resolve(op, param, &rm_list) != ss_StatusOK)
+    return op->rsp->status;
+
+  sib_store_transaction(param->RDF_store);
+  rdf_retractor_apply(param, rm_list);
+  if (!sib_store_commit(param->RDF_store))
+    {
+      printf("rdf_retractor: commit failed:\n%s\n", sib_store_error(param->RDF_store));
+      sib_store_rollback(param->RDF_store);
+      m3_free_triple_int_list(&rm_list, NULL);
+      op->rsp->status = ss_OperationFailed;
+      return op->rsp->status;
+    }
+  m3_caches_changed(param, rm_list, FALSE);
+  m3_inference_changed(param, rm_list, FALSE);
+  m3_sub_notify_changes(param, rm_list, FALSE);
+
+  //printf("XXX RETRACTOR: Now freeing triple int list in transaction %d\n", op->header->tr_id);
+  m3_free_triple_int_list(&rm_list, NULL);
+  return op->rsp->status;
+}
+
+/*
+ * Resolve a template query to node id patterns. Resolving creates the
+ * nodes not yet in the store, so the patterns stay valid and need not
+ * be resolved again. Must be called with store_lock held and outside
+ * of a store transaction.
+ */
+ssStatus_t m3_template_compile(sib_data_structure* p, GSList* template_query, GSList** patterns)
+{
+  ssTriple_t* tq;
+  m3_triple_int* tq_int;
+  ssStatus_t status = ss_StatusOK;
 
-  for (i = op->req->remove_graph; i != NULL; i = i->next)
+  for ( ; template_query != NULL; template_query = template_query->next)
     {
-      t = (ssTriple_t*)i->data;
-      if (!t->subject || !t->predicate || !t->object)
+      tq = (ssTriple_t*)template_query->data;
+      if (!tq->subject || !tq->predicate || !tq->object)
 	{
-	  goto error;
+	  status = ss_OperationFailed;
+	  break;
 	}
-
-      t_int = ssTriple_t_to_m3_triple_int(param->RDF_store, t, &(op->rsp->status));
-
-      if (op->rsp->status != ss_StatusOK)
+      tq_int = ssTriple_t_to_m3_triple_int(p->RDF_store, tq, &status);
+      if (status != ss_StatusOK)
 	{
-	  goto error;
+	  status = ss_OperationFailed;
+	  break;
 	}
+      *patterns = g_slist_prepend(*patterns, tq_int);
+    }
 
-      if (t_int->s == 0 || t_int->p == 0 || t_int->o == 0)
-	{
-	  piglet_query(param->RDF_store, t_int->s, t_int->p, t_int->o, 0,
-		       &rm_triples_hash, triple_callback);
- 	}
-      else
-	{
-	  key = g_strdup_printf("%d_%d_%d", t_int->s, t_int->p, t_int->o);
-	  tmp = g_hash_table_lookup(rm_triples_hash, key);
-	  if (NULL != tmp)
-	    {
-	      /* Free the previous instance of duplicate triple */
-	      g_free(tmp);
-	      g_hash_table_insert(rm_triples_hash, key, t_int);
-	    }
-	  else
-	    {
-	      g_hash_table_insert(rm_triples_hash, key, t_int);
-	    }
-	  //printf("RDFRETRACTOR: adding to rm_list triple %d %d %d\n", t_int->s, t_int->p, t_int->o);
-	  //rm_list = g_slist_prepend(rm_list, t_int);
-	}
+  if (status != ss_StatusOK)
+    m3_free_triple_int_list(patterns, NULL);
+  return status;
+}
 
-    }
+GSList* m3_template_copy(GSList* patterns)
+{
+  GSList* copy = NULL;
+  m3_triple_int *t, *c;
 
-  g_hash_table_iter_init(&iter, rm_triples_hash);
-  while(g_hash_table_iter_next(&iter, (gpointer*)&key_iter, (gpointer*)&t_int_iter))
+  for ( ; patterns != NULL; patterns = patterns->next)
     {
-      printf("RDFRETRACTOR: adding to rm_list triple %d %d %d from HT\n", t_int_iter->s, t_int_iter->p, t_int_iter->o);
-      rm_list = g_slist_prepend(rm_list, t_int_iter);
+      t = (m3_triple_int*)patterns->data;
+      c = g_new0(m3_triple_int, 1);
+      c->s = t->s;
+      c->p = t->p;
+      c->o = t->o;
+      c->dt = t->dt;
+      c->lang = g_strdup(t->lang);
+      copy = g_slist_prepend(copy, c);
     }
+  return copy;
+}
 
-  for (i = rm_list; i != NULL; i = i->next)
+void m3_template_free(gpointer patterns)
+{
+  GSList* l = (GSList*)patterns;
+  m3_free_triple_int_list(&l, NULL);
+}
+
+/*
+ * Resolve the template query of op to node ids in op->patterns.
+ * Queries repeated with the same query string reuse the patterns
+ * compiled the first time. Called from the scheduler with store_lock
+ * held, as resolving may add nodes to the store.
+ */
+ssStatus_t rdf_reader_prepare(scheduler_item* op, sib_data_structure* p)
+{
+  GSList* patterns;
+  ssStatus_t status = ss_StatusOK;
+  /* The query string of a subscription does not outlive m3_subscribe */
+  gboolean reuse = (op->header->tr_type == M3_QUERY && NULL != op->req->query_str);
+
+  patterns = reuse ? g_hash_table_lookup(p->prepared, op->req->query_str) : NULL;
+  if (NULL != patterns)
     {
-      t_int = (m3_triple_int*)i->data;
-      piglet_del(param->RDF_store, t_int->s, t_int->p, t_int->o, 0, false);
-      printf("RDFRETRACTOR: Deleted triple %d %d %d\n", t_int->s, t_int->p, t_int->o);
-      printf("RDFRETRACTOR: Deleted triple\n %s\n %s\n %s\n", node_to_ssElement_t(param->RDF_store, t_int->s, &(op->rsp->status)),
-	     node_to_ssElement_t(param->RDF_store, t_int->p, &(op->rsp->status)),
-	     node_to_ssElement_t(param->RDF_store, t_int->o, &(op->rsp->status)));
+      op->patterns = m3_template_copy(patterns);
+    }
+  else
+    {
+      status = m3_template_compile(p, op->req->template_query, &(op->patterns));
+      if (status == ss_StatusOK && reuse && NULL != op->patterns)
+	{
+	  /* Forget all at once when full, the queries in use come back soon */
+	  if (g_hash_table_size(p->prepared) >= SIB_PREPARED_QUERIES)
+	    g_hash_table_remove_all(p->prepared);
+	  g_hash_table_insert(p->prepared, g_strdup((gchar*)op->req->query_str),
+			      m3_template_copy(op->patterns));
+	}
     }
 
-  //printf("XXX RETRACTOR: Now freeing triple int list in transaction %d\n", op->header->tr_id);
-  m3_free_triple_int_list(&rm_list, NULL);
-  g_hash_table_destroy(rm_triples_hash);
-  op->rsp->status = ss_StatusOK;
-  return op->rsp->status;
- error:
-  m3_free_triple_int_list(&rm_list, NULL);
-  g_hash_table_destroy(rm_triples_hash);
-  op->rsp->status = ss_OperationFailed;
-  return op->rsp->status;
+  /* Writes are made with store_lock held, so the versions taken here
+     are the ones of the state the query reads */
+  if (status == ss_StatusOK && NULL != op->cache_key)
+    op->cache_stamp = sib_result_cache_stamp(p->results, op->patterns);
+  return status;
 }
 
 ssStatus_t rdf_reader(scheduler_item* op, sib_data_structure* p)
 {
   whiteboard_log_debug("Querying in transaction %d\n", op->header->tr_id);
-  char* str_tmp_exp;
+  gchar* str_tmp_exp;
+
+#if WITH_WQL==1
+  /* WQL is evaluated natively or by the Python layer over the piglet
+     database. Node types are only known to the Python layer. */
+  if ((!p->wql_native || op->req->type == QueryTypeWQLNodeTypes) &&
+      !sib_store_is_piglet(p->RDF_store) &&
+      op->req->type != QueryTypeTemplate &&
+      op->req->type != QueryTypeSPARQLSelect)
+    {
+      op->rsp->status = ss_SIBFailNotImpl;
+      return op->rsp->status;
+    }
+#endif
 
   switch (op->req->type)
     {
     case QueryTypeTemplate:
       {
-	ssTriple_t* tq;
-	m3_triple_int *tq_int, *t;
-	GSList* query_list = op->req->template_query;
+	m3_triple_int* t;
+	GSList *l, *patterns;
 	GHashTableIter iter;
-	gchar* key;
-	GHashTable* results = g_hash_table_new_full(g_str_hash, g_str_equal,
-						    g_free, NULL);
-
-	whiteboard_log_debug("Doing template query");
-	/* Changed if anything goes wrong */
-	op->rsp->status = ss_StatusOK;
-
-	/* Iterate over query here */
-	while (query_list != NULL) {
-	  tq = (ssTriple_t*)query_list->data;
-	  if (!tq->subject || !tq->predicate || !tq->object)
-	    {
-	      op->rsp->status = ss_OperationFailed;
-	      op->rsp->results = NULL;
-	      break;
-	    }
-	  printf("RDF reader: now querying for transaction %d\n", op->header->tr_id);
-	  printf("RDF reader: triple is %s\n%s\n%s\n", tq->subject, tq->predicate, tq->object);
-	  tq_int = ssTriple_t_to_m3_triple_int(p->RDF_store, tq, &(op->rsp->status));
-	  if (op->rsp->status != ss_StatusOK)
-	    {
-	      op->rsp->status = ss_OperationFailed;
-	      op->rsp->results = NULL;
-	      break;
-	    }
-	  piglet_query(p->RDF_store, tq_int->s, tq_int->p, tq_int->o, 0, &results, triple_callback);
+	GHashTable* results;
+	subscription_state* sub = NULL;
 
-	  g_free(tq_int->lang);
-	  g_free(tq_int);
-	  query_list = query_list->next;
-	}
-	if (op->rsp->status == ss_StatusOK)
+	if (op->header->tr_type == M3_SUBSCRIBE)
 	  {
-	    g_hash_table_iter_init(&iter, results);
-  	    while(g_hash_table_iter_next(&iter, (gpointer*)&key, (gpointer*)&t))
+	    sub = (subscription_state*)op->complete_data;
+	    g_mutex_lock(p->subscriptions_lock);
+	    if (sub->indexed && !sub->resync)
 	      {
-		op->rsp->results = g_slist_prepend(op->rsp->results, t);
+		/* Changes since the last round are already in sub->deltas */
+		g_mutex_unlock(p->subscriptions_lock);
+		op->rsp->status = ss_StatusOK;
+		op->rsp->results = NULL;
+		break;
 	      }
-	    g_hash_table_destroy(results);
+	    g_mutex_unlock(p->subscriptions_lock);
+	  }
+
+	whiteboard_log_debug("Doing template query");
+	if (NULL != sub)
+	  {
+	    /* Compiled in m3_subscribe */
+	    patterns = sub->patterns;
+	    op->rsp->status = ss_StatusOK;
 	  }
 	else
 	  {
-	    /* If something went wrong, free results */
-	    g_hash_table_iter_init(&iter, results);
-  	    while(g_hash_table_iter_next(&iter, (gpointer*)&key, (gpointer*)&t))
+	    op->rsp->status = rdf_reader_prepare(op, p);
+	    patterns = op->patterns;
+	  }
+	if (op->rsp->status != ss_StatusOK)
+	  {
+	    op->rsp->results = NULL;
+	    break;
+	  }
+
+	printf("RDF reader: now querying for transaction %d\n", op->header->tr_id);
+	results = m3_triple_set_new();
+	for (l = patterns; l != NULL; l = l->next)
+	  {
+	    t = (m3_triple_int*)l->data;
+	    sib_store_query(p->RDF_store, t->s, t->p, t->o, triple_callback, &results);
+	  }
+
+	op->rsp->results = NULL;
+	g_hash_table_iter_init(&iter, results);
+	while(g_hash_table_iter_next(&iter, NULL, (gpointer*)&t))
+	  {
+	    op->rsp->results = g_slist_prepend(op->rsp->results, t);
+	  }
+	g_hash_table_destroy(results);
+
+	if (NULL != sub)
+	  {
+	    g_mutex_lock(p->subscriptions_lock);
+	    if (!sub->indexed)
 	      {
-		g_free(t);
+		/* From now on the subscription gets changes via the index */
+		sib_sub_index_add(p->sub_index, sub->patterns, sub);
+		sub->indexed = TRUE;
 	      }
-	    g_hash_table_destroy(results);
-	    op->rsp->results = NULL;
+	    /* The full result already contains all earlier changes */
+	    m3_free_delta_list(&(sub->deltas));
+	    sub->n_deltas = 0;
+	    sub->resync = FALSE;
+	    sub->requeried = TRUE;
+	    g_mutex_unlock(p->subscriptions_lock);
 	  }
+	m3_free_triple_int_list(&(op->patterns), NULL);
 	break;
       }
 #if WITH_WQL==1
@@ -2776,6 +3923,7 @@ ssStatus_t rdf_reader(scheduler_item* op, sib_data_structure* p)
 	gchar* path;
 	gint node;
 	ssElementType_t node_type;
+	SibWqlPath* wql_path;
 
 	node_str = op->req->wql_query->wqlType.values.startNode->string;
 	path = op->req->wql_query->wqlType.values.pathExpr;
@@ -2791,24 +3939,39 @@ ssStatus_t rdf_reader(scheduler_item* op, sib_data_structure* p)
 	    op->rsp->results = NULL;
 	    break;
 	  }
-	piglet_transaction(p->RDF_store);
+	sib_store_transaction(p->RDF_store);
 
-	str_tmp_exp = piglet_expand_m3(p->RDF_store, (char*)node_str);
+	str_tmp_exp = sib_store_expand(p->RDF_store, (gchar*)node_str);
 	if (node_type == ssElement_TYPE_URI)
 	  {
-	    node = piglet_node(p->RDF_store, str_tmp_exp);
+	    node = sib_store_node(p->RDF_store, str_tmp_exp);
 	  }
 	else
 	  {
-	    node = piglet_literal(p->RDF_store, str_tmp_exp, 0, NULL);
+	    node = sib_store_literal(p->RDF_store, str_tmp_exp);
 	  }
-	free(str_tmp_exp);
-
-	op->rsp->results = p_call_values(p->p_w, node, path);
-
-	piglet_commit(p->RDF_store);
+	g_free(str_tmp_exp);
 
 	op->rsp->status = ss_StatusOK;
+	if (p->wql_native)
+	  {
+	    wql_path = m3_wql_path(p, path);
+	    if (NULL == wql_path)
+	      op->rsp->status = ss_OperationFailed;
+	    else if (!sib_rdfs_index_values(p->rdfs, p->RDF_store, p->same_as,
+					    sib_wql_path_property(wql_path), node,
+					    &(op->rsp->results)) &&
+		     !sib_same_as_values(p->same_as, p->RDF_store,
+					 sib_wql_path_property(wql_path), node,
+					 &(op->rsp->results)))
+	      op->rsp->results = sib_wql_values(p->RDF_store, p->same_as, wql_path, node);
+	  }
+	else
+	  {
+	    op->rsp->results = p_call_values(p->p_w, node, path);
+	  }
+
+	sib_store_commit(p->RDF_store);
 	break;
       }
     case QueryTypeWQLNodeTypes:
@@ -2824,14 +3987,14 @@ ssStatus_t rdf_reader(scheduler_item* op, sib_data_structure* p)
 	    op->rsp->results = NULL;
 	    break;
 	  }
-	piglet_transaction(p->RDF_store);
+	sib_store_transaction(p->RDF_store);
 
-	str_tmp_exp = piglet_expand_m3(p->RDF_store, (char*)node_str);
-	node = piglet_node(p->RDF_store, str_tmp_exp);
-	free(str_tmp_exp);
+	str_tmp_exp = sib_store_expand(p->RDF_store, (gchar*)node_str);
+	node = sib_store_node(p->RDF_store, str_tmp_exp);
+	g_free(str_tmp_exp);
 	op->rsp->results = p_call_nodetypes(p->p_w, node);
 
-	piglet_commit(p->RDF_store);
+	sib_store_commit(p->RDF_store);
 
 	op->rsp->status = ss_StatusOK;
 	break;
@@ -2844,6 +4007,7 @@ ssStatus_t rdf_reader(scheduler_item* op, sib_data_structure* p)
 	gchar *path;
 	gint source, sink;
 	ssElementType_t source_type, sink_type;
+	SibWqlPath* wql_path;
 
 
 	path = op->req->wql_query->wqlType.related.pathExpr;
@@ -2858,36 +4022,46 @@ ssStatus_t rdf_reader(scheduler_item* op, sib_data_structure* p)
 	    op->rsp->bool_results = false;
 	    break;
 	  }
-	piglet_transaction(p->RDF_store);
+	sib_store_transaction(p->RDF_store);
 
-	str_tmp_exp = piglet_expand_m3(p->RDF_store, (char*)source_str);
+	str_tmp_exp = sib_store_expand(p->RDF_store, (gchar*)source_str);
 
 	if (source_type == ssElement_TYPE_URI)
 	  {
-	    source = piglet_node(p->RDF_store, str_tmp_exp);
+	    source = sib_store_node(p->RDF_store, str_tmp_exp);
 	  }
 	else
 	  {
-	    source = piglet_literal(p->RDF_store, str_tmp_exp, 0, NULL);
+	    source = sib_store_literal(p->RDF_store, str_tmp_exp);
 	  }
-	free(str_tmp_exp);
+	g_free(str_tmp_exp);
 
-	str_tmp_exp = piglet_expand_m3(p->RDF_store, (char*)sink_str);
+	str_tmp_exp = sib_store_expand(p->RDF_store, (gchar*)sink_str);
 	if (sink_type == ssElement_TYPE_URI)
 	  {
-	    sink = piglet_node(p->RDF_store, str_tmp_exp);
+	    sink = sib_store_node(p->RDF_store, str_tmp_exp);
 	  }
 	else
 	  {
-	    sink = piglet_literal(p->RDF_store, str_tmp_exp, 0, NULL);
+	    sink = sib_store_literal(p->RDF_store, str_tmp_exp);
 	  }
-	free(str_tmp_exp);
-
-	op->rsp->bool_results = p_call_related(p->p_w, source, path, sink);
-
-	piglet_commit(p->RDF_store);
+	g_free(str_tmp_exp);
 
 	op->rsp->status = ss_StatusOK;
+	if (p->wql_native)
+	  {
+	    wql_path = m3_wql_path(p, path);
+	    if (NULL != wql_path)
+	      op->rsp->bool_results = sib_wql_related(p->RDF_store, wql_path, source, sink);
+	    else
+	      op->rsp->status = ss_OperationFailed;
+	  }
+	else
+	  {
+	    op->rsp->bool_results = p_call_related(p->p_w, source, path, sink);
+	  }
+
+	sib_store_commit(p->RDF_store);
 	break;
       }
     case QueryTypeWQLIsType:
@@ -2904,19 +4078,22 @@ ssStatus_t rdf_reader(scheduler_item* op, sib_data_structure* p)
 	    op->rsp->bool_results = false;
 	    break;
 	  }
-	piglet_transaction(p->RDF_store);
+	sib_store_transaction(p->RDF_store);
 
-	str_tmp_exp = piglet_expand_m3(p->RDF_store, (char*)node_str);
-	node = piglet_node(p->RDF_store, str_tmp_exp);
-	free(str_tmp_exp);
+	str_tmp_exp = sib_store_expand(p->RDF_store, (gchar*)node_str);
+	node = sib_store_node(p->RDF_store, str_tmp_exp);
+	g_free(str_tmp_exp);
 
-	str_tmp_exp = piglet_expand_m3(p->RDF_store, (char*)type_str);
-	type = piglet_node(p->RDF_store, str_tmp_exp);
-	free(str_tmp_exp);
+	str_tmp_exp = sib_store_expand(p->RDF_store, (gchar*)type_str);
+	type = sib_store_node(p->RDF_store, str_tmp_exp);
+	g_free(str_tmp_exp);
 
-	op->rsp->bool_results = p_call_istype(p->p_w, node, type);
+	if (p->wql_native)
+	  op->rsp->bool_results = sib_rdfs_index_is_type(p->rdfs, p->RDF_store, node, type);
+	else
+	  op->rsp->bool_results = p_call_istype(p->p_w, node, type);
 
-	piglet_commit(p->RDF_store);
+	sib_store_commit(p->RDF_store);
 
 	op->rsp->status = ss_StatusOK;
 	break;
@@ -2935,20 +4112,24 @@ ssStatus_t rdf_reader(scheduler_item* op, sib_data_structure* p)
 	    op->rsp->bool_results = false;
 	    break;
 	  }
-	piglet_transaction(p->RDF_store);
+	sib_store_transaction(p->RDF_store);
 
 
-	str_tmp_exp = piglet_expand_m3(p->RDF_store, (char*)sub_str);
-	sub = piglet_node(p->RDF_store, str_tmp_exp);
-	free(str_tmp_exp);
+	str_tmp_exp = sib_store_expand(p->RDF_store, (gchar*)sub_str);
+	sub = sib_store_node(p->RDF_store, str_tmp_exp);
+	g_free(str_tmp_exp);
 
-	str_tmp_exp = piglet_expand_m3(p->RDF_store, (char*)super_str);
-	super = piglet_node(p->RDF_store, str_tmp_exp);
-	free(str_tmp_exp);
+	str_tmp_exp = sib_store_expand(p->RDF_store, (gchar*)super_str);
+	super = sib_store_node(p->RDF_store, str_tmp_exp);
+	g_free(str_tmp_exp);
 
-	op->rsp->bool_results = p_call_issubtype(p->p_w, sub, super);
+	if (p->wql_native)
+	  op->rsp->bool_results = sib_rdfs_index_is_subclass(p->rdfs, p->RDF_store,
+							     sub, super);
+	else
+	  op->rsp->bool_results = p_call_issubtype(p->p_w, sub, super);
 
-	piglet_commit(p->RDF_store);
+	sib_store_commit(p->RDF_store);
 
 	op->rsp->status = ss_StatusOK;
 	break;
@@ -2972,10 +4153,9 @@ ssStatus_t rdf_reader(scheduler_item* op, sib_data_structure* p)
 
   if (op->header->tr_type == M3_SUBSCRIBE && op->rsp->status == ss_StatusOK)
     {
-      subscription_state* s;
+      subscription_state* s = (subscription_state*)op->complete_data;
       g_mutex_lock(p->subscriptions_lock);
-      s = g_hash_table_lookup(p->subs, op->rsp->sub_id);
-      if (NULL != s && s->status != M3_SUB_STOPPED)
+      if (s->status != M3_SUB_STOPPED)
 	{
 	  s->status = M3_SUB_ONGOING;
 	  printf("Set subscription %s to ongoing\n", s->sub_id); /* SUB_DEBUG */
@@ -2985,6 +4165,14 @@ ssStatus_t rdf_reader(scheduler_item* op, sib_data_structure* p)
   return op->rsp->status;
 }
 
+/*
+ * Hand a processed operation to its completion callback
+ */
+void scheduler_item_done(scheduler_item* op, sib_data_structure* p)
+{
+  g_thread_pool_push(p->completion_pool, op, NULL);
+}
+
 void do_insert(gpointer op_param, gpointer p_param)
 {
   scheduler_item* op = (scheduler_item*) op_param;
@@ -2992,106 +4180,297 @@ void do_insert(gpointer op_param, gpointer p_param)
   switch (op->header->tr_type)
     {
     case M3_INSERT:
-      g_mutex_lock(op->op_lock);
       g_mutex_lock(p->store_lock);
       whiteboard_log_debug("Beginning to insert for transaction %d\n", op->header->tr_id);
       rdf_writer(op, p);
       whiteboard_log_debug("Done inserting for transaction %d\n", op->header->tr_id);
       g_mutex_unlock(p->store_lock);
-      op->op_complete = TRUE;
-      // printf("Now signaling transaction %d for finished operation\n", op->header->tr_id);
-      g_cond_signal(op->op_cond);
-      g_mutex_unlock(op->op_lock);
       break;
     case M3_REMOVE:
-      g_mutex_lock(op->op_lock);
       g_mutex_lock(p->store_lock);
       whiteboard_log_debug("Beginning to remove for transaction %d\n", op->header->tr_id);
       rdf_retractor(op, p);
       whiteboard_log_debug("Done removing for transaction %d\n", op->header->tr_id);
       g_mutex_unlock(p->store_lock);
-      op->op_complete = TRUE;
-      g_cond_signal(op->op_cond);
-      g_mutex_unlock(op->op_lock);
       break;
     case M3_UPDATE:
-      g_mutex_lock(op->op_lock);
       g_mutex_lock(p->store_lock);
       whiteboard_log_debug("Beginning to update for transaction %d\n", op->header->tr_id);
-      rdf_retractor(op, p);
-      rdf_writer(op, p);
+      /* A failed removal is not hidden by the status of the insert */
+      if (rdf_retractor(op, p) == ss_StatusOK)
+	rdf_writer(op, p);
       whiteboard_log_debug("Done updating for transaction %d\n", op->header->tr_id);
       g_mutex_unlock(p->store_lock);
-      op->op_complete = TRUE;
-      g_cond_signal(op->op_cond);
-      g_mutex_unlock(op->op_lock);
       break;
 
       /*AD-ARCES*/
       case M3_PROTECTION_FAULT:
             /* SIB PROTECTION FAULT CASE */
           	printf("----> SIB PROTECTION FAULT CASE\n");
-            g_mutex_lock(op->op_lock);
 
             /*AD-ARCES*/
             op->rsp->status = ss_SIBProtectionFault;// ss_SIBFailAccessDenied;// ss_InvalidParameter;// ss_OperationFailed;//
-
-            /*AD-ARCES*/
-            op->op_complete = TRUE; //FALSE; //it is just for lock purpose
-
-
-            g_cond_signal(op->op_cond);
-            g_mutex_unlock(op->op_lock);
             break;
 
 
     default:
       /* ERROR CASE */
-      g_mutex_lock(op->op_lock);
       op->rsp->status = ss_InvalidParameter;
-      op->op_complete = TRUE;
-      g_cond_signal(op->op_cond);
-      g_mutex_unlock(op->op_lock);
       break;
     }
+  /* The requester is replied from the completion pool */
+  scheduler_item_done(op, p);
+}
+
+/* Changes of one operation in a group commit, delivered to
+   subscriptions once the group is committed */
+typedef struct {
+  GSList* triples;
+  gboolean added;
+} m3_change_batch;
+
+/*
+ * Apply RDF/M3 inserts, removes and updates in one store transaction.
+ * Each operation is resolved completely before anything of it is
+ * applied, so a failing operation is left out of the transaction
+ * without affecting the others. Requesters are replied after commit.
+ */
+void do_insert_group(GSList* group, sib_data_structure* p)
+{
+  GSList *l, *changes = NULL;
+  GSList *added, *removed;
+  scheduler_item* op;
+  m3_change_batch* c;
+  ssStatus_t status;
+
+  g_mutex_lock(p->store_lock);
+  whiteboard_log_debug("Beginning group commit of %d operations\n", g_slist_length(group));
+  sib_store_transaction(p->RDF_store);
+  for (l = group; l != NULL; l = l->next)
+    {
+      op = (scheduler_item*)l->data;
+      added = NULL;
+      removed = NULL;
+      status = ss_StatusOK;
+
+      if (op->header->tr_type != M3_REMOVE)
+	status = rdf_writer_resolve(op, p, &added);
+      if (status == ss_StatusOK && op->header->tr_type != M3_INSERT)
+	status = rdf_retractor_resolve(op, p, &removed);
+      if (status != ss_StatusOK)
+	{
+	  whiteboard_log_debug("Left transaction %d out of group commit\n", op->header->tr_id);
+	  m3_free_triple_int_list(&added, NULL);
+	  m3_free_triple_int_list(&removed, NULL);
+	  continue;
+	}
+
+      if (NULL != removed)
+	{
+	  rdf_retractor_apply(p, removed);
+	  c = g_new0(m3_change_batch, 1);
+	  c->triples = removed;
+	  c->added = FALSE;
+	  changes = g_slist_prepend(changes, c);
+	}
+      if (NULL != added)
+	{
+	  rdf_writer_apply(p, added);
+	  c = g_new0(m3_change_batch, 1);
+	  c->triples = added;
+	  c->added = TRUE;
+	  changes = g_slist_prepend(changes, c);
+	}
+    }
+
+  changes = g_slist_reverse(changes);
+  if (sib_store_commit(p->RDF_store))
+    {
+      for (l = changes; l != NULL; l = l->next)
+	{
+	  c = (m3_change_batch*)l->data;
+	  m3_caches_changed(p, c->triples, c->added);
+	  m3_inference_changed(p, c->triples, c->added);
+	  m3_sub_notify_changes(p, c->triples, c->added);
+	}
+    }
+  else
+    {
+      printf("Group commit failed:\n%s\n", sib_store_error(p->RDF_store));
+      sib_store_rollback(p->RDF_store);
+      for (l = group; l != NULL; l = l->next)
+	((scheduler_item*)l->data)->rsp->status = ss_OperationFailed;
+    }
+  whiteboard_log_debug("Done group commit\n");
+  g_mutex_unlock(p->store_lock);
+
+  for (l = changes; l != NULL; l = l->next)
+    {
+      c = (m3_change_batch*)l->data;
+      m3_free_triple_int_list(&(c->triples), NULL);
+      g_free(c);
+    }
+  g_slist_free(changes);
+
+  g_slist_foreach(group, (GFunc)scheduler_item_done, p);
+}
+
+/*
+ * Process the insert list of a scheduler round in arrival order.
+ * Runs of RDF/M3 operations are group committed, RDF/XML loads and
+ * rejected operations are processed one by one in between.
+ */
+void do_insert_list(GSList* i_list, sib_data_structure* p)
+{
+  GSList *l, *group = NULL;
+  scheduler_item* op;
+  gboolean m3xml;
+
+  for (l = i_list; l != NULL; l = l->next)
+    {
+      op = (scheduler_item*)l->data;
+      m3xml = (op->header->tr_type == M3_REMOVE ||
+	       ((op->header->tr_type == M3_INSERT ||
+		 op->header->tr_type == M3_UPDATE) &&
+		op->req->encoding == EncodingM3XML));
+      if (m3xml)
+	{
+	  group = g_slist_prepend(group, op);
+	  continue;
+	}
+      if (NULL != group)
+	{
+	  group = g_slist_reverse(group);
+	  do_insert_group(group, p);
+	  g_slist_free(group);
+	  group = NULL;
+	}
+      do_insert(op, p);
+    }
+  if (NULL != group)
+    {
+      group = g_slist_reverse(group);
+      do_insert_group(group, p);
+      g_slist_free(group);
+    }
+}
+
+/*
+ * Runs completion callbacks of processed operations
+ */
+void run_completion(gpointer op_param, gpointer p_param)
+{
+  scheduler_item* op = (scheduler_item*) op_param;
+  op->complete(op, (sib_data_structure*) p_param);
+}
+
+/*
+ * Reader pool function: run a prepared template query in a read
+ * transaction of the thread's own store handle. The scheduler's
+ * commits wait for the transaction, so keep it to the query itself.
+ */
+void rdf_snapshot_reader(gpointer op_param, gpointer p_param)
+{
+  scheduler_item* op = (scheduler_item*) op_param;
+  sib_data_structure* p = (sib_data_structure*) p_param;
+  SibStore* store;
+  GSList* l;
+  m3_triple_int* t;
+  GHashTable* results;
+  GHashTableIter iter;
+
+  store = sib_reader_store(p);
+  if (NULL == store)
+    {
+      /* No own handle, read the main store */
+      g_mutex_lock(p->store_lock);
+      store = p->RDF_store;
+    }
+
+  whiteboard_log_debug("Beginning to query snapshot for transaction %d\n", op->header->tr_id);
+  results = m3_triple_set_new();
+  sib_store_transaction(store);
+  for (l = op->patterns; l != NULL; l = l->next)
+    {
+      t = (m3_triple_int*)l->data;
+      sib_store_query(store, t->s, t->p, t->o, triple_callback, &results);
+    }
+  sib_store_commit(store);
+
+  if (store == p->RDF_store)
+    g_mutex_unlock(p->store_lock);
+
+  op->rsp->results = NULL;
+  g_hash_table_iter_init(&iter, results);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer*)&t))
+    {
+      op->rsp->results = g_slist_prepend(op->rsp->results, t);
+    }
+  g_hash_table_destroy(results);
+  m3_free_triple_int_list(&(op->patterns), NULL);
+  op->rsp->status = ss_StatusOK;
+  whiteboard_log_debug("Done querying snapshot for transaction %d\n", op->header->tr_id);
+
+  scheduler_item_done(op, p);
 }
 
 void do_query(gpointer op_param, gpointer p_param)
 {
   scheduler_item* op = (scheduler_item*) op_param;
   sib_data_structure* p = (sib_data_structure*) p_param;
+
+  /* Template queries are only resolved here and run in the reader
+     pool, so that they neither wait for nor delay the writes.
+     Subscriptions stay here as their results must line up with the
+     changes delivered through the subscription index. */
+  if (NULL != p->reader_pool &&
+      op->header->tr_type == M3_QUERY &&
+      op->req->type == QueryTypeTemplate)
+    {
+      g_mutex_lock(p->store_lock);
+      op->rsp->status = rdf_reader_prepare(op, p);
+      g_mutex_unlock(p->store_lock);
+      if (op->rsp->status == ss_StatusOK)
+	{
+	  g_thread_pool_push(p->reader_pool, op, NULL);
+	}
+      else
+	{
+	  op->rsp->results = NULL;
+	  scheduler_item_done(op, p);
+	}
+      return;
+    }
+
   switch (op->header->tr_type)
     {
     /* Query and subscribe handled similarly at this level (for now) */
     case M3_SUBSCRIBE:
       /* Fallthrough */
     case M3_QUERY:
-      g_mutex_lock(op->op_lock);
       g_mutex_lock(p->store_lock);
       whiteboard_log_debug("Beginning to query for transaction %d\n", op->header->tr_id);
       rdf_reader(op,p);
       whiteboard_log_debug("Done querying for transaction %d\n", op->header->tr_id);
       g_mutex_unlock(p->store_lock);
-      op->op_complete = TRUE;
-      g_cond_signal(op->op_cond);
-      g_mutex_unlock(op->op_lock);
       break;
     default:
       /* ERROR CASE */
-      g_mutex_lock(op->op_lock);
       op->rsp->status = ss_InvalidParameter;
-      op->op_complete = TRUE;
-      g_cond_signal(op->op_cond);
-      g_mutex_unlock(op->op_lock);
       break;
     }
+  scheduler_item_done(op, p);
 }
 
-void set_sub_to_pending(gpointer sub_id, gpointer sub_data, gpointer unused)
+void set_sub_to_pending(gpointer sub_id, gpointer sub_data, gpointer marked)
 {
   subscription_state* s = (subscription_state*)sub_data;
+  /* Template subscriptions are set pending through the subscription index */
+  if (s->type == QueryTypeTemplate)
+    return;
   if (s->status != M3_SUB_STOPPED)
     s->status = M3_SUB_PENDING;
+  *(gboolean*)marked = TRUE;
   printf("Set subscription %s to pending\n", s->sub_id); /* SUB_DEBUG */
 
 }
@@ -3125,7 +4504,6 @@ gpointer scheduler(gpointer data)
   GCond* new_reqs_cond = p->new_reqs_cond;
   GMutex* new_reqs_lock = p->new_reqs_lock;
   /* gboolean new_reqs = p->new_reqs; */
-  GHashTable* subs = p->subs;
   GMutex* subscriptions_lock = p->subscriptions_lock;
 
 #if WITH_WQL==1
@@ -3135,12 +4513,22 @@ gpointer scheduler(gpointer data)
 #endif /* WITH_WQL */
 
   gboolean updated = false;
+  gboolean marked = false;
+  /* Earliest round of a subscription delayed for coalescing */
+  gboolean delayed = FALSE;
+  gint64 due = 0;
+  gint64 now;
+  GTimeVal due_time;
 
   GSList* i_list = NULL;
   GSList* q_list = NULL;
+  /* Subscriptions waiting for something to change */
+  GSList* parked = NULL;
+  GSList *l, *next;
   /* GSList* s_list = NULL; */
 
   scheduler_item* op;
+  subscription_state* sub;
 
 #if WITH_WQL==1
   g_mutex_lock(p->scheduler_init_lock);
@@ -3179,7 +4567,16 @@ gpointer scheduler(gpointer data)
     g_mutex_lock(new_reqs_lock);
     while (!(p->new_reqs))
       {
-	g_cond_wait(new_reqs_cond, new_reqs_lock);
+	if (!delayed)
+	  {
+	    g_cond_wait(new_reqs_cond, new_reqs_lock);
+	    continue;
+	  }
+	due_time.tv_sec = due / G_USEC_PER_SEC;
+	due_time.tv_usec = due % G_USEC_PER_SEC;
+	/* A delayed subscription is due */
+	if (!g_cond_timed_wait(new_reqs_cond, new_reqs_lock, &due_time))
+	  break;
       }
     p->new_reqs = FALSE;
     g_mutex_unlock(new_reqs_lock);
@@ -3236,18 +4633,62 @@ gpointer scheduler(gpointer data)
     /*
      * Process both inserts and queries
      */
-    g_slist_foreach(i_list, do_insert, p);
+    /* Items were prepended, process them in arrival order */
+    i_list = g_slist_reverse(i_list);
+    do_insert_list(i_list, p);
     g_slist_free(i_list);
     i_list = NULL;
 
+    /* Inference of the round, after its writes are committed */
+    m3_post_process(p);
+
     if (updated)
       {
+	marked = false;
 	g_mutex_lock(subscriptions_lock);
-	g_hash_table_foreach(subs, set_sub_to_pending, NULL);
+	g_hash_table_foreach(p->sub_groups, set_sub_to_pending, &marked);
 	g_mutex_unlock(subscriptions_lock);
-	printf("RDF store updated, set all subscriptions to pending\n"); /* SUB_DEBUG */
+	printf("RDF store updated, set non-template subscriptions to pending\n"); /* SUB_DEBUG */
 	updated = false;
+
+	/* Run another round for subscriptions queued after this one started */
+	if (marked)
+	  {
+	    g_mutex_lock(new_reqs_lock);
+	    p->new_reqs = TRUE;
+	    g_mutex_unlock(new_reqs_lock);
+	  }
+      }
+
+    /*
+     * Subscriptions whose results cannot have changed are parked
+     * until they are set pending or stopped, and so are those
+     * waiting for their minimum indication interval until it is over
+     */
+    q_list = g_slist_concat(q_list, parked);
+    parked = NULL;
+    delayed = FALSE;
+    now = m3_now();
+    g_mutex_lock(subscriptions_lock);
+    for (l = q_list; l != NULL; l = next)
+      {
+	next = l->next;
+	op = (scheduler_item*)l->data;
+	if (op->header->tr_type != M3_SUBSCRIBE)
+	  continue;
+	sub = (subscription_state*)op->complete_data;
+	if (m3_sub_delayed(sub, now))
+	  {
+	    if (!delayed || sub->next_round < due)
+	      due = sub->next_round;
+	    delayed = TRUE;
+	  }
+	else if (sub->status != M3_SUB_ONGOING)
+	  continue;
+	q_list = g_slist_delete_link(q_list, l);
+	parked = g_slist_prepend(parked, op);
       }
+    g_mutex_unlock(subscriptions_lock);
 
     /* Process plugin reasoners here */
 
@@ -3277,6 +4718,11 @@ sib_data_structure* sib_initialize(gchar* name)
 {
 
   sib_data_structure* sd;
+  const gchar* env;
+#if WITH_WQL==1
+  const gchar* store_env;
+  const gchar* wql_env;
+#endif /* WITH_WQL */
 
   /* Allocate sib data structures */
 
@@ -3314,6 +4760,22 @@ sib_data_structure* sib_initialize(gchar* name)
   sd->subs = g_hash_table_new(g_str_hash, g_str_equal);
   if (NULL == sd->subs) exit(-1);
 
+  sd->sub_groups = g_hash_table_new(g_str_hash, g_str_equal);
+  if (NULL == sd->sub_groups) exit(-1);
+
+  sd->sub_index = sib_sub_index_new();
+  if (NULL == sd->sub_index) exit(-1);
+
+  sd->prepared = g_hash_table_new_full(g_str_hash, g_str_equal,
+				       g_free, m3_template_free);
+  if (NULL == sd->prepared) exit(-1);
+
+  sd->results = sib_result_cache_new(SIB_CACHED_RESULTS);
+  if (NULL == sd->results) exit(-1);
+
+  sd->inferences = m3_triple_set_new();
+  if (NULL == sd->inferences) exit(-1);
+
   sd->members_lock = g_mutex_new();
   if (NULL == sd->members_lock) exit(-1);
 
@@ -3331,6 +4793,16 @@ sib_data_structure* sib_initialize(gchar* name)
 
   sd->new_reqs = FALSE;
 
+  env = g_getenv("SIB_SUB_MIN_INTERVAL");
+  if (NULL != env)
+    sd->sub_min_interval = MAX(atoi(env), 0);
+  env = g_getenv("SIB_SUB_MAX_BATCH");
+  if (NULL != env)
+    sd->sub_max_batch = MAX(atoi(env), 0);
+
+  sd->completion_pool = g_thread_pool_new(run_completion, sd,
+					  SIB_COMPLETION_THREADS, TRUE, NULL);
+  if (NULL == sd->completion_pool) exit(-1);
 
   /* Start scheduler */
   g_thread_create(scheduler, sd, FALSE, NULL);
@@ -3342,14 +4814,50 @@ sib_data_structure* sib_initialize(gchar* name)
     g_cond_wait(sd->scheduler_init_cond, sd->scheduler_init_lock);
   g_mutex_unlock(sd->scheduler_init_lock);
 
-  sd->RDF_store = p_call_get_db(sd->p_w);
+  /* The Python layer has opened the piglet database already */
+  store_env = g_getenv("SIB_STORE");
+  if (NULL == store_env || 0 == strcmp(store_env, "piglet"))
+    sd->RDF_store = sib_store_piglet_wrap(p_call_get_db(sd->p_w));
+  else
+    sd->RDF_store = sib_store_open(sd->ss_name);
+  if (NULL == sd->RDF_store) exit(-1);
+
+  /* The Python layer stays the default over piglet until the native
+     engine gives the same results, SIB_WQL=native selects the native
+     one. The Python layer only works over piglet. */
+  wql_env = g_getenv("SIB_WQL");
+  sd->wql_native = ((NULL != wql_env && 0 == strcmp(wql_env, "native")) ||
+		    !sib_store_is_piglet(sd->RDF_store));
+  sd->wql_paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					(GDestroyNotify)sib_wql_path_free);
+  if (NULL == sd->wql_paths) exit(-1);
+  sd->rdfs = sib_rdfs_index_new(SIB_RDFS_INDEXED_NODES);
+  sd->same_as = sib_same_as_new();
 #else /* WITH_WQL */
 
-  sd->RDF_store = piglet_open(sd->ss_name);
+  sd->RDF_store = sib_store_open(sd->ss_name);
   if (NULL == sd->RDF_store) exit(-1);
 
 #endif /* WITH_WQL */
 
+#if SIB_READER_THREADS > 0
+  /* Without reader handles the queries stay in the scheduler, under
+     store_lock, and do not run in parallel with writes. Only the
+     memory engine has reader handles (SIB_STORE=memory[:path]). */
+  if (!sib_store_has_readers(sd->RDF_store))
+    whiteboard_log_warning("Store has no reader handles, template queries "
+			   "are not run in parallel with writes\n");
+  else
+    {
+      sd->reader_store = g_private_new((GDestroyNotify)sib_store_close);
+      if (NULL == sd->reader_store) exit(-1);
+
+      sd->reader_pool = g_thread_pool_new(rdf_snapshot_reader, sd,
+					  SIB_READER_THREADS, TRUE, NULL);
+      if (NULL == sd->reader_pool) exit(-1);
+    }
+#endif /* SIB_READER_THREADS */
+
 #if WITH_WQL==1
   g_mutex_free(sd->scheduler_init_lock);
   g_cond_free(sd->scheduler_init_cond);
@@ -0,0 +1,510 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_rdfs_index.c
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <glib.h>
+
+#include "sib_operations.h"
+#include "sib_rdfs_index.h"
+
+#define RDF_NS "http://www.w3.org/1999/02/22-rdf-syntax-ns#"
+#define RDFS_NS "http://www.w3.org/2000/01/rdf-schema#"
+
+/*
+ * The sets of nodes below are hash tables with each node as both key
+ * and value. 0 is never a node.
+ */
+struct _SibRdfsIndex
+{
+  /* Whether the vocabulary has been looked up since the schema last
+     changed, nothing else is kept without it */
+  gboolean valid;
+  gint type;
+  gint subclass;
+  gint subprop;
+  gint resource;
+  /* The properties standing for rdf:type, rdfs:subClassOf,
+     rdfs:domain and rdfs:range: each of them and its subproperties */
+  GHashTable* type_props;
+  GHashTable* subclass_props;
+  GHashTable* domain_props;
+  GHashTable* range_props;
+  /* Class -> set of its superclasses, the class included and
+     rdfs:Resource left out */
+  GHashTable* supers;
+  /* Property -> set of the types its subjects get from its domains */
+  GHashTable* domain_types;
+  /* Property -> set of the types its objects get from its ranges */
+  GHashTable* range_types;
+  /* Node -> set of its types, rdfs:Resource left out */
+  GHashTable* types;
+  guint size;
+};
+
+typedef struct
+{
+  GArray* out;
+  /* 0, 1 or 2: collect subjects, predicates or objects */
+  gint which;
+} SibRdfsCollect;
+
+/* Private functions */
+
+static GHashTable* sib_rdfs_set_new(void)
+{
+  return g_hash_table_new(g_direct_hash, g_direct_equal);
+}
+
+static void sib_rdfs_set_add(GHashTable* set, gint node)
+{
+  g_hash_table_insert(set, GINT_TO_POINTER(node), GINT_TO_POINTER(node));
+}
+
+static gboolean sib_rdfs_set_has(GHashTable* set, gint node)
+{
+  return NULL != g_hash_table_lookup(set, GINT_TO_POINTER(node));
+}
+
+static void sib_rdfs_set_union(GHashTable* to, GHashTable* from)
+{
+  GHashTableIter iter;
+  gpointer key;
+
+  if (to == from)
+    return;
+  g_hash_table_iter_init(&iter, from);
+  while (g_hash_table_iter_next(&iter, &key, NULL))
+    g_hash_table_insert(to, key, key);
+}
+
+static GHashTable* sib_rdfs_table_new(void)
+{
+  return g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+			       (GDestroyNotify)g_hash_table_destroy);
+}
+
+static gboolean sib_rdfs_collect(gint s, gint p, gint o, gpointer data)
+{
+  SibRdfsCollect* c = (SibRdfsCollect*)data;
+  gint node = (c->which == 0) ? s : ((c->which == 1) ? p : o);
+  g_array_append_val(c->out, node);
+  return TRUE;
+}
+
+/* Subjects, predicates or objects of the triples matching a pattern */
+static GArray* sib_rdfs_query(SibStore* store, gint s, gint p, gint o, gint which)
+{
+  SibRdfsCollect c;
+
+  c.out = g_array_new(FALSE, FALSE, sizeof(gint));
+  c.which = which;
+  sib_store_query(store, s, p, o, sib_rdfs_collect, &c);
+  return c.out;
+}
+
+/*
+ * Nodes reached from node by repeating any of props, forwards or
+ * backwards, node included
+ */
+static GHashTable* sib_rdfs_closure(SibStore* store, gint node, GHashTable* props,
+				    gboolean backward)
+{
+  GHashTable* seen = sib_rdfs_set_new();
+  GArray* queue = g_array_new(FALSE, FALSE, sizeof(gint));
+  GArray* found;
+  GHashTableIter iter;
+  gpointer prop;
+  guint i, j;
+  gint n, m;
+
+  g_array_append_val(queue, node);
+  sib_rdfs_set_add(seen, node);
+  for (i = 0; i < queue->len; i++)
+    {
+      n = g_array_index(queue, gint, i);
+      g_hash_table_iter_init(&iter, props);
+      while (g_hash_table_iter_next(&iter, &prop, NULL))
+	{
+	  if (backward)
+	    found = sib_rdfs_query(store, 0, GPOINTER_TO_INT(prop), n, 0);
+	  else
+	    found = sib_rdfs_query(store, n, GPOINTER_TO_INT(prop), 0, 2);
+	  for (j = 0; j < found->len; j++)
+	    {
+	      m = g_array_index(found, gint, j);
+	      if (sib_rdfs_set_has(seen, m))
+		continue;
+	      sib_rdfs_set_add(seen, m);
+	      g_array_append_val(queue, m);
+	    }
+	  g_array_free(found, TRUE);
+	}
+    }
+  g_array_free(queue, TRUE);
+  return seen;
+}
+
+/* A property and its subproperties, as the WQL rewrite expands it */
+static GHashTable* sib_rdfs_subprops(SibRdfsIndex* self, SibStore* store, const gchar* uri)
+{
+  GHashTable* subprop = sib_rdfs_set_new();
+  GHashTable* props;
+
+  sib_rdfs_set_add(subprop, self->subprop);
+  props = sib_rdfs_closure(store, sib_store_resolve(store, uri, FALSE), subprop, TRUE);
+  g_hash_table_destroy(subprop);
+  return props;
+}
+
+static void sib_rdfs_forget(SibRdfsIndex* self)
+{
+  g_hash_table_remove_all(self->supers);
+  g_hash_table_remove_all(self->domain_types);
+  g_hash_table_remove_all(self->range_types);
+  g_hash_table_remove_all(self->types);
+}
+
+static void sib_rdfs_drop_all(SibRdfsIndex* self)
+{
+  if (!self->valid)
+    return;
+  sib_rdfs_forget(self);
+  g_hash_table_destroy(self->type_props);
+  g_hash_table_destroy(self->subclass_props);
+  g_hash_table_destroy(self->domain_props);
+  g_hash_table_destroy(self->range_props);
+  self->type_props = NULL;
+  self->subclass_props = NULL;
+  self->domain_props = NULL;
+  self->range_props = NULL;
+  self->valid = FALSE;
+}
+
+/*
+ * Looks up the vocabulary if needed, at the start of every lookup.
+ * Forgets all entries at once when full: the sets handed out by the
+ * functions below stay valid until the next lookup.
+ */
+static void sib_rdfs_prepare(SibRdfsIndex* self, SibStore* store)
+{
+  if (self->valid)
+    {
+      if (g_hash_table_size(self->supers) + g_hash_table_size(self->types) +
+	  g_hash_table_size(self->domain_types) +
+	  g_hash_table_size(self->range_types) >= self->size)
+	sib_rdfs_forget(self);
+      return;
+    }
+
+  self->type = sib_store_resolve(store, RDF_NS "type", FALSE);
+  self->subclass = sib_store_resolve(store, RDFS_NS "subClassOf", FALSE);
+  self->subprop = sib_store_resolve(store, RDFS_NS "subPropertyOf", FALSE);
+  self->resource = sib_store_resolve(store, RDFS_NS "Resource", FALSE);
+  self->type_props = sib_rdfs_subprops(self, store, RDF_NS "type");
+  self->subclass_props = sib_rdfs_subprops(self, store, RDFS_NS "subClassOf");
+  self->domain_props = sib_rdfs_subprops(self, store, RDFS_NS "domain");
+  self->range_props = sib_rdfs_subprops(self, store, RDFS_NS "range");
+  self->valid = TRUE;
+}
+
+/* Superclasses of a class, rep*(rdfs:subClassOf) from it */
+static GHashTable* sib_rdfs_supers(SibRdfsIndex* self, SibStore* store, gint cls)
+{
+  GHashTable* set = g_hash_table_lookup(self->supers, GINT_TO_POINTER(cls));
+
+  if (NULL == set)
+    {
+      set = sib_rdfs_closure(store, cls, self->subclass_props, FALSE);
+      g_hash_table_insert(self->supers, GINT_TO_POINTER(cls), set);
+    }
+  return set;
+}
+
+/* Types given by the domains (or ranges) of a property */
+static GHashTable* sib_rdfs_prop_types(SibRdfsIndex* self, SibStore* store,
+				       GHashTable* table, GHashTable* props, gint prop)
+{
+  GHashTable* set = g_hash_table_lookup(table, GINT_TO_POINTER(prop));
+  GHashTableIter iter;
+  GArray* classes;
+  gpointer p;
+  guint i;
+
+  if (NULL != set)
+    return set;
+
+  set = sib_rdfs_set_new();
+  g_hash_table_iter_init(&iter, props);
+  while (g_hash_table_iter_next(&iter, &p, NULL))
+    {
+      classes = sib_rdfs_query(store, prop, GPOINTER_TO_INT(p), 0, 2);
+      for (i = 0; i < classes->len; i++)
+	sib_rdfs_set_union(set, sib_rdfs_supers(self, store, g_array_index(classes, gint, i)));
+      g_array_free(classes, TRUE);
+    }
+  g_hash_table_insert(table, GINT_TO_POINTER(prop), set);
+  return set;
+}
+
+/* Types of a node, the values of the rewritten rdf:type path but
+   rdfs:Resource. Resource is only in the set if reached through
+   rdfs:subClassOf, so that its superclasses are added with it. */
+static GHashTable* sib_rdfs_types(SibRdfsIndex* self, SibStore* store, gint node)
+{
+  GHashTable* set = g_hash_table_lookup(self->types, GINT_TO_POINTER(node));
+  GHashTableIter iter;
+  GArray* found;
+  gpointer p;
+  guint i;
+
+  if (NULL != set)
+    return set;
+
+  set = sib_rdfs_set_new();
+  g_hash_table_iter_init(&iter, self->type_props);
+  while (g_hash_table_iter_next(&iter, &p, NULL))
+    {
+      found = sib_rdfs_query(store, node, GPOINTER_TO_INT(p), 0, 2);
+      for (i = 0; i < found->len; i++)
+	sib_rdfs_set_union(set, sib_rdfs_supers(self, store, g_array_index(found, gint, i)));
+      g_array_free(found, TRUE);
+    }
+
+  found = sib_rdfs_query(store, node, 0, 0, 1);
+  for (i = 0; i < found->len; i++)
+    sib_rdfs_set_union(set, sib_rdfs_prop_types(self, store, self->domain_types,
+						self->domain_props,
+						g_array_index(found, gint, i)));
+  g_array_free(found, TRUE);
+
+  found = sib_rdfs_query(store, 0, 0, node, 1);
+  for (i = 0; i < found->len; i++)
+    sib_rdfs_set_union(set, sib_rdfs_prop_types(self, store, self->range_types,
+						self->range_props,
+						g_array_index(found, gint, i)));
+  g_array_free(found, TRUE);
+
+  g_hash_table_insert(self->types, GINT_TO_POINTER(node), set);
+  return set;
+}
+
+/* Adds supers to the sets of table that have cls */
+static void sib_rdfs_extend(GHashTable* table, gint cls, GHashTable* supers)
+{
+  GHashTableIter iter;
+  gpointer set;
+
+  g_hash_table_iter_init(&iter, table);
+  while (g_hash_table_iter_next(&iter, NULL, &set))
+    if (sib_rdfs_set_has((GHashTable*)set, cls))
+      sib_rdfs_set_union((GHashTable*)set, supers);
+}
+
+/* Whether a change of triples with predicate p changes the schema,
+   except added subclasses which are handled in place */
+static gboolean sib_rdfs_schema(SibRdfsIndex* self, gint p)
+{
+  return (p == self->subprop ||
+	  sib_rdfs_set_has(self->domain_props, p) ||
+	  sib_rdfs_set_has(self->range_props, p));
+}
+
+static void sib_rdfs_added(SibRdfsIndex* self, SibStore* store, m3_triple_int* t)
+{
+  GHashTable *set, *supers;
+
+  if (sib_rdfs_set_has(self->subclass_props, t->p))
+    {
+      /* Whatever had the subclass gets the superclasses */
+      supers = sib_rdfs_supers(self, store, t->o);
+      sib_rdfs_extend(self->supers, t->s, supers);
+      sib_rdfs_extend(self->domain_types, t->s, supers);
+      sib_rdfs_extend(self->range_types, t->s, supers);
+      sib_rdfs_extend(self->types, t->s, supers);
+    }
+
+  set = g_hash_table_lookup(self->types, GINT_TO_POINTER(t->s));
+  if (NULL != set)
+    {
+      if (sib_rdfs_set_has(self->type_props, t->p))
+	sib_rdfs_set_union(set, sib_rdfs_supers(self, store, t->o));
+      sib_rdfs_set_union(set, sib_rdfs_prop_types(self, store, self->domain_types,
+						  self->domain_props, t->p));
+    }
+  set = g_hash_table_lookup(self->types, GINT_TO_POINTER(t->o));
+  if (NULL != set)
+    sib_rdfs_set_union(set, sib_rdfs_prop_types(self, store, self->range_types,
+						self->range_props, t->p));
+}
+
+/* Public functions */
+
+SibRdfsIndex* sib_rdfs_index_new(guint size)
+{
+  SibRdfsIndex* self = g_new0(SibRdfsIndex, 1);
+
+  self->supers = sib_rdfs_table_new();
+  self->domain_types = sib_rdfs_table_new();
+  self->range_types = sib_rdfs_table_new();
+  self->types = sib_rdfs_table_new();
+  self->size = MAX(size, 1);
+  return self;
+}
+
+void sib_rdfs_index_destroy(SibRdfsIndex* self)
+{
+  g_return_if_fail(NULL != self);
+
+  sib_rdfs_drop_all(self);
+  g_hash_table_destroy(self->supers);
+  g_hash_table_destroy(self->domain_types);
+  g_hash_table_destroy(self->range_types);
+  g_hash_table_destroy(self->types);
+  g_free(self);
+}
+
+gboolean sib_rdfs_index_is_type(SibRdfsIndex* self, SibStore* store, gint node, gint type)
+{
+  g_return_val_if_fail(NULL != self && NULL != store, FALSE);
+
+  sib_rdfs_prepare(self, store);
+  return (type == self->resource ||
+	  sib_rdfs_set_has(sib_rdfs_types(self, store, node), type));
+}
+
+gboolean sib_rdfs_index_is_subclass(SibRdfsIndex* self, SibStore* store, gint sub, gint super)
+{
+  g_return_val_if_fail(NULL != self && NULL != store, FALSE);
+
+  sib_rdfs_prepare(self, store);
+  return (super == self->resource ||
+	  sib_rdfs_set_has(sib_rdfs_supers(self, store, sub), super));
+}
+
+gboolean sib_rdfs_index_values(SibRdfsIndex* self, SibStore* store, SibSameAs* same_as,
+			       gint prop, gint node, GSList** values)
+{
+  GHashTable* results;
+  GHashTableIter iter;
+  GArray* nodes;
+  m3_node_int* n;
+  gpointer key;
+  guint i;
+
+  g_return_val_if_fail(NULL != self && NULL != store && NULL != same_as &&
+		       NULL != values, FALSE);
+
+  sib_rdfs_prepare(self, store);
+  if (prop != self->type && prop != self->subclass)
+    return FALSE;
+
+  results = sib_rdfs_set_new();
+  nodes = sib_same_as_members(same_as, store, node);
+  for (i = 0; i < nodes->len; i++)
+    {
+      node = g_array_index(nodes, gint, i);
+      if (prop == self->type)
+	sib_rdfs_set_union(results, sib_rdfs_types(self, store, node));
+      else
+	sib_rdfs_set_union(results, sib_rdfs_supers(self, store, node));
+    }
+  sib_rdfs_set_add(results, self->resource);
+  g_array_free(nodes, TRUE);
+
+  *values = NULL;
+  g_hash_table_iter_init(&iter, results);
+  while (g_hash_table_iter_next(&iter, &key, NULL))
+    {
+      n = g_new0(m3_node_int, 1);
+      n->node = GPOINTER_TO_INT(key);
+      *values = g_slist_prepend(*values, n);
+    }
+  g_hash_table_destroy(results);
+  return TRUE;
+}
+
+void sib_rdfs_index_changed(SibRdfsIndex* self, SibStore* store, GSList* triples,
+			    gboolean added, gboolean complete)
+{
+  m3_triple_int* t;
+  GSList* l;
+
+  g_return_if_fail(NULL != self && NULL != store);
+
+  /* Nothing is kept before the vocabulary is looked up */
+  if (!self->valid)
+    return;
+
+  for (l = triples; l != NULL; l = l->next)
+    {
+      t = (m3_triple_int*)l->data;
+      if (sib_rdfs_schema(self, t->p) ||
+	  (sib_rdfs_set_has(self->subclass_props, t->p) && !(added && complete)))
+	{
+	  sib_rdfs_drop_all(self);
+	  return;
+	}
+    }
+
+  for (l = triples; l != NULL; l = l->next)
+    {
+      t = (m3_triple_int*)l->data;
+      if (added && complete)
+	{
+	  sib_rdfs_added(self, store, t);
+	  continue;
+	}
+      /* Types found through removed triples, or through triples the
+	 store inferred from the added ones, are found again */
+      g_hash_table_remove(self->types, GINT_TO_POINTER(t->s));
+      g_hash_table_remove(self->types, GINT_TO_POINTER(t->o));
+      if (added)
+	g_hash_table_remove(self->types, GINT_TO_POINTER(t->p));
+    }
+}
+
+void sib_rdfs_index_clear(SibRdfsIndex* self)
+{
+  g_return_if_fail(NULL != self);
+
+  sib_rdfs_drop_all(self);
+}
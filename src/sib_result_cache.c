@@ -0,0 +1,277 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_result_cache.c
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <glib.h>
+
+#include "sib_operations.h"
+#include "sib_result_cache.h"
+
+/* Version counter shared by the patterns binding neither subject nor
+   predicate. 0 is never a node. */
+#define ANY_NODE 0
+
+/* Number of nodes with a version counter before all counters and
+   results are dropped, as the counters of nodes are never removed */
+#define MAX_VERSIONS (1 << 16)
+
+typedef struct
+{
+  gchar* result;
+  SibResultCacheStamp* stamp;
+} SibResultCacheEntry;
+
+struct _SibResultCacheStamp
+{
+  /* Value of epoch of the cache when taken */
+  guint epoch;
+  guint n_deps;
+  gint* deps;
+  guint* versions;
+};
+
+struct _SibResultCache
+{
+  GMutex* lock;
+  /* Canonical query -> SibResultCacheEntry */
+  GHashTable* entries;
+  /* Node -> version counter, missing nodes are at version 0 */
+  GHashTable* versions;
+  /* Moved when the counters are dropped, so that stamps taken before
+     no longer match */
+  guint epoch;
+  guint size;
+};
+
+/* Private functions */
+
+static void sib_result_cache_entry_free(gpointer data)
+{
+  SibResultCacheEntry* e = (SibResultCacheEntry*)data;
+  g_free(e->result);
+  sib_result_cache_stamp_free(e->stamp);
+  g_free(e);
+}
+
+static guint sib_result_cache_version(SibResultCache* self, gint node)
+{
+  return GPOINTER_TO_UINT(g_hash_table_lookup(self->versions, GINT_TO_POINTER(node)));
+}
+
+static void sib_result_cache_bump(SibResultCache* self, gint node)
+{
+  g_hash_table_insert(self->versions, GINT_TO_POINTER(node),
+		      GUINT_TO_POINTER(sib_result_cache_version(self, node) + 1));
+}
+
+/* Whether nothing a stamp depends on has changed, called locked */
+static gboolean sib_result_cache_current(SibResultCache* self, SibResultCacheStamp* stamp)
+{
+  guint i;
+
+  if (stamp->epoch != self->epoch)
+    return FALSE;
+  for (i = 0; i < stamp->n_deps; i++)
+    if (stamp->versions[i] != sib_result_cache_version(self, stamp->deps[i]))
+      return FALSE;
+  return TRUE;
+}
+
+static void sib_result_cache_drop_all(SibResultCache* self)
+{
+  g_hash_table_remove_all(self->entries);
+  g_hash_table_remove_all(self->versions);
+  self->epoch++;
+}
+
+/* Public functions */
+
+SibResultCache* sib_result_cache_new(guint size)
+{
+  SibResultCache* self = g_new0(SibResultCache, 1);
+
+  self->lock = g_mutex_new();
+  self->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+					g_free, sib_result_cache_entry_free);
+  self->versions = g_hash_table_new(g_direct_hash, g_direct_equal);
+  self->size = MAX(size, 1);
+  return self;
+}
+
+void sib_result_cache_destroy(SibResultCache* self)
+{
+  g_return_if_fail(NULL != self);
+
+  g_hash_table_destroy(self->entries);
+  g_hash_table_destroy(self->versions);
+  g_mutex_free(self->lock);
+  g_free(self);
+}
+
+gchar* sib_result_cache_get(SibResultCache* self, const gchar* key)
+{
+  SibResultCacheEntry* e;
+  gchar* result = NULL;
+
+  g_return_val_if_fail(NULL != self, NULL);
+
+  g_mutex_lock(self->lock);
+  e = (SibResultCacheEntry*)g_hash_table_lookup(self->entries, key);
+  if (NULL != e && !sib_result_cache_current(self, e->stamp))
+    {
+      g_hash_table_remove(self->entries, key);
+      e = NULL;
+    }
+  if (NULL != e)
+    result = g_strdup(e->result);
+  g_mutex_unlock(self->lock);
+  return result;
+}
+
+SibResultCacheStamp* sib_result_cache_stamp(SibResultCache* self, GSList* patterns)
+{
+  SibResultCacheStamp* stamp;
+  m3_triple_int* t;
+  gint node;
+  guint i;
+
+  g_return_val_if_fail(NULL != self, NULL);
+
+  stamp = g_new0(SibResultCacheStamp, 1);
+  stamp->deps = g_new0(gint, g_slist_length(patterns));
+  stamp->versions = g_new0(guint, g_slist_length(patterns));
+
+  g_mutex_lock(self->lock);
+  stamp->epoch = self->epoch;
+  for ( ; patterns != NULL; patterns = patterns->next)
+    {
+      t = (m3_triple_int*)patterns->data;
+      if (0 != t->s)
+	node = t->s;
+      else if (0 != t->p)
+	node = t->p;
+      else
+	node = ANY_NODE;
+
+      for (i = 0; i < stamp->n_deps && stamp->deps[i] != node; i++)
+	;
+      if (i < stamp->n_deps)
+	continue;
+      stamp->deps[stamp->n_deps] = node;
+      stamp->versions[stamp->n_deps] = sib_result_cache_version(self, node);
+      stamp->n_deps++;
+    }
+  g_mutex_unlock(self->lock);
+  return stamp;
+}
+
+void sib_result_cache_stamp_free(SibResultCacheStamp* stamp)
+{
+  if (NULL == stamp)
+    return;
+  g_free(stamp->deps);
+  g_free(stamp->versions);
+  g_free(stamp);
+}
+
+void sib_result_cache_put(SibResultCache* self, const gchar* key,
+			  SibResultCacheStamp* stamp, const gchar* result)
+{
+  SibResultCacheEntry* e;
+
+  g_return_if_fail(NULL != self);
+
+  g_mutex_lock(self->lock);
+  if (!sib_result_cache_current(self, stamp))
+    {
+      g_mutex_unlock(self->lock);
+      sib_result_cache_stamp_free(stamp);
+      return;
+    }
+
+  /* Forget all at once when full, the queries in use come back soon */
+  if (g_hash_table_size(self->entries) >= self->size &&
+      NULL == g_hash_table_lookup(self->entries, key))
+    g_hash_table_remove_all(self->entries);
+
+  e = g_new0(SibResultCacheEntry, 1);
+  e->result = g_strdup(result);
+  e->stamp = stamp;
+  g_hash_table_replace(self->entries, g_strdup(key), e);
+  g_mutex_unlock(self->lock);
+}
+
+void sib_result_cache_changed(SibResultCache* self, GSList* triples)
+{
+  m3_triple_int* t;
+
+  g_return_if_fail(NULL != self);
+
+  if (NULL == triples)
+    return;
+
+  g_mutex_lock(self->lock);
+  if (g_hash_table_size(self->versions) >= MAX_VERSIONS)
+    {
+      sib_result_cache_drop_all(self);
+    }
+  else
+    {
+      for ( ; triples != NULL; triples = triples->next)
+	{
+	  t = (m3_triple_int*)triples->data;
+	  sib_result_cache_bump(self, t->s);
+	  sib_result_cache_bump(self, t->p);
+	}
+      sib_result_cache_bump(self, ANY_NODE);
+    }
+  g_mutex_unlock(self->lock);
+}
+
+void sib_result_cache_clear(SibResultCache* self)
+{
+  g_return_if_fail(NULL != self);
+
+  g_mutex_lock(self->lock);
+  sib_result_cache_drop_all(self);
+  g_mutex_unlock(self->lock);
+}
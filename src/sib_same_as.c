@@ -0,0 +1,282 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_same_as.c
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <glib.h>
+
+#include "sib_operations.h"
+#include "sib_same_as.h"
+
+#define OWL_NS "http://www.w3.org/2002/07/owl#"
+
+struct _SibSameAs
+{
+  /* Whether the classes have been read from the store */
+  gboolean valid;
+  gint same_as;
+  /* Node -> parent node in the forest, roots are their own parents.
+     Only nodes in a class of two or more are in the forest. */
+  GHashTable* parent;
+  /* Root -> GArray of the gint members of its class */
+  GHashTable* members;
+};
+
+/* Private functions */
+
+static void sib_same_as_array_free(gpointer data)
+{
+  g_array_free((GArray*)data, TRUE);
+}
+
+static gint sib_same_as_parent(SibSameAs* self, gint node)
+{
+  return GPOINTER_TO_INT(g_hash_table_lookup(self->parent, GINT_TO_POINTER(node)));
+}
+
+/* Root of the class of a node, 0 if it has no class */
+static gint sib_same_as_find(SibSameAs* self, gint node)
+{
+  gint root, parent, next;
+
+  root = sib_same_as_parent(self, node);
+  if (0 == root)
+    return 0;
+  while ((parent = sib_same_as_parent(self, root)) != root)
+    root = parent;
+
+  /* Path compression */
+  while (node != root)
+    {
+      next = sib_same_as_parent(self, node);
+      g_hash_table_insert(self->parent, GINT_TO_POINTER(node), GINT_TO_POINTER(root));
+      node = next;
+    }
+  return root;
+}
+
+/* Class of a node, made into a class of its own if it has none */
+static gint sib_same_as_root(SibSameAs* self, gint node)
+{
+  GArray* members;
+  gint root = sib_same_as_find(self, node);
+
+  if (0 != root)
+    return root;
+  g_hash_table_insert(self->parent, GINT_TO_POINTER(node), GINT_TO_POINTER(node));
+  members = g_array_new(FALSE, FALSE, sizeof(gint));
+  g_array_append_val(members, node);
+  g_hash_table_insert(self->members, GINT_TO_POINTER(node), members);
+  return node;
+}
+
+/* Joins the classes of two nodes, the smaller under the larger */
+static void sib_same_as_union(SibSameAs* self, gint a, gint b)
+{
+  GArray *big, *small;
+  gint ra, rb, tmp;
+
+  if (a == b)
+    return;
+  ra = sib_same_as_root(self, a);
+  rb = sib_same_as_root(self, b);
+  if (ra == rb)
+    return;
+
+  big = (GArray*)g_hash_table_lookup(self->members, GINT_TO_POINTER(ra));
+  small = (GArray*)g_hash_table_lookup(self->members, GINT_TO_POINTER(rb));
+  if (big->len < small->len)
+    {
+      tmp = ra;
+      ra = rb;
+      rb = tmp;
+      big = small;
+      small = (GArray*)g_hash_table_lookup(self->members, GINT_TO_POINTER(rb));
+    }
+  g_hash_table_insert(self->parent, GINT_TO_POINTER(rb), GINT_TO_POINTER(ra));
+  g_array_append_vals(big, small->data, small->len);
+  g_hash_table_remove(self->members, GINT_TO_POINTER(rb));
+}
+
+static gboolean sib_same_as_triple(gint s, gint p, gint o, gpointer data)
+{
+  sib_same_as_union((SibSameAs*)data, s, o);
+  return TRUE;
+}
+
+static void sib_same_as_build(SibSameAs* self, SibStore* store)
+{
+  if (self->valid)
+    return;
+  self->same_as = sib_store_resolve(store, OWL_NS "sameAs", FALSE);
+  sib_store_query(store, 0, self->same_as, 0, sib_same_as_triple, self);
+  self->valid = TRUE;
+}
+
+/*
+ * Rebuilds the class of a node after sameAs triples of it were
+ * removed. The class can only split, so only the sameAs triples of
+ * its members are read.
+ */
+static void sib_same_as_rebuild(SibSameAs* self, SibStore* store, gint node)
+{
+  GArray* members;
+  gint root = sib_same_as_find(self, node);
+  guint i;
+
+  if (0 == root)
+    return;
+  members = (GArray*)g_hash_table_lookup(self->members, GINT_TO_POINTER(root));
+  g_hash_table_steal(self->members, GINT_TO_POINTER(root));
+  for (i = 0; i < members->len; i++)
+    g_hash_table_remove(self->parent, GINT_TO_POINTER(g_array_index(members, gint, i)));
+
+  /* Every triple between the members has one of them as subject */
+  for (i = 0; i < members->len; i++)
+    sib_store_query(store, g_array_index(members, gint, i), self->same_as, 0,
+		    sib_same_as_triple, self);
+  g_array_free(members, TRUE);
+}
+
+/* Public functions */
+
+SibSameAs* sib_same_as_new(void)
+{
+  SibSameAs* self = g_new0(SibSameAs, 1);
+
+  self->parent = g_hash_table_new(g_direct_hash, g_direct_equal);
+  self->members = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+					NULL, sib_same_as_array_free);
+  return self;
+}
+
+void sib_same_as_destroy(SibSameAs* self)
+{
+  g_return_if_fail(NULL != self);
+
+  g_hash_table_destroy(self->parent);
+  g_hash_table_destroy(self->members);
+  g_free(self);
+}
+
+GArray* sib_same_as_members(SibSameAs* self, SibStore* store, gint node)
+{
+  GArray *nodes, *members;
+  gint root, m;
+  guint i;
+
+  g_return_val_if_fail(NULL != self && NULL != store, NULL);
+
+  sib_same_as_build(self, store);
+  nodes = g_array_new(FALSE, FALSE, sizeof(gint));
+  g_array_append_val(nodes, node);
+  root = sib_same_as_find(self, node);
+  if (0 == root)
+    return nodes;
+
+  members = (GArray*)g_hash_table_lookup(self->members, GINT_TO_POINTER(root));
+  for (i = 0; i < members->len; i++)
+    {
+      m = g_array_index(members, gint, i);
+      if (m != node)
+	g_array_append_val(nodes, m);
+    }
+  return nodes;
+}
+
+gboolean sib_same_as_values(SibSameAs* self, SibStore* store, gint prop, gint node,
+			    GSList** values)
+{
+  GArray* members;
+  m3_node_int* n;
+  guint i;
+
+  g_return_val_if_fail(NULL != self && NULL != store && NULL != values, FALSE);
+
+  sib_same_as_build(self, store);
+  if (0 == prop || prop != self->same_as)
+    return FALSE;
+
+  *values = NULL;
+  if (0 == sib_same_as_find(self, node))
+    return TRUE;
+  members = sib_same_as_members(self, store, node);
+  for (i = 0; i < members->len; i++)
+    {
+      n = g_new0(m3_node_int, 1);
+      n->node = g_array_index(members, gint, i);
+      *values = g_slist_prepend(*values, n);
+    }
+  g_array_free(members, TRUE);
+  return TRUE;
+}
+
+void sib_same_as_changed(SibSameAs* self, SibStore* store, GSList* triples, gboolean added)
+{
+  m3_triple_int* t;
+  GSList* l;
+
+  g_return_if_fail(NULL != self && NULL != store);
+
+  /* Read from the store when first used */
+  if (!self->valid)
+    return;
+
+  for (l = triples; l != NULL; l = l->next)
+    {
+      t = (m3_triple_int*)l->data;
+      if (t->p != self->same_as)
+	continue;
+      if (added)
+	sib_same_as_union(self, t->s, t->o);
+      else
+	sib_same_as_rebuild(self, store, t->s);
+    }
+}
+
+void sib_same_as_clear(SibSameAs* self)
+{
+  g_return_if_fail(NULL != self);
+
+  g_hash_table_remove_all(self->parent);
+  g_hash_table_remove_all(self->members);
+  self->valid = FALSE;
+}
@@ -0,0 +1,918 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_ssap_server.c
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+
+#include <sib_dbus_ifaces.h>
+#include <whiteboard_log.h>
+
+#include "sib_ssap_server.h"
+
+/* Larger frames close the connection */
+#define SSAP_MAX_FRAME (16 * 1024 * 1024)
+#define SSAP_MAX_EVENTS 64
+#define SSAP_READ_SIZE 65536
+#define SSAP_BACKLOG 64
+
+/* Outstanding transactions per connection unless set */
+#define SSAP_DEFAULT_WINDOW 32
+
+#define SSAP_FIELD_STRING 's'
+#define SSAP_FIELD_INT32 'i'
+
+struct _SibSsapConnection
+{
+  SibSsapServer* server;
+  gint fd;
+  gboolean listener;
+  volatile gint ref_count;
+
+  /* Received bytes not yet parsed, only used by the server thread */
+  GByteArray* in;
+  /* Whether the KP has shut down its side, the connection closes once
+     the received requests are answered. Only used by the server
+     thread. */
+  gboolean eof;
+
+  /* Protects the rest, replies are sent from the operation threads */
+  GMutex* lock;
+  /* Frames not yet written */
+  GByteArray* out;
+  /* Whether the socket is polled for reading and writing. Reading
+     stops while the transaction window is full. */
+  gboolean polling_in;
+  gboolean polling_out;
+  gboolean closed;
+  /* Outstanding transactions: tr_id -> count, and their total */
+  GHashTable* outstanding;
+  guint n_outstanding;
+  /* Whether the connection waits in the woken list of the server,
+     protected by the wake_lock of the server */
+  gboolean queued;
+};
+
+struct _SibSsapServer
+{
+  SibSsapRequestFunc func;
+  gpointer data;
+
+  gint epfd;
+  /* Wakes the server thread up, both ends non-blocking. It holds a
+     byte while wake_pending is set. */
+  gint wake[2];
+  /* Connections to resume reading or to write, each at most once */
+  GMutex* wake_lock;
+  GSList* woken;
+  gboolean wake_pending;
+  /* Maximum outstanding transactions per connection */
+  guint window;
+  GSList* listeners;
+  gchar* unix_path;
+  /* Open client connections, only used by the server thread */
+  GHashTable* connections;
+
+  GThread* thread;
+  volatile gint running;
+};
+
+/* Private functions */
+
+static gboolean ssap_set_nonblocking(gint fd)
+{
+  gint flags = fcntl(fd, F_GETFL, 0);
+
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static void ssap_put_u32(GByteArray* a, guint32 v)
+{
+  guint8 b[4];
+
+  b[0] = (v >> 24) & 0xff;
+  b[1] = (v >> 16) & 0xff;
+  b[2] = (v >> 8) & 0xff;
+  b[3] = v & 0xff;
+  g_byte_array_append(a, b, 4);
+}
+
+static guint32 ssap_get_u32(const guint8* p)
+{
+  return ((guint32)p[0] << 24) | ((guint32)p[1] << 16) |
+    ((guint32)p[2] << 8) | (guint32)p[3];
+}
+
+static void ssap_put_string(GByteArray* a, const gchar* str)
+{
+  guint8 type = SSAP_FIELD_STRING;
+  guint32 len = strlen(str);
+
+  g_byte_array_append(a, &type, 1);
+  ssap_put_u32(a, len);
+  g_byte_array_append(a, (const guint8*)str, len);
+}
+
+/* Reads a string field, NULL if the field is not a valid string */
+static gchar* ssap_get_string(const guint8** p, const guint8* end)
+{
+  guint32 len;
+  const gchar* str;
+
+  if (end - *p < 5 || **p != SSAP_FIELD_STRING)
+    return NULL;
+  len = ssap_get_u32(*p + 1);
+  if ((guint32)(end - *p - 5) < len)
+    return NULL;
+  str = (const gchar*)*p + 5;
+  /* DBus strings are UTF-8 without nul bytes */
+  if (!g_utf8_validate(str, len, NULL))
+    return NULL;
+  *p += 5 + len;
+  return g_strndup(str, len);
+}
+
+/* DBus member names: [A-Za-z_][A-Za-z0-9_]* */
+static gboolean ssap_valid_name(const gchar* name)
+{
+  const gchar* c;
+
+  if (name[0] == '\0' || g_ascii_isdigit(name[0]) || strlen(name) > 255)
+    return FALSE;
+  for (c = name; *c; c++)
+    if (!g_ascii_isalnum(*c) && *c != '_')
+      return FALSE;
+  return TRUE;
+}
+
+/* Builds the DBus method call of a request, NULL if malformed */
+static DBusMessage* ssap_decode(const guint8* p, guint32 len)
+{
+  const guint8* end = p + len;
+  DBusMessage* msg;
+  gchar* name;
+  gchar* str;
+  gint32 i;
+
+  name = ssap_get_string(&p, end);
+  if (NULL == name || !ssap_valid_name(name))
+    {
+      g_free(name);
+      return NULL;
+    }
+  msg = dbus_message_new_method_call(SIB_DBUS_SERVICE, SIB_DBUS_OBJECT,
+				     SIB_DBUS_KP_INTERFACE, name);
+  g_free(name);
+
+  while (p < end)
+    {
+      if (*p == SSAP_FIELD_STRING)
+	{
+	  str = ssap_get_string(&p, end);
+	  if (NULL == str)
+	    break;
+	  dbus_message_append_args(msg, DBUS_TYPE_STRING, &str,
+				   DBUS_TYPE_INVALID);
+	  g_free(str);
+	}
+      else if (*p == SSAP_FIELD_INT32 && end - p >= 5)
+	{
+	  i = (gint32)ssap_get_u32(p + 1);
+	  p += 5;
+	  dbus_message_append_args(msg, DBUS_TYPE_INT32, &i,
+				   DBUS_TYPE_INVALID);
+	}
+      else
+	break;
+    }
+
+  if (p != end)
+    {
+      dbus_message_unref(msg);
+      return NULL;
+    }
+  return msg;
+}
+
+static SibSsapConnection* ssap_connection_new(SibSsapServer* server,
+					      gint fd, gboolean listener)
+{
+  SibSsapConnection* conn = g_new0(SibSsapConnection, 1);
+
+  conn->server = server;
+  conn->fd = fd;
+  conn->listener = listener;
+  conn->ref_count = 1;
+  conn->lock = g_mutex_new();
+  conn->polling_in = TRUE;
+  if (!listener)
+    {
+      conn->in = g_byte_array_new();
+      conn->out = g_byte_array_new();
+      conn->outstanding = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+  return conn;
+}
+
+/* Adds or changes the events polled for a connection, as given by
+   polling_in and polling_out */
+static gboolean ssap_poll(SibSsapConnection* conn, gint op)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = (conn->polling_in ? EPOLLIN : 0) |
+    (conn->polling_out ? EPOLLOUT : 0);
+  ev.data.ptr = conn;
+  return epoll_ctl(conn->server->epfd, op, conn->fd, &ev) == 0;
+}
+
+/* Writes queued frames, called with conn->lock held. Errors are left
+   for the server thread to notice when reading. */
+static void ssap_flush(SibSsapConnection* conn)
+{
+  gssize n;
+  gboolean out;
+
+  while (conn->out->len > 0)
+    {
+      n = send(conn->fd, conn->out->data, conn->out->len, MSG_NOSIGNAL);
+      if (n > 0)
+	g_byte_array_remove_range(conn->out, 0, n);
+      else if (n < 0 && errno == EINTR)
+	continue;
+      else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	break;
+      else
+	{
+	  g_byte_array_set_size(conn->out, 0);
+	  break;
+	}
+    }
+
+  out = (conn->out->len > 0);
+  if (out != conn->polling_out)
+    {
+      conn->polling_out = out;
+      ssap_poll(conn, EPOLL_CTL_MOD);
+    }
+}
+
+/* Wakes the server thread up, called with wake_lock held. Never
+   blocks, so it is safe from the server thread too. */
+static void ssap_ring(SibSsapServer* self)
+{
+  const guint8 byte = 0;
+
+  if (self->wake_pending)
+    return;
+  if (write(self->wake[1], &byte, 1) == 1)
+    self->wake_pending = TRUE;
+  else
+    whiteboard_log_error("Could not wake the SSAP thread up\n");
+}
+
+/* Asks the server thread to write the queued frames of conn and to
+   resume reading it. Wake ups of a connection not yet looked at are
+   merged. Called with the lock of an open conn held: the server
+   closes every connection under its lock before it is freed, so it
+   stays valid until the lock is released. */
+static void ssap_wake_up(SibSsapConnection* conn)
+{
+  SibSsapServer* self = conn->server;
+
+  g_mutex_lock(self->wake_lock);
+  if (!conn->queued)
+    {
+      conn->queued = TRUE;
+      self->woken = g_slist_prepend(self->woken, sib_ssap_connection_ref(conn));
+      ssap_ring(self);
+    }
+  g_mutex_unlock(self->wake_lock);
+}
+
+/* Closes a connection, in the server thread */
+static void ssap_close(SibSsapConnection* conn)
+{
+  SibSsapServer* self = conn->server;
+
+  g_mutex_lock(conn->lock);
+  if (!conn->closed)
+    {
+      epoll_ctl(self->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+      close(conn->fd);
+      conn->fd = -1;
+      conn->closed = TRUE;
+      if (conn->out)
+	g_byte_array_set_size(conn->out, 0);
+    }
+  g_mutex_unlock(conn->lock);
+
+  if (!conn->listener)
+    g_hash_table_remove(self->connections, conn);
+  sib_ssap_connection_unref(conn);
+}
+
+static void ssap_accept(SibSsapServer* self, SibSsapConnection* listener)
+{
+  SibSsapConnection* conn;
+  gint fd;
+  gint one = 1;
+
+  while ((fd = accept(listener->fd, NULL, NULL)) >= 0)
+    {
+      if (!ssap_set_nonblocking(fd))
+	{
+	  close(fd);
+	  continue;
+	}
+      /* Fails harmlessly on unix sockets */
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+      conn = ssap_connection_new(self, fd, FALSE);
+      g_hash_table_insert(self->connections, conn, conn);
+      if (!ssap_poll(conn, EPOLL_CTL_ADD))
+	ssap_close(conn);
+    }
+}
+
+/* Transaction id of a request: space_id, kp_id and tr_id lead the
+   arguments of all KP requests */
+static gboolean ssap_tr_id(DBusMessage* msg, gint* tr_id)
+{
+  DBusError err;
+  const gchar* space_id;
+  const gchar* kp_id;
+  gboolean ok;
+
+  dbus_error_init(&err);
+  ok = dbus_message_get_args(msg, &err,
+			     DBUS_TYPE_STRING, &space_id,
+			     DBUS_TYPE_STRING, &kp_id,
+			     DBUS_TYPE_INT32, tr_id,
+			     DBUS_TYPE_INVALID);
+  dbus_error_free(&err);
+  return ok;
+}
+
+/* Dispatches the complete frames received so far while the window
+   allows, returns FALSE if the connection was closed */
+static gboolean ssap_process(SibSsapServer* self, SibSsapConnection* conn)
+{
+  DBusMessage* msg;
+  guint pos = 0;
+  guint32 len;
+  gint tr_id;
+  guint count;
+  gboolean full = FALSE;
+
+  /* Pipelined requests are dispatched in order, the operations may
+     complete in any order */
+  while (conn->in->len - pos >= 4)
+    {
+      len = ssap_get_u32(conn->in->data + pos);
+      if (len > SSAP_MAX_FRAME)
+	{
+	  whiteboard_log_warning("SSAP frame of %u bytes, closing connection\n", len);
+	  ssap_close(conn);
+	  return FALSE;
+	}
+      if (conn->in->len - pos - 4 < len)
+	break;
+
+      /* A full window stops reading until a transaction completes,
+	 which pushes back on the KP through the socket */
+      g_mutex_lock(conn->lock);
+      full = (conn->n_outstanding >= self->window);
+      if (full && conn->polling_in)
+	{
+	  conn->polling_in = FALSE;
+	  ssap_poll(conn, EPOLL_CTL_MOD);
+	}
+      g_mutex_unlock(conn->lock);
+      if (full)
+	break;
+
+      msg = ssap_decode(conn->in->data + pos + 4, len);
+      if (NULL == msg || !ssap_tr_id(msg, &tr_id))
+	{
+	  whiteboard_log_warning("Malformed SSAP frame, closing connection\n");
+	  if (msg)
+	    dbus_message_unref(msg);
+	  ssap_close(conn);
+	  return FALSE;
+	}
+      pos += 4 + len;
+
+      g_mutex_lock(conn->lock);
+      count = GPOINTER_TO_UINT(g_hash_table_lookup(conn->outstanding,
+						   GINT_TO_POINTER(tr_id)));
+      if (count > 0)
+	whiteboard_log_warning("SSAP: transaction %d already outstanding\n", tr_id);
+      g_hash_table_insert(conn->outstanding, GINT_TO_POINTER(tr_id),
+			  GUINT_TO_POINTER(count + 1));
+      conn->n_outstanding++;
+      g_mutex_unlock(conn->lock);
+
+      self->func(conn, tr_id, msg, self->data);
+      dbus_message_unref(msg);
+    }
+  if (pos > 0)
+    g_byte_array_remove_range(conn->in, 0, pos);
+
+  if (!full)
+    {
+      g_mutex_lock(conn->lock);
+      if (!conn->polling_in && !conn->closed && !conn->eof)
+	{
+	  conn->polling_in = TRUE;
+	  ssap_poll(conn, EPOLL_CTL_MOD);
+	}
+      g_mutex_unlock(conn->lock);
+    }
+  return TRUE;
+}
+
+/* Closes a connection shut down by the KP once its transactions are
+   done and their replies written, returns FALSE if it was closed */
+static gboolean ssap_drain(SibSsapConnection* conn)
+{
+  gboolean drained;
+
+  if (!conn->eof)
+    return TRUE;
+  g_mutex_lock(conn->lock);
+  drained = !conn->closed && 0 == conn->n_outstanding && 0 == conn->out->len;
+  g_mutex_unlock(conn->lock);
+  if (!drained)
+    return TRUE;
+  ssap_close(conn);
+  return FALSE;
+}
+
+/* Reads what is available and dispatches it, returns FALSE if the
+   connection was closed */
+static gboolean ssap_read(SibSsapServer* self, SibSsapConnection* conn)
+{
+  guint8 buf[SSAP_READ_SIZE];
+  gssize n;
+
+  n = read(conn->fd, buf, sizeof(buf));
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return TRUE;
+  /* End of input again means the KP is gone altogether */
+  if (n < 0 || (n == 0 && conn->eof))
+    {
+      ssap_close(conn);
+      return FALSE;
+    }
+  if (n == 0)
+    {
+      /* The KP may still read the replies of what it has sent */
+      conn->eof = TRUE;
+      g_mutex_lock(conn->lock);
+      conn->polling_in = FALSE;
+      ssap_poll(conn, EPOLL_CTL_MOD);
+      g_mutex_unlock(conn->lock);
+    }
+  else
+    g_byte_array_append(conn->in, buf, n);
+
+  return ssap_process(self, conn) && ssap_drain(conn);
+}
+
+/* Handles the wake up pipe, returns FALSE when stopping */
+static gboolean ssap_wake(SibSsapServer* self)
+{
+  guint8 buf[64];
+  GSList *woken, *l;
+  SibSsapConnection* conn;
+
+  while (read(self->wake[0], buf, sizeof(buf)) > 0)
+    ;
+
+  g_mutex_lock(self->wake_lock);
+  woken = g_slist_reverse(self->woken);
+  self->woken = NULL;
+  self->wake_pending = FALSE;
+  for (l = woken; l != NULL; l = l->next)
+    ((SibSsapConnection*)l->data)->queued = FALSE;
+  g_mutex_unlock(self->wake_lock);
+
+  for (l = woken; l != NULL; l = l->next)
+    {
+      conn = (SibSsapConnection*)l->data;
+      /* Everything queued since the wake up goes out in one write */
+      g_mutex_lock(conn->lock);
+      if (!conn->closed)
+	ssap_flush(conn);
+      g_mutex_unlock(conn->lock);
+      /* Requests already received resume before new ones are read */
+      if (!conn->closed && ssap_process(self, conn))
+	ssap_drain(conn);
+      sib_ssap_connection_unref(conn);
+    }
+  g_slist_free(woken);
+  return g_atomic_int_get(&self->running);
+}
+
+static gpointer ssap_thread(gpointer data)
+{
+  SibSsapServer* self = (SibSsapServer*)data;
+  struct epoll_event events[SSAP_MAX_EVENTS];
+  SibSsapConnection* conn;
+  gint i, n;
+
+  while (g_atomic_int_get(&self->running))
+    {
+      n = epoll_wait(self->epfd, events, SSAP_MAX_EVENTS, -1);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  whiteboard_log_error("epoll_wait failed: %s\n", strerror(errno));
+	  break;
+	}
+
+      for (i = 0; i < n; i++)
+	{
+	  conn = (SibSsapConnection*)events[i].data.ptr;
+	  if (NULL == conn)
+	    {
+	      if (!ssap_wake(self))
+		g_atomic_int_set(&self->running, 0);
+	      continue;
+	    }
+	  if (conn->listener)
+	    {
+	      ssap_accept(self, conn);
+	      continue;
+	    }
+	  if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+	      !ssap_read(self, conn))
+	    continue;
+	  if (events[i].events & EPOLLOUT)
+	    {
+	      g_mutex_lock(conn->lock);
+	      if (!conn->closed)
+		ssap_flush(conn);
+	      g_mutex_unlock(conn->lock);
+	      ssap_drain(conn);
+	    }
+	}
+    }
+  return NULL;
+}
+
+static gboolean ssap_listen(SibSsapServer* self, gint fd,
+			    struct sockaddr* addr, socklen_t addrlen)
+{
+  SibSsapConnection* listener;
+
+  if (bind(fd, addr, addrlen) != 0 || listen(fd, SSAP_BACKLOG) != 0 ||
+      !ssap_set_nonblocking(fd))
+    {
+      whiteboard_log_error("Could not listen for SSAP connections: %s\n",
+			   strerror(errno));
+      close(fd);
+      return FALSE;
+    }
+
+  listener = ssap_connection_new(self, fd, TRUE);
+  if (!ssap_poll(listener, EPOLL_CTL_ADD))
+    {
+      close(fd);
+      sib_ssap_connection_unref(listener);
+      return FALSE;
+    }
+  self->listeners = g_slist_prepend(self->listeners, listener);
+  return TRUE;
+}
+
+/* Public functions */
+
+SibSsapServer* sib_ssap_server_new(SibSsapRequestFunc func, gpointer data)
+{
+  SibSsapServer* self;
+  struct epoll_event ev;
+
+  g_return_val_if_fail(NULL != func, NULL);
+
+  self = g_new0(SibSsapServer, 1);
+  self->func = func;
+  self->data = data;
+  self->window = SSAP_DEFAULT_WINDOW;
+  self->connections = g_hash_table_new(g_direct_hash, g_direct_equal);
+  self->epfd = epoll_create(SSAP_MAX_EVENTS);
+  if (self->epfd < 0 || pipe(self->wake) != 0 ||
+      !ssap_set_nonblocking(self->wake[0]) ||
+      !ssap_set_nonblocking(self->wake[1]))
+    {
+      whiteboard_log_error("Could not create SSAP event loop: %s\n",
+			   strerror(errno));
+      if (self->epfd >= 0)
+	close(self->epfd);
+      g_hash_table_destroy(self->connections);
+      g_free(self);
+      return NULL;
+    }
+
+  self->wake_lock = g_mutex_new();
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(self->epfd, EPOLL_CTL_ADD, self->wake[0], &ev);
+  return self;
+}
+
+gboolean sib_ssap_server_listen_tcp(SibSsapServer* self, guint16 port)
+{
+  struct sockaddr_in addr;
+  gint fd;
+  gint one = 1;
+
+  g_return_val_if_fail(NULL != self, FALSE);
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return FALSE;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  return ssap_listen(self, fd, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+gboolean sib_ssap_server_listen_unix(SibSsapServer* self, const gchar* path)
+{
+  struct sockaddr_un addr;
+  gint fd;
+
+  g_return_val_if_fail(NULL != self, FALSE);
+  g_return_val_if_fail(NULL != path, FALSE);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    {
+      whiteboard_log_error("SSAP socket path too long: %s\n", path);
+      return FALSE;
+    }
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return FALSE;
+  unlink(path);
+  if (!ssap_listen(self, fd, (struct sockaddr*)&addr, sizeof(addr)))
+    return FALSE;
+
+  g_free(self->unix_path);
+  self->unix_path = g_strdup(path);
+  return TRUE;
+}
+
+void sib_ssap_server_set_window(SibSsapServer* self, guint window)
+{
+  g_return_if_fail(NULL != self);
+  g_return_if_fail(window > 0);
+
+  self->window = window;
+}
+
+gboolean sib_ssap_server_start(SibSsapServer* self)
+{
+  GError* gerror = NULL;
+
+  g_return_val_if_fail(NULL != self, FALSE);
+
+  self->running = 1;
+  self->thread = g_thread_create(ssap_thread, self, TRUE, &gerror);
+  if (gerror)
+    {
+      whiteboard_log_error("Could not create SSAP thread: %s\n", gerror->message);
+      g_error_free(gerror);
+      self->running = 0;
+      return FALSE;
+    }
+  return TRUE;
+}
+
+void sib_ssap_server_destroy(SibSsapServer* self)
+{
+  GList* conns;
+  GList* l;
+  GSList* sl;
+
+  g_return_if_fail(NULL != self);
+
+  if (self->thread)
+    {
+      g_atomic_int_set(&self->running, 0);
+      g_mutex_lock(self->wake_lock);
+      ssap_ring(self);
+      g_mutex_unlock(self->wake_lock);
+      g_thread_join(self->thread);
+    }
+
+  /* Once closed, the connections wake the server up no more */
+  conns = g_hash_table_get_keys(self->connections);
+  for (l = conns; l != NULL; l = l->next)
+    ssap_close((SibSsapConnection*)l->data);
+  g_list_free(conns);
+
+  for (sl = self->woken; sl != NULL; sl = sl->next)
+    sib_ssap_connection_unref((SibSsapConnection*)sl->data);
+  g_slist_free(self->woken);
+  for (sl = self->listeners; sl != NULL; sl = sl->next)
+    ssap_close((SibSsapConnection*)sl->data);
+  g_slist_free(self->listeners);
+
+  if (self->unix_path)
+    unlink(self->unix_path);
+  close(self->wake[0]);
+  close(self->wake[1]);
+  close(self->epfd);
+  g_mutex_free(self->wake_lock);
+  g_hash_table_destroy(self->connections);
+  g_free(self->unix_path);
+  g_free(self);
+}
+
+SibSsapConnection* sib_ssap_connection_ref(SibSsapConnection* conn)
+{
+  g_return_val_if_fail(NULL != conn, NULL);
+
+  g_atomic_int_inc(&conn->ref_count);
+  return conn;
+}
+
+void sib_ssap_connection_unref(SibSsapConnection* conn)
+{
+  g_return_if_fail(NULL != conn);
+
+  if (!g_atomic_int_dec_and_test(&conn->ref_count))
+    return;
+
+  if (conn->in)
+    g_byte_array_free(conn->in, TRUE);
+  if (conn->out)
+    g_byte_array_free(conn->out, TRUE);
+  if (conn->outstanding)
+    g_hash_table_destroy(conn->outstanding);
+  g_mutex_free(conn->lock);
+  g_free(conn);
+}
+
+gboolean sib_ssap_send_valist(SibSsapConnection* conn, const gchar* name,
+			      int first_type, va_list args)
+{
+  guint start;
+  guint8 type;
+  gint32 i;
+  int t;
+  gboolean ok = TRUE;
+  gboolean wake = FALSE;
+
+  g_return_val_if_fail(NULL != conn, FALSE);
+  g_return_val_if_fail(NULL != name, FALSE);
+
+  g_mutex_lock(conn->lock);
+  if (conn->closed)
+    {
+      g_mutex_unlock(conn->lock);
+      return FALSE;
+    }
+
+  /* Frame in place at the end of the output, length patched below */
+  start = conn->out->len;
+  ssap_put_u32(conn->out, 0);
+  ssap_put_string(conn->out, name);
+  for (t = first_type; t != DBUS_TYPE_INVALID; t = va_arg(args, int))
+    {
+      if (t == DBUS_TYPE_STRING)
+	{
+	  ssap_put_string(conn->out, *va_arg(args, const gchar**));
+	}
+      else if (t == DBUS_TYPE_INT32)
+	{
+	  i = *va_arg(args, gint32*);
+	  type = SSAP_FIELD_INT32;
+	  g_byte_array_append(conn->out, &type, 1);
+	  ssap_put_u32(conn->out, (guint32)i);
+	}
+      else
+	{
+	  whiteboard_log_error("SSAP: unsupported argument type %d\n", t);
+	  ok = FALSE;
+	  break;
+	}
+    }
+
+  if (ok)
+    {
+      conn->out->data[start] = ((conn->out->len - start - 4) >> 24) & 0xff;
+      conn->out->data[start + 1] = ((conn->out->len - start - 4) >> 16) & 0xff;
+      conn->out->data[start + 2] = ((conn->out->len - start - 4) >> 8) & 0xff;
+      conn->out->data[start + 3] = (conn->out->len - start - 4) & 0xff;
+      /* The server thread writes the frames, it is woken up for the
+	 first one only: the frames queued meanwhile go in the same
+	 write, or wait for the socket with the ones already there */
+      wake = (start == 0);
+    }
+  else
+    g_byte_array_set_size(conn->out, start);
+
+  if (wake)
+    ssap_wake_up(conn);
+  g_mutex_unlock(conn->lock);
+  return ok;
+}
+
+void sib_ssap_connection_done(SibSsapConnection* conn, gint tr_id)
+{
+  guint count;
+
+  g_return_if_fail(NULL != conn);
+
+  g_mutex_lock(conn->lock);
+  count = GPOINTER_TO_UINT(g_hash_table_lookup(conn->outstanding,
+					       GINT_TO_POINTER(tr_id)));
+  if (count > 1)
+    g_hash_table_insert(conn->outstanding, GINT_TO_POINTER(tr_id),
+			GUINT_TO_POINTER(count - 1));
+  else if (count == 1)
+    g_hash_table_remove(conn->outstanding, GINT_TO_POINTER(tr_id));
+  if (count > 0)
+    conn->n_outstanding--;
+
+  /* The server may be gone once the connection is closed */
+  if (!conn->closed && !conn->polling_in &&
+      conn->n_outstanding < conn->server->window)
+    ssap_wake_up(conn);
+  g_mutex_unlock(conn->lock);
+}
+
+gsize sib_ssap_connection_backlog(SibSsapConnection* conn)
+{
+  gsize len;
+
+  g_return_val_if_fail(NULL != conn, 0);
+
+  g_mutex_lock(conn->lock);
+  len = conn->out->len;
+  g_mutex_unlock(conn->lock);
+  return len;
+}
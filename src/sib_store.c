@@ -0,0 +1,424 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_store.c
+ *
+ * Storage engine dispatch and the piglet engine
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <whiteboard_log.h>
+
+#include "sib_store.h"
+
+/* Maximum number of node mappings cached in each direction */
+#define SIB_STORE_NODE_CACHE_SIZE 65536
+
+/* Piglet reports the kind of an error only by its message */
+#define PIGLET_ERR_NODE_NEW "Unable to insert a new node"
+#define PIGLET_ERR_NODE_FIND "Unable to find node"
+
+typedef struct {
+  SibStore base;
+  DB db;
+  /* Whether the database was opened by us */
+  gboolean owned;
+} SibStorePiglet;
+
+typedef struct {
+  SibStoreTripleFunc func;
+  gpointer data;
+} SibStorePigletQuery;
+
+/* Private functions */
+
+static const SibStoreEngine sib_store_piglet_engine;
+
+static SibStorePiglet* sib_store_piglet_new(DB db, gboolean owned)
+{
+  SibStorePiglet* self = g_new0(SibStorePiglet, 1);
+  self->base.engine = &sib_store_piglet_engine;
+  self->base.cache = sib_node_cache_new(SIB_STORE_NODE_CACHE_SIZE);
+  self->base.resolved = g_array_new(FALSE, FALSE, sizeof(gint));
+  self->db = db;
+  self->owned = owned;
+  return self;
+}
+
+/* Piglet strings are allocated with malloc */
+static gchar* sib_store_piglet_string(char* str)
+{
+  gchar* dup;
+  if (NULL == str)
+    return NULL;
+  dup = g_strdup(str);
+  free(str);
+  return dup;
+}
+
+static void sib_store_piglet_close(SibStore* store)
+{
+  SibStorePiglet* self = (SibStorePiglet*)store;
+  guint64 hits, misses;
+
+  sib_node_cache_stats(store->cache, &hits, &misses);
+  whiteboard_log_debug("Node cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses\n",
+		       hits, misses);
+  sib_node_cache_destroy(store->cache);
+  g_array_free(store->resolved, TRUE);
+  if (self->owned)
+    piglet_close(self->db);
+  g_free(self);
+}
+
+static gboolean sib_store_piglet_transaction(SibStore* store)
+{
+  return piglet_transaction(((SibStorePiglet*)store)->db);
+}
+
+static gboolean sib_store_piglet_commit(SibStore* store)
+{
+  return piglet_commit(((SibStorePiglet*)store)->db);
+}
+
+static gboolean sib_store_piglet_rollback(SibStore* store)
+{
+  return piglet_rollback(((SibStorePiglet*)store)->db);
+}
+
+static gint sib_store_piglet_node(SibStore* store, const gchar* uri)
+{
+  return piglet_node(((SibStorePiglet*)store)->db, (char*)uri);
+}
+
+static gint sib_store_piglet_literal(SibStore* store, const gchar* str)
+{
+  return piglet_literal(((SibStorePiglet*)store)->db, (char*)str, 0, NULL);
+}
+
+static gchar* sib_store_piglet_info(SibStore* store, gint node)
+{
+  int dt = 0;
+  return sib_store_piglet_string(piglet_info(((SibStorePiglet*)store)->db, node, &dt, NULL));
+}
+
+static gchar* sib_store_piglet_expand(SibStore* store, const gchar* str)
+{
+  gchar* expanded = sib_store_piglet_string(piglet_expand_m3(((SibStorePiglet*)store)->db,
+							      (char*)str));
+  if (NULL == expanded)
+    expanded = g_strdup(str);
+  return expanded;
+}
+
+static gboolean sib_store_piglet_add(SibStore* store, gint s, gint p, gint o)
+{
+  return piglet_add(((SibStorePiglet*)store)->db, s, p, o, 0, false);
+}
+
+static gboolean sib_store_piglet_post_process(SibStore* store, gint s, gint p, gint o)
+{
+  return piglet_add_post_process(((SibStorePiglet*)store)->db, s, p, o);
+}
+
+static gboolean sib_store_piglet_del(SibStore* store, gint s, gint p, gint o)
+{
+  return piglet_del(((SibStorePiglet*)store)->db, s, p, o, 0, false);
+}
+
+static bool sib_store_piglet_triple(DB db, void* data, Node s, Node p, Node o)
+{
+  SibStorePigletQuery* q = (SibStorePigletQuery*)data;
+  return q->func((gint)s, (gint)p, (gint)o, q->data);
+}
+
+static gboolean sib_store_piglet_query(SibStore* store, gint s, gint p, gint o,
+				       SibStoreTripleFunc func, gpointer data)
+{
+  SibStorePigletQuery q;
+  q.func = func;
+  q.data = data;
+  piglet_query(((SibStorePiglet*)store)->db, s, p, o, 0, &q, sib_store_piglet_triple);
+  return TRUE;
+}
+
+static gboolean sib_store_piglet_load_rdfxml(SibStore* store, const gchar* rdfxml)
+{
+  return piglet_load_m3(((SibStorePiglet*)store)->db, 0, (unsigned char*)rdfxml, false);
+}
+
+static const gchar* sib_store_piglet_error(SibStore* store)
+{
+  return piglet_error_message;
+}
+
+static SibStoreStatus sib_store_piglet_status(SibStore* store)
+{
+  if (NULL == piglet_error_message)
+    return SIB_STORE_OK;
+  if (0 == strcmp(piglet_error_message, PIGLET_ERR_NODE_NEW))
+    return SIB_STORE_NODE_NEW;
+  if (0 == strcmp(piglet_error_message, PIGLET_ERR_NODE_FIND))
+    return SIB_STORE_NODE_FIND;
+  return SIB_STORE_FAILED;
+}
+
+static const SibStoreEngine sib_store_piglet_engine = {
+  "piglet",
+  /* Piglet gives no way to put SQLite in WAL mode, where the shared
+     locks of other connections would not hold back the commits of
+     the writer. Its reads stay on the main handle. */
+  NULL,
+  sib_store_piglet_close,
+  sib_store_piglet_transaction,
+  sib_store_piglet_commit,
+  sib_store_piglet_rollback,
+  sib_store_piglet_node,
+  sib_store_piglet_literal,
+  sib_store_piglet_info,
+  sib_store_piglet_expand,
+  sib_store_piglet_add,
+  sib_store_piglet_post_process,
+  sib_store_piglet_del,
+  sib_store_piglet_query,
+  sib_store_piglet_load_rdfxml,
+  sib_store_piglet_error,
+  sib_store_piglet_status
+};
+
+/* Public functions */
+
+SibStore* sib_store_piglet_open(const gchar* name)
+{
+  DB db = piglet_open(name);
+  if (NULL == db)
+    {
+      whiteboard_log_warning("Could not open piglet store %s: %s\n", name, piglet_error_message);
+      return NULL;
+    }
+  return (SibStore*)sib_store_piglet_new(db, TRUE);
+}
+
+SibStore* sib_store_piglet_wrap(DB db)
+{
+  return (SibStore*)sib_store_piglet_new(db, FALSE);
+}
+
+SibStore* sib_store_open(const gchar* name)
+{
+  const gchar* engine = g_getenv("SIB_STORE");
+
+  if (NULL == engine || 0 == strcmp(engine, "piglet"))
+    return sib_store_piglet_open(name);
+
+  if (0 == strcmp(engine, "memory"))
+    return sib_store_mem_open(NULL);
+
+  if (g_str_has_prefix(engine, "memory:"))
+    return sib_store_mem_open(engine + strlen("memory:"));
+
+  whiteboard_log_warning("Unknown store engine %s\n", engine);
+  return NULL;
+}
+
+SibStore* sib_store_open_reader(SibStore* store)
+{
+  if (!sib_store_has_readers(store))
+    return NULL;
+  return store->engine->open_reader(store);
+}
+
+gboolean sib_store_has_readers(SibStore* store)
+{
+  return NULL != store->engine->open_reader;
+}
+
+void sib_store_close(SibStore* store)
+{
+  store->engine->close(store);
+}
+
+gboolean sib_store_transaction(SibStore* store)
+{
+  if (NULL != store->resolved)
+    g_array_set_size(store->resolved, 0);
+  return store->engine->transaction(store);
+}
+
+gboolean sib_store_commit(SibStore* store)
+{
+  gboolean success = store->engine->commit(store);
+  if (success && NULL != store->resolved)
+    g_array_set_size(store->resolved, 0);
+  return success;
+}
+
+gboolean sib_store_rollback(SibStore* store)
+{
+  /* Nodes created in the transaction are gone, and their ids may be
+     given to other strings later */
+  if (NULL != store->resolved)
+    {
+      sib_node_cache_invalidate(store->cache, (gint*)store->resolved->data,
+				store->resolved->len);
+      g_array_set_size(store->resolved, 0);
+    }
+  return store->engine->rollback(store);
+}
+
+gint sib_store_node(SibStore* store, const gchar* uri)
+{
+  return store->engine->node(store, uri);
+}
+
+gint sib_store_literal(SibStore* store, const gchar* str)
+{
+  return store->engine->literal(store, str);
+}
+
+gint sib_store_resolve(SibStore* store, const gchar* str, gboolean literal)
+{
+  gchar* expanded = NULL;
+  gint node;
+
+  if (NULL != store->cache && NULL != str &&
+      sib_node_cache_get_node(store->cache, str, literal, &node))
+    return node;
+
+  if (literal)
+    node = store->engine->literal(store, str);
+  else
+    {
+      expanded = store->engine->expand(store, str);
+      node = store->engine->node(store, expanded);
+    }
+
+  if (0 != node && NULL != store->cache)
+    {
+      sib_node_cache_put_node(store->cache, str, literal, node);
+      sib_node_cache_put_string(store->cache, node, literal ? str : expanded);
+      if (NULL != store->resolved)
+	g_array_append_val(store->resolved, node);
+    }
+  g_free(expanded);
+  return node;
+}
+
+gchar* sib_store_string(SibStore* store, gint node)
+{
+  gchar* str;
+  gchar* expanded;
+
+  if (NULL != store->cache)
+    {
+      str = sib_node_cache_get_string(store->cache, node);
+      if (NULL != str)
+	return str;
+    }
+
+  /* Literals are not expanded */
+  str = store->engine->info(store, node);
+  if (NULL == str || node < 0)
+    expanded = str;
+  else
+    {
+      expanded = store->engine->expand(store, str);
+      g_free(str);
+    }
+
+  if (NULL != expanded && NULL != store->cache)
+    sib_node_cache_put_string(store->cache, node, expanded);
+  return expanded;
+}
+
+gchar* sib_store_info(SibStore* store, gint node)
+{
+  return store->engine->info(store, node);
+}
+
+gchar* sib_store_expand(SibStore* store, const gchar* str)
+{
+  return store->engine->expand(store, str);
+}
+
+gboolean sib_store_add(SibStore* store, gint s, gint p, gint o)
+{
+  return store->engine->add(store, s, p, o);
+}
+
+gboolean sib_store_post_process(SibStore* store, gint s, gint p, gint o)
+{
+  return store->engine->post_process(store, s, p, o);
+}
+
+gboolean sib_store_del(SibStore* store, gint s, gint p, gint o)
+{
+  return store->engine->del(store, s, p, o);
+}
+
+gboolean sib_store_query(SibStore* store, gint s, gint p, gint o,
+			 SibStoreTripleFunc func, gpointer data)
+{
+  return store->engine->query(store, s, p, o, func, data);
+}
+
+gboolean sib_store_load_rdfxml(SibStore* store, const gchar* rdfxml)
+{
+  return store->engine->load_rdfxml(store, rdfxml);
+}
+
+const gchar* sib_store_error(SibStore* store)
+{
+  return store->engine->error(store);
+}
+
+SibStoreStatus sib_store_status(SibStore* store)
+{
+  return store->engine->status(store);
+}
+
+gboolean sib_store_is_piglet(SibStore* store)
+{
+  return store->engine == &sib_store_piglet_engine;
+}
@@ -0,0 +1,974 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_store_mem.c
+ *
+ * Native in-memory storage engine. Triples are kept in three nested
+ * integer indexes (SPO, POS and OSP), so that every query pattern is
+ * answered by walking one index from its bound positions. Nodes live
+ * in an append-only dictionary.
+ *
+ * If a path is given, the store is made durable with a snapshot file
+ * and a log of changes appended at each commit. A commit returns once
+ * its log records are synced to the disk. The log is folded into a new
+ * snapshot once it grows past SIB_STORE_MEM_LOG_MAX records; the
+ * snapshot is synced and renamed into place before the log is
+ * truncated. Writing the snapshot takes time in proportion to the whole
+ * store. It is done after the commit that crossed the limit, under the
+ * read lock, so reader transactions go on but the next write waits.
+ * Once a log write fails the store accepts no more commits, so that the
+ * files on disk stay a consistent image of the committed changes.
+ *
+ * Handles share the store behind a read-write lock. A transaction of
+ * the writer handle holds the lock for writing and a transaction of a
+ * reader handle holds it for reading. The indexes are not versioned,
+ * so the engine serialises readers against the writer: a query in a
+ * reader transaction holds back commits until it ends, and reader
+ * handles only take the queries off the scheduler thread.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <whiteboard_log.h>
+
+#include "sib_store.h"
+
+/* Log records written before the log is folded into a new snapshot */
+#define SIB_STORE_MEM_LOG_MAX 100000
+
+/* Log and snapshot record types */
+#define REC_NODE 'N'
+#define REC_ADD 'A'
+#define REC_DEL 'D'
+
+typedef struct {
+  /* Dictionary: URI node n at uris[n-1], literal node -n at literals[n-1] */
+  GPtrArray* uris;
+  GPtrArray* literals;
+  GHashTable* uri_nodes;
+  GHashTable* literal_nodes;
+
+  /* Triple indexes: first node -> second node -> set of third nodes */
+  GHashTable* spo;
+  GHashTable* pos;
+  GHashTable* osp;
+  guint n_triples;
+
+  GStaticRWLock lock;
+  gint handles;
+
+  /* Durable storage, NULL path if in memory only */
+  gchar* path;
+  FILE* log;
+  guint log_records;
+  /* Log length at the last commit, and whether a log write failed */
+  glong log_size;
+  gboolean log_failed;
+} SibStoreMemData;
+
+typedef struct {
+  gint s;
+  gint p;
+  gint o;
+  gboolean added;
+} SibStoreMemChange;
+
+typedef struct {
+  SibStore base;
+  SibStoreMemData* data;
+  gboolean writer;
+  gboolean in_transaction;
+
+  /* Writer transaction: changes to undo on rollback, and their log
+     records written on commit */
+  GArray* undo;
+  GString* pending;
+  const gchar* error;
+  SibStoreStatus status;
+} SibStoreMem;
+
+typedef struct {
+  SibStoreTripleFunc func;
+  gpointer data;
+  gboolean stopped;
+} SibStoreMemQuery;
+
+/* Namespace prefixes expanded by the store */
+static const gchar* sib_store_mem_namespaces[][2] = {
+  { "rdf", "http://www.w3.org/1999/02/22-rdf-syntax-ns#" },
+  { "rdfs", "http://www.w3.org/2000/01/rdf-schema#" },
+  { "owl", "http://www.w3.org/2002/07/owl#" },
+  { "xsd", "http://www.w3.org/2001/XMLSchema#" },
+  { NULL, NULL }
+};
+
+/* Private functions */
+
+static const SibStoreEngine sib_store_mem_engine;
+
+static SibStoreMem* sib_store_mem_handle_new(SibStoreMemData* data, gboolean writer)
+{
+  SibStoreMem* self = g_new0(SibStoreMem, 1);
+  self->base.engine = &sib_store_mem_engine;
+  self->data = data;
+  self->writer = writer;
+  g_atomic_int_inc(&(data->handles));
+  return self;
+}
+
+/* Remembers the last error of a handle */
+static void sib_store_mem_fail(SibStoreMem* self, SibStoreStatus status, const gchar* error)
+{
+  self->status = status;
+  self->error = error;
+}
+
+/* Locking of calls outside transactions */
+
+static void sib_store_mem_read_lock(SibStoreMem* self)
+{
+  if (!self->in_transaction)
+    g_static_rw_lock_reader_lock(&(self->data->lock));
+}
+
+static void sib_store_mem_read_unlock(SibStoreMem* self)
+{
+  if (!self->in_transaction)
+    g_static_rw_lock_reader_unlock(&(self->data->lock));
+}
+
+static void sib_store_mem_write_lock(SibStoreMem* self)
+{
+  if (!self->in_transaction)
+    g_static_rw_lock_writer_lock(&(self->data->lock));
+}
+
+static void sib_store_mem_write_unlock(SibStoreMem* self)
+{
+  if (!self->in_transaction)
+    g_static_rw_lock_writer_unlock(&(self->data->lock));
+}
+
+/* Indexes */
+
+static gboolean sib_store_mem_index_add(GHashTable* index, gint a, gint b, gint c)
+{
+  GHashTable *second, *third;
+
+  second = g_hash_table_lookup(index, GINT_TO_POINTER(a));
+  if (NULL == second)
+    {
+      second = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+				     NULL, (GDestroyNotify)g_hash_table_destroy);
+      g_hash_table_insert(index, GINT_TO_POINTER(a), second);
+    }
+  third = g_hash_table_lookup(second, GINT_TO_POINTER(b));
+  if (NULL == third)
+    {
+      third = g_hash_table_new(g_direct_hash, g_direct_equal);
+      g_hash_table_insert(second, GINT_TO_POINTER(b), third);
+    }
+  if (NULL != g_hash_table_lookup(third, GINT_TO_POINTER(c)))
+    return FALSE;
+  g_hash_table_insert(third, GINT_TO_POINTER(c), GINT_TO_POINTER(TRUE));
+  return TRUE;
+}
+
+static gboolean sib_store_mem_index_del(GHashTable* index, gint a, gint b, gint c)
+{
+  GHashTable *second, *third;
+
+  second = g_hash_table_lookup(index, GINT_TO_POINTER(a));
+  if (NULL == second)
+    return FALSE;
+  third = g_hash_table_lookup(second, GINT_TO_POINTER(b));
+  if (NULL == third || !g_hash_table_remove(third, GINT_TO_POINTER(c)))
+    return FALSE;
+  if (0 == g_hash_table_size(third))
+    {
+      g_hash_table_remove(second, GINT_TO_POINTER(b));
+      if (0 == g_hash_table_size(second))
+	g_hash_table_remove(index, GINT_TO_POINTER(a));
+    }
+  return TRUE;
+}
+
+static gboolean sib_store_mem_triple_add(SibStoreMemData* data, gint s, gint p, gint o)
+{
+  if (!sib_store_mem_index_add(data->spo, s, p, o))
+    return FALSE;
+  sib_store_mem_index_add(data->pos, p, o, s);
+  sib_store_mem_index_add(data->osp, o, s, p);
+  data->n_triples++;
+  return TRUE;
+}
+
+static gboolean sib_store_mem_triple_del(SibStoreMemData* data, gint s, gint p, gint o)
+{
+  if (!sib_store_mem_index_del(data->spo, s, p, o))
+    return FALSE;
+  sib_store_mem_index_del(data->pos, p, o, s);
+  sib_store_mem_index_del(data->osp, o, s, p);
+  data->n_triples--;
+  return TRUE;
+}
+
+/* Dictionary */
+
+static const gchar* sib_store_mem_node_string(SibStoreMemData* data, gint node)
+{
+  if (node > 0 && (guint)node <= data->uris->len)
+    return g_ptr_array_index(data->uris, node - 1);
+  if (node < 0 && (guint)(-node) <= data->literals->len)
+    return g_ptr_array_index(data->literals, -node - 1);
+  return NULL;
+}
+
+static gint sib_store_mem_node_add(SibStoreMemData* data, const gchar* str, gboolean literal)
+{
+  gchar* dup = g_strdup(str);
+  gint node;
+
+  if (literal)
+    {
+      g_ptr_array_add(data->literals, dup);
+      node = -(gint)data->literals->len;
+      g_hash_table_insert(data->literal_nodes, dup, GINT_TO_POINTER(node));
+    }
+  else
+    {
+      g_ptr_array_add(data->uris, dup);
+      node = (gint)data->uris->len;
+      g_hash_table_insert(data->uri_nodes, dup, GINT_TO_POINTER(node));
+    }
+  return node;
+}
+
+/* Durable storage */
+
+static void sib_store_mem_record_node(GString* buf, gint node, const gchar* str)
+{
+  guint32 len = strlen(str);
+  g_string_append_c(buf, REC_NODE);
+  g_string_append_len(buf, (const gchar*)&node, sizeof(node));
+  g_string_append_len(buf, (const gchar*)&len, sizeof(len));
+  g_string_append_len(buf, str, len);
+}
+
+static void sib_store_mem_record_triple(GString* buf, gchar type, gint s, gint p, gint o)
+{
+  g_string_append_c(buf, type);
+  g_string_append_len(buf, (const gchar*)&s, sizeof(s));
+  g_string_append_len(buf, (const gchar*)&p, sizeof(p));
+  g_string_append_len(buf, (const gchar*)&o, sizeof(o));
+}
+
+/* Makes a rename in the directory of file durable */
+static gboolean sib_store_mem_sync_dir(const gchar* file)
+{
+  gchar* dir = g_path_get_dirname(file);
+  int fd = open(dir, O_RDONLY);
+  gboolean ok = (fd >= 0 && 0 == fsync(fd));
+
+  if (fd >= 0)
+    close(fd);
+  g_free(dir);
+  return ok;
+}
+
+/* Marks the log failed and cuts it back to the last commit */
+static void sib_store_mem_log_fail(SibStoreMemData* data)
+{
+  if (data->log_failed)
+    return;
+  whiteboard_log_warning("Could not write store log %s.log, no further commits accepted\n",
+			 data->path);
+  data->log_failed = TRUE;
+  if (NULL != data->log &&
+      (0 != ftruncate(fileno(data->log), data->log_size) ||
+       0 != fsync(fileno(data->log))))
+    whiteboard_log_warning("Could not truncate store log %s.log\n", data->path);
+}
+
+/* Appends records to the log, they are synced by the next commit */
+static gboolean sib_store_mem_log_write(SibStoreMemData* data, GString* buf, guint records)
+{
+  if (NULL == data->path)
+    return TRUE;
+  if (data->log_failed || NULL == data->log ||
+      fwrite(buf->str, 1, buf->len, data->log) != buf->len ||
+      0 != fflush(data->log))
+    {
+      sib_store_mem_log_fail(data);
+      return FALSE;
+    }
+  data->log_records += records;
+  return TRUE;
+}
+
+/* Appends the records of a commit and syncs the log */
+static gboolean sib_store_mem_log_commit(SibStoreMemData* data, GString* buf, guint records)
+{
+  if (NULL == data->path)
+    return TRUE;
+  /* Nothing to sync for a transaction that only read */
+  if (0 == buf->len && (data->log_failed || ftell(data->log) == data->log_size))
+    return TRUE;
+  if (!sib_store_mem_log_write(data, buf, records) ||
+      0 != fsync(fileno(data->log)))
+    {
+      sib_store_mem_log_fail(data);
+      return FALSE;
+    }
+  data->log_size = ftell(data->log);
+  return TRUE;
+}
+
+/* Writes the whole store to path.snap and truncates the log */
+static void sib_store_mem_snapshot(SibStoreMemData* data)
+{
+  gchar *snap, *tmp, *log;
+  FILE* f;
+  gboolean synced;
+  GHashTableIter i1, i2, i3;
+  gpointer s, p, o;
+  GHashTable *ps, *os;
+  GString* buf;
+  guint n;
+
+  snap = g_strdup_printf("%s.snap", data->path);
+  tmp = g_strdup_printf("%s.snap.tmp", data->path);
+  log = g_strdup_printf("%s.log", data->path);
+
+  f = fopen(tmp, "wb");
+  if (NULL == f)
+    {
+      whiteboard_log_warning("Could not write store snapshot %s\n", tmp);
+      goto out;
+    }
+
+  /* Nodes in id order, so that reading them back gives the same ids */
+  buf = g_string_new(NULL);
+  for (n = 0; n < data->uris->len; n++)
+    sib_store_mem_record_node(buf, n + 1, g_ptr_array_index(data->uris, n));
+  for (n = 0; n < data->literals->len; n++)
+    sib_store_mem_record_node(buf, -(gint)(n + 1), g_ptr_array_index(data->literals, n));
+  fwrite(buf->str, 1, buf->len, f);
+  g_string_truncate(buf, 0);
+
+  g_hash_table_iter_init(&i1, data->spo);
+  while (g_hash_table_iter_next(&i1, &s, (gpointer*)&ps))
+    {
+      g_hash_table_iter_init(&i2, ps);
+      while (g_hash_table_iter_next(&i2, &p, (gpointer*)&os))
+	{
+	  g_hash_table_iter_init(&i3, os);
+	  while (g_hash_table_iter_next(&i3, &o, NULL))
+	    sib_store_mem_record_triple(buf, REC_ADD, GPOINTER_TO_INT(s),
+					GPOINTER_TO_INT(p), GPOINTER_TO_INT(o));
+	}
+      fwrite(buf->str, 1, buf->len, f);
+      g_string_truncate(buf, 0);
+    }
+  g_string_free(buf, TRUE);
+
+  /* The snapshot must be on the disk before it replaces the old one */
+  synced = (!ferror(f) && 0 == fflush(f) && 0 == fsync(fileno(f)));
+  if (0 != fclose(f) || !synced || 0 != g_rename(tmp, snap) ||
+      !sib_store_mem_sync_dir(snap))
+    {
+      whiteboard_log_warning("Could not write store snapshot %s\n", snap);
+      goto out;
+    }
+
+  /* Everything in the log is now in the snapshot. Should the
+     truncation be lost, replaying the old log over the snapshot gives
+     the same store. */
+  if (NULL != data->log)
+    fclose(data->log);
+  data->log = fopen(log, "wb");
+  data->log_records = 0;
+  data->log_size = 0;
+  if (NULL == data->log)
+    sib_store_mem_log_fail(data);
+
+ out:
+  g_free(snap);
+  g_free(tmp);
+  g_free(log);
+}
+
+/*
+ * Applies the records of a snapshot or log file, returns record count.
+ * If end is given, it is set to the length of the complete records.
+ */
+static guint sib_store_mem_replay(SibStoreMemData* data, const gchar* file, glong* end)
+{
+  FILE* f = fopen(file, "rb");
+  gint c, node, s, p, o;
+  guint32 len;
+  gchar* str;
+  guint records = 0;
+
+  if (NULL != end)
+    *end = 0;
+  if (NULL == f)
+    return 0;
+
+  while (EOF != (c = fgetc(f)))
+    {
+      if (REC_NODE == c)
+	{
+	  if (1 != fread(&node, sizeof(node), 1, f) ||
+	      1 != fread(&len, sizeof(len), 1, f))
+	    break;
+	  str = g_malloc(len + 1);
+	  if (len != fread(str, 1, len, f))
+	    {
+	      g_free(str);
+	      break;
+	    }
+	  str[len] = '\0';
+	  /* Nodes already known from the snapshot are skipped */
+	  if (NULL == sib_store_mem_node_string(data, node))
+	    sib_store_mem_node_add(data, str, node < 0);
+	  g_free(str);
+	}
+      else if (REC_ADD == c || REC_DEL == c)
+	{
+	  if (1 != fread(&s, sizeof(s), 1, f) ||
+	      1 != fread(&p, sizeof(p), 1, f) ||
+	      1 != fread(&o, sizeof(o), 1, f))
+	    break;
+	  if (REC_ADD == c)
+	    sib_store_mem_triple_add(data, s, p, o);
+	  else
+	    sib_store_mem_triple_del(data, s, p, o);
+	}
+      else
+	break;
+      records++;
+      if (NULL != end)
+	*end = ftell(f);
+    }
+  if (!feof(f))
+    whiteboard_log_warning("Store file %s is truncated or corrupt, read %u records\n",
+			   file, records);
+  fclose(f);
+  return records;
+}
+
+/* Engine functions */
+
+static SibStore* sib_store_mem_open_reader(SibStore* store)
+{
+  return (SibStore*)sib_store_mem_handle_new(((SibStoreMem*)store)->data, FALSE);
+}
+
+static void sib_store_mem_close(SibStore* store)
+{
+  SibStoreMem* self = (SibStoreMem*)store;
+  SibStoreMemData* data = self->data;
+
+  if (self->in_transaction)
+    store->engine->rollback(store);
+
+  if (g_atomic_int_dec_and_test(&(data->handles)))
+    {
+      if (NULL != data->log)
+	fclose(data->log);
+      g_hash_table_destroy(data->spo);
+      g_hash_table_destroy(data->pos);
+      g_hash_table_destroy(data->osp);
+      g_hash_table_destroy(data->uri_nodes);
+      g_hash_table_destroy(data->literal_nodes);
+      g_ptr_array_foreach(data->uris, (GFunc)g_free, NULL);
+      g_ptr_array_free(data->uris, TRUE);
+      g_ptr_array_foreach(data->literals, (GFunc)g_free, NULL);
+      g_ptr_array_free(data->literals, TRUE);
+      g_static_rw_lock_free(&(data->lock));
+      g_free(data->path);
+      g_free(data);
+    }
+  g_free(self);
+}
+
+static gboolean sib_store_mem_transaction(SibStore* store)
+{
+  SibStoreMem* self = (SibStoreMem*)store;
+
+  if (self->in_transaction)
+    {
+      sib_store_mem_fail(self, SIB_STORE_FAILED, "Transaction already started");
+      return FALSE;
+    }
+  if (self->writer)
+    {
+      g_static_rw_lock_writer_lock(&(self->data->lock));
+      self->undo = g_array_new(FALSE, FALSE, sizeof(SibStoreMemChange));
+      self->pending = g_string_new(NULL);
+    }
+  else
+    g_static_rw_lock_reader_lock(&(self->data->lock));
+  self->in_transaction = TRUE;
+  return TRUE;
+}
+
+static void sib_store_mem_end(SibStoreMem* self)
+{
+  self->in_transaction = FALSE;
+  if (self->writer)
+    {
+      g_array_free(self->undo, TRUE);
+      g_string_free(self->pending, TRUE);
+      self->undo = NULL;
+      self->pending = NULL;
+      g_static_rw_lock_writer_unlock(&(self->data->lock));
+    }
+  else
+    g_static_rw_lock_reader_unlock(&(self->data->lock));
+}
+
+static gboolean sib_store_mem_commit(SibStore* store)
+{
+  SibStoreMem* self = (SibStoreMem*)store;
+  SibStoreMemData* data = self->data;
+  gboolean snapshot;
+
+  if (!self->in_transaction)
+    {
+      sib_store_mem_fail(self, SIB_STORE_FAILED, "No transaction to commit");
+      return FALSE;
+    }
+  /* On failure the transaction stays open for the caller to roll back */
+  if (self->writer &&
+      !sib_store_mem_log_commit(data, self->pending, self->undo->len))
+    {
+      sib_store_mem_fail(self, SIB_STORE_FAILED, "Could not write store log");
+      return FALSE;
+    }
+  snapshot = self->writer && data->log_records > SIB_STORE_MEM_LOG_MAX;
+  sib_store_mem_end(self);
+
+  /* Reader transactions go on while the store is written out. Only
+     this handle writes, so nothing changes meanwhile. */
+  if (snapshot)
+    {
+      g_static_rw_lock_reader_lock(&(data->lock));
+      sib_store_mem_snapshot(data);
+      g_static_rw_lock_reader_unlock(&(data->lock));
+    }
+  return TRUE;
+}
+
+static gboolean sib_store_mem_rollback(SibStore* store)
+{
+  SibStoreMem* self = (SibStoreMem*)store;
+  SibStoreMemChange* c;
+  gint n;
+
+  if (!self->in_transaction)
+    {
+      sib_store_mem_fail(self, SIB_STORE_FAILED, "No transaction to roll back");
+      return FALSE;
+    }
+  if (self->writer)
+    {
+      /* Nodes are kept, they are already in the log */
+      for (n = self->undo->len - 1; n >= 0; n--)
+	{
+	  c = &g_array_index(self->undo, SibStoreMemChange, n);
+	  if (c->added)
+	    sib_store_mem_triple_del(self->data, c->s, c->p, c->o);
+	  else
+	    sib_store_mem_triple_add(self->data, c->s, c->p, c->o);
+	}
+    }
+  sib_store_mem_end(self);
+  return TRUE;
+}
+
+static gint sib_store_mem_lookup(SibStore* store, const gchar* str, gboolean literal)
+{
+  SibStoreMem* self = (SibStoreMem*)store;
+  SibStoreMemData* data = self->data;
+  GHashTable* nodes;
+  gint node;
+  GString* buf;
+
+  if (NULL == str)
+    {
+      sib_store_mem_fail(self, SIB_STORE_FAILED, "Unable to create a new node ID");
+      return 0;
+    }
+  nodes = literal ? data->literal_nodes : data->uri_nodes;
+
+  sib_store_mem_read_lock(self);
+  node = GPOINTER_TO_INT(g_hash_table_lookup(nodes, str));
+  sib_store_mem_read_unlock(self);
+  if (0 != node)
+    return node;
+
+  if (!self->writer)
+    {
+      sib_store_mem_fail(self, SIB_STORE_NODE_NEW, "Unable to find node");
+      return 0;
+    }
+
+  sib_store_mem_write_lock(self);
+  /* Someone may have added it meanwhile */
+  node = GPOINTER_TO_INT(g_hash_table_lookup(nodes, str));
+  if (0 == node)
+    {
+      node = sib_store_mem_node_add(data, str, literal);
+      /* Logged at once, nodes are not rolled back. A failed write
+	 fails the commit of the transaction using the node. */
+      buf = g_string_new(NULL);
+      sib_store_mem_record_node(buf, node, str);
+      sib_store_mem_log_write(data, buf, 1);
+      g_string_free(buf, TRUE);
+    }
+  sib_store_mem_write_unlock(self);
+  return node;
+}
+
+static gint sib_store_mem_node(SibStore* store, const gchar* uri)
+{
+  return sib_store_mem_lookup(store, uri, FALSE);
+}
+
+static gint sib_store_mem_literal(SibStore* store, const gchar* str)
+{
+  return sib_store_mem_lookup(store, str, TRUE);
+}
+
+static gchar* sib_store_mem_info(SibStore* store, gint node)
+{
+  SibStoreMem* self = (SibStoreMem*)store;
+  gchar* str;
+
+  sib_store_mem_read_lock(self);
+  str = g_strdup(sib_store_mem_node_string(self->data, node));
+  sib_store_mem_read_unlock(self);
+  if (NULL == str)
+    sib_store_mem_fail(self, SIB_STORE_NODE_FIND, "Unable to find node");
+  return str;
+}
+
+static gchar* sib_store_mem_expand(SibStore* store, const gchar* str)
+{
+  const gchar* colon;
+  gint n;
+
+  colon = (NULL != str) ? strchr(str, ':') : NULL;
+  if (NULL == colon)
+    return g_strdup(str);
+  for (n = 0; NULL != sib_store_mem_namespaces[n][0]; n++)
+    {
+      if (strlen(sib_store_mem_namespaces[n][0]) == (gsize)(colon - str) &&
+	  0 == strncmp(str, sib_store_mem_namespaces[n][0], colon - str))
+	return g_strconcat(sib_store_mem_namespaces[n][1], colon + 1, NULL);
+    }
+  return g_strdup(str);
+}
+
+static gboolean sib_store_mem_change(SibStore* store, gint s, gint p, gint o, gboolean add)
+{
+  SibStoreMem* self = (SibStoreMem*)store;
+  SibStoreMemData* data = self->data;
+  SibStoreMemChange c;
+  GString* buf;
+  gboolean changed, ok = TRUE;
+
+  if (!self->writer)
+    {
+      sib_store_mem_fail(self, SIB_STORE_FAILED, "Read-only store handle");
+      return FALSE;
+    }
+  if (0 == s || 0 == p || 0 == o)
+    {
+      sib_store_mem_fail(self, SIB_STORE_FAILED,
+			 add ? "Unable to insert new triple" : "Unable to delete triple");
+      return FALSE;
+    }
+
+  sib_store_mem_write_lock(self);
+  if (add)
+    changed = sib_store_mem_triple_add(data, s, p, o);
+  else
+    changed = sib_store_mem_triple_del(data, s, p, o);
+  if (changed)
+    {
+      if (self->in_transaction)
+	{
+	  c.s = s;
+	  c.p = p;
+	  c.o = o;
+	  c.added = add;
+	  g_array_append_vals(self->undo, &c, 1);
+	  sib_store_mem_record_triple(self->pending, add ? REC_ADD : REC_DEL, s, p, o);
+	}
+      else
+	{
+	  /* Committed on its own, undone if its log record fails */
+	  buf = g_string_new(NULL);
+	  sib_store_mem_record_triple(buf, add ? REC_ADD : REC_DEL, s, p, o);
+	  if (!sib_store_mem_log_commit(data, buf, 1))
+	    {
+	      if (add)
+		sib_store_mem_triple_del(data, s, p, o);
+	      else
+		sib_store_mem_triple_add(data, s, p, o);
+	      sib_store_mem_fail(self, SIB_STORE_FAILED, "Could not write store log");
+	      ok = FALSE;
+	    }
+	  g_string_free(buf, TRUE);
+	}
+    }
+  sib_store_mem_write_unlock(self);
+  return ok;
+}
+
+static gboolean sib_store_mem_add(SibStore* store, gint s, gint p, gint o)
+{
+  return sib_store_mem_change(store, s, p, o, TRUE);
+}
+
+static gboolean sib_store_mem_post_process(SibStore* store, gint s, gint p, gint o)
+{
+  /* No RDFS post-processing in this engine */
+  return TRUE;
+}
+
+static gboolean sib_store_mem_del(SibStore* store, gint s, gint p, gint o)
+{
+  return sib_store_mem_change(store, s, p, o, FALSE);
+}
+
+/* Calls the query function for all c in a set, with a and b bound */
+static void sib_store_mem_emit(SibStoreMemQuery* q, GHashTable* set, gint a, gint b, gint order)
+{
+  GHashTableIter iter;
+  gpointer c;
+  gint t;
+
+  if (NULL == set)
+    return;
+  g_hash_table_iter_init(&iter, set);
+  while (!q->stopped && g_hash_table_iter_next(&iter, &c, NULL))
+    {
+      t = GPOINTER_TO_INT(c);
+      /* order tells which index the set comes from */
+      switch (order)
+	{
+	case 0: /* SPO */
+	  q->stopped = !q->func(a, b, t, q->data);
+	  break;
+	case 1: /* POS */
+	  q->stopped = !q->func(t, a, b, q->data);
+	  break;
+	default: /* OSP */
+	  q->stopped = !q->func(b, t, a, q->data);
+	  break;
+	}
+    }
+}
+
+/* Walks an index from a bound first node, or all of it if a is 0 */
+static void sib_store_mem_walk(SibStoreMemQuery* q, GHashTable* index, gint a, gint b, gint order)
+{
+  GHashTableIter i1, i2;
+  gpointer k1, k2;
+  GHashTable *second, *third;
+
+  if (0 != a)
+    {
+      second = g_hash_table_lookup(index, GINT_TO_POINTER(a));
+      if (NULL == second)
+	return;
+      if (0 != b)
+	{
+	  sib_store_mem_emit(q, g_hash_table_lookup(second, GINT_TO_POINTER(b)), a, b, order);
+	  return;
+	}
+      g_hash_table_iter_init(&i2, second);
+      while (!q->stopped && g_hash_table_iter_next(&i2, &k2, (gpointer*)&third))
+	sib_store_mem_emit(q, third, a, GPOINTER_TO_INT(k2), order);
+      return;
+    }
+
+  g_hash_table_iter_init(&i1, index);
+  while (!q->stopped && g_hash_table_iter_next(&i1, &k1, (gpointer*)&second))
+    {
+      g_hash_table_iter_init(&i2, second);
+      while (!q->stopped && g_hash_table_iter_next(&i2, &k2, (gpointer*)&third))
+	sib_store_mem_emit(q, third, GPOINTER_TO_INT(k1), GPOINTER_TO_INT(k2), order);
+    }
+}
+
+static gboolean sib_store_mem_query(SibStore* store, gint s, gint p, gint o,
+				    SibStoreTripleFunc func, gpointer data)
+{
+  SibStoreMem* self = (SibStoreMem*)store;
+  SibStoreMemQuery q;
+  GHashTable *second, *third;
+
+  q.func = func;
+  q.data = data;
+  q.stopped = FALSE;
+
+  sib_store_mem_read_lock(self);
+  if (0 != s && 0 != p && 0 != o)
+    {
+      second = g_hash_table_lookup(self->data->spo, GINT_TO_POINTER(s));
+      third = (NULL != second) ? g_hash_table_lookup(second, GINT_TO_POINTER(p)) : NULL;
+      if (NULL != third && NULL != g_hash_table_lookup(third, GINT_TO_POINTER(o)))
+	func(s, p, o, data);
+    }
+  else if (0 != s && 0 == o)
+    sib_store_mem_walk(&q, self->data->spo, s, p, 0);
+  else if (0 != p)
+    sib_store_mem_walk(&q, self->data->pos, p, o, 1);
+  else if (0 != o)
+    sib_store_mem_walk(&q, self->data->osp, o, s, 2);
+  else
+    sib_store_mem_walk(&q, self->data->spo, 0, 0, 0);
+  sib_store_mem_read_unlock(self);
+  return TRUE;
+}
+
+static gboolean sib_store_mem_load_rdfxml(SibStore* store, const gchar* rdfxml)
+{
+  sib_store_mem_fail((SibStoreMem*)store, SIB_STORE_FAILED,
+		     "RDF/XML is not supported by the memory store");
+  return FALSE;
+}
+
+static const gchar* sib_store_mem_error(SibStore* store)
+{
+  SibStoreMem* self = (SibStoreMem*)store;
+  return (NULL != self->error) ? self->error : "";
+}
+
+static SibStoreStatus sib_store_mem_status(SibStore* store)
+{
+  return ((SibStoreMem*)store)->status;
+}
+
+static const SibStoreEngine sib_store_mem_engine = {
+  "memory",
+  sib_store_mem_open_reader,
+  sib_store_mem_close,
+  sib_store_mem_transaction,
+  sib_store_mem_commit,
+  sib_store_mem_rollback,
+  sib_store_mem_node,
+  sib_store_mem_literal,
+  sib_store_mem_info,
+  sib_store_mem_expand,
+  sib_store_mem_add,
+  sib_store_mem_post_process,
+  sib_store_mem_del,
+  sib_store_mem_query,
+  sib_store_mem_load_rdfxml,
+  sib_store_mem_error,
+  sib_store_mem_status
+};
+
+/* Public functions */
+
+SibStore* sib_store_mem_open(const gchar* path)
+{
+  SibStoreMemData* data;
+  SibStoreMem* self;
+  gchar* file;
+  guint records;
+
+  data = g_new0(SibStoreMemData, 1);
+  data->uris = g_ptr_array_new();
+  data->literals = g_ptr_array_new();
+  data->uri_nodes = g_hash_table_new(g_str_hash, g_str_equal);
+  data->literal_nodes = g_hash_table_new(g_str_hash, g_str_equal);
+  data->spo = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+				    NULL, (GDestroyNotify)g_hash_table_destroy);
+  data->pos = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+				    NULL, (GDestroyNotify)g_hash_table_destroy);
+  data->osp = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+				    NULL, (GDestroyNotify)g_hash_table_destroy);
+  g_static_rw_lock_init(&(data->lock));
+  self = sib_store_mem_handle_new(data, TRUE);
+
+  if (NULL != path && '\0' != *path)
+    {
+      data->path = g_strdup(path);
+
+      file = g_strdup_printf("%s.snap", path);
+      sib_store_mem_replay(data, file, NULL);
+      g_free(file);
+
+      /* A torn record at the end of the log is cut off, so that new
+	 records are not appended after it */
+      file = g_strdup_printf("%s.log", path);
+      records = sib_store_mem_replay(data, file, &(data->log_size));
+      data->log = fopen(file, "ab");
+      g_free(file);
+      if (NULL != data->log &&
+	  0 != ftruncate(fileno(data->log), data->log_size))
+	{
+	  fclose(data->log);
+	  data->log = NULL;
+	}
+      if (NULL == data->log)
+	{
+	  whiteboard_log_warning("Could not open store log %s.log\n", path);
+	  sib_store_mem_close((SibStore*)self);
+	  return NULL;
+	}
+      data->log_records = records;
+      whiteboard_log_debug("Loaded %u triples from %s\n", data->n_triples, path);
+    }
+
+  return (SibStore*)self;
+}
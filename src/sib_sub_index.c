@@ -0,0 +1,254 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_sub_index.c
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <glib.h>
+
+#include "sib_operations.h"
+#include "sib_sub_index.h"
+
+/* Bits of the wildcard shape of a pattern: set bit = bound position */
+#define SHAPE_S 1
+#define SHAPE_P 2
+#define SHAPE_O 4
+#define N_SHAPES 8
+
+typedef struct
+{
+  gint s;
+  gint p;
+  gint o;
+} SibSubIndexKey;
+
+struct _SibSubIndex
+{
+  /* One table per shape: SibSubIndexKey -> GSList of subscriptions */
+  GHashTable* shapes[N_SHAPES];
+  guint n_patterns;
+};
+
+/* Private functions */
+
+static guint sib_sub_index_key_hash(gconstpointer key)
+{
+  const SibSubIndexKey* k = (const SibSubIndexKey*)key;
+  guint h = (guint)k->s;
+  h = h * 31 + (guint)k->p;
+  h = h * 31 + (guint)k->o;
+  return h;
+}
+
+static gboolean sib_sub_index_key_equal(gconstpointer a, gconstpointer b)
+{
+  const SibSubIndexKey* ka = (const SibSubIndexKey*)a;
+  const SibSubIndexKey* kb = (const SibSubIndexKey*)b;
+  return ka->s == kb->s && ka->p == kb->p && ka->o == kb->o;
+}
+
+static void sib_sub_index_free_subs(gpointer data)
+{
+  g_slist_free((GSList*)data);
+}
+
+static gint sib_sub_index_shape(const m3_triple_int* t)
+{
+  gint shape = 0;
+  if (t->s != 0)
+    shape |= SHAPE_S;
+  if (t->p != 0)
+    shape |= SHAPE_P;
+  if (t->o != 0)
+    shape |= SHAPE_O;
+  return shape;
+}
+
+/* Masks a concrete triple to the key it would have under given shape */
+static void sib_sub_index_make_key(SibSubIndexKey* key, gint shape,
+				   gint s, gint p, gint o)
+{
+  key->s = (shape & SHAPE_S) ? s : 0;
+  key->p = (shape & SHAPE_P) ? p : 0;
+  key->o = (shape & SHAPE_O) ? o : 0;
+}
+
+/* Public functions */
+
+SibSubIndex* sib_sub_index_new(void)
+{
+  SibSubIndex* self;
+  gint i;
+
+  self = g_new0(SibSubIndex, 1);
+  for (i = 0; i < N_SHAPES; i++)
+    {
+      self->shapes[i] = g_hash_table_new_full(sib_sub_index_key_hash,
+					      sib_sub_index_key_equal,
+					      g_free,
+					      sib_sub_index_free_subs);
+    }
+  self->n_patterns = 0;
+  return self;
+}
+
+void sib_sub_index_destroy(SibSubIndex* self)
+{
+  gint i;
+
+  g_return_if_fail(NULL != self);
+
+  for (i = 0; i < N_SHAPES; i++)
+    g_hash_table_destroy(self->shapes[i]);
+  g_free(self);
+}
+
+void sib_sub_index_add(SibSubIndex* self, GSList* patterns, gpointer sub)
+{
+  m3_triple_int* t;
+  SibSubIndexKey lookup;
+  SibSubIndexKey* key;
+  gpointer orig_key;
+  gpointer value;
+  gint shape;
+
+  g_return_if_fail(NULL != self);
+
+  for ( ; patterns != NULL; patterns = patterns->next)
+    {
+      t = (m3_triple_int*)patterns->data;
+      shape = sib_sub_index_shape(t);
+      sib_sub_index_make_key(&lookup, shape, t->s, t->p, t->o);
+
+      if (!g_hash_table_lookup_extended(self->shapes[shape], &lookup,
+					&orig_key, &value))
+	{
+	  key = g_new0(SibSubIndexKey, 1);
+	  *key = lookup;
+	  g_hash_table_insert(self->shapes[shape], key,
+			      g_slist_prepend(NULL, sub));
+	  self->n_patterns++;
+	}
+      else if (NULL == g_slist_find((GSList*)value, sub))
+	{
+	  /* Steal so that the value destroy function does not free the list */
+	  g_hash_table_steal(self->shapes[shape], &lookup);
+	  g_hash_table_insert(self->shapes[shape], orig_key,
+			      g_slist_prepend((GSList*)value, sub));
+	}
+    }
+}
+
+void sib_sub_index_remove(SibSubIndex* self, GSList* patterns, gpointer sub)
+{
+  m3_triple_int* t;
+  SibSubIndexKey lookup;
+  gpointer orig_key;
+  gpointer value;
+  GSList* subs;
+  gint shape;
+
+  g_return_if_fail(NULL != self);
+
+  for ( ; patterns != NULL; patterns = patterns->next)
+    {
+      t = (m3_triple_int*)patterns->data;
+      shape = sib_sub_index_shape(t);
+      sib_sub_index_make_key(&lookup, shape, t->s, t->p, t->o);
+
+      if (!g_hash_table_lookup_extended(self->shapes[shape], &lookup,
+					&orig_key, &value))
+	continue;
+
+      subs = g_slist_remove((GSList*)value, sub);
+      g_hash_table_steal(self->shapes[shape], &lookup);
+      if (NULL == subs)
+	{
+	  g_free(orig_key);
+	  self->n_patterns--;
+	}
+      else
+	{
+	  g_hash_table_insert(self->shapes[shape], orig_key, subs);
+	}
+    }
+}
+
+GSList* sib_sub_index_match(SibSubIndex* self, gint s, gint p, gint o)
+{
+  SibSubIndexKey lookup;
+  GSList* matches = NULL;
+  GSList* subs;
+  GHashTable* seen = NULL;
+  gint shape;
+
+  g_return_val_if_fail(NULL != self, NULL);
+
+  for (shape = 0; shape < N_SHAPES; shape++)
+    {
+      if (0 == g_hash_table_size(self->shapes[shape]))
+	continue;
+
+      sib_sub_index_make_key(&lookup, shape, s, p, o);
+      for (subs = g_hash_table_lookup(self->shapes[shape], &lookup);
+	   subs != NULL;
+	   subs = subs->next)
+	{
+	  /* A subscription may match through several of its patterns */
+	  if (NULL == seen)
+	    seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+	  if (NULL != g_hash_table_lookup(seen, subs->data))
+	    continue;
+	  g_hash_table_insert(seen, subs->data, subs->data);
+	  matches = g_slist_prepend(matches, subs->data);
+	}
+    }
+
+  if (NULL != seen)
+    g_hash_table_destroy(seen);
+  return matches;
+}
+
+guint sib_sub_index_size(SibSubIndex* self)
+{
+  g_return_val_if_fail(NULL != self, 0);
+
+  return self->n_patterns;
+}
@@ -0,0 +1,1150 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * sib_wql.c
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string.h>
+#include <glib.h>
+
+#include "sib_operations.h"
+#include "sib_wql.h"
+
+#define RDF_NS "http://www.w3.org/1999/02/22-rdf-syntax-ns#"
+#define RDFS_NS "http://www.w3.org/2000/01/rdf-schema#"
+
+typedef enum
+{
+  /* Steps, the leaves of a path */
+  WQL_NODE,		/* along a property */
+  WQL_ANY,		/* along any property */
+  WQL_MEMBERS,		/* along rdf:_1, rdf:_2, ... while they have values */
+  WQL_SELF,		/* to the node itself */
+  WQL_P_OF_S,		/* to the properties the node is subject of */
+  WQL_P_OF_O,		/* to the properties the node is object of */
+  WQL_VALUE,		/* to a given node */
+  WQL_FILTER,		/* to the node itself if its string matches */
+  /* Operators */
+  WQL_SEQ,
+  WQL_SEQ_OPT,		/* seq+: the first path, optionally followed by the rest */
+  WQL_OR,
+  WQL_REP,		/* rep* */
+  WQL_REP_PLUS,
+  WQL_INV,
+  WQL_NOREWRITE
+} SibWqlOp;
+
+/* Parsed path expression */
+typedef struct _SibWqlExpr
+{
+  SibWqlOp op;
+  /* WQL_NODE and WQL_VALUE */
+  gint node;
+  /* WQL_FILTER */
+  gchar* pattern;
+  /* Operators */
+  GSList* args;
+} SibWqlExpr;
+
+/* Input of the automaton: a step walked forwards or backwards */
+typedef struct
+{
+  SibWqlOp op;
+  gboolean inverse;
+  gint node;
+  gchar* pattern;
+  GRegex* regex;
+} SibWqlStep;
+
+typedef struct
+{
+  guint step;
+  guint target;
+} SibWqlTransition;
+
+typedef struct
+{
+  gboolean terminal;
+  /* SibWqlTransition */
+  GArray* transitions;
+} SibWqlState;
+
+struct _SibWqlPath
+{
+  gboolean reasoner;
+  /* The property the expression names, 0 if it is not a single
+     property */
+  gint property;
+  /* SibWqlStep*, the inputs */
+  GPtrArray* steps;
+  /* SibWqlState, the first one is the start state */
+  GArray* states;
+};
+
+/* Nodes of the RDFS vocabulary used in reasoning */
+typedef struct
+{
+  gint type;
+  gint subclass;
+  gint subprop;
+  gint domain;
+  gint range;
+  gint resource;
+} SibWqlVocab;
+
+typedef struct
+{
+  const gchar* p;
+  SibStore* store;
+} SibWqlParser;
+
+/* Positions of the path (its leaves) during compilation, the
+   Glushkov construction of PathFSA */
+typedef struct
+{
+  SibWqlPath* path;
+  guint n_positions;
+  guint words;
+  guint next;
+  /* Step of each position, end is the position after the path */
+  guint* position_step;
+  guint end;
+  /* Bit sets of the positions following each position */
+  guint32* follows;
+} SibWqlBuilder;
+
+/* Node reached in a state during a walk */
+typedef struct
+{
+  gint node;
+  guint state;
+} SibWqlVisit;
+
+typedef struct
+{
+  GArray* out;
+  /* 0, 1 or 2: collect subjects, predicates or objects */
+  gint which;
+} SibWqlCollect;
+
+/* Private functions */
+
+static void sib_wql_vocab_init(SibWqlVocab* v, SibStore* store)
+{
+  v->type = sib_store_resolve(store, RDF_NS "type", FALSE);
+  v->subclass = sib_store_resolve(store, RDFS_NS "subClassOf", FALSE);
+  v->subprop = sib_store_resolve(store, RDFS_NS "subPropertyOf", FALSE);
+  v->domain = sib_store_resolve(store, RDFS_NS "domain", FALSE);
+  v->range = sib_store_resolve(store, RDFS_NS "range", FALSE);
+  v->resource = sib_store_resolve(store, RDFS_NS "Resource", FALSE);
+}
+
+static SibWqlExpr* sib_wql_expr_new(SibWqlOp op, gint node)
+{
+  SibWqlExpr* e = g_new0(SibWqlExpr, 1);
+  e->op = op;
+  e->node = node;
+  return e;
+}
+
+static SibWqlExpr* sib_wql_expr_op(SibWqlOp op, SibWqlExpr* arg)
+{
+  SibWqlExpr* e = sib_wql_expr_new(op, 0);
+  e->args = g_slist_append(e->args, arg);
+  return e;
+}
+
+static void sib_wql_expr_free(SibWqlExpr* e)
+{
+  if (NULL == e)
+    return;
+  g_slist_foreach(e->args, (GFunc)sib_wql_expr_free, NULL);
+  g_slist_free(e->args);
+  g_free(e->pattern);
+  g_free(e);
+}
+
+static gboolean sib_wql_is_leaf(SibWqlOp op)
+{
+  return op < WQL_SEQ;
+}
+
+/* Whether values are dropped from the arguments of an operator when
+   inverted, as in the invert of wilbur */
+static gboolean sib_wql_drops_values(SibWqlOp op)
+{
+  return op == WQL_SEQ || op == WQL_SEQ_OPT || op == WQL_OR;
+}
+
+/*
+ * Parsing of the path expressions, nested lists of quoted strings
+ */
+
+static void sib_wql_skip_space(SibWqlParser* parser)
+{
+  while (g_ascii_isspace(*parser->p))
+    parser->p++;
+}
+
+static gchar* sib_wql_parse_string(SibWqlParser* parser)
+{
+  GString* str;
+  gchar quote = *parser->p;
+
+  if (quote != '\'' && quote != '"')
+    return NULL;
+  str = g_string_new(NULL);
+  for (parser->p++; *parser->p != quote; parser->p++)
+    {
+      if ('\0' == *parser->p)
+	{
+	  g_string_free(str, TRUE);
+	  return NULL;
+	}
+      if ('\\' == *parser->p && '\0' != parser->p[1])
+	{
+	  parser->p++;
+	  switch (*parser->p)
+	    {
+	    case 'n':
+	      g_string_append_c(str, '\n');
+	      continue;
+	    case 't':
+	      g_string_append_c(str, '\t');
+	      continue;
+	    default:
+	      break;
+	    }
+	}
+      g_string_append_c(str, *parser->p);
+    }
+  parser->p++;
+  return g_string_free(str, FALSE);
+}
+
+static gboolean sib_wql_operator(const gchar* word, SibWqlOp* op)
+{
+  static const struct { const gchar* word; SibWqlOp op; } operators[] = {
+    { "seq", WQL_SEQ },
+    { "seq+", WQL_SEQ_OPT },
+    { "or", WQL_OR },
+    { "rep*", WQL_REP },
+    { "rep+", WQL_REP_PLUS },
+    { "inv", WQL_INV },
+    { "value", WQL_VALUE },
+    { "norewrite", WQL_NOREWRITE },
+    { "filter", WQL_FILTER },
+    { NULL, 0 }
+  };
+  gint i;
+
+  for (i = 0; NULL != operators[i].word; i++)
+    if (0 == strcmp(word, operators[i].word))
+      {
+	*op = operators[i].op;
+	return TRUE;
+      }
+  return FALSE;
+}
+
+/* A string outside the operator position: special step or property */
+static SibWqlExpr* sib_wql_leaf(SibWqlParser* parser, const gchar* word)
+{
+  static const struct { const gchar* word; SibWqlOp op; } tokens[] = {
+    { "any", WQL_ANY },
+    { "members", WQL_MEMBERS },
+    { "self", WQL_SELF },
+    { "p-of-s", WQL_P_OF_S },
+    { "p-of-o", WQL_P_OF_O },
+    { NULL, 0 }
+  };
+  SibWqlOp op;
+  gint i, node;
+
+  for (i = 0; NULL != tokens[i].word; i++)
+    if (0 == strcmp(word, tokens[i].word))
+      return sib_wql_expr_new(tokens[i].op, 0);
+  if (sib_wql_operator(word, &op))
+    return NULL;
+
+  node = sib_store_resolve(parser->store, word, FALSE);
+  if (0 == node)
+    return NULL;
+  return sib_wql_expr_new(WQL_NODE, node);
+}
+
+static SibWqlExpr* sib_wql_parse_expr(SibWqlParser* parser);
+
+static SibWqlExpr* sib_wql_parse_list(SibWqlParser* parser)
+{
+  SibWqlExpr *e, *arg;
+  gchar* word;
+  guint n_args = 0;
+  SibWqlOp op;
+
+  parser->p++;
+  sib_wql_skip_space(parser);
+  word = sib_wql_parse_string(parser);
+  if (NULL == word)
+    return NULL;
+  if (!sib_wql_operator(word, &op))
+    {
+      g_free(word);
+      return NULL;
+    }
+  g_free(word);
+  e = sib_wql_expr_new(op, 0);
+
+  for (;;)
+    {
+      /* Elements are separated by commas, a trailing one is allowed */
+      sib_wql_skip_space(parser);
+      if (']' == *parser->p)
+	break;
+      if (',' != *parser->p)
+	goto error;
+      parser->p++;
+      sib_wql_skip_space(parser);
+      if (']' == *parser->p)
+	break;
+
+      if (op == WQL_VALUE || op == WQL_FILTER)
+	{
+	  /* The argument is a node or a regular expression */
+	  word = sib_wql_parse_string(parser);
+	  if (NULL == word || n_args > 0)
+	    {
+	      g_free(word);
+	      goto error;
+	    }
+	  if (op == WQL_VALUE)
+	    e->node = sib_store_resolve(parser->store, word, FALSE);
+	  else
+	    e->pattern = g_strdup(word);
+	  g_free(word);
+	  if (op == WQL_VALUE && 0 == e->node)
+	    goto error;
+	}
+      else
+	{
+	  arg = sib_wql_parse_expr(parser);
+	  if (NULL == arg)
+	    goto error;
+	  e->args = g_slist_append(e->args, arg);
+	}
+      n_args++;
+    }
+  parser->p++;
+
+  switch (op)
+    {
+    case WQL_SEQ:
+    case WQL_SEQ_OPT:
+    case WQL_OR:
+      if (n_args < 1)
+	goto error;
+      break;
+    default:
+      if (n_args != 1)
+	goto error;
+      break;
+    }
+  return e;
+
+ error:
+  sib_wql_expr_free(e);
+  return NULL;
+}
+
+static SibWqlExpr* sib_wql_parse_expr(SibWqlParser* parser)
+{
+  SibWqlExpr* e;
+  gchar* word;
+
+  sib_wql_skip_space(parser);
+  if ('[' == *parser->p)
+    return sib_wql_parse_list(parser);
+
+  word = sib_wql_parse_string(parser);
+  if (NULL == word)
+    return NULL;
+  e = sib_wql_leaf(parser, word);
+  g_free(word);
+  return e;
+}
+
+/*
+ * Reasoning, the path rewriting of rdfplus_m3
+ */
+
+/* A property or, if it has subproperties, any of them */
+static SibWqlExpr* sib_wql_subprops(SibStore* store, SibWqlVocab* v, gint prop);
+
+static gboolean sib_wql_collect(gint s, gint p, gint o, gpointer data)
+{
+  SibWqlCollect* c = (SibWqlCollect*)data;
+  gint node = (c->which == 0) ? s : ((c->which == 1) ? p : o);
+  g_array_append_val(c->out, node);
+  return TRUE;
+}
+
+/*
+ * Nodes reached from node by repeating a property, forwards and with
+ * both also backwards, node included
+ */
+static GArray* sib_wql_closure(SibStore* store, gint node, gint prop, gboolean forward, gboolean backward)
+{
+  GHashTable* seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+  GArray* nodes = g_array_new(FALSE, FALSE, sizeof(gint));
+  SibWqlCollect c;
+  guint i, j;
+  gint n, m;
+
+  c.out = g_array_new(FALSE, FALSE, sizeof(gint));
+  g_array_append_val(nodes, node);
+  g_hash_table_insert(seen, GINT_TO_POINTER(node), nodes);
+  for (i = 0; i < nodes->len; i++)
+    {
+      n = g_array_index(nodes, gint, i);
+      g_array_set_size(c.out, 0);
+      if (forward)
+	{
+	  c.which = 2;
+	  sib_store_query(store, n, prop, 0, sib_wql_collect, &c);
+	}
+      if (backward)
+	{
+	  c.which = 0;
+	  sib_store_query(store, 0, prop, n, sib_wql_collect, &c);
+	}
+      for (j = 0; j < c.out->len; j++)
+	{
+	  m = g_array_index(c.out, gint, j);
+	  if (NULL != g_hash_table_lookup(seen, GINT_TO_POINTER(m)))
+	    continue;
+	  g_hash_table_insert(seen, GINT_TO_POINTER(m), nodes);
+	  g_array_append_val(nodes, m);
+	}
+    }
+  g_array_free(c.out, TRUE);
+  g_hash_table_destroy(seen);
+  return nodes;
+}
+
+static SibWqlExpr* sib_wql_subprops(SibStore* store, SibWqlVocab* v, gint prop)
+{
+  GArray* props = sib_wql_closure(store, prop, v->subprop, FALSE, TRUE);
+  SibWqlExpr* e;
+  guint i;
+
+  if (props->len == 1)
+    {
+      e = sib_wql_expr_new(WQL_NODE, prop);
+    }
+  else
+    {
+      e = sib_wql_expr_new(WQL_OR, 0);
+      for (i = 0; i < props->len; i++)
+	e->args = g_slist_append(e->args,
+				 sib_wql_expr_new(WQL_NODE, g_array_index(props, gint, i)));
+    }
+  g_array_free(props, TRUE);
+  return e;
+}
+
+/* seq(step, prop, rep*(subClassOf)), types through range or domain */
+static SibWqlExpr* sib_wql_types_via(SibStore* store, SibWqlVocab* v, SibWqlOp step, gint prop)
+{
+  SibWqlExpr* e = sib_wql_expr_new(WQL_SEQ, 0);
+  e->args = g_slist_append(e->args, sib_wql_expr_new(step, 0));
+  e->args = g_slist_append(e->args, sib_wql_subprops(store, v, prop));
+  e->args = g_slist_append(e->args,
+			   sib_wql_expr_op(WQL_REP, sib_wql_subprops(store, v, v->subclass)));
+  return e;
+}
+
+/* Rewrite of a property, rewritePathForTypes and
+   rewritePathForSubprops of rdfplus_m3 */
+static SibWqlExpr* sib_wql_rewrite_prop(SibStore* store, SibWqlVocab* v, gint prop)
+{
+  SibWqlExpr *e, *types;
+
+  if (prop == v->type)
+    {
+      e = sib_wql_expr_new(WQL_OR, 0);
+      types = sib_wql_expr_new(WQL_SEQ, 0);
+      types->args = g_slist_append(types->args, sib_wql_subprops(store, v, v->type));
+      types->args = g_slist_append(types->args,
+				   sib_wql_expr_op(WQL_REP, sib_wql_subprops(store, v, v->subclass)));
+      e->args = g_slist_append(e->args, types);
+      e->args = g_slist_append(e->args, sib_wql_types_via(store, v, WQL_P_OF_O, v->range));
+      e->args = g_slist_append(e->args, sib_wql_types_via(store, v, WQL_P_OF_S, v->domain));
+      e->args = g_slist_append(e->args, sib_wql_expr_new(WQL_VALUE, v->resource));
+      return e;
+    }
+  if (prop == v->subclass)
+    {
+      e = sib_wql_expr_new(WQL_OR, 0);
+      e->args = g_slist_append(e->args,
+			       sib_wql_expr_op(WQL_REP, sib_wql_subprops(store, v, v->subclass)));
+      e->args = g_slist_append(e->args, sib_wql_expr_new(WQL_VALUE, v->resource));
+      return e;
+    }
+  if (prop == v->subprop)
+    return sib_wql_expr_op(WQL_REP, sib_wql_subprops(store, v, v->subprop));
+  return sib_wql_subprops(store, v, prop);
+}
+
+static SibWqlExpr* sib_wql_rewrite(SibStore* store, SibWqlVocab* v, SibWqlExpr* e)
+{
+  SibWqlExpr* r;
+  GSList* l;
+
+  switch (e->op)
+    {
+    case WQL_NODE:
+      r = sib_wql_rewrite_prop(store, v, e->node);
+      sib_wql_expr_free(e);
+      return r;
+    case WQL_NOREWRITE:
+      return e;
+    default:
+      for (l = e->args; l != NULL; l = l->next)
+	l->data = sib_wql_rewrite(store, v, (SibWqlExpr*)l->data);
+      return e;
+    }
+}
+
+/*
+ * Compilation into an automaton
+ */
+
+/* Number of positions of a path, as decorated by sib_wql_decorate */
+static guint sib_wql_count(SibWqlExpr* e, gboolean inverse)
+{
+  GSList* l;
+  guint n = 0;
+
+  if (sib_wql_is_leaf(e->op))
+    return 1;
+  for (l = e->args; l != NULL; l = l->next)
+    {
+      if (inverse && sib_wql_drops_values(e->op) && ((SibWqlExpr*)l->data)->op == WQL_VALUE)
+	continue;
+      n += sib_wql_count((SibWqlExpr*)l->data, (e->op == WQL_INV) ? !inverse : inverse);
+    }
+  return (e->op == WQL_REP_PLUS) ? 2 * n : n;
+}
+
+static guint sib_wql_step_index(SibWqlPath* path, SibWqlExpr* e, gboolean inverse)
+{
+  SibWqlStep* step;
+  guint i;
+
+  /* Self, value and filter steps are their own inverse */
+  if (e->op == WQL_SELF || e->op == WQL_VALUE || e->op == WQL_FILTER)
+    inverse = FALSE;
+
+  for (i = 0; i < path->steps->len; i++)
+    {
+      step = (SibWqlStep*)g_ptr_array_index(path->steps, i);
+      if (step->op == e->op && step->inverse == inverse && step->node == e->node &&
+	  (e->op != WQL_FILTER || 0 == strcmp(step->pattern, e->pattern)))
+	return i;
+    }
+
+  step = g_new0(SibWqlStep, 1);
+  step->op = e->op;
+  step->inverse = inverse;
+  step->node = e->node;
+  if (e->op == WQL_FILTER)
+    {
+      step->pattern = g_strdup(e->pattern);
+      step->regex = g_regex_new(e->pattern, 0, 0, NULL);
+    }
+  g_ptr_array_add(path->steps, step);
+  return path->steps->len - 1;
+}
+
+static guint32* sib_wql_bits_new(SibWqlBuilder* b)
+{
+  return g_new0(guint32, b->words);
+}
+
+static void sib_wql_bits_or(SibWqlBuilder* b, guint32* to, const guint32* from)
+{
+  guint i;
+  for (i = 0; i < b->words; i++)
+    to[i] |= from[i];
+}
+
+static void sib_wql_bits_set(guint32* bits, guint i)
+{
+  bits[i / 32] |= (1u << (i % 32));
+}
+
+static gboolean sib_wql_bits_get(const guint32* bits, guint i)
+{
+  return 0 != (bits[i / 32] & (1u << (i % 32)));
+}
+
+/* All positions in last are followed by the positions in first */
+static void sib_wql_follow(SibWqlBuilder* b, const guint32* last, const guint32* first)
+{
+  guint i;
+
+  for (i = 0; i < b->n_positions; i++)
+    if (sib_wql_bits_get(last, i))
+      sib_wql_bits_or(b, &b->follows[i * b->words], first);
+}
+
+static gboolean sib_wql_decorate(SibWqlBuilder* b, SibWqlExpr* e, gboolean inverse,
+				 guint32* first, guint32* last);
+
+/* seq+ of the arguments, nested to the right as in wilbur */
+static gboolean sib_wql_decorate_seq_opt(SibWqlBuilder* b, GSList* args, gboolean inverse,
+					 guint32* first, guint32* last)
+{
+  guint32 *first2, *last2;
+  gboolean null;
+
+  null = sib_wql_decorate(b, (SibWqlExpr*)args->data, inverse, first, last);
+  if (NULL == args->next)
+    return null;
+
+  first2 = sib_wql_bits_new(b);
+  last2 = sib_wql_bits_new(b);
+  sib_wql_decorate_seq_opt(b, args->next, inverse, first2, last2);
+  sib_wql_follow(b, last, first2);
+  if (null)
+    sib_wql_bits_or(b, first, first2);
+  sib_wql_bits_or(b, last, last2);
+  g_free(first2);
+  g_free(last2);
+  return null;
+}
+
+/*
+ * Glushkov construction: the positions a path can start and end with,
+ * and the positions following each position. Inversion is pushed down
+ * to the steps, reversing sequences on the way.
+ *
+ * @return whether the path matches the empty path
+ */
+static gboolean sib_wql_decorate(SibWqlBuilder* b, SibWqlExpr* e, gboolean inverse,
+				 guint32* first, guint32* last)
+{
+  GSList *l, *args = NULL;
+  guint32 *first2, *last2;
+  gboolean null, null2;
+  SibWqlExpr* arg;
+  guint i;
+
+  if (sib_wql_is_leaf(e->op))
+    {
+      i = b->next++;
+      b->position_step[i] = sib_wql_step_index(b->path, e, inverse);
+      sib_wql_bits_set(first, i);
+      sib_wql_bits_set(last, i);
+      return FALSE;
+    }
+
+  switch (e->op)
+    {
+    case WQL_INV:
+      return sib_wql_decorate(b, (SibWqlExpr*)e->args->data, !inverse, first, last);
+    case WQL_NOREWRITE:
+      return sib_wql_decorate(b, (SibWqlExpr*)e->args->data, inverse, first, last);
+    case WQL_REP:
+      sib_wql_decorate(b, (SibWqlExpr*)e->args->data, inverse, first, last);
+      sib_wql_follow(b, last, first);
+      return TRUE;
+    case WQL_REP_PLUS:
+      /* seq(x, rep*(x)) */
+      first2 = sib_wql_bits_new(b);
+      last2 = sib_wql_bits_new(b);
+      null = sib_wql_decorate(b, (SibWqlExpr*)e->args->data, inverse, first, last);
+      sib_wql_decorate(b, (SibWqlExpr*)e->args->data, inverse, first2, last2);
+      sib_wql_follow(b, last2, first2);
+      sib_wql_follow(b, last, first2);
+      if (null)
+	sib_wql_bits_or(b, first, first2);
+      sib_wql_bits_or(b, last, last2);
+      g_free(first2);
+      g_free(last2);
+      return null;
+    case WQL_OR:
+      null = FALSE;
+      first2 = sib_wql_bits_new(b);
+      last2 = sib_wql_bits_new(b);
+      for (l = e->args; l != NULL; l = l->next)
+	{
+	  if (inverse && ((SibWqlExpr*)l->data)->op == WQL_VALUE)
+	    continue;
+	  memset(first2, 0, b->words * sizeof(guint32));
+	  memset(last2, 0, b->words * sizeof(guint32));
+	  null |= sib_wql_decorate(b, (SibWqlExpr*)l->data, inverse, first2, last2);
+	  sib_wql_bits_or(b, first, first2);
+	  sib_wql_bits_or(b, last, last2);
+	}
+      g_free(first2);
+      g_free(last2);
+      return null;
+    default:
+      break;
+    }
+
+  /* Sequences, walked backwards without their values when inverted */
+  for (l = e->args; l != NULL; l = l->next)
+    {
+      arg = (SibWqlExpr*)l->data;
+      if (!inverse)
+	args = g_slist_append(args, arg);
+      else if (arg->op != WQL_VALUE)
+	args = g_slist_prepend(args, arg);
+    }
+  if (NULL == args)
+    return TRUE;
+
+  if (e->op == WQL_SEQ_OPT)
+    {
+      null = sib_wql_decorate_seq_opt(b, args, inverse, first, last);
+      g_slist_free(args);
+      return null;
+    }
+
+  first2 = sib_wql_bits_new(b);
+  last2 = sib_wql_bits_new(b);
+  null = sib_wql_decorate(b, (SibWqlExpr*)args->data, inverse, first, last);
+  for (l = args->next; l != NULL; l = l->next)
+    {
+      memset(first2, 0, b->words * sizeof(guint32));
+      memset(last2, 0, b->words * sizeof(guint32));
+      null2 = sib_wql_decorate(b, (SibWqlExpr*)l->data, inverse, first2, last2);
+      sib_wql_follow(b, last, first2);
+      if (null)
+	sib_wql_bits_or(b, first, first2);
+      if (!null2)
+	memset(last, 0, b->words * sizeof(guint32));
+      sib_wql_bits_or(b, last, last2);
+      null = null && null2;
+    }
+  g_free(first2);
+  g_free(last2);
+  g_slist_free(args);
+  return null;
+}
+
+static guint sib_wql_add_state(GPtrArray* sets, SibWqlBuilder* b, guint32* positions)
+{
+  guint i;
+
+  for (i = 0; i < sets->len; i++)
+    if (0 == memcmp(g_ptr_array_index(sets, i), positions, b->words * sizeof(guint32)))
+      {
+	g_free(positions);
+	return i;
+      }
+  g_ptr_array_add(sets, positions);
+  return sets->len - 1;
+}
+
+/*
+ * Subset construction: each state is a set of positions, the
+ * transitions on a step lead to the positions following the
+ * positions of the step in the state
+ */
+static void sib_wql_construct(SibWqlBuilder* b, guint32* start)
+{
+  GPtrArray* sets = g_ptr_array_new();
+  SibWqlState state;
+  SibWqlTransition tr;
+  guint32 *positions, *target;
+  guint i, p;
+  gboolean empty;
+
+  sib_wql_add_state(sets, b, start);
+  for (i = 0; i < sets->len; i++)
+    {
+      positions = (guint32*)g_ptr_array_index(sets, i);
+      state.terminal = sib_wql_bits_get(positions, b->end);
+      state.transitions = g_array_new(FALSE, FALSE, sizeof(SibWqlTransition));
+      for (tr.step = 0; tr.step < b->path->steps->len; tr.step++)
+	{
+	  target = sib_wql_bits_new(b);
+	  empty = TRUE;
+	  for (p = 0; p < b->end; p++)
+	    if (b->position_step[p] == tr.step && sib_wql_bits_get(positions, p))
+	      {
+		sib_wql_bits_or(b, target, &b->follows[p * b->words]);
+		empty = FALSE;
+	      }
+	  if (empty)
+	    {
+	      g_free(target);
+	      continue;
+	    }
+	  tr.target = sib_wql_add_state(sets, b, target);
+	  g_array_append_val(state.transitions, tr);
+	}
+      g_array_append_val(b->path->states, state);
+    }
+  for (i = 0; i < sets->len; i++)
+    g_free(g_ptr_array_index(sets, i));
+  g_ptr_array_free(sets, TRUE);
+}
+
+static SibWqlPath* sib_wql_compile(SibStore* store, SibWqlExpr* e, gboolean reasoner)
+{
+  SibWqlBuilder b;
+  SibWqlVocab v;
+  SibWqlPath* path;
+  SibWqlStep* step;
+  guint32 *first, *last, *end;
+  gboolean null;
+  guint i;
+
+  if (reasoner)
+    {
+      sib_wql_vocab_init(&v, store);
+      e = sib_wql_rewrite(store, &v, e);
+    }
+
+  path = g_new0(SibWqlPath, 1);
+  path->reasoner = reasoner;
+  path->steps = g_ptr_array_new();
+  path->states = g_array_new(FALSE, FALSE, sizeof(SibWqlState));
+
+  memset(&b, 0, sizeof(b));
+  b.path = path;
+  b.end = sib_wql_count(e, FALSE);
+  b.n_positions = b.end + 1;
+  b.words = (b.n_positions + 31) / 32;
+  b.position_step = g_new0(guint, b.n_positions);
+  b.follows = g_new0(guint32, b.n_positions * b.words);
+
+  /* seq(path, end) */
+  first = sib_wql_bits_new(&b);
+  last = sib_wql_bits_new(&b);
+  end = sib_wql_bits_new(&b);
+  null = sib_wql_decorate(&b, e, FALSE, first, last);
+  sib_wql_bits_set(end, b.end);
+  b.position_step[b.end] = G_MAXUINT;
+  sib_wql_follow(&b, last, end);
+  if (null)
+    sib_wql_bits_or(&b, first, end);
+  sib_wql_construct(&b, first);
+
+  g_free(last);
+  g_free(end);
+  g_free(b.position_step);
+  g_free(b.follows);
+  sib_wql_expr_free(e);
+
+  for (i = 0; i < path->steps->len; i++)
+    {
+      step = (SibWqlStep*)g_ptr_array_index(path->steps, i);
+      if (step->op == WQL_FILTER && NULL == step->regex)
+	{
+	  sib_wql_path_free(path);
+	  return NULL;
+	}
+    }
+  return path;
+}
+
+/*
+ * Walking
+ */
+
+/* Nodes reached from node in one step */
+static void sib_wql_step(SibStore* store, SibWqlStep* step, gint node, GArray* out)
+{
+  SibWqlCollect c;
+  gchar *uri, *str;
+  guint before;
+  gint i, member;
+
+  c.out = out;
+  switch (step->op)
+    {
+    case WQL_NODE:
+      c.which = step->inverse ? 0 : 2;
+      if (step->inverse)
+	sib_store_query(store, 0, step->node, node, sib_wql_collect, &c);
+      else
+	sib_store_query(store, node, step->node, 0, sib_wql_collect, &c);
+      break;
+    case WQL_ANY:
+      c.which = step->inverse ? 0 : 2;
+      if (step->inverse)
+	sib_store_query(store, 0, 0, node, sib_wql_collect, &c);
+      else
+	sib_store_query(store, node, 0, 0, sib_wql_collect, &c);
+      break;
+    case WQL_MEMBERS:
+      c.which = step->inverse ? 0 : 2;
+      for (i = 1; ; i++)
+	{
+	  uri = g_strdup_printf(RDF_NS "_%d", i);
+	  member = sib_store_resolve(store, uri, FALSE);
+	  g_free(uri);
+	  before = out->len;
+	  if (0 != member)
+	    {
+	      if (step->inverse)
+		sib_store_query(store, 0, member, node, sib_wql_collect, &c);
+	      else
+		sib_store_query(store, node, member, 0, sib_wql_collect, &c);
+	    }
+	  if (out->len == before)
+	    break;
+	}
+      break;
+    case WQL_SELF:
+      g_array_append_val(out, node);
+      break;
+    case WQL_P_OF_S:
+      /* Backwards from a property to its subjects */
+      c.which = step->inverse ? 0 : 1;
+      if (step->inverse)
+	sib_store_query(store, 0, node, 0, sib_wql_collect, &c);
+      else
+	sib_store_query(store, node, 0, 0, sib_wql_collect, &c);
+      break;
+    case WQL_P_OF_O:
+      /* Backwards from a property to its objects */
+      c.which = step->inverse ? 2 : 1;
+      if (step->inverse)
+	sib_store_query(store, 0, node, 0, sib_wql_collect, &c);
+      else
+	sib_store_query(store, 0, 0, node, sib_wql_collect, &c);
+      break;
+    case WQL_VALUE:
+      g_array_append_val(out, step->node);
+      break;
+    case WQL_FILTER:
+      str = sib_store_info(store, node);
+      if (NULL != str && g_regex_match(step->regex, str, 0, NULL))
+	g_array_append_val(out, node);
+      g_free(str);
+      break;
+    default:
+      break;
+    }
+}
+
+/*
+ * Walk the automaton from the start nodes. Each node is visited at
+ * most once in each state. The nodes reached in a terminal state are
+ * put in results, or with a sink the walk stops when it is reached.
+ *
+ * @return whether sink was reached
+ */
+static gboolean sib_wql_walk(SibStore* store, SibWqlPath* path, GArray* starts,
+			     GHashTable* results, gint sink)
+{
+  GHashTable** visited = g_new0(GHashTable*, path->states->len);
+  GArray* stack = g_array_new(FALSE, FALSE, sizeof(SibWqlVisit));
+  GArray* values = g_array_new(FALSE, FALSE, sizeof(gint));
+  SibWqlState* state;
+  SibWqlTransition* tr;
+  SibWqlVisit visit, next;
+  gboolean reached = FALSE;
+  guint i, j;
+
+  for (i = 0; i < path->states->len; i++)
+    visited[i] = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  visit.state = 0;
+  for (i = 0; i < starts->len; i++)
+    {
+      visit.node = g_array_index(starts, gint, i);
+      g_array_append_val(stack, visit);
+    }
+
+  while (!reached && stack->len > 0)
+    {
+      visit = g_array_index(stack, SibWqlVisit, stack->len - 1);
+      g_array_set_size(stack, stack->len - 1);
+      if (g_hash_table_lookup_extended(visited[visit.state], GINT_TO_POINTER(visit.node),
+				       NULL, NULL))
+	continue;
+      g_hash_table_insert(visited[visit.state], GINT_TO_POINTER(visit.node), NULL);
+
+      state = &g_array_index(path->states, SibWqlState, visit.state);
+      if (state->terminal)
+	{
+	  if (NULL != results)
+	    g_hash_table_insert(results, GINT_TO_POINTER(visit.node), NULL);
+	  else if (visit.node == sink)
+	    reached = TRUE;
+	}
+
+      for (i = 0; i < state->transitions->len; i++)
+	{
+	  tr = &g_array_index(state->transitions, SibWqlTransition, i);
+	  g_array_set_size(values, 0);
+	  sib_wql_step(store, (SibWqlStep*)g_ptr_array_index(path->steps, tr->step),
+		       visit.node, values);
+	  next.state = tr->target;
+	  for (j = 0; j < values->len; j++)
+	    {
+	      next.node = g_array_index(values, gint, j);
+	      g_array_append_val(stack, next);
+	    }
+	}
+    }
+
+  for (i = 0; i < path->states->len; i++)
+    g_hash_table_destroy(visited[i]);
+  g_free(visited);
+  g_array_free(stack, TRUE);
+  g_array_free(values, TRUE);
+  return reached;
+}
+
+/* Public functions */
+
+SibWqlPath* sib_wql_path_new(SibStore* store, const gchar* expr, gboolean reasoner)
+{
+  SibWqlParser parser;
+  SibWqlPath* path;
+  SibWqlExpr* e;
+  gint property;
+
+  g_return_val_if_fail(NULL != store && NULL != expr, NULL);
+
+  parser.p = expr;
+  parser.store = store;
+  e = sib_wql_parse_expr(&parser);
+  if (NULL == e)
+    return NULL;
+  sib_wql_skip_space(&parser);
+  if ('\0' != *parser.p)
+    {
+      sib_wql_expr_free(e);
+      return NULL;
+    }
+  property = (e->op == WQL_NODE) ? e->node : 0;
+  path = sib_wql_compile(store, e, reasoner);
+  if (NULL != path)
+    path->property = property;
+  return path;
+}
+
+void sib_wql_path_free(SibWqlPath* path)
+{
+  SibWqlStep* step;
+  guint i;
+
+  if (NULL == path)
+    return;
+  for (i = 0; i < path->steps->len; i++)
+    {
+      step = (SibWqlStep*)g_ptr_array_index(path->steps, i);
+      if (NULL != step->regex)
+	g_regex_unref(step->regex);
+      g_free(step->pattern);
+      g_free(step);
+    }
+  g_ptr_array_free(path->steps, TRUE);
+  for (i = 0; i < path->states->len; i++)
+    g_array_free(g_array_index(path->states, SibWqlState, i).transitions, TRUE);
+  g_array_free(path->states, TRUE);
+  g_free(path);
+}
+
+gint sib_wql_path_property(SibWqlPath* path)
+{
+  g_return_val_if_fail(NULL != path, 0);
+
+  return path->property;
+}
+
+GSList* sib_wql_values(SibStore* store, SibSameAs* same_as, SibWqlPath* path, gint node)
+{
+  GHashTable* results;
+  GHashTableIter iter;
+  GArray* starts;
+  GSList* values = NULL;
+  m3_node_int* n;
+  gpointer key;
+
+  g_return_val_if_fail(NULL != store && NULL != path, NULL);
+  g_return_val_if_fail(NULL != same_as || !path->reasoner, NULL);
+
+  /* With reasoning the values of all nodes sameAs node */
+  if (path->reasoner)
+    starts = sib_same_as_members(same_as, store, node);
+  else
+    {
+      starts = g_array_new(FALSE, FALSE, sizeof(gint));
+      g_array_append_val(starts, node);
+    }
+
+  results = g_hash_table_new(g_direct_hash, g_direct_equal);
+  sib_wql_walk(store, path, starts, results, 0);
+
+  g_hash_table_iter_init(&iter, results);
+  while (g_hash_table_iter_next(&iter, &key, NULL))
+    {
+      n = g_new0(m3_node_int, 1);
+      n->node = GPOINTER_TO_INT(key);
+      values = g_slist_prepend(values, n);
+    }
+  g_hash_table_destroy(results);
+  g_array_free(starts, TRUE);
+  return values;
+}
+
+gboolean sib_wql_related(SibStore* store, SibWqlPath* path, gint source, gint sink)
+{
+  GArray* starts;
+  gboolean related;
+
+  g_return_val_if_fail(NULL != store && NULL != path, FALSE);
+
+  starts = g_array_new(FALSE, FALSE, sizeof(gint));
+  g_array_append_val(starts, source);
+  related = sib_wql_walk(store, path, starts, NULL, sink);
+  g_array_free(starts, TRUE);
+  return related;
+}
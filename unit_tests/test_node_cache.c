@@ -0,0 +1,136 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * test_node_cache.c
+ *
+ * Unit test of the node cache: both directions, literals kept apart
+ * from URIs, CLOCK eviction in a full shard and invalidation of
+ * removed nodes.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string.h>
+#include <glib.h>
+
+#include "sib_node_cache.h"
+
+/* Number of shards in sib_node_cache.c */
+#define N_SHARDS 16
+
+/* Whether a node goes to the first node shard, as in sib_node_cache.c */
+static gboolean first_shard(gint node)
+{
+  return 0 == ((guint32)node * 2654435761u) >> 28;
+}
+
+static gint next_in_first_shard(gint node)
+{
+  do
+    node++;
+  while (!first_shard(node));
+  return node;
+}
+
+static gboolean has_string(SibNodeCache* cache, gint node, const gchar* str)
+{
+  gchar* s = sib_node_cache_get_string(cache, node);
+  gboolean found = (NULL != s && 0 == strcmp(s, str));
+
+  g_free(s);
+  return found;
+}
+
+int main(int argc, char* argv[])
+{
+  SibNodeCache* cache;
+  guint64 hits, misses;
+  gint node, x, y, z, w;
+  gint removed[1];
+
+  if (!g_thread_supported ()) g_thread_init (NULL);
+
+  /* Both directions, a literal and an URI with the same string apart */
+  cache = sib_node_cache_new(1024);
+  sib_node_cache_put_node(cache, "ex:a", FALSE, 1);
+  sib_node_cache_put_node(cache, "ex:a", TRUE, 2);
+  sib_node_cache_put_string(cache, 1, "http://example.org/a");
+  g_assert(sib_node_cache_get_node(cache, "ex:a", FALSE, &node) && 1 == node);
+  g_assert(sib_node_cache_get_node(cache, "ex:a", TRUE, &node) && 2 == node);
+  g_assert(!sib_node_cache_get_node(cache, "ex:b", FALSE, &node));
+  g_assert(has_string(cache, 1, "http://example.org/a"));
+  g_assert(NULL == sib_node_cache_get_string(cache, 2));
+  sib_node_cache_stats(cache, &hits, &misses);
+  g_assert(3 == hits && 2 == misses);
+
+  /* Stored again, the new mapping replaces the old one */
+  sib_node_cache_put_node(cache, "ex:a", TRUE, 3);
+  g_assert(sib_node_cache_get_node(cache, "ex:a", TRUE, &node) && 3 == node);
+
+  /* Invalidation removes the node in both directions */
+  removed[0] = 1;
+  sib_node_cache_invalidate(cache, removed, 1);
+  g_assert(!sib_node_cache_get_node(cache, "ex:a", FALSE, &node));
+  g_assert(NULL == sib_node_cache_get_string(cache, 1));
+  g_assert(sib_node_cache_get_node(cache, "ex:a", TRUE, &node) && 3 == node);
+  sib_node_cache_destroy(cache);
+
+  /* Two mappings in each shard. Of x and y, only x is used when z
+     comes in, so y is evicted. */
+  cache = sib_node_cache_new(2 * N_SHARDS);
+  x = next_in_first_shard(0);
+  y = next_in_first_shard(x);
+  z = next_in_first_shard(y);
+  w = next_in_first_shard(z);
+  sib_node_cache_put_string(cache, x, "x");
+  sib_node_cache_put_string(cache, y, "y");
+  g_assert(has_string(cache, x, "x"));
+  sib_node_cache_put_string(cache, z, "z");
+  g_assert(NULL == sib_node_cache_get_string(cache, y));
+  g_assert(has_string(cache, x, "x"));
+  g_assert(has_string(cache, z, "z"));
+
+  /* Both used: each gets its second chance and the hand comes back
+     to x first */
+  sib_node_cache_put_string(cache, w, "w");
+  g_assert(NULL == sib_node_cache_get_string(cache, x));
+  g_assert(has_string(cache, z, "z"));
+  g_assert(has_string(cache, w, "w"));
+  sib_node_cache_destroy(cache);
+  return 0;
+}
@@ -0,0 +1,142 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * test_result_cache.c
+ *
+ * Unit test of the result cache: results invalidated by changes to
+ * the nodes they depend on, stamps taken before a change, and the
+ * new epoch once the version counters are dropped.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string.h>
+#include <glib.h>
+
+#include "sib_operations.h"
+#include "sib_result_cache.h"
+
+/* Must be at least MAX_VERSIONS of sib_result_cache.c */
+#define N_NODES (1 << 16)
+
+static m3_triple_int subject_pattern = { 1, 0, 0, 0, NULL };
+
+static SibResultCacheStamp* stamp(SibResultCache* cache)
+{
+  GSList* patterns = g_slist_prepend(NULL, &subject_pattern);
+  SibResultCacheStamp* s = sib_result_cache_stamp(cache, patterns);
+
+  g_slist_free(patterns);
+  return s;
+}
+
+static void change(SibResultCache* cache, gint s, gint p)
+{
+  m3_triple_int t = { s, p, 0, 0, NULL };
+  GSList* triples = g_slist_prepend(NULL, &t);
+
+  sib_result_cache_changed(cache, triples);
+  g_slist_free(triples);
+}
+
+static gboolean cached(SibResultCache* cache, const gchar* key, const gchar* result)
+{
+  gchar* r = sib_result_cache_get(cache, key);
+  gboolean found = (NULL != r && 0 == strcmp(r, result));
+
+  g_free(r);
+  return found;
+}
+
+int main(int argc, char* argv[])
+{
+  SibResultCache* cache;
+  SibResultCacheStamp* s;
+  gint i;
+
+  if (!g_thread_supported ()) g_thread_init (NULL);
+
+  cache = sib_result_cache_new(16);
+
+  /* Kept until a node it depends on changes */
+  sib_result_cache_put(cache, "q", stamp(cache), "r1");
+  g_assert(cached(cache, "q", "r1"));
+  change(cache, 2, 3);
+  g_assert(cached(cache, "q", "r1"));
+  change(cache, 1, 3);
+  g_assert(NULL == sib_result_cache_get(cache, "q"));
+
+  /* Dropped when the node changed after the stamp was taken */
+  s = stamp(cache);
+  change(cache, 1, 3);
+  sib_result_cache_put(cache, "q", s, "r2");
+  g_assert(NULL == sib_result_cache_get(cache, "q"));
+
+  /* Node 1 is at version 2. Changes to other nodes leave the result
+     until the counters are dropped, which takes MAX_VERSIONS nodes. */
+  s = stamp(cache);
+  sib_result_cache_put(cache, "q", stamp(cache), "r3");
+  for (i = 1; cached(cache, "q", "r3"); i++)
+    {
+      g_assert(i <= N_NODES);
+      change(cache, 1000 + i, 3);
+    }
+  g_assert(i > N_NODES / 2);
+
+  /* A stamp taken before must not match the counters started again
+     from 0, although node 1 is back at version 2 */
+  change(cache, 1, 3);
+  change(cache, 1, 3);
+  sib_result_cache_put(cache, "q", s, "r4");
+  g_assert(NULL == sib_result_cache_get(cache, "q"));
+
+  /* Stamps of the new epoch work as before */
+  sib_result_cache_put(cache, "q", stamp(cache), "r5");
+  g_assert(cached(cache, "q", "r5"));
+  change(cache, 1, 3);
+  g_assert(NULL == sib_result_cache_get(cache, "q"));
+
+  /* And so after a clear */
+  s = stamp(cache);
+  sib_result_cache_clear(cache);
+  sib_result_cache_put(cache, "q", s, "r6");
+  g_assert(NULL == sib_result_cache_get(cache, "q"));
+
+  sib_result_cache_destroy(cache);
+  return 0;
+}
@@ -0,0 +1,170 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * test_same_as.c
+ *
+ * Unit test of the owl:sameAs classes: joining classes as triples are
+ * added and splitting them as triples are removed, on an in-memory
+ * store.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <glib.h>
+
+#include "sib_operations.h"
+#include "sib_same_as.h"
+#include "sib_store.h"
+
+#define OWL_NS "http://www.w3.org/2002/07/owl#"
+
+static gint same_as;
+
+static gboolean has_member(GArray* members, gint node)
+{
+  guint i;
+
+  for (i = 0; i < members->len; i++)
+    if (g_array_index(members, gint, i) == node)
+      return TRUE;
+  return FALSE;
+}
+
+/* Number of members in the class of node, asserting the given ones are in it */
+static guint class_size(SibSameAs* classes, SibStore* store, gint node,
+			gint m1, gint m2)
+{
+  GArray* members = sib_same_as_members(classes, store, node);
+  guint len = members->len;
+
+  g_assert(g_array_index(members, gint, 0) == node);
+  g_assert(0 == m1 || has_member(members, m1));
+  g_assert(0 == m2 || has_member(members, m2));
+  g_array_free(members, TRUE);
+  return len;
+}
+
+/* Adds or removes s sameAs o and tells the classes about it */
+static void change(SibSameAs* classes, SibStore* store, gint s, gint o, gboolean added)
+{
+  m3_triple_int t = { s, same_as, o, 0, NULL };
+  GSList* triples = g_slist_prepend(NULL, &t);
+
+  g_assert(sib_store_transaction(store));
+  if (added)
+    g_assert(sib_store_add(store, s, same_as, o));
+  else
+    g_assert(sib_store_del(store, s, same_as, o));
+  g_assert(sib_store_commit(store));
+  sib_same_as_changed(classes, store, triples, added);
+  g_slist_free(triples);
+}
+
+static guint values_size(SibSameAs* classes, SibStore* store, gint node)
+{
+  GSList *values = NULL, *l;
+  guint len;
+
+  g_assert(sib_same_as_values(classes, store, same_as, node, &values));
+  len = g_slist_length(values);
+  for (l = values; l != NULL; l = l->next)
+    g_free(l->data);
+  g_slist_free(values);
+  return len;
+}
+
+int main(int argc, char* argv[])
+{
+  SibStore* store;
+  SibSameAs* classes;
+  GSList* values;
+  gint a, b, c, d, p;
+
+  if (!g_thread_supported ()) g_thread_init (NULL);
+
+  store = sib_store_mem_open(NULL);
+  g_assert(NULL != store);
+  classes = sib_same_as_new();
+
+  g_assert(sib_store_transaction(store));
+  same_as = sib_store_node(store, OWL_NS "sameAs");
+  a = sib_store_node(store, "http://example.org/a");
+  b = sib_store_node(store, "http://example.org/b");
+  c = sib_store_node(store, "http://example.org/c");
+  d = sib_store_node(store, "http://example.org/d");
+  p = sib_store_node(store, "http://example.org/p");
+  g_assert(sib_store_add(store, a, same_as, b));
+  g_assert(sib_store_add(store, b, same_as, c));
+  g_assert(sib_store_add(store, a, p, d));
+  g_assert(sib_store_commit(store));
+
+  /* Read from the store on first use */
+  g_assert(3 == class_size(classes, store, a, b, c));
+  g_assert(3 == class_size(classes, store, c, a, b));
+  g_assert(1 == class_size(classes, store, d, 0, 0));
+  g_assert(!sib_same_as_values(classes, store, p, a, &values));
+
+  /* Joined as added: a b c d */
+  change(classes, store, d, c, TRUE);
+  g_assert(4 == class_size(classes, store, a, c, d));
+  g_assert(4 == values_size(classes, store, d));
+
+  /* Split as removed, with the triple in the middle of the chain
+     gone: a b and c d */
+  change(classes, store, b, c, FALSE);
+  g_assert(2 == class_size(classes, store, a, b, 0));
+  g_assert(2 == class_size(classes, store, b, a, 0));
+  g_assert(2 == class_size(classes, store, c, d, 0));
+  g_assert(2 == class_size(classes, store, d, c, 0));
+
+  /* Removing the last triple of a class leaves its nodes without one */
+  change(classes, store, d, c, FALSE);
+  g_assert(1 == class_size(classes, store, c, 0, 0));
+  g_assert(1 == class_size(classes, store, d, 0, 0));
+  g_assert(0 == values_size(classes, store, c));
+  g_assert(2 == values_size(classes, store, a));
+
+  /* The same classes are read from the store after a clear */
+  sib_same_as_clear(classes);
+  g_assert(2 == class_size(classes, store, b, a, 0));
+  g_assert(1 == class_size(classes, store, c, 0, 0));
+
+  sib_same_as_destroy(classes);
+  sib_store_close(store);
+  return 0;
+}
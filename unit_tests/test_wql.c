@@ -0,0 +1,202 @@
+/*
+
+  Copyright (c) 2009, Nokia Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+    * Neither the name of Nokia nor the names of its contributors
+    may be used to endorse or promote products derived from this
+    software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*
+ * SIB daemon
+ *
+ * test_wql.c
+ *
+ * Unit test of the native WQL paths: parsing of the path expressions
+ * and the nodes the compiled automaton reaches on an in-memory store,
+ * with and without reasoning.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <glib.h>
+
+#include "sib_operations.h"
+#include "sib_same_as.h"
+#include "sib_store.h"
+#include "sib_wql.h"
+
+#define EX "http://example.org/"
+#define RDFS_NS "http://www.w3.org/2000/01/rdf-schema#"
+#define OWL_NS "http://www.w3.org/2002/07/owl#"
+
+static SibStore* store;
+static SibSameAs* same_as;
+
+static gint node(const gchar* name)
+{
+  gchar* uri = g_strconcat(EX, name, NULL);
+  gint n = sib_store_node(store, uri);
+
+  g_free(uri);
+  g_assert(0 != n);
+  return n;
+}
+
+static void add(const gchar* s, const gchar* p, const gchar* o)
+{
+  g_assert(sib_store_add(store, node(s), node(p), node(o)));
+}
+
+/* Whether the values of a path from a node are the given nodes, a
+   space separated list of names */
+static gboolean values_are(const gchar* expr, gboolean reasoner, const gchar* start,
+			   const gchar* expected)
+{
+  SibWqlPath* path;
+  GSList *values, *l;
+  gchar** names;
+  gboolean same;
+  guint i;
+
+  path = sib_wql_path_new(store, expr, reasoner);
+  g_assert(NULL != path);
+  values = sib_wql_values(store, same_as, path, node(start));
+  names = g_strsplit(expected, " ", 0);
+
+  same = (g_slist_length(values) == g_strv_length(names));
+  for (i = 0; same && NULL != names[i]; i++)
+    {
+      for (l = values; l != NULL; l = l->next)
+	if (((m3_node_int*)l->data)->node == node(names[i]))
+	  break;
+      same = (NULL != l);
+    }
+
+  g_strfreev(names);
+  for (l = values; l != NULL; l = l->next)
+    g_free(l->data);
+  g_slist_free(values);
+  sib_wql_path_free(path);
+  return same;
+}
+
+static gboolean related(const gchar* expr, const gchar* source, const gchar* sink)
+{
+  SibWqlPath* path = sib_wql_path_new(store, expr, FALSE);
+  gboolean r;
+
+  g_assert(NULL != path);
+  r = sib_wql_related(store, path, node(source), node(sink));
+  sib_wql_path_free(path);
+  return r;
+}
+
+static gboolean valid(const gchar* expr)
+{
+  SibWqlPath* path = sib_wql_path_new(store, expr, FALSE);
+
+  sib_wql_path_free(path);
+  return NULL != path;
+}
+
+int main(int argc, char* argv[])
+{
+  SibWqlPath* path;
+
+  if (!g_thread_supported ()) g_thread_init (NULL);
+
+  store = sib_store_mem_open(NULL);
+  g_assert(NULL != store);
+  same_as = sib_same_as_new();
+
+  /* A chain a p b p c p d, closed into a cycle by d p b */
+  g_assert(sib_store_transaction(store));
+  add("a", "p", "b");
+  add("b", "p", "c");
+  add("c", "p", "d");
+  add("d", "p", "b");
+  add("b", "q", "e");
+  add("x", "p", "a");
+  g_assert(sib_store_commit(store));
+
+  /* Parsing */
+  g_assert(valid("'" EX "p'"));
+  g_assert(valid("[ 'seq', \"" EX "p\", ['rep*', '" EX "q'], ]"));
+  g_assert(!valid("['seq']"));
+  g_assert(!valid("['rep*', '" EX "p', '" EX "q']"));
+  g_assert(!valid("['walk', '" EX "p']"));
+  g_assert(!valid("['seq', '" EX "p'"));
+  g_assert(!valid("'" EX "p' '" EX "q'"));
+  g_assert(!valid("'" EX "p"));
+  g_assert(!valid("['seq', 'rep*']"));
+
+  path = sib_wql_path_new(store, "'" EX "p'", FALSE);
+  g_assert(node("p") == sib_wql_path_property(path));
+  sib_wql_path_free(path);
+  path = sib_wql_path_new(store, "['inv', '" EX "p']", FALSE);
+  g_assert(0 == sib_wql_path_property(path));
+  sib_wql_path_free(path);
+
+  /* Walking, the cycle visited once */
+  g_assert(values_are("'" EX "p'", FALSE, "a", "b"));
+  g_assert(values_are("['rep*', '" EX "p']", FALSE, "a", "a b c d"));
+  g_assert(values_are("['rep+', '" EX "p']", FALSE, "a", "b c d"));
+  g_assert(values_are("['rep+', '" EX "p']", FALSE, "b", "b c d"));
+  g_assert(values_are("['seq', '" EX "p', '" EX "q']", FALSE, "a", "e"));
+  g_assert(values_are("['seq', ['rep*', '" EX "p'], '" EX "q']", FALSE, "x", "e"));
+  g_assert(values_are("['or', '" EX "p', '" EX "q']", FALSE, "b", "c e"));
+  g_assert(values_are("['inv', '" EX "p']", FALSE, "a", "x"));
+  g_assert(values_are("['inv', ['seq', '" EX "p', '" EX "q']]", FALSE, "e", "a d"));
+  g_assert(values_are("['seq', '" EX "q', '" EX "p']", FALSE, "a", ""));
+  g_assert(values_are("['value', '" EX "v']", FALSE, "a", "v"));
+  g_assert(values_are("['seq', ['rep*', '" EX "p'], ['filter', '/c$']]", FALSE, "a", "c"));
+
+  g_assert(related("['rep+', '" EX "p']", "x", "d"));
+  g_assert(!related("['rep+', '" EX "p']", "d", "x"));
+  g_assert(!related("['rep+', '" EX "p']", "a", "a"));
+
+  /* Reasoning: subproperties and owl:sameAs of the start node */
+  g_assert(sib_store_transaction(store));
+  g_assert(sib_store_add(store, node("r"), sib_store_node(store, RDFS_NS "subPropertyOf"),
+			 node("p")));
+  add("a", "r", "y");
+  g_assert(sib_store_add(store, node("z"), sib_store_node(store, OWL_NS "sameAs"),
+			 node("a")));
+  g_assert(sib_store_commit(store));
+
+  g_assert(values_are("'" EX "p'", FALSE, "a", "b"));
+  g_assert(values_are("'" EX "p'", TRUE, "a", "b y"));
+  g_assert(values_are("'" EX "p'", FALSE, "z", ""));
+  g_assert(values_are("'" EX "p'", TRUE, "z", "b y"));
+
+  sib_same_as_destroy(same_as);
+  sib_store_close(store);
+  return 0;
+}